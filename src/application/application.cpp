@@ -1,28 +1,197 @@
 #include "application.h"
 
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <thread>
+
 #include <imgui_impl_vulkan.h>
 #include <imgui_impl_glfw.h>
 
-#include "gui.h"
+#include <chunk_bricks.h>
+#include <chunk_mesher.h>
+#include <terrain_generator.h>
+
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
+
+static const VkSpecializationMapEntry raygenSpecializationMapEntries[] = {
+    { .constantID = 0, .offset = 0, .size = sizeof(uint32_t) }
+};
+
+// The triangles of each face are consecutive, so the hit shader finds the face by primitive ID.
+static const float cubeVertices[] = {
+    -0.5f, -0.5f, -0.5f,
+     0.5f, -0.5f, -0.5f,
+     0.5f,  0.5f, -0.5f,
+    -0.5f,  0.5f, -0.5f,
+    -0.5f, -0.5f,  0.5f,
+     0.5f, -0.5f,  0.5f,
+     0.5f,  0.5f,  0.5f,
+    -0.5f,  0.5f,  0.5f
+};
+
+static const uint32_t cubeIndices[] = {
+    0, 2, 1, 0, 3, 2,
+    4, 5, 6, 4, 6, 7,
+    0, 1, 5, 0, 5, 4,
+    3, 6, 2, 3, 7, 6,
+    0, 4, 7, 0, 7, 3,
+    1, 2, 6, 1, 6, 5
+};
+
+static constexpr uint32_t CUBE_GRID_SIZE = 32;
+
+// The cubes bob up and down in a wave across the grid.
+static VkTransformMatrixKHR getCubeTransform(uint32_t x, uint32_t z, float time) {
+    float offsetX = 1.5f * ((float)x - 0.5f * (CUBE_GRID_SIZE - 1));
+    float offsetY = 0.5f * sinf(2.0f * time + 0.3f * (float)(x + z));
+    float offsetZ = 1.5f * ((float)z - 0.5f * (CUBE_GRID_SIZE - 1));
+
+    VkTransformMatrixKHR transform = {{
+        { 1.0f, 0.0f, 0.0f, offsetX },
+        { 0.0f, 1.0f, 0.0f, offsetY },
+        { 0.0f, 0.0f, 1.0f, offsetZ }
+    }};
+
+    return transform;
+}
+
+// Hit groups in the order of their SBT entries.
+static constexpr uint32_t CUBE_HIT_GROUP = 0;
+static constexpr uint32_t CHUNK_HIT_GROUP = 1;
+static constexpr uint32_t BRICK_HIT_GROUP = 2;
+
+// The world lies below the cubes, with blocks a quarter of a cube across.
+static constexpr int32_t WORLD_CHUNK_HEIGHT = 2;
+static constexpr float WORLD_BLOCK_SIZE = 0.25f;
+static constexpr float WORLD_ORIGIN[] = { -32.0f, -12.0f, -32.0f };
+
+// The terrain within this many chunks of the camera is loaded.
+static constexpr uint32_t WORLD_VIEW_DISTANCE = 6;
+
+// The camera of the ray generation shader.
+static constexpr float CAMERA_POSITION[] = { 0.0f, 24.0f, 40.0f };
+static constexpr float CAMERA_TARGET[] = { 0.0f, 0.0f, 0.0f };
+
+static constexpr Block STONE = 1;
+static constexpr Block DIRT = 2;
+static constexpr Block GRASS = 3;
+static constexpr Block ORE = 4;
+
+// Rolling hills of stone, dirt and grass with some ores.
+static const TerrainSettings TERRAIN_SETTINGS = {
+    .seed        = 1,
+    .chunkHeight = WORLD_CHUNK_HEIGHT,
+    .baseHeight  = 24.0f,
+    .amplitude   = 16.0f,
+    .frequency   = 1.0f / 64.0f,
+    .octaveCount = 4,
+    .dirtDepth   = 3,
+    .oreRarity   = 64,
+    .stone       = STONE,
+    .dirt        = DIRT,
+    .grass       = GRASS,
+    .ore         = ORE
+};
+
+// Bricks are built by a job per chunk into the chunk's own range of the arrays, with blocks per
+// worker.
+struct BrickBuild {
+    ChunkMap* chunkMap;
+    const ChunkCoordinate* coordinates;
+    Block* blocks;
+    Brick* bricks;
+    BrickBounds* bounds;
+    uint32_t* brickCounts;
+};
+
+static void buildBricks(void* data, uint32_t chunkIndex, uint32_t workerIndex) {
+    BrickBuild* build = (BrickBuild*)data;
+    Block* blocks = &build->blocks[workerIndex * CHUNK_BLOCK_COUNT];
+
+    // The map doesn't change while the jobs run, so finding chunks is safe.
+    build->chunkMap->find(build->coordinates[chunkIndex])->decode(blocks);
+
+    uint32_t firstBrick = chunkIndex * CHUNK_BRICK_COUNT;
+    build->brickCounts[chunkIndex] = buildChunkBricks(blocks, &build->bricks[firstBrick], &build->bounds[firstBrick]);
+}
+
+static VkTransformMatrixKHR getChunkTransform(ChunkCoordinate coordinate) {
+    float chunkSize = CHUNK_SIZE * WORLD_BLOCK_SIZE;
+
+    VkTransformMatrixKHR transform = {{
+        { WORLD_BLOCK_SIZE, 0.0f, 0.0f, WORLD_ORIGIN[0] + coordinate.x * chunkSize },
+        { 0.0f, WORLD_BLOCK_SIZE, 0.0f, WORLD_ORIGIN[1] + coordinate.y * chunkSize },
+        { 0.0f, 0.0f, WORLD_BLOCK_SIZE, WORLD_ORIGIN[2] + coordinate.z * chunkSize }
+    }};
+
+    return transform;
+}
 
 Application::Application() {
-    glfwInit();
+    // VORTEX_TRACE_FRAMES captures startup and the given number of frames.
+    const char* traceFrameCount = getenv("VORTEX_TRACE_FRAMES");
+
+    if (traceFrameCount != nullptr) {
+        TRACE_CAPTURE(atoi(traceFrameCount), "trace.json");
+    }
+
+    TRACE_THREAD_NAME("Main");
+    TRACE_ZONE("Startup");
+
+    readHeadlessSettings();
+    readPresentSettings();
+    readWorldSettings();
+
+    if (!headless) {
+        glfwInit();
+        createWindow();
+    }
 
-    createWindow();
     createEngineResources();
-    createGuiResources();
+
+    if (!headless) {
+        createGuiResources();
+    }
 }
 
 Application::~Application() {
+    if (pendingCompilation != nullptr) {
+        vkDestroyPipeline(device.logical, pipelineCompiler.finish(device.logical, pendingCompilation), nullptr);
+    }
+
+    pipelineCompiler.destroy();
+    jobSystem.destroy();
+
     renderer.waitIdle(device.logical);
-    renderer.destroy(device.logical);
-    shaderBindingTable.destroy(device.logical);
+    pipelineCache.save(device);
+    shaderModuleCache.save();
+    renderer.destroy(device);
+    accelerationStructureManager.destroy(device);
+    geometryBuffer.destroy(device);
+
+    if (worldGeometry == WORLD_GEOMETRY_TRIANGLES) {
+        worldIndexBuffer.destroy(device);
+    }
 
-    ImGui_ImplVulkan_Shutdown();
-    ImGui_ImplGlfw_Shutdown();
-    ImGui::DestroyContext();
+    worldVertexBuffer.destroy(device);
+    chunkMap.destroy();
+    cubeIndexBuffer.destroy(device);
+    cubeVertexBuffer.destroy(device);
+    pipelineVariantCache.destroy(device);
+    uploader.destroy(device);
 
-    vkDestroyPipeline(device.logical, rayTracingPipeline, nullptr);
+    if (!headless) {
+        ImGui_ImplVulkan_Shutdown();
+        ImGui_ImplGlfw_Shutdown();
+        ImGui::DestroyContext();
+    }
+
+    shaderModuleCache.destroy(device.logical);
+    pipelineCache.destroy(device.logical);
     vkDestroyPipelineLayout(device.logical, pipelineLayout, nullptr);
     vkDestroyDescriptorPool(device.logical, guiDescriptorPool, nullptr);
     vkDestroyRenderPass(device.logical, renderPass, nullptr);
@@ -32,20 +201,62 @@ Application::~Application() {
     vkDestroySurfaceKHR(instance, surface, nullptr);
     vkDestroyInstance(instance, nullptr);
 
-    glfwDestroyWindow(window);
-    glfwTerminate();
+    if (!headless) {
+        glfwDestroyWindow(window);
+        glfwTerminate();
+    }
 }
 
 void Application::run() {
-    VkExtent2D extent = surfaceCapabilities.currentExtent;
-    renderer.recordCommandBuffers(device.logical, pipelineLayout, rayTracingPipeline, shaderBindingTable, extent);
+    if (headless) {
+        runHeadless();
+        return;
+    }
+
+    renderer.setTracePipeline(pipelineLayout, rayTracingPipeline, shaderBindingTable);
 
     while (!glfwWindowShouldClose(window)) {
-        glfwPollEvents();
+        {
+            TRACE_ZONE("Poll Events");
+            glfwPollEvents();
+        }
+
+        guiState.frameWaitTime = renderer.scheduler.getWaitTime();
+        guiState.presentLatency = renderer.measuresPresentLatency() ? renderer.getPresentLatency() : -1.0;
+        guiState.renderScale = renderer.resolutionScaler.getScale();
+
+        AccelerationStructureStatistics accelerationStructureStatistics = accelerationStructureManager.getStatistics();
+        guiState.blasSize = accelerationStructureStatistics.compactedSize;
+        guiState.blasBuildSize = accelerationStructureStatistics.buildSize;
+        guiState.tlasRefitCount = accelerationStructureStatistics.refitCount;
+        guiState.accelerationStructureBuildTime = accelerationStructureStatistics.buildTime;
+        guiState.blasBuildTime = accelerationStructureStatistics.blasBuildTime;
 
-        renderGui();
+        // Job statistics are averaged over half a second, so that they can be read.
+        double time = glfwGetTime();
+
+        if (time - jobStatisticsTime >= 0.5) {
+            jobSystem.updateStatistics();
+            jobStatisticsTime = time;
+        }
+
+        renderGui(guiState);
+
+        if (guiState.presentMode != presentMode || guiState.swapchainImageCount != swapchainImageCount || guiState.waitForPresent != waitForPresent) {
+            updatePresentSettings();
+        }
+
+        renderer.scheduler.setFrameRateLimit(guiState.frameRateLimit);
+        renderer.resolutionScaler.setBudget(guiState.traceBudget);
+
+        updateRayTracingPipeline();
+
+        animateScene((float)glfwGetTime());
+        accelerationStructureManager.update(device, VK_NULL_HANDLE, 0);
+
+        if (!renderer.render(device, renderPass, surfaceCapabilities.currentExtent)) {
+            TRACE_ZONE("Resize");
 
-        if (!renderer.render(device, renderPass, extent)) {
             int width, height;
             glfwGetFramebufferSize(window, &width, &height);
 
@@ -54,13 +265,173 @@ void Application::run() {
                 glfwGetFramebufferSize(window, &width, &height);
             }
 
-            renderer.waitIdle(device.logical);
-
             RendererCreateInfo rendererCreateInfo = getRendererCreateInfo();
             renderer.resize(device, rendererCreateInfo);
-            renderer.recordCommandBuffers(device.logical, pipelineLayout, rayTracingPipeline, shaderBindingTable, extent);
+        }
+
+        TRACE_FRAME();
+    }
+}
+
+// Renders a fixed number of frames without presenting them, and writes the last one to disk.
+void Application::runHeadless() {
+    renderer.setTracePipeline(pipelineLayout, rayTracingPipeline, shaderBindingTable);
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < headlessFrameCount; ++i) {
+        if (i + 1 == headlessFrameCount) {
+            renderer.captureFrame(headlessOutputFileName);
+        }
+
+        // Headless frames are a fixed 60 Hz apart, so that captures are reproducible.
+        animateScene(i / 60.0f);
+        accelerationStructureManager.update(device, VK_NULL_HANDLE, 0);
+
+        renderer.render(device, VK_NULL_HANDLE, headlessExtent);
+
+        TRACE_FRAME();
+    }
+
+    renderer.waitIdle(device.logical);
+
+    double renderTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    if (renderer.writeCapture(device)) {
+        printf("Wrote frame %u to %s\n", headlessFrameCount, headlessOutputFileName);
+    }
+
+    printf("Using %s\n", guiState.deviceName);
+    printf("Pipelines created in %.2f ms (%s pipeline cache)\n", guiState.pipelineCreationTime, guiState.pipelineCacheWarm ? "warm" : "cold");
+    printf("World: %u chunks as %u %s in %.2f ms, %.2f MiB of geometry\n", guiState.worldChunkCount, guiState.worldPrimitiveCount, guiState.worldGeometry == WORLD_GEOMETRY_BRICKS ? "bricks" : "quads", guiState.worldCreationTime, guiState.worldGeometrySize / (1024.0 * 1024.0));
+    printf("Rendered %u frames in %.2f ms (%.3f ms per frame)\n", headlessFrameCount, renderTime, renderTime / headlessFrameCount);
+
+    // Timings of the last frame in flight aren't resolved, since no frame follows it.
+    for (uint32_t i = 0; i < renderer.profiler.getScopeCount(); ++i) {
+        GpuScopeStatistics statistics = renderer.profiler.getStatistics(i);
+        printf("%s: %.3f ms average, %.3f ms p99\n", renderer.profiler.getScopeLabel(i), statistics.average, statistics.p99);
+    }
+
+    // The BLAS build time is only known if a later update() saw the build complete.
+    AccelerationStructureStatistics accelerationStructureStatistics = accelerationStructureManager.getStatistics();
+
+    printf("BLAS memory: %.2f MiB (%.2f MiB before compaction)\n", accelerationStructureStatistics.compactedSize / (1024.0 * 1024.0), accelerationStructureStatistics.buildSize / (1024.0 * 1024.0));
+
+    if (accelerationStructureStatistics.blasBuildTime >= 0.0f) {
+        printf("Last BLAS build: %.3f ms\n", accelerationStructureStatistics.blasBuildTime);
+    }
+
+    // The job statistics cover everything since startup, which is when most jobs run.
+    jobSystem.updateStatistics();
+
+    for (uint32_t i = 0; i < jobSystem.getWorkerCount(); ++i) {
+        JobWorkerStatistics statistics = jobSystem.getStatistics(i);
+        printf("Job worker %u: %.1f%% utilization, %u jobs, %u stolen, max queue depth %u\n", i, statistics.utilization * 100.0f, statistics.jobCount, statistics.stealCount, statistics.maxQueueDepth);
+    }
+}
+
+// VORTEX_HEADLESS=<width>x<height> renders without a window, VORTEX_HEADLESS_FRAMES sets the number
+// of frames to render and VORTEX_HEADLESS_OUTPUT the file the last frame is written to.
+void Application::readHeadlessSettings() {
+    const char* size = getenv("VORTEX_HEADLESS");
+
+    if (size == nullptr || sscanf(size, "%ux%u", &headlessExtent.width, &headlessExtent.height) != 2 || headlessExtent.width == 0 || headlessExtent.height == 0) {
+        return;
+    }
+
+    headless = true;
+
+    const char* frameCount = getenv("VORTEX_HEADLESS_FRAMES");
+
+    if (frameCount != nullptr && atoi(frameCount) > 0) {
+        headlessFrameCount = atoi(frameCount);
+    }
+
+    const char* outputFileName = getenv("VORTEX_HEADLESS_OUTPUT");
+
+    if (outputFileName != nullptr) {
+        headlessOutputFileName = outputFileName;
+    }
+}
+
+// VORTEX_PRESENT_MODE is one of fifo, fifo_relaxed, mailbox or immediate, VORTEX_SWAPCHAIN_IMAGES
+// sets the number of swapchain images, VORTEX_FRAME_LIMIT limits the frame rate,
+// VORTEX_WAIT_FOR_PRESENT=1 favours latency over throughput, VORTEX_TRACE_BUDGET scales the
+// trace resolution to fit the given GPU time in milliseconds and VORTEX_TRACE_TO_SWAPCHAIN=0 keeps
+// the blit even if the swapchain images could be traced into.
+void Application::readPresentSettings() {
+    static const struct {
+        const char* name;
+        VkPresentModeKHR presentMode;
+    } presentModeNames[] = {
+        { "fifo", VK_PRESENT_MODE_FIFO_KHR },
+        { "fifo_relaxed", VK_PRESENT_MODE_FIFO_RELAXED_KHR },
+        { "mailbox", VK_PRESENT_MODE_MAILBOX_KHR },
+        { "immediate", VK_PRESENT_MODE_IMMEDIATE_KHR }
+    };
+
+    const char* presentModeName = getenv("VORTEX_PRESENT_MODE");
+
+    if (presentModeName != nullptr) {
+        for (uint32_t i = 0; i < ARRAY_SIZE(presentModeNames); ++i) {
+            if (strcmp(presentModeName, presentModeNames[i].name) == 0) {
+                presentMode = presentModeNames[i].presentMode;
+            }
         }
     }
+
+    const char* imageCount = getenv("VORTEX_SWAPCHAIN_IMAGES");
+
+    if (imageCount != nullptr && atoi(imageCount) >= 2) {
+        swapchainImageCount = atoi(imageCount);
+    }
+
+    const char* frameRateLimit = getenv("VORTEX_FRAME_LIMIT");
+
+    if (frameRateLimit != nullptr && atoi(frameRateLimit) > 0) {
+        guiState.frameRateLimit = atoi(frameRateLimit);
+    }
+
+    const char* waitForPresent = getenv("VORTEX_WAIT_FOR_PRESENT");
+
+    if (waitForPresent != nullptr) {
+        this->waitForPresent = atoi(waitForPresent) != 0;
+    }
+
+    const char* traceBudget = getenv("VORTEX_TRACE_BUDGET");
+
+    if (traceBudget != nullptr && atof(traceBudget) > 0.0) {
+        guiState.traceBudget = (float)atof(traceBudget);
+    }
+
+    const char* traceToSwapchain = getenv("VORTEX_TRACE_TO_SWAPCHAIN");
+
+    if (traceToSwapchain != nullptr) {
+        this->traceToSwapchain = atoi(traceToSwapchain) != 0;
+    }
+}
+
+// VORTEX_WORLD_GEOMETRY is either triangles or bricks.
+void Application::readWorldSettings() {
+    const char* geometry = getenv("VORTEX_WORLD_GEOMETRY");
+
+    if (geometry != nullptr && strcmp(geometry, "bricks") == 0) {
+        worldGeometry = WORLD_GEOMETRY_BRICKS;
+    }
+
+    guiState.worldGeometry = worldGeometry;
+}
+
+// Recreates the swapchain with the present settings from the GUI.
+void Application::updatePresentSettings() {
+    presentMode = guiState.presentMode;
+    swapchainImageCount = guiState.swapchainImageCount;
+    waitForPresent = guiState.waitForPresent;
+
+    RendererCreateInfo rendererCreateInfo = getRendererCreateInfo();
+    renderer.resize(device, rendererCreateInfo);
+
+    ImGui_ImplVulkan_SetMinImageCount(surfaceCapabilities.minImageCount);
 }
 
 void Application::createWindow() {
@@ -70,28 +441,355 @@ void Application::createWindow() {
 }
 
 void Application::createEngineResources() {
-    instance = createInstance();
-    glfwCreateWindowSurface(instance, window, nullptr, &surface);
-    device = Device(instance, surface);
+    TRACE_ZONE("Create Engine Resources");
+
+    instance = createInstance(headless);
+    surface = VK_NULL_HANDLE;
+
+    if (!headless) {
+        glfwCreateWindowSurface(instance, window, nullptr, &surface);
+    }
+
+    // VORTEX_DEVICE selects a device by index or by part of its name.
+    device = Device(instance, surface, getenv("VORTEX_DEVICE"));
     loadFunctionPointers(device.logical);
-    surfaceFormat = device.getSurfaceFormat(surface);
-    renderPass = createRenderPass(device.logical, surfaceFormat.format, false);
-    guiDescriptorPool = createGuiDescriptorPool(device.logical);
+
+    // VORTEX_JOB_THREADS sets the number of job worker threads besides the main thread. There's
+    // always at least one, since pipelines compile in the background while the main thread renders.
+    uint32_t hardwareThreadCount = std::thread::hardware_concurrency();
+    uint32_t jobThreadCount = hardwareThreadCount > 1 ? hardwareThreadCount - 1 : 1;
+    const char* jobThreads = getenv("VORTEX_JOB_THREADS");
+
+    if (jobThreads != nullptr && atoi(jobThreads) > 0) {
+        jobThreadCount = atoi(jobThreads);
+    }
+
+    jobSystem = JobSystem(jobThreadCount);
+
+    // The caches are read on the workers while the scene is created.
+    JobCounter cacheCounter;
+
+    Job cacheJobs[] = {
+        { .function = loadCache, .data = this, .index = 0, .mainThread = false },
+        { .function = loadCache, .data = this, .index = 1, .mainThread = false }
+    };
+
+    jobSystem.submit(ARRAY_SIZE(cacheJobs), cacheJobs, cacheCounter);
+
+    uploader = Uploader(device, 64 * 1024 * 1024);
+    pipelineCompiler = PipelineCompiler(device.logical, shaderModuleCache, jobSystem);
+
+    // Headless applications have no surface to present to, nor a GUI to render.
+    surfaceFormat = {};
+    renderPass = VK_NULL_HANDLE;
+    guiDescriptorPool = VK_NULL_HANDLE;
+
+    if (!headless) {
+        surfaceFormat = device.getSurfaceFormat(surface);
+        renderPass = createRenderPass(device.logical, surfaceFormat.format, false);
+        guiDescriptorPool = createGuiDescriptorPool(device.logical);
+    }
+
+    createScene();
+
+    jobSystem.wait(cacheCounter);
 
     RendererCreateInfo rendererCreateInfo = getRendererCreateInfo();
     renderer = Renderer(device, rendererCreateInfo);
+    guiState.deviceName = device.properties.deviceName;
+    guiState.pipelineCacheWarm = pipelineCache.warm;
+    guiState.profiler = &renderer.profiler;
+    guiState.jobSystem = &jobSystem;
+    guiState.tracesToSwapchain = renderer.tracesToSwapchain();
+    renderer.resolutionScaler.setBudget(guiState.traceBudget);
 
     pipelineLayout = createPipelineLayout(device.logical, 1, &renderer.descriptorSetLayout);
 
-    ShaderBindingTableEntry sbtEntries[] = {
-        { .stage = ShaderBindingTableStage::RAYGEN, .generalShader = "raygen.spv" }
+    // The raygen constants are read straight from the GUI state, so changing a setting changes
+    // the variant key.
+    raygenSpecializationInfo = {
+        .mapEntryCount = ARRAY_SIZE(raygenSpecializationMapEntries),
+        .pMapEntries   = raygenSpecializationMapEntries,
+        .dataSize      = sizeof(uint32_t),
+        .pData         = &guiState.debugView
+    };
+
+    // Devices that can't write to storage images without a format only trace off-screen, with a
+    // raygen shader that declares it.
+    const char* raygenShader = device.storageImageWriteWithoutFormat ? "raygen.spv" : "raygen_offscreen.spv";
+
+    sbtEntries[0] = { .stage = ShaderBindingTableStage::RAYGEN, .generalShader = raygenShader, .specializationInfo = &raygenSpecializationInfo };
+    sbtEntries[1] = { .stage = ShaderBindingTableStage::MISS, .generalShader = "miss.spv" };
+    sbtEntries[2] = { .stage = ShaderBindingTableStage::HIT, .closestHitShader = "closesthit.spv" };
+    sbtEntries[3] = { .stage = ShaderBindingTableStage::HIT, .closestHitShader = "chunk_hit.spv" };
+    sbtEntries[4] = { .stage = ShaderBindingTableStage::HIT, .closestHitShader = "brick_hit.spv", .intersectionShader = "brick_intersection.spv" };
+
+    pipelineVariantCache = PipelineVariantCache(4);
+
+    auto start = std::chrono::steady_clock::now();
+
+    TRACE_ZONE("Create Pipelines");
+
+    PipelineCompilation* compilation = pipelineCompiler.compile(device.logical, pipelineCache, ARRAY_SIZE(sbtEntries), sbtEntries, pipelineLayout);
+    rayTracingPipeline = pipelineCompiler.finish(device.logical, compilation);
+
+    guiState.pipelineCreationTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    shaderBindingTable = ShaderBindingTable(device, rayTracingPipeline, ARRAY_SIZE(sbtEntries), sbtEntries, uploader);
+
+    requestedVariantKey = getSpecializationKey(ARRAY_SIZE(sbtEntries), sbtEntries);
+    pipelineVariantCache.insert(requestedVariantKey, rayTracingPipeline, shaderBindingTable);
+
+    // The trace waits for the upload on the GPU instead of stalling here.
+    renderer.setUploadDependency(uploader.semaphore, uploader.flush(device));
+}
+
+void Application::loadCache(void* data, uint32_t cacheIndex, uint32_t) {
+    TRACE_ZONE("Load Cache");
+
+    Application* application = (Application*)data;
+
+    if (cacheIndex == 0) {
+        application->pipelineCache = PipelineCache(application->device, "pipeline_cache.bin");
+    }
+    else {
+        application->shaderModuleCache = ShaderModuleCache(application->device, "shader_cache.bin");
+    }
+}
+
+// Instances one cube BLAS in a grid above a world of chunks, which has a BLAS per chunk. The
+// builds wait for the uploads on the GPU.
+void Application::createScene() {
+    TRACE_ZONE("Create Scene");
+
+    // The view is in chunks, from the camera towards its target.
+    float chunkSize = CHUNK_SIZE * WORLD_BLOCK_SIZE;
+
+    TerrainView view = {
+        .x          = (CAMERA_POSITION[0] - WORLD_ORIGIN[0]) / chunkSize,
+        .z          = (CAMERA_POSITION[2] - WORLD_ORIGIN[2]) / chunkSize,
+        .directionX = CAMERA_TARGET[0] - CAMERA_POSITION[0],
+        .directionZ = CAMERA_TARGET[2] - CAMERA_POSITION[2]
+    };
+
+    chunkMap = ChunkMap(512);
+
+    TerrainGenerator terrainGenerator(jobSystem, TERRAIN_SETTINGS, WORLD_VIEW_DISTANCE, 64);
+    terrainGenerator.load(chunkMap, view);
+    terrainGenerator.destroy();
+
+    uint32_t chunkCount = chunkMap.getChunkCount();
+    ChunkCoordinate* coordinates = new ChunkCoordinate[chunkCount];
+    uint32_t coordinateCount = 0;
+
+    chunkMap.forEachChunk([&](ChunkCoordinate coordinate, Chunk&) {
+        coordinates[coordinateCount++] = coordinate;
+    });
+
+    accelerationStructureManager = AccelerationStructureManager(device, 1 + chunkCount, CUBE_GRID_SIZE * CUBE_GRID_SIZE + chunkCount);
+
+    VkBufferUsageFlags usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+
+    cubeVertexBuffer = Buffer(device, sizeof(cubeVertices), usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    cubeIndexBuffer = Buffer(device, sizeof(cubeIndices), usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+    uploader.uploadBuffer(device, cubeVertexBuffer, 0, sizeof(cubeVertices), cubeVertices);
+    uploader.uploadBuffer(device, cubeIndexBuffer, 0, sizeof(cubeIndices), cubeIndices);
+
+    BlasTriangles triangles = {
+        .vertexAddress = cubeVertexBuffer.getDeviceAddress(device.logical),
+        .vertexStride  = 3 * sizeof(float),
+        .vertexCount   = ARRAY_SIZE(cubeVertices) / 3,
+        .indexAddress  = cubeIndexBuffer.getDeviceAddress(device.logical),
+        .triangleCount = ARRAY_SIZE(cubeIndices) / 3
+    };
+
+    uint32_t blas = accelerationStructureManager.addBlas(triangles);
+
+    // The cubes are colored by their custom index, which is their index in the grid.
+    for (uint32_t z = 0; z < CUBE_GRID_SIZE; ++z) {
+        for (uint32_t x = 0; x < CUBE_GRID_SIZE; ++x) {
+            accelerationStructureManager.addInstance(blas, getCubeTransform(x, z, 0.0f), z * CUBE_GRID_SIZE + x, CUBE_HIT_GROUP);
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    if (worldGeometry == WORLD_GEOMETRY_TRIANGLES) {
+        createWorldTriangles(chunkCount, coordinates);
+    }
+    else {
+        createWorldBricks(chunkCount, coordinates);
+    }
+
+    guiState.worldChunkCount = chunkCount;
+    guiState.worldCreationTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    guiState.worldGeometrySize = worldVertexBuffer.allocation.size + geometryBuffer.allocation.size + (worldGeometry == WORLD_GEOMETRY_TRIANGLES ? worldIndexBuffer.allocation.size : 0);
+
+    delete[] coordinates;
+
+    accelerationStructureManager.update(device, uploader.semaphore, uploader.flush(device));
+}
+
+// Meshes the chunks into one vertex buffer, with the attributes of their quads in the geometry
+// buffer. All chunks share the indices of the largest mesh, and their custom index is their first
+// quad.
+void Application::createWorldTriangles(uint32_t chunkCount, const ChunkCoordinate* coordinates) {
+    TRACE_ZONE("Create World Triangles");
+
+    ChunkMesher chunkMesher(jobSystem);
+    ChunkMesh* meshes = new ChunkMesh[chunkCount];
+    JobCounter counter;
+
+    chunkMesher.mesh(chunkMap, chunkCount, coordinates, meshes, counter);
+    jobSystem.wait(counter);
+
+    uint32_t quadCount = 0;
+    uint32_t maxQuadCount = 0;
+
+    for (uint32_t i = 0; i < chunkCount; ++i) {
+        quadCount += meshes[i].quadCount;
+        maxQuadCount = meshes[i].quadCount > maxQuadCount ? meshes[i].quadCount : maxQuadCount;
+    }
+
+    // Buffers can't be empty, even if the world is.
+    VkBufferUsageFlags usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+    VkDeviceSize quadVertexSize = 4 * 3 * sizeof(float);
+
+    worldVertexBuffer = Buffer(device, (quadCount > 0 ? quadCount : 1) * quadVertexSize, usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    worldIndexBuffer = Buffer(device, (maxQuadCount > 0 ? maxQuadCount : 1) * 6 * sizeof(uint32_t), usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    geometryBuffer = Buffer(device, (quadCount > 0 ? quadCount : 1) * sizeof(uint32_t), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+    uint32_t* indices = new uint32_t[maxQuadCount * 6];
+    writeQuadIndices(maxQuadCount, indices);
+
+    uploader.uploadBuffer(device, worldIndexBuffer, 0, maxQuadCount * 6 * sizeof(uint32_t), indices);
+
+    delete[] indices;
+
+    VkDeviceAddress vertexAddress = worldVertexBuffer.getDeviceAddress(device.logical);
+    VkDeviceAddress indexAddress = worldIndexBuffer.getDeviceAddress(device.logical);
+    uint32_t quadOffset = 0;
+
+    // The meshes are copied into the upload ring before the mesher reuses its arenas.
+    for (uint32_t i = 0; i < chunkCount; ++i) {
+        const ChunkMesh& mesh = meshes[i];
+
+        if (mesh.quadCount == 0) {
+            continue;
+        }
+
+        uploader.uploadBuffer(device, worldVertexBuffer, quadOffset * quadVertexSize, mesh.quadCount * quadVertexSize, mesh.vertices);
+        uploader.uploadBuffer(device, geometryBuffer, quadOffset * sizeof(uint32_t), mesh.quadCount * sizeof(uint32_t), mesh.quadAttributes);
+
+        BlasTriangles triangles = {
+            .vertexAddress = vertexAddress + quadOffset * quadVertexSize,
+            .vertexStride  = 3 * sizeof(float),
+            .vertexCount   = mesh.quadCount * 4,
+            .indexAddress  = indexAddress,
+            .triangleCount = mesh.quadCount * 2
+        };
+
+        uint32_t blas = accelerationStructureManager.addBlas(triangles);
+        accelerationStructureManager.addInstance(blas, getChunkTransform(coordinates[i]), quadOffset, CHUNK_HIT_GROUP);
+
+        quadOffset += mesh.quadCount;
+    }
+
+    guiState.worldPrimitiveCount = quadCount;
+
+    delete[] meshes;
+    chunkMesher.destroy();
+}
+
+// Puts a box around the solid blocks of every occupied brick, and the bricks in the geometry buffer
+// in the same order. The custom index of a chunk is its first brick.
+void Application::createWorldBricks(uint32_t chunkCount, const ChunkCoordinate* coordinates) {
+    TRACE_ZONE("Create World Bricks");
+
+    BrickBuild build = {
+        .chunkMap    = &chunkMap,
+        .coordinates = coordinates,
+        .blocks      = new Block[jobSystem.getWorkerCount() * CHUNK_BLOCK_COUNT],
+        .bricks      = new Brick[chunkCount * CHUNK_BRICK_COUNT],
+        .bounds      = new BrickBounds[chunkCount * CHUNK_BRICK_COUNT],
+        .brickCounts = new uint32_t[chunkCount]
     };
 
-    rayTracingPipeline = createRayTracingPipeline(device.logical, 1, sbtEntries, pipelineLayout);
-    shaderBindingTable = ShaderBindingTable(device, 1, sbtEntries);
+    Job* jobs = new Job[chunkCount];
+    JobCounter counter;
+
+    for (uint32_t i = 0; i < chunkCount; ++i) {
+        jobs[i] = { .function = buildBricks, .data = &build, .index = i, .mainThread = false };
+    }
+
+    jobSystem.submit(chunkCount, jobs, counter);
+    jobSystem.wait(counter);
+
+    // Pack the bricks of all chunks together, in chunk order.
+    Brick* bricks = build.bricks;
+    BrickBounds* bounds = build.bounds;
+    uint32_t* brickCounts = build.brickCounts;
+    uint32_t brickCount = 0;
+
+    for (uint32_t i = 0; i < chunkCount; ++i) {
+        memmove(&bricks[brickCount], &bricks[i * CHUNK_BRICK_COUNT], brickCounts[i] * sizeof(Brick));
+        memmove(&bounds[brickCount], &bounds[i * CHUNK_BRICK_COUNT], brickCounts[i] * sizeof(BrickBounds));
+
+        brickCount += brickCounts[i];
+    }
+
+    VkBufferUsageFlags usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+
+    worldVertexBuffer = Buffer(device, (brickCount > 0 ? brickCount : 1) * sizeof(BrickBounds), usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    geometryBuffer = Buffer(device, (brickCount > 0 ? brickCount : 1) * sizeof(Brick), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+    uploader.uploadBuffer(device, worldVertexBuffer, 0, brickCount * sizeof(BrickBounds), bounds);
+    uploader.uploadBuffer(device, geometryBuffer, 0, brickCount * sizeof(Brick), bricks);
+
+    VkDeviceAddress aabbAddress = worldVertexBuffer.getDeviceAddress(device.logical);
+    uint32_t brickOffset = 0;
+
+    for (uint32_t i = 0; i < chunkCount; ++i) {
+        if (brickCounts[i] == 0) {
+            continue;
+        }
+
+        BlasAabbs aabbs = {
+            .aabbAddress = aabbAddress + brickOffset * sizeof(BrickBounds),
+            .aabbStride  = sizeof(BrickBounds),
+            .aabbCount   = brickCounts[i]
+        };
+
+        uint32_t blas = accelerationStructureManager.addBlas(aabbs);
+        accelerationStructureManager.addInstance(blas, getChunkTransform(coordinates[i]), brickOffset, BRICK_HIT_GROUP);
+
+        brickOffset += brickCounts[i];
+    }
+
+    guiState.worldPrimitiveCount = brickCount;
+
+    delete[] jobs;
+    delete[] brickCounts;
+    delete[] bounds;
+    delete[] bricks;
+    delete[] build.blocks;
+}
+
+// Only moves the cubes, so the TLAS is refitted. The instances were added in grid order.
+void Application::animateScene(float time) {
+    TRACE_ZONE("Animate Scene");
+
+    for (uint32_t z = 0; z < CUBE_GRID_SIZE; ++z) {
+        for (uint32_t x = 0; x < CUBE_GRID_SIZE; ++x) {
+            accelerationStructureManager.setInstanceTransform(z * CUBE_GRID_SIZE + x, getCubeTransform(x, z, time));
+        }
+    }
 }
 
 void Application::createGuiResources() {
+    TRACE_ZONE("Create GUI Resources");
+
     ImGui::CreateContext();
 
     ImGui_ImplGlfw_InitForVulkan(window, true);
@@ -107,7 +805,7 @@ void Application::createGuiResources() {
         .MinImageCount       = surfaceCapabilities.minImageCount,
         .ImageCount          = surfaceCapabilities.minImageCount,
         .MSAASamples         = VK_SAMPLE_COUNT_1_BIT,
-        .PipelineCache       = VK_NULL_HANDLE,
+        .PipelineCache       = pipelineCache,
         .Subpass             = 0,
         .UseDynamicRendering = false,
         .Allocator           = nullptr,
@@ -115,18 +813,108 @@ void Application::createGuiResources() {
         .MinAllocationSize   = 0
     };
 
+    auto start = std::chrono::steady_clock::now();
+
     ImGui_ImplVulkan_Init(&initInfo);
+
+    guiState.pipelineCreationTime += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void Application::updateRayTracingPipeline() {
+    TRACE_ZONE("Update Pipeline");
+
+    // Compile pipeline variants in the background and swap them in once they're ready. Variants
+    // that were already built are swapped in immediately, and F5 recompiles all shaders.
+    if (pendingCompilation == nullptr) {
+        uint64_t key = getSpecializationKey(ARRAY_SIZE(sbtEntries), sbtEntries);
+
+        if (ImGui::IsKeyPressed(ImGuiKey_F5, false)) {
+            // Libraries are keyed by shader code, so only edited shaders are recompiled, but
+            // every variant has to be linked again.
+            reloadingShaders = true;
+        }
+        else if (key == requestedVariantKey) {
+            return;
+        }
+
+        requestedVariantKey = key;
+
+        PipelineVariant* variant = reloadingShaders ? nullptr : pipelineVariantCache.find(key);
+
+        if (variant != nullptr) {
+            useRayTracingPipelineVariant(*variant);
+        }
+        else {
+            pendingVariantKey = key;
+            pendingCompilation = pipelineCompiler.compile(device.logical, pipelineCache, ARRAY_SIZE(sbtEntries), sbtEntries, pipelineLayout);
+        }
+
+        return;
+    }
+
+    if (!pipelineCompiler.isComplete(pendingCompilation)) {
+        return;
+    }
+
+    VkPipeline pipeline = pipelineCompiler.finish(device.logical, pendingCompilation);
+    pendingCompilation = nullptr;
+
+    if (pipeline == VK_NULL_HANDLE) {
+        reloadingShaders = false;
+        return;
+    }
+
+    // Only the reload destroys variants that frames in flight may still use.
+    if (reloadingShaders) {
+        renderer.waitIdle(device.logical);
+        pipelineVariantCache.clear(device);
+        reloadingShaders = false;
+    }
+
+    ShaderBindingTable sbt(device, pipeline, ARRAY_SIZE(sbtEntries), sbtEntries, uploader);
+    renderer.setUploadDependency(uploader.semaphore, uploader.flush(device));
+
+    useRayTracingPipelineVariant(*pipelineVariantCache.insert(pendingVariantKey, pipeline, sbt));
+}
+
+// Frames are recorded from scratch, and variants outlive the frames that use them, so the swap
+// doesn't wait for the GPU.
+void Application::useRayTracingPipelineVariant(const PipelineVariant& variant) {
+    rayTracingPipeline = variant.pipeline;
+    shaderBindingTable = variant.sbt;
+
+    renderer.setTracePipeline(pipelineLayout, rayTracingPipeline, shaderBindingTable);
 }
 
 RendererCreateInfo Application::getRendererCreateInfo() {
-    surfaceCapabilities = device.getSurfaceCapabilities(surface, window);
+    if (headless) {
+        surfaceCapabilities = {};
+        surfaceCapabilities.currentExtent = headlessExtent;
+    }
+    else {
+        // Unsupported settings fall back to supported ones, which the GUI then shows.
+        surfaceCapabilities = device.getSurfaceCapabilities(surface, window, swapchainImageCount);
+        swapchainImageCount = surfaceCapabilities.minImageCount;
+        presentMode = device.getPresentMode(surface, presentMode);
+        waitForPresent = waitForPresent && device.presentWait;
+    }
+
+    guiState.presentMode = presentMode;
+    guiState.swapchainImageCount = swapchainImageCount;
+    guiState.waitForPresent = waitForPresent;
 
     RendererCreateInfo rendererCreateInfo = {
         .surface             = surface,
         .surfaceCapabilities = &surfaceCapabilities,
         .surfaceFormat       = surfaceFormat,
+        .presentMode         = presentMode,
+        .waitForPresent      = waitForPresent,
+        .traceToSwapchain    = traceToSwapchain && guiState.traceBudget == 0.0f,
+        .tlas                = accelerationStructureManager.getTlas(),
+        .geometryBuffer      = geometryBuffer,
         .renderPass          = renderPass,
-        .framesInFlight      = 2
+        .framesInFlight      = 2,
+        .jobSystem           = &jobSystem
     };
 
     return rendererCreateInfo;
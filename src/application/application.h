@@ -1,6 +1,17 @@
 #pragma once
 
+#include <acceleration_structure.h>
 #include <graphics.h>
+#include <job_system.h>
+#include <pipeline_cache.h>
+#include <pipeline_compiler.h>
+#include <shader_cache.h>
+#include <staging.h>
+#include <trace.h>
+
+#include <chunk_map.h>
+
+#include "gui.h"
 
 class Application {
 public:
@@ -10,10 +21,33 @@ public:
     void run();
 
 private:
-    GLFWwindow* window;
+    bool headless = false;
+    VkExtent2D headlessExtent;
+    uint32_t headlessFrameCount = 1;
+    const char* headlessOutputFileName = "frame.ppm";
+    VkPresentModeKHR presentMode = VK_PRESENT_MODE_MAILBOX_KHR;
+    uint32_t swapchainImageCount = 3;
+    bool waitForPresent = false;
+    bool traceToSwapchain = true;
+    WorldGeometry worldGeometry = WORLD_GEOMETRY_TRIANGLES;
+    GLFWwindow* window = nullptr;
     VkInstance instance;
     VkSurfaceKHR surface;
     Device device;
+    JobSystem jobSystem;
+    double jobStatisticsTime = 0.0;
+    Uploader uploader;
+    AccelerationStructureManager accelerationStructureManager;
+    Buffer cubeVertexBuffer;
+    Buffer cubeIndexBuffer;
+    ChunkMap chunkMap;
+    Buffer worldVertexBuffer;
+    Buffer worldIndexBuffer;
+    Buffer geometryBuffer;
+    PipelineCache pipelineCache;
+    ShaderModuleCache shaderModuleCache;
+    PipelineCompiler pipelineCompiler;
+    PipelineVariantCache pipelineVariantCache;
     VkSurfaceCapabilitiesKHR surfaceCapabilities;
     VkSurfaceFormatKHR surfaceFormat;
     VkRenderPass renderPass;
@@ -21,11 +55,32 @@ private:
     Renderer renderer;
     VkPipelineLayout pipelineLayout;
     VkPipeline rayTracingPipeline;
+    PipelineCompilation* pendingCompilation = nullptr;
+    uint64_t pendingVariantKey;
+    uint64_t requestedVariantKey;
+    bool reloadingShaders = false;
     ShaderBindingTable shaderBindingTable;
+    GuiState guiState = {};
+    VkSpecializationInfo raygenSpecializationInfo;
+    ShaderBindingTableEntry sbtEntries[5];
 
+    void runHeadless();
+
+    void readHeadlessSettings();
+    void readPresentSettings();
+    void readWorldSettings();
+    void updatePresentSettings();
     void createWindow();
     void createEngineResources();
+    static void loadCache(void* data, uint32_t cacheIndex, uint32_t workerIndex);
+    void createScene();
+    void createWorldTriangles(uint32_t chunkCount, const ChunkCoordinate* coordinates);
+    void createWorldBricks(uint32_t chunkCount, const ChunkCoordinate* coordinates);
+    void animateScene(float time);
     void createGuiResources();
 
+    void updateRayTracingPipeline();
+    void useRayTracingPipelineVariant(const PipelineVariant& variant);
+
     RendererCreateInfo getRendererCreateInfo();
 };
@@ -1,11 +1,97 @@
 #include "gui.h"
 
+#include <stdio.h>
+
 #include <imgui_impl_vulkan.h>
 #include <imgui_impl_glfw.h>
 
+#include <job_system.h>
+#include <profiler.h>
+#include <trace.h>
+
 using namespace ImGui;
 
-static void renderMainMenuBar() {
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
+
+struct PresentModeItem {
+    const char* label;
+    VkPresentModeKHR presentMode;
+};
+
+static const PresentModeItem presentModeItems[] = {
+    { "FIFO", VK_PRESENT_MODE_FIFO_KHR },
+    { "FIFO Relaxed", VK_PRESENT_MODE_FIFO_RELAXED_KHR },
+    { "Mailbox", VK_PRESENT_MODE_MAILBOX_KHR },
+    { "Immediate", VK_PRESENT_MODE_IMMEDIATE_KHR }
+};
+
+static const uint32_t frameRateLimits[] = { 30, 60, 120, 144, 240 };
+static const float traceBudgets[] = { 2.0f, 4.0f, 8.0f, 16.0f };
+
+static void renderPresentMenu(GuiState& state) {
+    if (BeginMenu("Present Mode")) {
+        for (uint32_t i = 0; i < ARRAY_SIZE(presentModeItems); ++i) {
+            if (MenuItem(presentModeItems[i].label, nullptr, state.presentMode == presentModeItems[i].presentMode)) {
+                state.presentMode = presentModeItems[i].presentMode;
+            }
+        }
+
+        EndMenu();
+    }
+
+    if (BeginMenu("Swapchain Images")) {
+        for (uint32_t imageCount = 2; imageCount <= 4; ++imageCount) {
+            char label[16];
+            snprintf(label, sizeof(label), "%u", imageCount);
+
+            if (MenuItem(label, nullptr, state.swapchainImageCount == imageCount)) {
+                state.swapchainImageCount = imageCount;
+            }
+        }
+
+        EndMenu();
+    }
+
+    if (BeginMenu("Frame Limit")) {
+        if (MenuItem("Off", nullptr, state.frameRateLimit == 0)) {
+            state.frameRateLimit = 0;
+        }
+
+        for (uint32_t i = 0; i < ARRAY_SIZE(frameRateLimits); ++i) {
+            char label[16];
+            snprintf(label, sizeof(label), "%u FPS", frameRateLimits[i]);
+
+            if (MenuItem(label, nullptr, state.frameRateLimit == frameRateLimits[i])) {
+                state.frameRateLimit = frameRateLimits[i];
+            }
+        }
+
+        EndMenu();
+    }
+
+    MenuItem("Wait For Present", nullptr, &state.waitForPresent, state.presentLatency >= 0.0);
+}
+
+static void renderResolutionMenu(GuiState& state) {
+    if (BeginMenu("Trace Budget", !state.tracesToSwapchain)) {
+        if (MenuItem("Off", nullptr, state.traceBudget == 0.0f)) {
+            state.traceBudget = 0.0f;
+        }
+
+        for (uint32_t i = 0; i < ARRAY_SIZE(traceBudgets); ++i) {
+            char label[16];
+            snprintf(label, sizeof(label), "%.0f ms", traceBudgets[i]);
+
+            if (MenuItem(label, nullptr, state.traceBudget == traceBudgets[i])) {
+                state.traceBudget = traceBudgets[i];
+            }
+        }
+
+        EndMenu();
+    }
+}
+
+static void renderMainMenuBar(GuiState& state) {
     if (BeginMainMenuBar()) {
         if (BeginMenu("File")) {
             EndMenu();
@@ -16,10 +102,39 @@ static void renderMainMenuBar() {
         }
 
         if (BeginMenu("View")) {
+            if (BeginMenu("Debug View")) {
+                if (MenuItem("None", nullptr, state.debugView == DEBUG_VIEW_NONE)) {
+                    state.debugView = DEBUG_VIEW_NONE;
+                }
+
+                if (MenuItem("Launch ID", nullptr, state.debugView == DEBUG_VIEW_LAUNCH_ID)) {
+                    state.debugView = DEBUG_VIEW_LAUNCH_ID;
+                }
+
+                EndMenu();
+            }
+
+            Separator();
+
+            renderPresentMenu(state);
+
+            Separator();
+
+            renderResolutionMenu(state);
+
             EndMenu();
         }
 
         if (BeginMenu("Tools")) {
+            MenuItem("GPU Profiler", nullptr, &state.showGpuProfiler);
+            MenuItem("Job System", nullptr, &state.showJobSystem);
+
+#ifdef VORTEX_TRACING
+            if (MenuItem("Capture CPU Trace")) {
+                TRACE_CAPTURE(120, "trace.json");
+            }
+#endif
+
             EndMenu();
         }
 
@@ -35,12 +150,144 @@ static void renderMainMenuBar() {
     }
 }
 
-void renderGui() {
+static void renderGpuProfiler(GuiState& state) {
+    if (!Begin("GPU Profiler", &state.showGpuProfiler)) {
+        End();
+        return;
+    }
+
+    GpuProfiler& profiler = *state.profiler;
+
+    Text("Device: %s", state.deviceName);
+    Text("Pipelines created in %.2f ms (%s pipeline cache)", state.pipelineCreationTime, state.pipelineCacheWarm ? "warm" : "cold");
+    Text("CPU frame wait: %.3f ms", state.frameWaitTime);
+
+    if (state.presentLatency >= 0.0) {
+        Text("Present latency: %.3f ms", state.presentLatency);
+    }
+    else {
+        TextUnformatted("Present latency: unsupported");
+    }
+
+    Text("Render scale: %.0f%%", state.renderScale * 100.0f);
+    Text("BLAS memory: %.2f MiB (%.2f MiB before compaction)", state.blasSize / (1024.0 * 1024.0), state.blasBuildSize / (1024.0 * 1024.0));
+
+    if (state.accelerationStructureBuildTime >= 0.0f) {
+        Text("Acceleration structure build: %.3f ms", state.accelerationStructureBuildTime);
+    }
+    else {
+        TextUnformatted("Acceleration structure build: unsupported");
+    }
+
+    if (state.blasBuildTime >= 0.0f) {
+        Text("Last BLAS build: %.3f ms", state.blasBuildTime);
+    }
+    else {
+        TextUnformatted("Last BLAS build: unsupported");
+    }
+
+    Text("TLAS refits since rebuild: %u", state.tlasRefitCount);
+    Text("World: %u chunks as %u %s in %.2f ms, %.2f MiB of geometry", state.worldChunkCount, state.worldPrimitiveCount, state.worldGeometry == WORLD_GEOMETRY_BRICKS ? "bricks" : "quads", state.worldCreationTime, state.worldGeometrySize / (1024.0 * 1024.0));
+
+    if (BeginTable("Scopes", 5, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg)) {
+        TableSetupColumn("Scope");
+        TableSetupColumn("Last (ms)");
+        TableSetupColumn("Min (ms)");
+        TableSetupColumn("Avg (ms)");
+        TableSetupColumn("P99 (ms)");
+        TableHeadersRow();
+
+        for (uint32_t i = 0; i < profiler.getScopeCount(); ++i) {
+            GpuScopeStatistics statistics = profiler.getStatistics(i);
+
+            TableNextRow();
+            TableNextColumn();
+            TextUnformatted(profiler.getScopeLabel(i));
+            TableNextColumn();
+            Text("%.3f", statistics.last);
+            TableNextColumn();
+            Text("%.3f", statistics.min);
+            TableNextColumn();
+            Text("%.3f", statistics.average);
+            TableNextColumn();
+            Text("%.3f", statistics.p99);
+        }
+
+        EndTable();
+    }
+
+    if (Button("Export CSV")) {
+        profiler.exportCsv("gpu_profile.csv");
+    }
+
+    End();
+}
+
+// Worker 0 is the main thread, which only runs jobs while it waits for them.
+static void renderJobSystem(GuiState& state) {
+    if (!Begin("Job System", &state.showJobSystem)) {
+        End();
+        return;
+    }
+
+    JobSystem& jobSystem = *state.jobSystem;
+
+    if (BeginTable("Workers", 6, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg)) {
+        TableSetupColumn("Worker");
+        TableSetupColumn("Utilization");
+        TableSetupColumn("Jobs");
+        TableSetupColumn("Stolen");
+        TableSetupColumn("Queue");
+        TableSetupColumn("Max Queue");
+        TableHeadersRow();
+
+        for (uint32_t i = 0; i < jobSystem.getWorkerCount(); ++i) {
+            JobWorkerStatistics statistics = jobSystem.getStatistics(i);
+
+            TableNextRow();
+            TableNextColumn();
+
+            if (i == 0) {
+                TextUnformatted("Main");
+            }
+            else {
+                Text("%u", i);
+            }
+
+            TableNextColumn();
+            Text("%.1f%%", statistics.utilization * 100.0f);
+            TableNextColumn();
+            Text("%u", statistics.jobCount);
+            TableNextColumn();
+            Text("%u", statistics.stealCount);
+            TableNextColumn();
+            Text("%u", statistics.queueDepth);
+            TableNextColumn();
+            Text("%u", statistics.maxQueueDepth);
+        }
+
+        EndTable();
+    }
+
+    End();
+}
+
+void renderGui(GuiState& state) {
+    TRACE_ZONE("GUI");
+
     ImGui_ImplVulkan_NewFrame();
     ImGui_ImplGlfw_NewFrame();
     NewFrame();
 
-    renderMainMenuBar();
+    renderMainMenuBar(state);
+
+    if (state.showGpuProfiler) {
+        renderGpuProfiler(state);
+    }
+
+    if (state.showJobSystem) {
+        renderJobSystem(state);
+    }
 
     Render();
 }
@@ -1,3 +1,57 @@
 #pragma once
 
-void renderGui();
+#include <stdint.h>
+
+#include <vulkan/vulkan.h>
+
+class GpuProfiler;
+class JobSystem;
+
+enum DebugView : uint32_t {
+    DEBUG_VIEW_NONE,
+    DEBUG_VIEW_LAUNCH_ID
+};
+
+// The world is traced either as triangle meshes of its chunks, or as boxes around its occupied
+// bricks that an intersection shader traverses.
+enum WorldGeometry : uint32_t {
+    WORLD_GEOMETRY_TRIANGLES,
+    WORLD_GEOMETRY_BRICKS
+};
+
+// The present latency is negative when it can't be measured. A trace budget of 0 disables dynamic
+// resolution, which isn't available when tracing into the swapchain. The BLAS build size is what
+// the BLASes would take without compaction. The acceleration structure build times are negative
+// when they can't be measured. World primitives are quads or bricks, depending on the geometry.
+// The pipeline and world creation times are measured once at startup.
+struct GuiState {
+    uint32_t debugView;
+    VkPresentModeKHR presentMode;
+    uint32_t swapchainImageCount;
+    bool waitForPresent;
+    uint32_t frameRateLimit;
+    float traceBudget;
+    float renderScale;
+    bool tracesToSwapchain;
+    const char* deviceName;
+    double pipelineCreationTime;
+    bool pipelineCacheWarm;
+    VkDeviceSize blasSize;
+    VkDeviceSize blasBuildSize;
+    uint32_t tlasRefitCount;
+    float accelerationStructureBuildTime;
+    float blasBuildTime;
+    WorldGeometry worldGeometry;
+    uint32_t worldChunkCount;
+    double worldCreationTime;
+    uint32_t worldPrimitiveCount;
+    VkDeviceSize worldGeometrySize;
+    bool showGpuProfiler;
+    GpuProfiler* profiler;
+    bool showJobSystem;
+    JobSystem* jobSystem;
+    double frameWaitTime;
+    double presentLatency;
+};
+
+void renderGui(GuiState& state);
@@ -0,0 +1,229 @@
+#include <math.h>
+#include <stdio.h>
+
+#include <chrono>
+
+#include <chunk_map.h>
+
+// Measures the throughput of chunk and chunk map operations, and the memory footprint of a sparse
+// terrain world compared to storing every block with 16 bits.
+
+static uint32_t random(uint32_t& state) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+
+    return state;
+}
+
+static double getMilliseconds(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void benchmarkChunk(uint32_t blockTypeCount) {
+    static Block blocks[CHUNK_BLOCK_COUNT];
+
+    uint32_t state = 1;
+    uint64_t checksum = 0;
+
+    for (uint32_t i = 0; i < CHUNK_BLOCK_COUNT; ++i) {
+        blocks[i] = (Block)(random(state) % blockTypeCount);
+    }
+
+    Chunk chunk(AIR);
+
+    // Set every block one by one, which grows the palette as it goes.
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < CHUNK_BLOCK_COUNT; ++i) {
+        chunk.set(i, blocks[i]);
+    }
+
+    double setTime = getMilliseconds(start);
+
+    constexpr uint32_t ACCESS_COUNT = 1 << 24;
+
+    start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < ACCESS_COUNT; ++i) {
+        checksum += chunk.get(random(state) % CHUNK_BLOCK_COUNT);
+    }
+
+    double getTime = getMilliseconds(start);
+
+    start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < ACCESS_COUNT; ++i) {
+        chunk.set(random(state) % CHUNK_BLOCK_COUNT, (Block)(random(state) % blockTypeCount));
+    }
+
+    double randomSetTime = getMilliseconds(start);
+
+    constexpr uint32_t PASS_COUNT = 256;
+
+    start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < PASS_COUNT; ++i) {
+        chunk.decode(blocks);
+        checksum += blocks[i];
+    }
+
+    double decodeTime = getMilliseconds(start);
+
+    start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < PASS_COUNT; ++i) {
+        chunk.encode(blocks);
+    }
+
+    double encodeTime = getMilliseconds(start);
+
+    printf("%5u types, %2u bits: %7.1f Mset/s sequential, %7.1f Mget/s random, %7.1f Mset/s random, %7.1f Mblocks/s decode, %7.1f Mblocks/s encode, %6zu bytes (checksum %llu)\n",
+        blockTypeCount, chunk.getBitsPerBlock(),
+        CHUNK_BLOCK_COUNT / setTime / 1e3,
+        ACCESS_COUNT / getTime / 1e3,
+        ACCESS_COUNT / randomSetTime / 1e3,
+        (double)PASS_COUNT * CHUNK_BLOCK_COUNT / decodeTime / 1e3,
+        (double)PASS_COUNT * CHUNK_BLOCK_COUNT / encodeTime / 1e3,
+        chunk.getMemoryUsage(), (unsigned long long)checksum);
+
+    chunk.destroy();
+}
+
+static void benchmarkChunkMap() {
+    constexpr int32_t EXTENT = 64;
+    constexpr uint32_t CHUNK_COUNT = EXTENT * EXTENT * EXTENT / 8;
+
+    ChunkMap chunkMap(16);
+    uint32_t state = 1;
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < CHUNK_COUNT; ++i) {
+        chunkMap.insert({ (int32_t)(random(state) % EXTENT) - EXTENT / 2, (int32_t)(random(state) % EXTENT) - EXTENT / 2, (int32_t)(random(state) % EXTENT) - EXTENT / 2 });
+    }
+
+    double insertTime = getMilliseconds(start);
+
+    constexpr uint32_t LOOKUP_COUNT = 1 << 24;
+    uint32_t foundCount = 0;
+
+    start = std::chrono::steady_clock::now();
+
+    // About an eighth of the coordinates exist.
+    for (uint32_t i = 0; i < LOOKUP_COUNT; ++i) {
+        foundCount += chunkMap.find({ (int32_t)(random(state) % EXTENT) - EXTENT / 2, (int32_t)(random(state) % EXTENT) - EXTENT / 2, (int32_t)(random(state) % EXTENT) - EXTENT / 2 }) != nullptr;
+    }
+
+    double findTime = getMilliseconds(start);
+
+    uint32_t chunkCount = chunkMap.getChunkCount();
+
+    start = std::chrono::steady_clock::now();
+
+    for (int32_t z = -EXTENT / 2; z < EXTENT / 2; ++z) {
+        for (int32_t y = -EXTENT / 2; y < EXTENT / 2; ++y) {
+            for (int32_t x = -EXTENT / 2; x < EXTENT / 2; ++x) {
+                chunkMap.remove({ x, y, z });
+            }
+        }
+    }
+
+    double removeTime = getMilliseconds(start);
+
+    printf("Chunk map: %u chunks, %.1f Minsert/s, %.1f Mfind/s (%.0f%% hits), %.1f Mremove/s, %u left\n",
+        chunkCount,
+        CHUNK_COUNT / insertTime / 1e3,
+        LOOKUP_COUNT / findTime / 1e3,
+        100.0 * foundCount / LOOKUP_COUNT,
+        (double)EXTENT * EXTENT * EXTENT / removeTime / 1e3,
+        chunkMap.getChunkCount());
+
+    chunkMap.destroy();
+}
+
+// Rolling hills of stone, dirt and grass with some ores, in a world that's mostly air above them.
+static void benchmarkWorld() {
+    constexpr int32_t WORLD_WIDTH = 1024;
+    constexpr int32_t WORLD_HEIGHT = 256;
+
+    constexpr Block STONE = 1;
+    constexpr Block DIRT = 2;
+    constexpr Block GRASS = 3;
+    constexpr Block ORE = 4;
+
+    ChunkMap chunkMap(1024);
+    uint32_t state = 1;
+    static Block blocks[CHUNK_BLOCK_COUNT];
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (int32_t chunkZ = 0; chunkZ < WORLD_WIDTH / (int32_t)CHUNK_SIZE; ++chunkZ) {
+        for (int32_t chunkX = 0; chunkX < WORLD_WIDTH / (int32_t)CHUNK_SIZE; ++chunkX) {
+            for (int32_t chunkY = 0; chunkY < WORLD_HEIGHT / (int32_t)CHUNK_SIZE; ++chunkY) {
+                bool empty = true;
+
+                for (uint32_t z = 0; z < CHUNK_SIZE; ++z) {
+                    for (uint32_t x = 0; x < CHUNK_SIZE; ++x) {
+                        float worldX = (float)(chunkX * CHUNK_SIZE + x);
+                        float worldZ = (float)(chunkZ * CHUNK_SIZE + z);
+                        int32_t height = (int32_t)(64.0f + 24.0f * sinf(worldX * 0.013f) * cosf(worldZ * 0.017f) + 8.0f * sinf(worldX * 0.05f + worldZ * 0.04f));
+
+                        for (uint32_t y = 0; y < CHUNK_SIZE; ++y) {
+                            int32_t worldY = chunkY * CHUNK_SIZE + y;
+                            Block block = AIR;
+
+                            if (worldY < height - 4) {
+                                block = random(state) % 64 == 0 ? ORE : STONE;
+                            }
+                            else if (worldY < height) {
+                                block = DIRT;
+                            }
+                            else if (worldY == height) {
+                                block = GRASS;
+                            }
+
+                            blocks[getBlockIndex(x, y, z)] = block;
+                            empty = empty && block == AIR;
+                        }
+                    }
+                }
+
+                if (!empty) {
+                    chunkMap.insert({ chunkX, chunkY, chunkZ }).encode(blocks);
+                }
+            }
+        }
+    }
+
+    double generateTime = getMilliseconds(start);
+
+    uint32_t uniformCount = 0;
+
+    chunkMap.forEachChunk([&](ChunkCoordinate, Chunk& chunk) {
+        uniformCount += chunk.isUniform();
+    });
+
+    size_t denseSize = (size_t)WORLD_WIDTH * WORLD_WIDTH * WORLD_HEIGHT * sizeof(Block);
+    size_t storedDenseSize = (size_t)chunkMap.getChunkCount() * CHUNK_BLOCK_COUNT * sizeof(Block);
+    size_t size = chunkMap.getMemoryUsage();
+
+    printf("World: %dx%dx%d blocks in %u chunks (%u uniform), generated in %.1f ms\n", WORLD_WIDTH, WORLD_HEIGHT, WORLD_WIDTH, chunkMap.getChunkCount(), uniformCount, generateTime);
+    printf("World memory: %.2f MiB, %.2f MiB for dense stored chunks (%.1fx), %.2f MiB for a dense world (%.1fx)\n",
+        size / (1024.0 * 1024.0),
+        storedDenseSize / (1024.0 * 1024.0), (double)storedDenseSize / size,
+        denseSize / (1024.0 * 1024.0), (double)denseSize / size);
+
+    chunkMap.destroy();
+}
+
+int main() {
+    uint32_t blockTypeCounts[] = { 1, 2, 4, 16, 256, 4096 };
+
+    for (uint32_t blockTypeCount : blockTypeCounts) {
+        benchmarkChunk(blockTypeCount);
+    }
+
+    benchmarkChunkMap();
+    benchmarkWorld();
+}
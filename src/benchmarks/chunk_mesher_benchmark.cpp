@@ -0,0 +1,184 @@
+#include <math.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include <chunk_mesher.h>
+
+// Measures how many chunks per second the greedy mesher gets through with an increasing number of
+// job system threads, on the same terrain as the chunk benchmark, and how many quads it saves over a
+// quad per visible face.
+
+static uint32_t random(uint32_t& state) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+
+    return state;
+}
+
+static double getMilliseconds(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void generateWorld(ChunkMap& chunkMap) {
+    constexpr int32_t WORLD_WIDTH = 512;
+    constexpr int32_t WORLD_HEIGHT = 256;
+
+    constexpr Block STONE = 1;
+    constexpr Block DIRT = 2;
+    constexpr Block GRASS = 3;
+    constexpr Block ORE = 4;
+
+    uint32_t state = 1;
+    static Block blocks[CHUNK_BLOCK_COUNT];
+
+    for (int32_t chunkZ = 0; chunkZ < WORLD_WIDTH / (int32_t)CHUNK_SIZE; ++chunkZ) {
+        for (int32_t chunkX = 0; chunkX < WORLD_WIDTH / (int32_t)CHUNK_SIZE; ++chunkX) {
+            for (int32_t chunkY = 0; chunkY < WORLD_HEIGHT / (int32_t)CHUNK_SIZE; ++chunkY) {
+                bool empty = true;
+
+                for (uint32_t z = 0; z < CHUNK_SIZE; ++z) {
+                    for (uint32_t x = 0; x < CHUNK_SIZE; ++x) {
+                        float worldX = (float)(chunkX * CHUNK_SIZE + x);
+                        float worldZ = (float)(chunkZ * CHUNK_SIZE + z);
+                        int32_t height = (int32_t)(64.0f + 24.0f * sinf(worldX * 0.013f) * cosf(worldZ * 0.017f) + 8.0f * sinf(worldX * 0.05f + worldZ * 0.04f));
+
+                        for (uint32_t y = 0; y < CHUNK_SIZE; ++y) {
+                            int32_t worldY = chunkY * CHUNK_SIZE + y;
+                            Block block = AIR;
+
+                            if (worldY < height - 4) {
+                                block = random(state) % 64 == 0 ? ORE : STONE;
+                            }
+                            else if (worldY < height) {
+                                block = DIRT;
+                            }
+                            else if (worldY == height) {
+                                block = GRASS;
+                            }
+
+                            blocks[getBlockIndex(x, y, z)] = block;
+                            empty = empty && block == AIR;
+                        }
+                    }
+                }
+
+                if (!empty) {
+                    chunkMap.insert({ chunkX, chunkY, chunkZ }).encode(blocks);
+                }
+            }
+        }
+    }
+}
+
+// Counts the faces between solid blocks and air, which is what a mesher without merging emits.
+static uint64_t countVisibleFaces(ChunkMap& chunkMap) {
+    uint64_t faceCount = 0;
+
+    chunkMap.forEachChunk([&](ChunkCoordinate coordinate, Chunk& chunk) {
+        for (int32_t z = 0; z < (int32_t)CHUNK_SIZE; ++z) {
+            for (int32_t y = 0; y < (int32_t)CHUNK_SIZE; ++y) {
+                for (int32_t x = 0; x < (int32_t)CHUNK_SIZE; ++x) {
+                    if (chunk.get(getBlockIndex(x, y, z)) == AIR) {
+                        continue;
+                    }
+
+                    int32_t worldX = coordinate.x * CHUNK_SIZE + x;
+                    int32_t worldY = coordinate.y * CHUNK_SIZE + y;
+                    int32_t worldZ = coordinate.z * CHUNK_SIZE + z;
+
+                    faceCount += chunkMap.getBlock(worldX + 1, worldY, worldZ) == AIR;
+                    faceCount += chunkMap.getBlock(worldX - 1, worldY, worldZ) == AIR;
+                    faceCount += chunkMap.getBlock(worldX, worldY + 1, worldZ) == AIR;
+                    faceCount += chunkMap.getBlock(worldX, worldY - 1, worldZ) == AIR;
+                    faceCount += chunkMap.getBlock(worldX, worldY, worldZ + 1) == AIR;
+                    faceCount += chunkMap.getBlock(worldX, worldY, worldZ - 1) == AIR;
+                }
+            }
+        }
+    });
+
+    return faceCount;
+}
+
+int main() {
+    ChunkMap chunkMap(1024);
+    generateWorld(chunkMap);
+
+    uint32_t chunkCount = chunkMap.getChunkCount();
+    ChunkCoordinate* coordinates = new ChunkCoordinate[chunkCount];
+    ChunkMesh* meshes = new ChunkMesh[chunkCount];
+    uint32_t coordinateCount = 0;
+
+    chunkMap.forEachChunk([&](ChunkCoordinate coordinate, Chunk&) {
+        coordinates[coordinateCount++] = coordinate;
+    });
+
+    uint64_t faceCount = countVisibleFaces(chunkMap);
+
+    printf("World: %u chunks, %llu visible faces\n", chunkCount, (unsigned long long)faceCount);
+
+    uint32_t maxThreadCount = std::max(std::thread::hardware_concurrency(), 1u);
+
+    for (uint32_t threadCount = 1; threadCount <= maxThreadCount; threadCount *= 2) {
+        // The calling thread is one of the meshing threads.
+        JobSystem jobSystem(threadCount - 1);
+        ChunkMesher chunkMesher(jobSystem);
+        JobCounter counter;
+
+        // The first pass grows the arenas, which later passes reuse.
+        chunkMesher.mesh(chunkMap, chunkCount, coordinates, meshes, counter);
+        jobSystem.wait(counter);
+        jobSystem.updateStatistics();
+
+        constexpr uint32_t PASS_COUNT = 8;
+
+        auto start = std::chrono::steady_clock::now();
+
+        for (uint32_t i = 0; i < PASS_COUNT; ++i) {
+            chunkMesher.mesh(chunkMap, chunkCount, coordinates, meshes, counter);
+            jobSystem.wait(counter);
+        }
+
+        double meshTime = getMilliseconds(start);
+
+        jobSystem.updateStatistics();
+
+        float utilization = 0.0f;
+        uint32_t stealCount = 0;
+
+        for (uint32_t i = 0; i < jobSystem.getWorkerCount(); ++i) {
+            JobWorkerStatistics statistics = jobSystem.getStatistics(i);
+
+            utilization += statistics.utilization;
+            stealCount += statistics.stealCount;
+        }
+
+        uint64_t quadCount = 0;
+
+        for (uint32_t i = 0; i < chunkCount; ++i) {
+            quadCount += meshes[i].quadCount;
+        }
+
+        size_t vertexSize = quadCount * 4 * 3 * sizeof(float);
+
+        printf("%2u threads: %8.0f chunks/s, %.2f ms per world, %llu quads (%.1fx fewer than faces), %.2f MiB of vertices, %.0f%% utilization, %u steals\n",
+            threadCount,
+            PASS_COUNT * chunkCount / meshTime * 1e3,
+            meshTime / PASS_COUNT,
+            (unsigned long long)quadCount, (double)faceCount / quadCount,
+            vertexSize / (1024.0 * 1024.0),
+            100.0f * utilization / threadCount, stealCount);
+
+        chunkMesher.destroy();
+        jobSystem.destroy();
+    }
+
+    delete[] meshes;
+    delete[] coordinates;
+
+    chunkMap.destroy();
+}
@@ -0,0 +1,186 @@
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include <terrain_generator.h>
+#include <terrain_noise.h>
+
+// Measures how fast the noise is sampled with and without vectors, how many chunks per second a
+// single core generates, how loading the terrain around a view scales with the number of job
+// system threads, and how long updates take on the main thread while the view moves.
+
+static double getMilliseconds(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static const TerrainSettings TERRAIN_SETTINGS = {
+    .seed        = 1,
+    .chunkHeight = 8,
+    .baseHeight  = 64.0f,
+    .amplitude   = 48.0f,
+    .frequency   = 1.0f / 128.0f,
+    .octaveCount = 4,
+    .dirtDepth   = 4,
+    .oreRarity   = 64,
+    .stone       = 1,
+    .dirt        = 2,
+    .grass       = 3,
+    .ore         = 4
+};
+
+static void measureNoise() {
+    constexpr uint32_t ROW_COUNT = 1 << 16;
+
+    float values[CHUNK_SIZE];
+    float checksum = 0.0f;
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < ROW_COUNT; ++i) {
+        sampleNoiseRow(TERRAIN_SETTINGS.seed, TERRAIN_SETTINGS.octaveCount, 0.0f, i * TERRAIN_SETTINGS.frequency, TERRAIN_SETTINGS.frequency, CHUNK_SIZE, values);
+        checksum += values[i % CHUNK_SIZE];
+    }
+
+    double vectorTime = getMilliseconds(start);
+
+    start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < ROW_COUNT; ++i) {
+        sampleNoiseRowScalar(TERRAIN_SETTINGS.seed, TERRAIN_SETTINGS.octaveCount, 0.0f, i * TERRAIN_SETTINGS.frequency, TERRAIN_SETTINGS.frequency, CHUNK_SIZE, values);
+        checksum -= values[i % CHUNK_SIZE];
+    }
+
+    double scalarTime = getMilliseconds(start);
+
+    printf("Noise (%u octaves): %.1f M samples/s with %s, %.1f M samples/s one at a time (%.1fx), checksum %g\n",
+        TERRAIN_SETTINGS.octaveCount,
+        ROW_COUNT * CHUNK_SIZE / vectorTime * 1e-3, getNoiseInstructionSet(),
+        ROW_COUNT * CHUNK_SIZE / scalarTime * 1e-3,
+        scalarTime / vectorTime, checksum);
+}
+
+static void measureColumns() {
+    constexpr int32_t COLUMN_WIDTH = 16;
+
+    TerrainScratch scratch = createTerrainScratch();
+    Chunk* chunks = new Chunk[TERRAIN_SETTINGS.chunkHeight];
+    bool* empty = new bool[TERRAIN_SETTINGS.chunkHeight];
+    uint32_t chunkCount = 0;
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (int32_t z = 0; z < COLUMN_WIDTH; ++z) {
+        for (int32_t x = 0; x < COLUMN_WIDTH; ++x) {
+            generateTerrainColumn(TERRAIN_SETTINGS, x, z, scratch, chunks, empty);
+
+            for (int32_t y = 0; y < TERRAIN_SETTINGS.chunkHeight; ++y) {
+                if (!empty[y]) {
+                    chunks[y].destroy();
+                    ++chunkCount;
+                }
+            }
+        }
+    }
+
+    double generateTime = getMilliseconds(start);
+
+    printf("Columns: %8.0f chunks/s on one core, %.3f ms per column, %.1f chunks per column\n",
+        chunkCount / generateTime * 1e3,
+        generateTime / (COLUMN_WIDTH * COLUMN_WIDTH),
+        (float)chunkCount / (COLUMN_WIDTH * COLUMN_WIDTH));
+
+    delete[] empty;
+    delete[] chunks;
+    destroyTerrainScratch(scratch);
+}
+
+static void measureLoading(uint32_t maxThreadCount) {
+    constexpr uint32_t VIEW_DISTANCE = 16;
+
+    TerrainView view = { .x = 0.5f, .z = 0.5f, .directionX = 1.0f, .directionZ = 0.0f };
+
+    for (uint32_t threadCount = 1; threadCount <= maxThreadCount; threadCount *= 2) {
+        // The calling thread is one of the generating threads.
+        JobSystem jobSystem(threadCount - 1);
+        TerrainGenerator terrainGenerator(jobSystem, TERRAIN_SETTINGS, VIEW_DISTANCE, 4 * threadCount);
+        ChunkMap chunkMap(4096);
+
+        auto start = std::chrono::steady_clock::now();
+
+        terrainGenerator.load(chunkMap, view);
+
+        double loadTime = getMilliseconds(start);
+        double chunksPerSecond = chunkMap.getChunkCount() / loadTime * 1e3;
+
+        printf("%2u threads: %8.0f chunks/s, %8.0f chunks/s per thread, %.2f ms for %u chunks\n",
+            threadCount, chunksPerSecond, chunksPerSecond / threadCount, loadTime, chunkMap.getChunkCount());
+
+        terrainGenerator.destroy();
+        chunkMap.destroy();
+        jobSystem.destroy();
+    }
+}
+
+// The view moves a quarter of a chunk per frame, and the main thread sleeps through the rest of the
+// frame as if it were rendering. Since it doesn't run jobs while it sleeps, there's always at least
+// one worker thread.
+static void measureStreaming(uint32_t maxThreadCount) {
+    constexpr uint32_t VIEW_DISTANCE = 16;
+    constexpr uint32_t FRAME_COUNT = 512;
+    constexpr uint32_t UPDATE_BUDGET = 16;
+    constexpr float VIEW_SPEED = 0.25f;
+    constexpr auto FRAME_DURATION = std::chrono::milliseconds(4);
+
+    uint32_t threadCount = std::max(maxThreadCount, 2u);
+
+    JobSystem jobSystem(threadCount - 1);
+    TerrainGenerator terrainGenerator(jobSystem, TERRAIN_SETTINGS, VIEW_DISTANCE, 4 * threadCount);
+    ChunkMap chunkMap(4096);
+
+    TerrainView view = { .x = 0.5f, .z = 0.5f, .directionX = 1.0f, .directionZ = 0.0f };
+    terrainGenerator.load(chunkMap, view);
+
+    double totalUpdateTime = 0.0;
+    double maxUpdateTime = 0.0;
+    uint32_t changeCount = 0;
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < FRAME_COUNT; ++i) {
+        auto frameStart = std::chrono::steady_clock::now();
+
+        view.x += VIEW_SPEED;
+        changeCount += terrainGenerator.update(chunkMap, view, UPDATE_BUDGET);
+
+        double updateTime = getMilliseconds(frameStart);
+
+        totalUpdateTime += updateTime;
+        maxUpdateTime = std::max(maxUpdateTime, updateTime);
+
+        std::this_thread::sleep_until(frameStart + FRAME_DURATION);
+    }
+
+    double streamTime = getMilliseconds(start);
+
+    printf("Streaming with %u threads: %u chunks in view, %.1f column changes per frame, %.3f ms average and %.3f ms longest update, %u columns pending, %.2f ms per frame\n",
+        threadCount, chunkMap.getChunkCount(),
+        (float)changeCount / FRAME_COUNT,
+        totalUpdateTime / FRAME_COUNT, maxUpdateTime,
+        terrainGenerator.getPendingCount(),
+        streamTime / FRAME_COUNT);
+
+    terrainGenerator.destroy();
+    chunkMap.destroy();
+    jobSystem.destroy();
+}
+
+int main() {
+    uint32_t maxThreadCount = std::max(std::thread::hardware_concurrency(), 1u);
+
+    measureNoise();
+    measureColumns();
+    measureLoading(maxThreadCount);
+    measureStreaming(maxThreadCount);
+}
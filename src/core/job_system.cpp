@@ -0,0 +1,512 @@
+#include "job_system.h"
+
+#include <stdio.h>
+
+#include <chrono>
+
+#include "trace.h"
+
+static constexpr int64_t JOB_QUEUE_CAPACITY = 4096;
+
+static_assert((JOB_QUEUE_CAPACITY & (JOB_QUEUE_CAPACITY - 1)) == 0, "Deque indices are wrapped with a mask");
+
+// The creating thread is worker 0 of any job system.
+static thread_local uint32_t currentWorkerIndex = 0;
+
+static uint64_t getTime() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint32_t getQueueDepth(JobQueue& queue) {
+    // The owner briefly moves the bottom past the top while it pops the last job.
+    int64_t depth = queue.bottom.load(std::memory_order_relaxed) - queue.top.load(std::memory_order_relaxed);
+
+    return depth > 0 ? (uint32_t)depth : 0;
+}
+
+// Called by the owner of the deque. Fails if it's full.
+static bool pushJob(JobQueue& queue, Job* job) {
+    int64_t bottom = queue.bottom.load(std::memory_order_relaxed);
+    int64_t top = queue.top.load(std::memory_order_acquire);
+
+    if (bottom - top >= JOB_QUEUE_CAPACITY) {
+        return false;
+    }
+
+    queue.jobs[bottom & (JOB_QUEUE_CAPACITY - 1)].store(job, std::memory_order_relaxed);
+    queue.bottom.store(bottom + 1, std::memory_order_release);
+
+    return true;
+}
+
+// Called by the owner of the deque, which races the thieves for the last job.
+static Job* popJob(JobQueue& queue) {
+    int64_t bottom = queue.bottom.load(std::memory_order_relaxed) - 1;
+    queue.bottom.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t top = queue.top.load(std::memory_order_relaxed);
+
+    if (top > bottom) {
+        queue.bottom.store(bottom + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    Job* job = queue.jobs[bottom & (JOB_QUEUE_CAPACITY - 1)].load(std::memory_order_relaxed);
+
+    if (top == bottom) {
+        if (!queue.top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            job = nullptr;
+        }
+
+        queue.bottom.store(bottom + 1, std::memory_order_relaxed);
+    }
+
+    return job;
+}
+
+// Fails if the deque is empty or another thread took the job first.
+static Job* stealJob(JobQueue& queue) {
+    int64_t top = queue.top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t bottom = queue.bottom.load(std::memory_order_acquire);
+
+    if (top >= bottom) {
+        return nullptr;
+    }
+
+    Job* job = queue.jobs[top & (JOB_QUEUE_CAPACITY - 1)].load(std::memory_order_relaxed);
+
+    if (!queue.top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+        return nullptr;
+    }
+
+    return job;
+}
+
+// Sleepers count themselves before they check for work under the lock, and wakers publish work
+// before they check the count, so one of them always sees the other.
+static void wakeWorkers(JobSystemState* state) {
+    if (state->sleepingCount.load() > 0) {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->condition.notify_all();
+    }
+}
+
+static void runJob(JobSystemState* state, uint32_t workerIndex, Job* job);
+
+// Called with the state mutex locked.
+static void appendJob(Job*& firstJob, Job*& lastJob, Job* job) {
+    job->next = nullptr;
+
+    if (lastJob != nullptr) {
+        lastJob->next = job;
+    }
+    else {
+        firstJob = job;
+    }
+
+    lastJob = job;
+}
+
+// Called with the state mutex locked.
+static Job* takeJob(Job*& firstJob, Job*& lastJob) {
+    Job* job = firstJob;
+
+    if (job != nullptr) {
+        firstJob = job->next;
+
+        if (firstJob == nullptr) {
+            lastJob = nullptr;
+        }
+    }
+
+    return job;
+}
+
+// Without worker threads, background jobs are queued like any other.
+static bool isBackgroundJob(JobSystemState* state, Job* job) {
+    return job->background && state->workerCount > 1;
+}
+
+// Queues a job whose dependency is done, without waking anyone.
+static void queueJob(JobSystemState* state, Job* job) {
+    if (job->mainThread) {
+        std::lock_guard<std::mutex> lock(state->mutex);
+
+        appendJob(state->mainThreadJobs, state->lastMainThreadJob, job);
+        state->mainThreadJobCount.fetch_add(1);
+
+        return;
+    }
+
+    if (isBackgroundJob(state, job)) {
+        std::lock_guard<std::mutex> lock(state->mutex);
+
+        appendJob(state->backgroundJobs, state->lastBackgroundJob, job);
+        state->backgroundJobCount.fetch_add(1);
+
+        return;
+    }
+
+    uint32_t workerIndex = currentWorkerIndex;
+    JobWorker& worker = state->workers[workerIndex];
+
+    state->queuedJobCount.fetch_add(1);
+
+    if (!pushJob(worker.queue, job)) {
+        // Run the job right away rather than growing the deque.
+        state->queuedJobCount.fetch_sub(1);
+        runJob(state, workerIndex, job);
+        return;
+    }
+
+    uint32_t queueDepth = getQueueDepth(worker.queue);
+
+    if (queueDepth > worker.maxQueueDepth.load(std::memory_order_relaxed)) {
+        worker.maxQueueDepth.store(queueDepth, std::memory_order_relaxed);
+    }
+}
+
+// The last job takes the counter to zero under the lock, so that no dependent can be added in
+// between, and so that waiters, which take the lock before they return, can't free the counter
+// while it's still being used here.
+static void finishJob(JobSystemState* state, JobCounter& counter) {
+    uint32_t value = counter.value.load(std::memory_order_relaxed);
+
+    while (value > 1) {
+        if (counter.value.compare_exchange_weak(value, value - 1)) {
+            return;
+        }
+    }
+
+    Job* dependents;
+
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+
+        if (counter.value.fetch_sub(1) != 1) {
+            return;
+        }
+
+        dependents = counter.dependents;
+        counter.dependents = nullptr;
+    }
+
+    while (dependents != nullptr) {
+        Job* next = dependents->next;
+        queueJob(state, dependents);
+        dependents = next;
+    }
+
+    wakeWorkers(state);
+}
+
+// Only the outermost job counts as busy time, since jobs also run inside jobs that wait.
+static void runJob(JobSystemState* state, uint32_t workerIndex, Job* job) {
+    JobWorker& worker = state->workers[workerIndex];
+
+    // The job may be submitted again as soon as its function returns.
+    JobCounter* counter = job->counter;
+    uint64_t start = worker.jobDepth++ == 0 ? getTime() : 0;
+
+    job->function(job->data, job->index, workerIndex);
+
+    if (--worker.jobDepth == 0) {
+        worker.busyTime.store(worker.busyTime.load(std::memory_order_relaxed) + getTime() - start, std::memory_order_relaxed);
+    }
+
+    worker.jobCount.store(worker.jobCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    finishJob(state, *counter);
+}
+
+// Thieves start at a random victim, so that they spread out over the workers.
+static Job* stealJob(JobSystemState* state, uint32_t workerIndex) {
+    JobWorker& worker = state->workers[workerIndex];
+
+    worker.randomState ^= worker.randomState << 13;
+    worker.randomState ^= worker.randomState >> 17;
+    worker.randomState ^= worker.randomState << 5;
+
+    uint32_t firstVictim = worker.randomState % state->workerCount;
+
+    for (uint32_t i = 0; i < state->workerCount; ++i) {
+        uint32_t victim = (firstVictim + i) % state->workerCount;
+
+        if (victim == workerIndex) {
+            continue;
+        }
+
+        Job* job = stealJob(state->workers[victim].queue);
+
+        if (job != nullptr) {
+            worker.stealCount.store(worker.stealCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return job;
+        }
+    }
+
+    return nullptr;
+}
+
+// The main thread prefers its own jobs, since no other thread can run them. The worker threads
+// only take background jobs once there's nothing else to run.
+static bool runNextJob(JobSystemState* state, uint32_t workerIndex) {
+    Job* job = nullptr;
+
+    if (workerIndex == 0 && state->mainThreadJobCount.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> lock(state->mutex);
+
+        job = takeJob(state->mainThreadJobs, state->lastMainThreadJob);
+
+        if (job != nullptr) {
+            state->mainThreadJobCount.fetch_sub(1);
+        }
+    }
+
+    if (job == nullptr) {
+        job = popJob(state->workers[workerIndex].queue);
+    }
+
+    if (job == nullptr) {
+        job = stealJob(state, workerIndex);
+    }
+
+    if (job == nullptr && workerIndex != 0 && state->backgroundJobCount.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> lock(state->mutex);
+
+        job = takeJob(state->backgroundJobs, state->lastBackgroundJob);
+
+        if (job != nullptr) {
+            state->backgroundJobCount.fetch_sub(1);
+        }
+    }
+
+    if (job == nullptr) {
+        return false;
+    }
+
+    if (!job->mainThread && !isBackgroundJob(state, job)) {
+        state->queuedJobCount.fetch_sub(1);
+    }
+
+    runJob(state, workerIndex, job);
+
+    return true;
+}
+
+// Called with the state mutex locked.
+static bool hasJobs(JobSystemState* state, uint32_t workerIndex) {
+    if (state->queuedJobCount.load() > 0) {
+        return true;
+    }
+
+    return workerIndex == 0 ? state->mainThreadJobCount.load() > 0 : state->backgroundJobCount.load() > 0;
+}
+
+static void runWorker(JobSystemState* state, uint32_t workerIndex) {
+    char threadName[32];
+    snprintf(threadName, sizeof(threadName), "Job Worker %u", workerIndex);
+
+    TRACE_THREAD_NAME(threadName);
+
+    currentWorkerIndex = workerIndex;
+
+    while (true) {
+        if (runNextJob(state, workerIndex)) {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(state->mutex);
+
+        if (!state->running) {
+            return;
+        }
+
+        state->sleepingCount.fetch_add(1);
+
+        if (!hasJobs(state, workerIndex)) {
+            state->condition.wait(lock);
+        }
+
+        state->sleepingCount.fetch_sub(1);
+    }
+}
+
+JobSystem::JobSystem(uint32_t threadCount) : state(new JobSystemState) {
+    state->running            = true;
+    state->workerCount        = threadCount + 1;
+    state->workers            = new JobWorker[threadCount + 1];
+    state->queuedJobCount     = 0;
+    state->sleepingCount      = 0;
+    state->mainThreadJobCount = 0;
+    state->mainThreadJobs     = nullptr;
+    state->lastMainThreadJob  = nullptr;
+    state->backgroundJobCount = 0;
+    state->backgroundJobs     = nullptr;
+    state->lastBackgroundJob  = nullptr;
+    state->sampleTime         = getTime();
+
+    for (uint32_t i = 0; i < threadCount + 1; ++i) {
+        JobWorker& worker = state->workers[i];
+
+        worker.queue.top         = 0;
+        worker.queue.bottom      = 0;
+        worker.queue.jobs        = new std::atomic<Job*>[JOB_QUEUE_CAPACITY];
+        worker.jobDepth          = 0;
+        worker.randomState       = (i + 1) * 0x9e3779b9u;
+        worker.busyTime          = 0;
+        worker.jobCount          = 0;
+        worker.stealCount        = 0;
+        worker.maxQueueDepth     = 0;
+        worker.sampledBusyTime   = 0;
+        worker.sampledJobCount   = 0;
+        worker.sampledStealCount = 0;
+        worker.statistics        = {};
+    }
+
+    currentWorkerIndex = 0;
+
+    threads = new std::thread[threadCount];
+
+    for (uint32_t i = 0; i < threadCount; ++i) {
+        threads[i] = std::thread(runWorker, state, i + 1);
+    }
+}
+
+void JobSystem::destroy() {
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->running = false;
+    }
+
+    state->condition.notify_all();
+
+    for (uint32_t i = 0; i < state->workerCount - 1; ++i) {
+        threads[i].join();
+    }
+
+    for (uint32_t i = 0; i < state->workerCount; ++i) {
+        delete[] state->workers[i].queue.jobs;
+    }
+
+    delete[] threads;
+    delete[] state->workers;
+    delete state;
+}
+
+void JobSystem::submit(uint32_t jobCount, Job* jobs, JobCounter& counter) {
+    counter.value.fetch_add(jobCount);
+
+    for (uint32_t i = 0; i < jobCount; ++i) {
+        jobs[i].counter = &counter;
+        queueJob(state, &jobs[i]);
+    }
+
+    wakeWorkers(state);
+}
+
+void JobSystem::submit(uint32_t jobCount, Job* jobs, JobCounter& counter, JobCounter& dependency) {
+    counter.value.fetch_add(jobCount);
+
+    for (uint32_t i = 0; i < jobCount; ++i) {
+        jobs[i].counter = &counter;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+
+        if (dependency.value.load() != 0) {
+            for (uint32_t i = 0; i < jobCount; ++i) {
+                jobs[i].next = dependency.dependents;
+                dependency.dependents = &jobs[i];
+            }
+
+            return;
+        }
+    }
+
+    for (uint32_t i = 0; i < jobCount; ++i) {
+        queueJob(state, &jobs[i]);
+    }
+
+    wakeWorkers(state);
+}
+
+void JobSystem::wait(JobCounter& counter) {
+    uint32_t workerIndex = currentWorkerIndex;
+
+    while (counter.value.load() != 0) {
+        if (runNextJob(state, workerIndex)) {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(state->mutex);
+
+        state->sleepingCount.fetch_add(1);
+
+        if (counter.value.load() != 0 && !hasJobs(state, workerIndex)) {
+            state->condition.wait(lock);
+        }
+
+        state->sleepingCount.fetch_sub(1);
+    }
+
+    // Wait for the last job to let go of the counter.
+    std::lock_guard<std::mutex> lock(state->mutex);
+}
+
+bool JobSystem::isComplete(JobCounter& counter) {
+    if (counter.value.load() != 0) {
+        return false;
+    }
+
+    // Like wait(), let the last job let go of the counter.
+    std::lock_guard<std::mutex> lock(state->mutex);
+
+    return true;
+}
+
+void JobSystem::hold(JobCounter& counter) {
+    counter.value.fetch_add(1);
+}
+
+void JobSystem::release(JobCounter& counter) {
+    finishJob(state, counter);
+}
+
+uint32_t JobSystem::getWorkerCount() {
+    return state->workerCount;
+}
+
+// Jobs count towards the interval they finish in, so a long job can push a worker's utilization
+// of a short interval above one.
+void JobSystem::updateStatistics() {
+    uint64_t time = getTime();
+    double interval = (double)(time - state->sampleTime);
+
+    for (uint32_t i = 0; i < state->workerCount; ++i) {
+        JobWorker& worker = state->workers[i];
+
+        uint64_t busyTime = worker.busyTime.load(std::memory_order_relaxed);
+        uint32_t jobCount = worker.jobCount.load(std::memory_order_relaxed);
+        uint32_t stealCount = worker.stealCount.load(std::memory_order_relaxed);
+
+        worker.statistics = {
+            .utilization   = interval > 0.0 ? (float)((busyTime - worker.sampledBusyTime) / interval) : 0.0f,
+            .jobCount      = jobCount - worker.sampledJobCount,
+            .stealCount    = stealCount - worker.sampledStealCount,
+            .queueDepth    = getQueueDepth(worker.queue),
+            .maxQueueDepth = worker.maxQueueDepth.exchange(0, std::memory_order_relaxed)
+        };
+
+        worker.sampledBusyTime = busyTime;
+        worker.sampledJobCount = jobCount;
+        worker.sampledStealCount = stealCount;
+    }
+
+    state->sampleTime = time;
+}
+
+JobWorkerStatistics JobSystem::getStatistics(uint32_t workerIndex) {
+    return state->workers[workerIndex].statistics;
+}
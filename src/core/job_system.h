@@ -0,0 +1,122 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+struct Job;
+
+// The index is the job's own argument, for jobs that share their function and data, and the
+// worker index identifies the thread, for per-thread scratch memory.
+typedef void (*JobFunction)(void* data, uint32_t index, uint32_t workerIndex);
+
+// Counts the unfinished jobs that were submitted against it, and holds the jobs that depend on it
+// until it reaches zero.
+struct JobCounter {
+    std::atomic<uint32_t> value = 0;
+    Job* dependents = nullptr;
+};
+
+// Jobs belong to their submitter and have to stay alive until their counter reaches zero, so that
+// a batch of jobs doesn't allocate. Main thread jobs only run on the thread that created the job
+// system, whenever it waits. Background jobs are the opposite, for long jobs that would stall the
+// main thread's waits, and only run on the worker threads unless there are none.
+struct Job {
+    JobFunction function;
+    void* data;
+    uint32_t index;
+    bool mainThread;
+    bool background;
+    JobCounter* counter;
+    Job* next;
+};
+
+// A Chase-Lev deque, which its owner pushes to and pops from at the bottom without locking, while
+// other threads steal from the top.
+struct JobQueue {
+    std::atomic<int64_t> top;
+    std::atomic<int64_t> bottom;
+    std::atomic<Job*>* jobs;
+};
+
+// Utilization is the fraction of the interval that the worker spent running jobs. The queue
+// depth is the number of jobs in the worker's deque at the end of the interval.
+struct JobWorkerStatistics {
+    float utilization;
+    uint32_t jobCount;
+    uint32_t stealCount;
+    uint32_t queueDepth;
+    uint32_t maxQueueDepth;
+};
+
+// The counters are only written by the worker itself and sampled by updateStatistics().
+struct alignas(64) JobWorker {
+    JobQueue queue;
+    uint32_t jobDepth;
+    uint32_t randomState;
+    std::atomic<uint64_t> busyTime;
+    std::atomic<uint32_t> jobCount;
+    std::atomic<uint32_t> stealCount;
+    std::atomic<uint32_t> maxQueueDepth;
+    uint64_t sampledBusyTime;
+    uint32_t sampledJobCount;
+    uint32_t sampledStealCount;
+    JobWorkerStatistics statistics;
+};
+
+struct JobSystemState {
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool running;
+    uint32_t workerCount;
+    JobWorker* workers;
+    std::atomic<int32_t> queuedJobCount;
+    std::atomic<uint32_t> sleepingCount;
+    std::atomic<uint32_t> mainThreadJobCount;
+    Job* mainThreadJobs;
+    Job* lastMainThreadJob;
+    std::atomic<uint32_t> backgroundJobCount;
+    Job* backgroundJobs;
+    Job* lastBackgroundJob;
+    uint64_t sampleTime;
+};
+
+// Runs jobs on a pool of worker threads and the thread that created it, which is worker 0. Every
+// worker has its own deque of jobs, which it works through last in first out while its cache is
+// still warm, and idle workers steal the oldest jobs of the others. Workers sleep once there's
+// nothing to run or steal.
+//
+// Jobs can depend on a counter and are only queued once it reaches zero, so chains of jobs run
+// without any thread blocking. Threads that wait for a counter run jobs in the meantime. Jobs are
+// submitted and waited for on the creating thread or from inside jobs.
+class JobSystem {
+public:
+    JobSystem() = default;
+    explicit JobSystem(uint32_t threadCount);
+    void destroy();
+
+    void submit(uint32_t jobCount, Job* jobs, JobCounter& counter);
+    void submit(uint32_t jobCount, Job* jobs, JobCounter& counter, JobCounter& dependency);
+    void wait(JobCounter& counter);
+
+    // Polls a counter without running any jobs. Once it returns true, the counter can be reused.
+    bool isComplete(JobCounter& counter);
+
+    // Holds a counter above zero for work that isn't a job, such as an operation that completes
+    // inside some later job.
+    void hold(JobCounter& counter);
+    void release(JobCounter& counter);
+
+    uint32_t getWorkerCount();
+
+    // Ends the statistics interval, which started at the previous update or at creation.
+    void updateStatistics();
+    JobWorkerStatistics getStatistics(uint32_t workerIndex);
+
+private:
+    JobSystemState* state;
+    std::thread* threads;
+};
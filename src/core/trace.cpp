@@ -0,0 +1,184 @@
+#include "trace.h"
+
+#ifdef VORTEX_TRACING
+
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+
+constexpr uint32_t TRACE_BUFFER_SIZE = 16384;
+
+// The fields are atomic since a capture may read an event while its thread overwrites it.
+struct TraceEvent {
+    std::atomic<const char*> name;
+    std::atomic<uint64_t> start;
+    std::atomic<uint64_t> end;
+};
+
+// Only the owning thread writes events. Like a sequence lock, the event count tells readers which
+// events are complete, and they discard the events that may have been overwritten while they
+// were being read.
+struct TraceBuffer {
+    TraceEvent events[TRACE_BUFFER_SIZE];
+    std::atomic<uint64_t> eventCount;
+    uint32_t threadId;
+    char threadName[64];
+    TraceBuffer* next;
+};
+
+static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+// Buffers are registered once per thread and never freed, so threads that have exited still
+// show up in the capture.
+static std::mutex bufferMutex;
+static TraceBuffer* buffers = nullptr;
+static uint32_t bufferCount = 0;
+
+static thread_local TraceBuffer* threadBuffer = nullptr;
+
+static std::atomic<bool> capturing = false;
+static uint64_t captureStart;
+static uint32_t remainingFrameCount;
+static const char* captureFileName;
+
+static uint64_t getTime() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+static TraceBuffer* getThreadBuffer() {
+    if (threadBuffer == nullptr) {
+        threadBuffer = new TraceBuffer;
+        threadBuffer->eventCount = 0;
+        threadBuffer->threadName[0] = '\0';
+
+        std::lock_guard<std::mutex> lock(bufferMutex);
+
+        threadBuffer->threadId = bufferCount++;
+        threadBuffer->next = buffers;
+        buffers = threadBuffer;
+    }
+
+    return threadBuffer;
+}
+
+static void writeEscaped(std::ofstream& file, const char* string) {
+    for (const char* c = string; *c != '\0'; ++c) {
+        if (*c == '"' || *c == '\\') {
+            file << '\\';
+        }
+
+        file << *c;
+    }
+}
+
+static void writeCapture(uint64_t captureEnd) {
+    std::ofstream file(captureFileName, std::ios::trunc);
+
+    file << "{\"traceEvents\":[";
+
+    bool first = true;
+
+    std::lock_guard<std::mutex> lock(bufferMutex);
+
+    for (TraceBuffer* buffer = buffers; buffer != nullptr; buffer = buffer->next) {
+        if (buffer->threadName[0] != '\0') {
+            file << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->threadId << ",\"args\":{\"name\":\"";
+            writeEscaped(file, buffer->threadName);
+            file << "\"}}";
+
+            first = false;
+        }
+
+        uint64_t eventCount = buffer->eventCount.load(std::memory_order_acquire);
+        uint64_t firstEvent = eventCount > TRACE_BUFFER_SIZE ? eventCount - TRACE_BUFFER_SIZE : 0;
+
+        for (uint64_t i = firstEvent; i < eventCount; ++i) {
+            TraceEvent& event = buffer->events[i % TRACE_BUFFER_SIZE];
+
+            const char* name = event.name.load(std::memory_order_relaxed);
+            uint64_t start = event.start.load(std::memory_order_relaxed);
+            uint64_t end = event.end.load(std::memory_order_relaxed);
+
+            // The thread overwrites the event once it has completed the one before the event's next
+            // use, and a read of any of the new fields makes that visible.
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            if (buffer->eventCount.load(std::memory_order_relaxed) - i >= TRACE_BUFFER_SIZE) {
+                continue;
+            }
+
+            if (start < captureStart || end > captureEnd) {
+                continue;
+            }
+
+            file << (first ? "" : ",") << "\n{\"name\":\"";
+            writeEscaped(file, name);
+            file << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->threadId << ",\"ts\":" << start / 1000.0 << ",\"dur\":" << (end - start) / 1000.0 << "}";
+
+            first = false;
+        }
+    }
+
+    file << "\n]}\n";
+    file.close();
+
+    if (file.fail()) {
+        printf("Failed to write the trace to %s\n", captureFileName);
+    }
+    else {
+        printf("Wrote the trace to %s\n", captureFileName);
+    }
+}
+
+TraceZone::TraceZone(const char* name) : name(name), start(getTime()) {}
+
+TraceZone::~TraceZone() {
+    TraceBuffer* buffer = getThreadBuffer();
+
+    uint64_t eventCount = buffer->eventCount.load(std::memory_order_relaxed);
+    TraceEvent& event = buffer->events[eventCount % TRACE_BUFFER_SIZE];
+
+    // Pairs with the fence of readers that see any of the new fields.
+    std::atomic_thread_fence(std::memory_order_release);
+
+    event.name.store(name, std::memory_order_relaxed);
+    event.start.store(start, std::memory_order_relaxed);
+    event.end.store(getTime(), std::memory_order_relaxed);
+
+    buffer->eventCount.store(eventCount + 1, std::memory_order_release);
+}
+
+void setTraceThreadName(const char* name) {
+    TraceBuffer* buffer = getThreadBuffer();
+
+    // Captures read the name under the lock.
+    std::lock_guard<std::mutex> lock(bufferMutex);
+
+    strncpy(buffer->threadName, name, sizeof(buffer->threadName) - 1);
+    buffer->threadName[sizeof(buffer->threadName) - 1] = '\0';
+}
+
+// Called on the thread that calls endTraceFrame.
+void beginTraceCapture(uint32_t frameCount, const char* fileName) {
+    if (capturing || frameCount == 0) {
+        return;
+    }
+
+    captureStart = getTime();
+    remainingFrameCount = frameCount;
+    captureFileName = fileName;
+    capturing = true;
+}
+
+void endTraceFrame() {
+    if (capturing && --remainingFrameCount == 0) {
+        writeCapture(getTime());
+        capturing = false;
+    }
+}
+
+#endif
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+
+// CPU trace zones. Every thread records the zones it finishes into its own ring buffer without
+// locking, and a capture writes the zones of the next frames as Chrome trace events, which can
+// be opened in Perfetto. Without VORTEX_TRACING the macros compile to nothing.
+#ifdef VORTEX_TRACING
+
+#define TRACE_CONCATENATE_(a, b) a##b
+#define TRACE_CONCATENATE(a, b) TRACE_CONCATENATE_(a, b)
+
+// The name has to outlive the capture, so it's usually a string literal.
+#define TRACE_ZONE(name) TraceZone TRACE_CONCATENATE(traceZone, __LINE__)(name)
+#define TRACE_THREAD_NAME(name) setTraceThreadName(name)
+#define TRACE_CAPTURE(frameCount, fileName) beginTraceCapture(frameCount, fileName)
+#define TRACE_FRAME() endTraceFrame()
+
+class TraceZone {
+public:
+    TraceZone(const char* name);
+    ~TraceZone();
+
+private:
+    const char* name;
+    uint64_t start;
+};
+
+void setTraceThreadName(const char* name);
+void beginTraceCapture(uint32_t frameCount, const char* fileName);
+void endTraceFrame();
+
+#else
+
+#define TRACE_ZONE(name)
+#define TRACE_THREAD_NAME(name)
+#define TRACE_CAPTURE(frameCount, fileName)
+#define TRACE_FRAME()
+
+#endif
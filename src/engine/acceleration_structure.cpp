@@ -0,0 +1,928 @@
+#include "acceleration_structure.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <trace.h>
+
+static PFN_vkCreateAccelerationStructureKHR vkCreateAccelerationStructure;
+static PFN_vkDestroyAccelerationStructureKHR vkDestroyAccelerationStructure;
+static PFN_vkGetAccelerationStructureBuildSizesKHR vkGetAccelerationStructureBuildSizes;
+static PFN_vkGetAccelerationStructureDeviceAddressKHR vkGetAccelerationStructureDeviceAddress;
+static PFN_vkCmdBuildAccelerationStructuresKHR vkCmdBuildAccelerationStructures;
+static PFN_vkCmdCopyAccelerationStructureKHR vkCmdCopyAccelerationStructure;
+static PFN_vkCmdWriteAccelerationStructuresPropertiesKHR vkCmdWriteAccelerationStructuresProperties;
+
+static VkDeviceSize alignSize(VkDeviceSize size, VkDeviceSize alignment) {
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+static void recordMemoryBarrier(VkCommandBuffer commandBuffer, VkPipelineStageFlags2 srcStageMask, VkAccessFlags2 srcAccessMask, VkPipelineStageFlags2 dstStageMask, VkAccessFlags2 dstAccessMask) {
+    VkMemoryBarrier2 memoryBarrier = {
+        .sType         = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+        .pNext         = nullptr,
+        .srcStageMask  = srcStageMask,
+        .srcAccessMask = srcAccessMask,
+        .dstStageMask  = dstStageMask,
+        .dstAccessMask = dstAccessMask
+    };
+
+    VkDependencyInfo dependencyInfo = {
+        .sType                    = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        .pNext                    = nullptr,
+        .dependencyFlags          = 0,
+        .memoryBarrierCount       = 1,
+        .pMemoryBarriers          = &memoryBarrier,
+        .bufferMemoryBarrierCount = 0,
+        .pBufferMemoryBarriers    = nullptr,
+        .imageMemoryBarrierCount  = 0,
+        .pImageMemoryBarriers     = nullptr
+    };
+
+    vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
+}
+
+AccelerationStructureManager::AccelerationStructureManager(Device& device, uint32_t blasCapacity, uint32_t instanceCapacity) : blasCapacity(blasCapacity), instanceCapacity(instanceCapacity) {
+    vkCreateAccelerationStructure = (PFN_vkCreateAccelerationStructureKHR)vkGetDeviceProcAddr(device.logical, "vkCreateAccelerationStructureKHR");
+    vkDestroyAccelerationStructure = (PFN_vkDestroyAccelerationStructureKHR)vkGetDeviceProcAddr(device.logical, "vkDestroyAccelerationStructureKHR");
+    vkGetAccelerationStructureBuildSizes = (PFN_vkGetAccelerationStructureBuildSizesKHR)vkGetDeviceProcAddr(device.logical, "vkGetAccelerationStructureBuildSizesKHR");
+    vkGetAccelerationStructureDeviceAddress = (PFN_vkGetAccelerationStructureDeviceAddressKHR)vkGetDeviceProcAddr(device.logical, "vkGetAccelerationStructureDeviceAddressKHR");
+    vkCmdBuildAccelerationStructures = (PFN_vkCmdBuildAccelerationStructuresKHR)vkGetDeviceProcAddr(device.logical, "vkCmdBuildAccelerationStructuresKHR");
+    vkCmdCopyAccelerationStructure = (PFN_vkCmdCopyAccelerationStructureKHR)vkGetDeviceProcAddr(device.logical, "vkCmdCopyAccelerationStructureKHR");
+    vkCmdWriteAccelerationStructuresProperties = (PFN_vkCmdWriteAccelerationStructuresPropertiesKHR)vkGetDeviceProcAddr(device.logical, "vkCmdWriteAccelerationStructuresPropertiesKHR");
+
+    VkPhysicalDeviceAccelerationStructurePropertiesKHR accelerationStructureProperties = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR,
+        .pNext = nullptr
+    };
+
+    VkPhysicalDeviceProperties2 properties = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+        .pNext = &accelerationStructureProperties
+    };
+
+    vkGetPhysicalDeviceProperties2(device.physical, &properties);
+
+    scratchAlignment = accelerationStructureProperties.minAccelerationStructureScratchOffsetAlignment;
+
+    // Create the timeline semaphore.
+    VkSemaphoreTypeCreateInfo semaphoreTypeCreateInfo = {
+        .sType         = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+        .pNext         = nullptr,
+        .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+        .initialValue  = 0
+    };
+
+    VkSemaphoreCreateInfo semaphoreCreateInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        .pNext = &semaphoreTypeCreateInfo,
+        .flags = 0
+    };
+
+    vkCreateSemaphore(device.logical, &semaphoreCreateInfo, nullptr, &semaphore);
+
+    // Create the compacted size query pool, with one query per BLAS.
+    VkQueryPoolCreateInfo queryPoolCreateInfo = {
+        .sType              = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        .pNext              = nullptr,
+        .flags              = 0,
+        .queryType          = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR,
+        .queryCount         = blasCapacity,
+        .pipelineStatistics = 0
+    };
+
+    vkCreateQueryPool(device.logical, &queryPoolCreateInfo, nullptr, &queryPool);
+
+    // Create the timestamp query pool, with a begin and end query per submission.
+    uint32_t queueFamilyPropertyCount;
+    vkGetPhysicalDeviceQueueFamilyProperties(device.physical, &queueFamilyPropertyCount, nullptr);
+
+    VkQueueFamilyProperties* queueFamilyProperties = new VkQueueFamilyProperties[queueFamilyPropertyCount];
+    vkGetPhysicalDeviceQueueFamilyProperties(device.physical, &queueFamilyPropertyCount, queueFamilyProperties);
+
+    uint32_t timestampValidBits = queueFamilyProperties[device.computeQueue.familyIndex].timestampValidBits;
+
+    delete[] queueFamilyProperties;
+
+    timestampsSupported = timestampValidBits != 0 && device.properties.limits.timestampPeriod != 0.0f;
+    timestampPeriod = device.properties.limits.timestampPeriod;
+    timestampMask = timestampValidBits < 64 ? (1ull << timestampValidBits) - 1 : UINT64_MAX;
+
+    queryPoolCreateInfo.queryType  = VK_QUERY_TYPE_TIMESTAMP;
+    queryPoolCreateInfo.queryCount = SUBMISSION_COUNT * 2;
+
+    vkCreateQueryPool(device.logical, &queryPoolCreateInfo, nullptr, &timestampQueryPool);
+
+    // Create the command pool and the submissions.
+    VkCommandPoolCreateInfo commandPoolCreateInfo = {
+        .sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .pNext            = nullptr,
+        .flags            = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+        .queueFamilyIndex = device.computeQueue.familyIndex
+    };
+
+    vkCreateCommandPool(device.logical, &commandPoolCreateInfo, nullptr, &commandPool);
+
+    VkCommandBuffer commandBuffers[SUBMISSION_COUNT];
+
+    VkCommandBufferAllocateInfo commandBufferAllocateInfo = {
+        .sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .pNext              = nullptr,
+        .commandPool        = commandPool,
+        .level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = SUBMISSION_COUNT
+    };
+
+    vkAllocateCommandBuffers(device.logical, &commandBufferAllocateInfo, commandBuffers);
+
+    // Every submission writes its own instances, so the host never overwrites ones that a
+    // pending TLAS build or refit reads. With one update() per frame, there are more of them
+    // than frames in flight.
+    for (uint32_t i = 0; i < SUBMISSION_COUNT; ++i) {
+        submissions[i].commandBuffer  = commandBuffers[i];
+        submissions[i].instanceBuffer = Buffer(device, instanceCapacity * sizeof(VkAccelerationStructureInstanceKHR), VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        submissions[i].value          = 0;
+        submissions[i].timed          = false;
+        submissions[i].buildsBlases   = false;
+    }
+
+    for (uint32_t i = 0; i < SCRATCH_BUFFER_COUNT; ++i) {
+        scratchBuffers[i].size  = 0;
+        scratchBuffers[i].value = 0;
+    }
+
+    // Allocate the BLASes and instances.
+    blases = new Blas[blasCapacity];
+
+    for (uint32_t i = 0; i < blasCapacity; ++i) {
+        blases[i].state = BlasState::FREE;
+    }
+
+    instances = new Instance[instanceCapacity];
+
+    for (uint32_t i = 0; i < instanceCapacity; ++i) {
+        instances[i].used = false;
+    }
+
+    retiredCapacity = 64;
+    retired = new RetiredAccelerationStructure[retiredCapacity];
+
+    // Create the TLAS for the maximum instance count. It's built empty by the first update(), and
+    // allows updates so that it can be refitted.
+    VkAccelerationStructureGeometryKHR geometry = {
+        .sType        = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR,
+        .pNext        = nullptr,
+        .geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR,
+        .geometry     = {
+            .instances = {
+                .sType           = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR,
+                .pNext           = nullptr,
+                .arrayOfPointers = VK_FALSE,
+                .data            = {}
+            }
+        },
+        .flags        = 0
+    };
+
+    VkAccelerationStructureBuildGeometryInfoKHR buildGeometryInfo = {
+        .sType                    = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR,
+        .pNext                    = nullptr,
+        .type                     = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR,
+        .flags                    = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR,
+        .mode                     = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR,
+        .srcAccelerationStructure = VK_NULL_HANDLE,
+        .dstAccelerationStructure = VK_NULL_HANDLE,
+        .geometryCount            = 1,
+        .pGeometries              = &geometry,
+        .ppGeometries             = nullptr,
+        .scratchData              = {}
+    };
+
+    VkAccelerationStructureBuildSizesInfoKHR buildSizesInfo = {
+        .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR,
+        .pNext = nullptr
+    };
+
+    vkGetAccelerationStructureBuildSizes(device.logical, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildGeometryInfo, &instanceCapacity, &buildSizesInfo);
+
+    tlas = createAccelerationStructure(device, VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR, buildSizesInfo.accelerationStructureSize, tlasBuffer);
+    tlasScratchSize = buildSizesInfo.buildScratchSize;
+    tlasUpdateScratchSize = buildSizesInfo.updateScratchSize;
+    tlasDirty = true;
+}
+
+void AccelerationStructureManager::destroy(Device& device) {
+    wait(device.logical, submittedValue);
+
+    completedValue = submittedValue;
+    reclaim(device);
+
+    for (uint32_t i = 0; i < blasCapacity; ++i) {
+        if (blases[i].state == BlasState::BUILT || blases[i].state == BlasState::COMPACTED) {
+            vkDestroyAccelerationStructure(device.logical, blases[i].accelerationStructure, nullptr);
+            blases[i].buffer.destroy(device);
+        }
+    }
+
+    vkDestroyAccelerationStructure(device.logical, tlas, nullptr);
+    tlasBuffer.destroy(device);
+
+    for (uint32_t i = 0; i < SCRATCH_BUFFER_COUNT; ++i) {
+        if (scratchBuffers[i].size != 0) {
+            scratchBuffers[i].buffer.destroy(device);
+        }
+    }
+
+    for (uint32_t i = 0; i < SUBMISSION_COUNT; ++i) {
+        submissions[i].instanceBuffer.destroy(device);
+    }
+
+    delete[] retired;
+    delete[] instances;
+    delete[] blases;
+
+    vkDestroyCommandPool(device.logical, commandPool, nullptr);
+    vkDestroyQueryPool(device.logical, timestampQueryPool, nullptr);
+    vkDestroyQueryPool(device.logical, queryPool, nullptr);
+    vkDestroySemaphore(device.logical, semaphore, nullptr);
+}
+
+uint32_t AccelerationStructureManager::addBlas(const BlasTriangles& triangles) {
+    return addBlas(VK_GEOMETRY_TYPE_TRIANGLES_KHR, triangles, {});
+}
+
+uint32_t AccelerationStructureManager::addBlas(const BlasAabbs& aabbs) {
+    return addBlas(VK_GEOMETRY_TYPE_AABBS_KHR, {}, aabbs);
+}
+
+// Instances of the BLAS have to be removed as well. The TLAS that's rebuilt without it is
+// submitted before it's destroyed, so the next update() retires it.
+void AccelerationStructureManager::removeBlas(uint32_t blas) {
+    Blas& removed = blases[blas];
+
+    if (removed.state == BlasState::BUILT || removed.state == BlasState::COMPACTED) {
+        retire(removed.accelerationStructure, removed.buffer, submittedValue + 1);
+    }
+
+    removed.state = BlasState::FREE;
+    tlasDirty = true;
+}
+
+// Returns UINT32_MAX when all instances are in use. Custom indices have 24 bits.
+uint32_t AccelerationStructureManager::addInstance(uint32_t blas, const VkTransformMatrixKHR& transform, uint32_t customIndex, uint32_t hitGroup) {
+    for (uint32_t i = 0; i < instanceCapacity; ++i) {
+        if (!instances[i].used) {
+            instances[i] = {
+                .used        = true,
+                .blas        = blas,
+                .transform   = transform,
+                .customIndex = customIndex,
+                .hitGroup    = hitGroup
+            };
+
+            tlasDirty = true;
+
+            return i;
+        }
+    }
+
+    return UINT32_MAX;
+}
+
+void AccelerationStructureManager::removeInstance(uint32_t instance) {
+    instances[instance].used = false;
+    tlasDirty = true;
+}
+
+// Moving instances only refits the TLAS, unless they have drifted too far since the last rebuild.
+void AccelerationStructureManager::setInstanceTransform(uint32_t instance, const VkTransformMatrixKHR& transform) {
+    instances[instance].transform = transform;
+    tlasMoved = true;
+}
+
+uint64_t AccelerationStructureManager::update(Device& device, VkSemaphore waitSemaphore, uint64_t waitValue) {
+    TRACE_ZONE("Update Acceleration Structures");
+
+    vkGetSemaphoreCounterValue(device.logical, semaphore, &completedValue);
+    reclaim(device);
+    resolveTimings(device.logical);
+
+    bool work = tlasDirty || tlasMoved;
+
+    for (uint32_t i = 0; i < blasCapacity && !work; ++i) {
+        BlasState state = blases[i].state;
+        work = state == BlasState::PENDING_BUILD || (state == BlasState::BUILT && blases[i].buildValue <= completedValue);
+    }
+
+    if (!work) {
+        return submittedValue;
+    }
+
+    AccelerationStructureSubmission& submission = submissions[submissionIndex];
+
+    // The command buffer, instances and timestamps of this slot may still be in use.
+    if (submission.value > completedValue) {
+        wait(device.logical, submission.value);
+
+        completedValue = submission.value;
+        resolveTimings(device.logical);
+    }
+
+    uint64_t value = submittedValue + 1;
+    uint32_t timestampQuery = submissionIndex * 2;
+
+    VkCommandBufferBeginInfo commandBufferBeginInfo = {
+        .sType            = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .pNext            = nullptr,
+        .flags            = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+        .pInheritanceInfo = nullptr
+    };
+
+    vkBeginCommandBuffer(submission.commandBuffer, &commandBufferBeginInfo);
+
+    if (timestampsSupported) {
+        vkCmdResetQueryPool(submission.commandBuffer, timestampQueryPool, timestampQuery, 2);
+        vkCmdWriteTimestamp2(submission.commandBuffer, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, timestampQueryPool, timestampQuery);
+    }
+
+    // Wait for the traces and builds that were submitted before, which may still read the TLAS
+    // or acceleration structures that are retired once this submission completes.
+    recordMemoryBarrier(submission.commandBuffer, VK_PIPELINE_STAGE_2_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR | VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_COPY_BIT_KHR, VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR, VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR | VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_COPY_BIT_KHR, VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR);
+
+    recordCompactions(device, submission.commandBuffer, value);
+    bool buildsBlases = recordBlasBuilds(device, submission.commandBuffer, value);
+
+    recordMemoryBarrier(submission.commandBuffer, VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR | VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_COPY_BIT_KHR, VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR, VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR | VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_COPY_BIT_KHR, VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR);
+
+    // Query the compacted sizes of the BLASes that were just built.
+    for (uint32_t i = 0; i < blasCapacity; ++i) {
+        if (blases[i].state == BlasState::BUILT && blases[i].buildValue == value) {
+            vkCmdWriteAccelerationStructuresProperties(submission.commandBuffer, 1, &blases[i].accelerationStructure, VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR, queryPool, i);
+        }
+    }
+
+    // Compactions change BLAS addresses, so the TLAS update is only chosen after them.
+    TlasUpdate tlasUpdate = selectTlasUpdate();
+
+    if (tlasUpdate != TlasUpdate::NONE) {
+        recordTlasBuild(device, submission.commandBuffer, submission, tlasUpdate, value);
+    }
+
+    recordMemoryBarrier(submission.commandBuffer, VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR, VK_PIPELINE_STAGE_2_RAY_TRACING_SHADER_BIT_KHR, VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR);
+
+    if (timestampsSupported) {
+        vkCmdWriteTimestamp2(submission.commandBuffer, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, timestampQueryPool, timestampQuery + 1);
+    }
+
+    vkEndCommandBuffer(submission.commandBuffer);
+
+    // Submit the builds.
+    submission.value = value;
+    submission.timed = timestampsSupported;
+    submission.buildsBlases = buildsBlases;
+    submittedValue = value;
+
+    VkSemaphoreSubmitInfo waitSemaphoreInfo = {
+        .sType       = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+        .pNext       = nullptr,
+        .semaphore   = waitSemaphore,
+        .value       = waitValue,
+        .stageMask   = VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+        .deviceIndex = 0
+    };
+
+    VkSemaphoreSubmitInfo signalSemaphoreInfo = {
+        .sType       = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+        .pNext       = nullptr,
+        .semaphore   = semaphore,
+        .value       = value,
+        .stageMask   = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+        .deviceIndex = 0
+    };
+
+    VkCommandBufferSubmitInfo commandBufferInfo = {
+        .sType         = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+        .pNext         = nullptr,
+        .commandBuffer = submission.commandBuffer,
+        .deviceMask    = 0
+    };
+
+    VkSubmitInfo2 submitInfo = {
+        .sType                    = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+        .pNext                    = nullptr,
+        .flags                    = 0,
+        .waitSemaphoreInfoCount   = waitSemaphore != VK_NULL_HANDLE ? 1u : 0u,
+        .pWaitSemaphoreInfos      = &waitSemaphoreInfo,
+        .commandBufferInfoCount   = 1,
+        .pCommandBufferInfos      = &commandBufferInfo,
+        .signalSemaphoreInfoCount = 1,
+        .pSignalSemaphoreInfos    = &signalSemaphoreInfo
+    };
+
+    vkQueueSubmit2(device.computeQueue, 1, &submitInfo, VK_NULL_HANDLE);
+
+    submissionIndex = (submissionIndex + 1) % SUBMISSION_COUNT;
+    tlasDirty = false;
+    tlasMoved = false;
+
+    return value;
+}
+
+VkAccelerationStructureKHR AccelerationStructureManager::getTlas() {
+    return tlas;
+}
+
+// The build size is what the BLASes would take without compaction.
+AccelerationStructureStatistics AccelerationStructureManager::getStatistics() {
+    AccelerationStructureStatistics statistics = {};
+
+    for (uint32_t i = 0; i < blasCapacity; ++i) {
+        if (blases[i].state == BlasState::BUILT || blases[i].state == BlasState::COMPACTED) {
+            ++statistics.blasCount;
+            statistics.buildSize += blases[i].buildSize;
+            statistics.compactedSize += blases[i].size;
+        }
+    }
+
+    statistics.refitCount = refitCount;
+    statistics.buildTime = lastBuildTime;
+    statistics.blasBuildTime = lastBlasBuildTime;
+
+    return statistics;
+}
+
+// Returns UINT32_MAX when all BLASes are in use. The BLAS is built by the next update().
+uint32_t AccelerationStructureManager::addBlas(VkGeometryTypeKHR geometryType, const BlasTriangles& triangles, const BlasAabbs& aabbs) {
+    for (uint32_t i = 0; i < blasCapacity; ++i) {
+        if (blases[i].state == BlasState::FREE) {
+            blases[i].state        = BlasState::PENDING_BUILD;
+            blases[i].geometryType = geometryType;
+            blases[i].triangles    = triangles;
+            blases[i].aabbs        = aabbs;
+
+            return i;
+        }
+    }
+
+    return UINT32_MAX;
+}
+
+VkAccelerationStructureKHR AccelerationStructureManager::createAccelerationStructure(Device& device, VkAccelerationStructureTypeKHR type, VkDeviceSize size, Buffer& buffer) {
+    buffer = Buffer(device, size, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+    VkAccelerationStructureCreateInfoKHR accelerationStructureCreateInfo = {
+        .sType         = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR,
+        .pNext         = nullptr,
+        .createFlags   = 0,
+        .buffer        = buffer,
+        .offset        = 0,
+        .size          = size,
+        .type          = type,
+        .deviceAddress = 0
+    };
+
+    VkAccelerationStructureKHR accelerationStructure;
+    vkCreateAccelerationStructure(device.logical, &accelerationStructureCreateInfo, nullptr, &accelerationStructure);
+
+    return accelerationStructure;
+}
+
+void AccelerationStructureManager::retire(VkAccelerationStructureKHR accelerationStructure, const Buffer& buffer, uint64_t value) {
+    if (retiredCount == retiredCapacity) {
+        retiredCapacity *= 2;
+
+        RetiredAccelerationStructure* newRetired = new RetiredAccelerationStructure[retiredCapacity];
+        memcpy(newRetired, retired, retiredCount * sizeof(RetiredAccelerationStructure));
+
+        delete[] retired;
+        retired = newRetired;
+    }
+
+    retired[retiredCount++] = {
+        .accelerationStructure = accelerationStructure,
+        .buffer                = buffer,
+        .value                 = value
+    };
+}
+
+// Destroys the retired acceleration structures whose submission has completed.
+void AccelerationStructureManager::reclaim(Device& device) {
+    uint32_t keptCount = 0;
+
+    for (uint32_t i = 0; i < retiredCount; ++i) {
+        if (retired[i].value <= completedValue) {
+            vkDestroyAccelerationStructure(device.logical, retired[i].accelerationStructure, nullptr);
+            retired[i].buffer.destroy(device);
+        }
+        else {
+            retired[keptCount++] = retired[i];
+        }
+    }
+
+    retiredCount = keptCount;
+}
+
+// Prefers the smallest idle buffer that's large enough, and otherwise grows an idle one. Only
+// waits when every buffer is used by pending submissions.
+VkDeviceAddress AccelerationStructureManager::acquireScratch(Device& device, VkDeviceSize size, uint64_t value) {
+    ScratchBuffer* scratchBuffer = nullptr;
+
+    while (scratchBuffer == nullptr) {
+        for (uint32_t i = 0; i < SCRATCH_BUFFER_COUNT; ++i) {
+            ScratchBuffer& candidate = scratchBuffers[i];
+
+            if (candidate.value > completedValue) {
+                continue;
+            }
+
+            if (scratchBuffer == nullptr) {
+                scratchBuffer = &candidate;
+            }
+            else if (candidate.size >= size && (scratchBuffer->size < size || candidate.size < scratchBuffer->size)) {
+                scratchBuffer = &candidate;
+            }
+            else if (scratchBuffer->size < size && candidate.size > scratchBuffer->size) {
+                scratchBuffer = &candidate;
+            }
+        }
+
+        if (scratchBuffer == nullptr) {
+            uint64_t oldestValue = UINT64_MAX;
+
+            for (uint32_t i = 0; i < SCRATCH_BUFFER_COUNT; ++i) {
+                oldestValue = scratchBuffers[i].value < oldestValue ? scratchBuffers[i].value : oldestValue;
+            }
+
+            wait(device.logical, oldestValue);
+            vkGetSemaphoreCounterValue(device.logical, semaphore, &completedValue);
+        }
+    }
+
+    // Scratch addresses have a stricter alignment than buffers, so there's room to align it up.
+    if (scratchBuffer->size < size) {
+        if (scratchBuffer->size != 0) {
+            scratchBuffer->buffer.destroy(device);
+        }
+
+        scratchBuffer->size = alignSize(size > MIN_SCRATCH_SIZE ? size : MIN_SCRATCH_SIZE, scratchAlignment);
+        scratchBuffer->buffer = Buffer(device, scratchBuffer->size + scratchAlignment, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        scratchBuffer->address = alignSize(scratchBuffer->buffer.getDeviceAddress(device.logical), scratchAlignment);
+    }
+
+    scratchBuffer->value = value;
+
+    return scratchBuffer->address;
+}
+
+void AccelerationStructureManager::wait(VkDevice device, uint64_t value) {
+    VkSemaphoreWaitInfo semaphoreWaitInfo = {
+        .sType          = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+        .pNext          = nullptr,
+        .flags          = 0,
+        .semaphoreCount = 1,
+        .pSemaphores    = &semaphore,
+        .pValues        = &value
+    };
+
+    vkWaitSemaphores(device, &semaphoreWaitInfo, UINT64_MAX);
+}
+
+// Reads the timestamps of the completed submissions. The statistics show the newest of them, and
+// the newest of those that built BLASes.
+void AccelerationStructureManager::resolveTimings(VkDevice device) {
+    uint64_t newestValue = 0;
+    uint64_t newestBlasValue = 0;
+
+    for (uint32_t i = 0; i < SUBMISSION_COUNT; ++i) {
+        AccelerationStructureSubmission& submission = submissions[i];
+
+        if (!submission.timed || submission.value > completedValue) {
+            continue;
+        }
+
+        submission.timed = false;
+
+        bool newest = submission.value > newestValue;
+        bool newestBlas = submission.buildsBlases && submission.value > newestBlasValue;
+
+        if (!newest && !newestBlas) {
+            continue;
+        }
+
+        uint64_t timestamps[2];
+        vkGetQueryPoolResults(device, timestampQueryPool, i * 2, 2, sizeof(timestamps), timestamps, sizeof(timestamps[0]), VK_QUERY_RESULT_64_BIT);
+
+        float buildTime = ((timestamps[1] - timestamps[0]) & timestampMask) * timestampPeriod * 1e-6f;
+
+        if (newest) {
+            newestValue = submission.value;
+            lastBuildTime = buildTime;
+        }
+
+        if (newestBlas) {
+            newestBlasValue = submission.value;
+            lastBlasBuildTime = buildTime;
+        }
+    }
+}
+
+// A refit keeps the topology of the last rebuild, which gets worse the further instances move
+// from where they were. Their drift is measured by how far their translations have moved.
+TlasUpdate AccelerationStructureManager::selectTlasUpdate() {
+    if (tlasDirty) {
+        return TlasUpdate::REBUILD;
+    }
+
+    if (!tlasMoved) {
+        return TlasUpdate::NONE;
+    }
+
+    float drift = 0.0f;
+    uint32_t instanceCount = 0;
+
+    for (uint32_t i = 0; i < instanceCapacity; ++i) {
+        const Instance& instance = instances[i];
+
+        if (!instance.used || blases[instance.blas].state == BlasState::FREE) {
+            continue;
+        }
+
+        float dx = instance.transform.matrix[0][3] - instance.builtTranslation[0];
+        float dy = instance.transform.matrix[1][3] - instance.builtTranslation[1];
+        float dz = instance.transform.matrix[2][3] - instance.builtTranslation[2];
+
+        drift += sqrtf(dx * dx + dy * dy + dz * dz);
+        ++instanceCount;
+    }
+
+    return drift > MAX_REFIT_DRIFT * tlasExtent * instanceCount ? TlasUpdate::REBUILD : TlasUpdate::REFIT;
+}
+
+// Copies the BLASes whose compacted size is known into acceleration structures of that size.
+// Their queries were written by completed submissions, so reading them never waits.
+void AccelerationStructureManager::recordCompactions(Device& device, VkCommandBuffer commandBuffer, uint64_t value) {
+    for (uint32_t i = 0; i < blasCapacity; ++i) {
+        Blas& blas = blases[i];
+
+        if (blas.state != BlasState::BUILT || blas.buildValue > completedValue) {
+            continue;
+        }
+
+        VkDeviceSize compactedSize;
+        vkGetQueryPoolResults(device.logical, queryPool, i, 1, sizeof(compactedSize), &compactedSize, sizeof(compactedSize), VK_QUERY_RESULT_64_BIT);
+
+        Buffer buffer;
+        VkAccelerationStructureKHR accelerationStructure = createAccelerationStructure(device, VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, compactedSize, buffer);
+
+        VkCopyAccelerationStructureInfoKHR copyAccelerationStructureInfo = {
+            .sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR,
+            .pNext = nullptr,
+            .src   = blas.accelerationStructure,
+            .dst   = accelerationStructure,
+            .mode  = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR
+        };
+
+        vkCmdCopyAccelerationStructure(commandBuffer, &copyAccelerationStructureInfo);
+
+        retire(blas.accelerationStructure, blas.buffer, value);
+
+        VkAccelerationStructureDeviceAddressInfoKHR addressInfo = {
+            .sType                 = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR,
+            .pNext                 = nullptr,
+            .accelerationStructure = accelerationStructure
+        };
+
+        blas.state                 = BlasState::COMPACTED;
+        blas.accelerationStructure = accelerationStructure;
+        blas.buffer                = buffer;
+        blas.size                  = compactedSize;
+        blas.address               = vkGetAccelerationStructureDeviceAddress(device.logical, &addressInfo);
+
+        tlasDirty = true;
+    }
+}
+
+// All pending BLASes are built by one command, each with its own range of one scratch buffer.
+// Returns whether there were any.
+bool AccelerationStructureManager::recordBlasBuilds(Device& device, VkCommandBuffer commandBuffer, uint64_t value) {
+    uint32_t buildCount = 0;
+
+    for (uint32_t i = 0; i < blasCapacity; ++i) {
+        buildCount += blases[i].state == BlasState::PENDING_BUILD;
+    }
+
+    if (buildCount == 0) {
+        return false;
+    }
+
+    VkAccelerationStructureGeometryKHR* geometries = new VkAccelerationStructureGeometryKHR[buildCount];
+    VkAccelerationStructureBuildGeometryInfoKHR* buildGeometryInfos = new VkAccelerationStructureBuildGeometryInfoKHR[buildCount];
+    VkAccelerationStructureBuildRangeInfoKHR* buildRangeInfos = new VkAccelerationStructureBuildRangeInfoKHR[buildCount];
+    const VkAccelerationStructureBuildRangeInfoKHR** buildRangeInfoPointers = new const VkAccelerationStructureBuildRangeInfoKHR*[buildCount];
+    VkDeviceSize* scratchOffsets = new VkDeviceSize[buildCount];
+
+    VkDeviceSize scratchSize = 0;
+    uint32_t buildIndex = 0;
+
+    for (uint32_t i = 0; i < blasCapacity; ++i) {
+        Blas& blas = blases[i];
+
+        if (blas.state != BlasState::PENDING_BUILD) {
+            continue;
+        }
+
+        const BlasTriangles& triangles = blas.triangles;
+        const BlasAabbs& aabbs = blas.aabbs;
+        uint32_t primitiveCount;
+
+        if (blas.geometryType == VK_GEOMETRY_TYPE_TRIANGLES_KHR) {
+            geometries[buildIndex] = {
+                .sType        = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR,
+                .pNext        = nullptr,
+                .geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR,
+                .geometry     = {
+                    .triangles = {
+                        .sType         = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR,
+                        .pNext         = nullptr,
+                        .vertexFormat  = VK_FORMAT_R32G32B32_SFLOAT,
+                        .vertexData    = { .deviceAddress = triangles.vertexAddress },
+                        .vertexStride  = triangles.vertexStride,
+                        .maxVertex     = triangles.vertexCount - 1,
+                        .indexType     = VK_INDEX_TYPE_UINT32,
+                        .indexData     = { .deviceAddress = triangles.indexAddress },
+                        .transformData = {}
+                    }
+                },
+                .flags        = VK_GEOMETRY_OPAQUE_BIT_KHR
+            };
+
+            primitiveCount = triangles.triangleCount;
+        }
+        else {
+            geometries[buildIndex] = {
+                .sType        = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR,
+                .pNext        = nullptr,
+                .geometryType = VK_GEOMETRY_TYPE_AABBS_KHR,
+                .geometry     = {
+                    .aabbs = {
+                        .sType  = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_AABBS_DATA_KHR,
+                        .pNext  = nullptr,
+                        .data   = { .deviceAddress = aabbs.aabbAddress },
+                        .stride = aabbs.aabbStride
+                    }
+                },
+                .flags        = VK_GEOMETRY_OPAQUE_BIT_KHR
+            };
+
+            primitiveCount = aabbs.aabbCount;
+        }
+
+        buildGeometryInfos[buildIndex] = {
+            .sType                    = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR,
+            .pNext                    = nullptr,
+            .type                     = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR,
+            .flags                    = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR,
+            .mode                     = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR,
+            .srcAccelerationStructure = VK_NULL_HANDLE,
+            .dstAccelerationStructure = VK_NULL_HANDLE,
+            .geometryCount            = 1,
+            .pGeometries              = &geometries[buildIndex],
+            .ppGeometries             = nullptr,
+            .scratchData              = {}
+        };
+
+        VkAccelerationStructureBuildSizesInfoKHR buildSizesInfo = {
+            .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR,
+            .pNext = nullptr
+        };
+
+        vkGetAccelerationStructureBuildSizes(device.logical, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildGeometryInfos[buildIndex], &primitiveCount, &buildSizesInfo);
+
+        blas.accelerationStructure = createAccelerationStructure(device, VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, buildSizesInfo.accelerationStructureSize, blas.buffer);
+        blas.buildSize = buildSizesInfo.accelerationStructureSize;
+        blas.size = buildSizesInfo.accelerationStructureSize;
+
+        VkAccelerationStructureDeviceAddressInfoKHR addressInfo = {
+            .sType                 = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR,
+            .pNext                 = nullptr,
+            .accelerationStructure = blas.accelerationStructure
+        };
+
+        blas.address = vkGetAccelerationStructureDeviceAddress(device.logical, &addressInfo);
+
+        buildGeometryInfos[buildIndex].dstAccelerationStructure = blas.accelerationStructure;
+        buildRangeInfos[buildIndex] = { primitiveCount, 0, 0, 0 };
+        buildRangeInfoPointers[buildIndex] = &buildRangeInfos[buildIndex];
+        scratchOffsets[buildIndex] = scratchSize;
+
+        scratchSize += alignSize(buildSizesInfo.buildScratchSize, scratchAlignment);
+
+        // The compacted size query is reset before the build that writes it.
+        vkCmdResetQueryPool(commandBuffer, queryPool, i, 1);
+
+        blas.state = BlasState::BUILT;
+        blas.buildValue = value;
+
+        ++buildIndex;
+    }
+
+    VkDeviceAddress scratchAddress = acquireScratch(device, scratchSize, value);
+
+    for (uint32_t i = 0; i < buildCount; ++i) {
+        buildGeometryInfos[i].scratchData.deviceAddress = scratchAddress + scratchOffsets[i];
+    }
+
+    vkCmdBuildAccelerationStructures(commandBuffer, buildCount, buildGeometryInfos, buildRangeInfoPointers);
+
+    delete[] scratchOffsets;
+    delete[] buildRangeInfoPointers;
+    delete[] buildRangeInfos;
+    delete[] buildGeometryInfos;
+    delete[] geometries;
+
+    return true;
+}
+
+// Refits write the same instances in the same order as the rebuild before them, since only their
+// transforms have changed. Rebuilds remember where the instances were, to measure their drift.
+void AccelerationStructureManager::recordTlasBuild(Device& device, VkCommandBuffer commandBuffer, AccelerationStructureSubmission& submission, TlasUpdate tlasUpdate, uint64_t value) {
+    bool refit = tlasUpdate == TlasUpdate::REFIT;
+
+    // Write the instances whose BLAS exists.
+    VkAccelerationStructureInstanceKHR* instanceData = (VkAccelerationStructureInstanceKHR*)submission.instanceBuffer.allocation.mappedData;
+    uint32_t instanceCount = 0;
+
+    float boundsMin[3] = { INFINITY, INFINITY, INFINITY };
+    float boundsMax[3] = { -INFINITY, -INFINITY, -INFINITY };
+
+    for (uint32_t i = 0; i < instanceCapacity; ++i) {
+        Instance& instance = instances[i];
+
+        if (!instance.used || blases[instance.blas].state == BlasState::FREE) {
+            continue;
+        }
+
+        if (!refit) {
+            for (uint32_t j = 0; j < 3; ++j) {
+                instance.builtTranslation[j] = instance.transform.matrix[j][3];
+                boundsMin[j] = fminf(boundsMin[j], instance.builtTranslation[j]);
+                boundsMax[j] = fmaxf(boundsMax[j], instance.builtTranslation[j]);
+            }
+        }
+
+        instanceData[instanceCount++] = {
+            .transform                              = instance.transform,
+            .instanceCustomIndex                    = instance.customIndex,
+            .mask                                   = 0xff,
+            .instanceShaderBindingTableRecordOffset = instance.hitGroup,
+            .flags                                  = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR,
+            .accelerationStructureReference         = blases[instance.blas].address
+        };
+    }
+
+    VkAccelerationStructureGeometryKHR geometry = {
+        .sType        = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR,
+        .pNext        = nullptr,
+        .geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR,
+        .geometry     = {
+            .instances = {
+                .sType           = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR,
+                .pNext           = nullptr,
+                .arrayOfPointers = VK_FALSE,
+                .data            = { .deviceAddress = submission.instanceBuffer.getDeviceAddress(device.logical) }
+            }
+        },
+        .flags        = 0
+    };
+
+    VkAccelerationStructureBuildGeometryInfoKHR buildGeometryInfo = {
+        .sType                    = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR,
+        .pNext                    = nullptr,
+        .type                     = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR,
+        .flags                    = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR,
+        .mode                     = refit ? VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR : VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR,
+        .srcAccelerationStructure = refit ? tlas : VK_NULL_HANDLE,
+        .dstAccelerationStructure = tlas,
+        .geometryCount            = 1,
+        .pGeometries              = &geometry,
+        .ppGeometries             = nullptr,
+        .scratchData              = { .deviceAddress = acquireScratch(device, refit ? tlasUpdateScratchSize : tlasScratchSize, value) }
+    };
+
+    VkAccelerationStructureBuildRangeInfoKHR buildRangeInfo = { instanceCount, 0, 0, 0 };
+    const VkAccelerationStructureBuildRangeInfoKHR* buildRangeInfoPointer = &buildRangeInfo;
+
+    vkCmdBuildAccelerationStructures(commandBuffer, 1, &buildGeometryInfo, &buildRangeInfoPointer);
+
+    if (refit) {
+        ++refitCount;
+    }
+    else {
+        float dx = instanceCount != 0 ? boundsMax[0] - boundsMin[0] : 0.0f;
+        float dy = instanceCount != 0 ? boundsMax[1] - boundsMin[1] : 0.0f;
+        float dz = instanceCount != 0 ? boundsMax[2] - boundsMin[2] : 0.0f;
+
+        tlasExtent = sqrtf(dx * dx + dy * dy + dz * dz);
+        refitCount = 0;
+    }
+}
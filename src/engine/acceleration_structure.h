@@ -0,0 +1,177 @@
+#pragma once
+
+#include "graphics.h"
+
+// Vertices are three floats at the given stride and indices are 32-bit.
+struct BlasTriangles {
+    VkDeviceAddress vertexAddress;
+    VkDeviceSize vertexStride;
+    uint32_t vertexCount;
+    VkDeviceAddress indexAddress;
+    uint32_t triangleCount;
+};
+
+// Boxes are VkAabbPositionsKHR at the given stride, whose hits are found by an intersection shader.
+struct BlasAabbs {
+    VkDeviceAddress aabbAddress;
+    VkDeviceSize aabbStride;
+    uint32_t aabbCount;
+};
+
+enum class BlasState {
+    FREE,
+    PENDING_BUILD,
+    BUILT,
+    COMPACTED
+};
+
+struct Blas {
+    BlasState state;
+    VkGeometryTypeKHR geometryType;
+    BlasTriangles triangles;
+    BlasAabbs aabbs;
+    VkAccelerationStructureKHR accelerationStructure;
+    Buffer buffer;
+    VkDeviceSize buildSize;
+    VkDeviceSize size;
+    VkDeviceAddress address;
+    uint64_t buildValue;
+};
+
+struct Instance {
+    bool used;
+    uint32_t blas;
+    VkTransformMatrixKHR transform;
+    uint32_t customIndex;
+    uint32_t hitGroup;
+    float builtTranslation[3];
+};
+
+struct RetiredAccelerationStructure {
+    VkAccelerationStructureKHR accelerationStructure;
+    Buffer buffer;
+    uint64_t value;
+};
+
+struct ScratchBuffer {
+    Buffer buffer;
+    VkDeviceSize size;
+    VkDeviceAddress address;
+    uint64_t value;
+};
+
+enum class TlasUpdate {
+    NONE,
+    REBUILD,
+    REFIT
+};
+
+struct AccelerationStructureSubmission {
+    VkCommandBuffer commandBuffer;
+    Buffer instanceBuffer;
+    uint64_t value;
+    bool timed;
+    bool buildsBlases;
+};
+
+// The build time is the GPU time of the last completed submission in milliseconds and the BLAS
+// build time that of the last completed submission that built BLASes, or negative if they couldn't
+// be measured.
+struct AccelerationStructureStatistics {
+    uint32_t blasCount;
+    VkDeviceSize buildSize;
+    VkDeviceSize compactedSize;
+    uint32_t refitCount;
+    float buildTime;
+    float blasBuildTime;
+};
+
+// Builds bottom level acceleration structures of triangles or boxes in batches and one top level
+// acceleration structure over their instances. BLASes that were added since the last update() are
+// built by a single command, with scratch memory from a pool of buffers that are reused once their
+// submission has completed. Their compacted sizes are queried after the build and read back
+// without waiting in a later update(), which then copies them into compacted acceleration
+// structures and retires the originals. The TLAS is created for the maximum instance count, so its
+// handle never changes and it's rebuilt in place whenever BLASes or instances change. When only
+// transforms have changed, it's refitted instead, until the instances have drifted so far from
+// where the last rebuild put them that the refitted TLAS would trace noticeably slower.
+//
+// Everything is submitted to the compute queue, which the renderer traces on, and every
+// submission starts and ends with a barrier against ray tracing. The traces are therefore ordered
+// with the builds without waiting for the semaphore, which only tracks completion on the host.
+class AccelerationStructureManager {
+public:
+    VkSemaphore semaphore;
+
+    AccelerationStructureManager() = default;
+    AccelerationStructureManager(Device& device, uint32_t blasCapacity, uint32_t instanceCapacity);
+    void destroy(Device& device);
+
+    uint32_t addBlas(const BlasTriangles& triangles);
+    uint32_t addBlas(const BlasAabbs& aabbs);
+    void removeBlas(uint32_t blas);
+
+    // The custom index is passed to the hit shaders, and the hit group selects them by its index
+    // in the hit region of the SBT.
+    uint32_t addInstance(uint32_t blas, const VkTransformMatrixKHR& transform, uint32_t customIndex, uint32_t hitGroup);
+    void removeInstance(uint32_t instance);
+    void setInstanceTransform(uint32_t instance, const VkTransformMatrixKHR& transform);
+
+    // Submits pending work, after the given semaphore has reached the value if it isn't null.
+    uint64_t update(Device& device, VkSemaphore waitSemaphore, uint64_t waitValue);
+
+    VkAccelerationStructureKHR getTlas();
+    AccelerationStructureStatistics getStatistics();
+
+private:
+    static constexpr uint32_t SUBMISSION_COUNT = 4;
+    static constexpr uint32_t SCRATCH_BUFFER_COUNT = SUBMISSION_COUNT * 2;
+    static constexpr VkDeviceSize MIN_SCRATCH_SIZE = 1 << 20;
+
+    // The average distance that instances may have moved since the last rebuild, relative to the
+    // extent of the instances at that rebuild, before the TLAS is rebuilt instead of refitted.
+    static constexpr float MAX_REFIT_DRIFT = 0.05f;
+
+    VkDeviceSize scratchAlignment;
+    uint32_t blasCapacity;
+    Blas* blases;
+    uint32_t instanceCapacity;
+    Instance* instances;
+    VkAccelerationStructureKHR tlas;
+    Buffer tlasBuffer;
+    VkDeviceSize tlasScratchSize;
+    VkDeviceSize tlasUpdateScratchSize;
+    bool tlasDirty = false;
+    bool tlasMoved = false;
+    float tlasExtent;
+    uint32_t refitCount = 0;
+    VkQueryPool queryPool;
+    VkQueryPool timestampQueryPool;
+    bool timestampsSupported;
+    float timestampPeriod;
+    uint64_t timestampMask;
+    float lastBuildTime = -1.0f;
+    float lastBlasBuildTime = -1.0f;
+    VkCommandPool commandPool;
+    AccelerationStructureSubmission submissions[SUBMISSION_COUNT];
+    uint32_t submissionIndex = 0;
+    uint64_t submittedValue = 0;
+    ScratchBuffer scratchBuffers[SCRATCH_BUFFER_COUNT];
+    RetiredAccelerationStructure* retired;
+    uint32_t retiredCount = 0;
+    uint32_t retiredCapacity;
+    uint64_t completedValue = 0;
+
+    uint32_t addBlas(VkGeometryTypeKHR geometryType, const BlasTriangles& triangles, const BlasAabbs& aabbs);
+    VkAccelerationStructureKHR createAccelerationStructure(Device& device, VkAccelerationStructureTypeKHR type, VkDeviceSize size, Buffer& buffer);
+    void retire(VkAccelerationStructureKHR accelerationStructure, const Buffer& buffer, uint64_t value);
+    void reclaim(Device& device);
+    VkDeviceAddress acquireScratch(Device& device, VkDeviceSize size, uint64_t value);
+    void wait(VkDevice device, uint64_t value);
+    void resolveTimings(VkDevice device);
+    TlasUpdate selectTlasUpdate();
+
+    void recordCompactions(Device& device, VkCommandBuffer commandBuffer, uint64_t value);
+    bool recordBlasBuilds(Device& device, VkCommandBuffer commandBuffer, uint64_t value);
+    void recordTlasBuild(Device& device, VkCommandBuffer commandBuffer, AccelerationStructureSubmission& submission, TlasUpdate tlasUpdate, uint64_t value);
+};
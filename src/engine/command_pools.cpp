@@ -0,0 +1,77 @@
+#include "command_pools.h"
+
+#include <string.h>
+
+FrameCommandPools::FrameCommandPools(VkDevice device, uint32_t queueFamilyIndex, uint32_t framesInFlight, uint32_t workerCount) : workerCount(workerCount), poolCount(framesInFlight * workerCount) {
+    pools = new Pool[poolCount];
+
+    // The pools are only ever reset as a whole.
+    VkCommandPoolCreateInfo commandPoolCreateInfo = {
+        .sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .pNext            = nullptr,
+        .flags            = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+        .queueFamilyIndex = queueFamilyIndex
+    };
+
+    for (uint32_t i = 0; i < poolCount; ++i) {
+        Pool& pool = pools[i];
+
+        vkCreateCommandPool(device, &commandPoolCreateInfo, nullptr, &pool.commandPool);
+
+        pool.commandBufferCount = 0;
+        pool.commandBufferCapacity = 4;
+        pool.usedCount = 0;
+        pool.commandBuffers = new VkCommandBuffer[pool.commandBufferCapacity];
+    }
+}
+
+// Destroying the pools frees their command buffers.
+void FrameCommandPools::destroy(VkDevice device) {
+    for (uint32_t i = 0; i < poolCount; ++i) {
+        vkDestroyCommandPool(device, pools[i].commandPool, nullptr);
+        delete[] pools[i].commandBuffers;
+    }
+
+    delete[] pools;
+}
+
+// Only called once the frame that last used the slot has completed.
+void FrameCommandPools::reset(VkDevice device, uint32_t frameIndex) {
+    for (uint32_t i = 0; i < workerCount; ++i) {
+        Pool& pool = pools[frameIndex * workerCount + i];
+
+        if (pool.usedCount != 0) {
+            vkResetCommandPool(device, pool.commandPool, 0);
+            pool.usedCount = 0;
+        }
+    }
+}
+
+VkCommandBuffer FrameCommandPools::allocate(VkDevice device, uint32_t frameIndex, uint32_t workerIndex) {
+    Pool& pool = pools[frameIndex * workerCount + workerIndex];
+
+    // Command buffers that were reset with their pool are recycled before allocating new ones.
+    if (pool.usedCount == pool.commandBufferCount) {
+        if (pool.commandBufferCount == pool.commandBufferCapacity) {
+            pool.commandBufferCapacity *= 2;
+
+            VkCommandBuffer* commandBuffers = new VkCommandBuffer[pool.commandBufferCapacity];
+            memcpy(commandBuffers, pool.commandBuffers, pool.commandBufferCount * sizeof(VkCommandBuffer));
+
+            delete[] pool.commandBuffers;
+            pool.commandBuffers = commandBuffers;
+        }
+
+        VkCommandBufferAllocateInfo commandBufferAllocateInfo = {
+            .sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .pNext              = nullptr,
+            .commandPool        = pool.commandPool,
+            .level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = 1
+        };
+
+        vkAllocateCommandBuffers(device, &commandBufferAllocateInfo, &pool.commandBuffers[pool.commandBufferCount++]);
+    }
+
+    return pool.commandBuffers[pool.usedCount++];
+}
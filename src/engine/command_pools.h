@@ -0,0 +1,31 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+// Every frame in flight has a command pool of one queue family per worker of the job system, so
+// that jobs record their command buffers without locking. All pools of a frame are reset at once
+// when its slot is reused, which recycles their command buffers instead of freeing them, so the
+// command buffers are only valid until their frame slot comes around again.
+class FrameCommandPools {
+public:
+    FrameCommandPools() = default;
+    FrameCommandPools(VkDevice device, uint32_t queueFamilyIndex, uint32_t framesInFlight, uint32_t workerCount);
+    void destroy(VkDevice device);
+
+    void reset(VkDevice device, uint32_t frameIndex);
+    VkCommandBuffer allocate(VkDevice device, uint32_t frameIndex, uint32_t workerIndex);
+
+private:
+    // Pools are only touched by their own worker, so they're kept on separate cache lines.
+    struct alignas(64) Pool {
+        VkCommandPool commandPool;
+        uint32_t commandBufferCount;
+        uint32_t commandBufferCapacity;
+        uint32_t usedCount;
+        VkCommandBuffer* commandBuffers;
+    };
+
+    uint32_t workerCount;
+    uint32_t poolCount;
+    Pool* pools;
+};
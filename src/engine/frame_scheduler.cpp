@@ -0,0 +1,197 @@
+#include "frame_scheduler.h"
+
+#include <assert.h>
+
+#include <algorithm>
+#include <thread>
+
+#include <trace.h>
+
+static VkSemaphore createTimelineSemaphore(VkDevice device) {
+    VkSemaphoreTypeCreateInfo semaphoreTypeCreateInfo = {
+        .sType         = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+        .pNext         = nullptr,
+        .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+        .initialValue  = 0
+    };
+
+    VkSemaphoreCreateInfo semaphoreCreateInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        .pNext = &semaphoreTypeCreateInfo,
+        .flags = 0
+    };
+
+    VkSemaphore semaphore;
+    vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &semaphore);
+
+    return semaphore;
+}
+
+static VkSemaphoreSubmitInfo getSemaphoreSubmitInfo(VkSemaphore semaphore, uint64_t value, VkPipelineStageFlags2 stageMask) {
+    VkSemaphoreSubmitInfo semaphoreSubmitInfo = {
+        .sType       = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+        .pNext       = nullptr,
+        .semaphore   = semaphore,
+        .value       = value,
+        .stageMask   = stageMask,
+        .deviceIndex = 0
+    };
+
+    return semaphoreSubmitInfo;
+}
+
+// The command buffers of a submission execute in order, so barriers in one apply to the next.
+static void getCommandBufferSubmitInfos(uint32_t commandBufferCount, const VkCommandBuffer* commandBuffers, VkCommandBufferSubmitInfo* commandBufferInfos) {
+    for (uint32_t i = 0; i < commandBufferCount; ++i) {
+        commandBufferInfos[i] = {
+            .sType         = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+            .pNext         = nullptr,
+            .commandBuffer = commandBuffers[i],
+            .deviceMask    = 0
+        };
+    }
+}
+
+FrameScheduler::FrameScheduler(VkDevice device) {
+    traceSemaphore = createTimelineSemaphore(device);
+    presentSemaphore = createTimelineSemaphore(device);
+}
+
+void FrameScheduler::destroy(VkDevice device) {
+    vkDestroySemaphore(device, presentSemaphore, nullptr);
+    vkDestroySemaphore(device, traceSemaphore, nullptr);
+}
+
+void FrameScheduler::beginFrame(VkDevice device, uint32_t framesInFlight) {
+    TRACE_ZONE("Wait For Frame");
+
+    if (frameRateLimit != 0) {
+        auto now = std::chrono::steady_clock::now();
+
+        if (now < nextFrameTime) {
+            std::this_thread::sleep_until(nextFrameTime);
+        }
+
+        // Don't try to catch up after slow frames.
+        nextFrameTime = std::max(nextFrameTime, now) + std::chrono::nanoseconds(1'000'000'000 / frameRateLimit);
+    }
+
+    // Wait until the frame that used the same resources has been presented.
+    auto start = std::chrono::steady_clock::now();
+
+    if (frame + 1 > framesInFlight) {
+        wait(device, frame + 1 - framesInFlight);
+    }
+
+    waitTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void FrameScheduler::submitTrace(VkQueue queue, uint32_t commandBufferCount, const VkCommandBuffer* commandBuffers) {
+    TRACE_ZONE("Submit Trace");
+
+    traceSignalInfos[traceSignalInfoCount++] = getSemaphoreSubmitInfo(traceSemaphore, frame + 1, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT);
+
+    VkCommandBufferSubmitInfo commandBufferInfos[MAX_COMMAND_BUFFER_COUNT];
+    getCommandBufferSubmitInfos(commandBufferCount, commandBuffers, commandBufferInfos);
+
+    VkSubmitInfo2 submitInfo = {
+        .sType                    = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+        .pNext                    = nullptr,
+        .flags                    = 0,
+        .waitSemaphoreInfoCount   = traceWaitInfoCount,
+        .pWaitSemaphoreInfos      = traceWaitInfos,
+        .commandBufferInfoCount   = commandBufferCount,
+        .pCommandBufferInfos      = commandBufferInfos,
+        .signalSemaphoreInfoCount = traceSignalInfoCount,
+        .pSignalSemaphoreInfos    = traceSignalInfos
+    };
+
+    vkQueueSubmit2(queue, 1, &submitInfo, VK_NULL_HANDLE);
+
+    traceWaitInfoCount = 0;
+    traceSignalInfoCount = 0;
+}
+
+void FrameScheduler::submitPresent(VkQueue queue, uint32_t commandBufferCount, const VkCommandBuffer* commandBuffers, VkSemaphore imageAvailableSemaphore, VkSemaphore renderFinishedSemaphore) {
+    TRACE_ZONE("Submit Present");
+
+    // The swapchain only works with binary semaphores, which headless renderers don't have.
+    VkSemaphoreSubmitInfo waitSemaphoreInfos[2];
+    uint32_t waitSemaphoreInfoCount = 0;
+
+    waitSemaphoreInfos[waitSemaphoreInfoCount++] = getSemaphoreSubmitInfo(traceSemaphore, frame + 1, VK_PIPELINE_STAGE_2_BLIT_BIT | VK_PIPELINE_STAGE_2_COPY_BIT);
+
+    if (imageAvailableSemaphore != VK_NULL_HANDLE) {
+        waitSemaphoreInfos[waitSemaphoreInfoCount++] = getSemaphoreSubmitInfo(imageAvailableSemaphore, 0, VK_PIPELINE_STAGE_2_BLIT_BIT);
+    }
+
+    VkSemaphoreSubmitInfo signalSemaphoreInfos[2];
+    uint32_t signalSemaphoreInfoCount = 0;
+
+    signalSemaphoreInfos[signalSemaphoreInfoCount++] = getSemaphoreSubmitInfo(presentSemaphore, frame + 1, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT);
+
+    if (renderFinishedSemaphore != VK_NULL_HANDLE) {
+        signalSemaphoreInfos[signalSemaphoreInfoCount++] = getSemaphoreSubmitInfo(renderFinishedSemaphore, 0, VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT);
+    }
+
+    VkCommandBufferSubmitInfo commandBufferInfos[MAX_COMMAND_BUFFER_COUNT];
+    getCommandBufferSubmitInfos(commandBufferCount, commandBuffers, commandBufferInfos);
+
+    VkSubmitInfo2 submitInfo = {
+        .sType                    = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+        .pNext                    = nullptr,
+        .flags                    = 0,
+        .waitSemaphoreInfoCount   = waitSemaphoreInfoCount,
+        .pWaitSemaphoreInfos      = waitSemaphoreInfos,
+        .commandBufferInfoCount   = commandBufferCount,
+        .pCommandBufferInfos      = commandBufferInfos,
+        .signalSemaphoreInfoCount = signalSemaphoreInfoCount,
+        .pSignalSemaphoreInfos    = signalSemaphoreInfos
+    };
+
+    vkQueueSubmit2(queue, 1, &submitInfo, VK_NULL_HANDLE);
+
+    ++frame;
+}
+
+void FrameScheduler::addTraceWait(VkSemaphore semaphore, uint64_t value, VkPipelineStageFlags2 stageMask) {
+    assert(traceWaitInfoCount < MAX_SEMAPHORE_INFO_COUNT);
+
+    traceWaitInfos[traceWaitInfoCount++] = getSemaphoreSubmitInfo(semaphore, value, stageMask);
+}
+
+void FrameScheduler::addTraceSignal(VkSemaphore semaphore, uint64_t value) {
+    // Leave room for the trace timeline itself.
+    assert(traceSignalInfoCount + 1 < MAX_SEMAPHORE_INFO_COUNT);
+
+    traceSignalInfos[traceSignalInfoCount++] = getSemaphoreSubmitInfo(semaphore, value, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT);
+}
+
+bool FrameScheduler::isComplete(VkDevice device, uint64_t frame) {
+    uint64_t value;
+    vkGetSemaphoreCounterValue(device, presentSemaphore, &value);
+
+    return value >= frame;
+}
+
+void FrameScheduler::wait(VkDevice device, uint64_t frame) {
+    VkSemaphoreWaitInfo semaphoreWaitInfo = {
+        .sType          = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+        .pNext          = nullptr,
+        .flags          = 0,
+        .semaphoreCount = 1,
+        .pSemaphores    = &presentSemaphore,
+        .pValues        = &frame
+    };
+
+    vkWaitSemaphores(device, &semaphoreWaitInfo, UINT64_MAX);
+}
+
+double FrameScheduler::getWaitTime() {
+    return waitTime;
+}
+
+// 0 disables the limit.
+void FrameScheduler::setFrameRateLimit(uint32_t framesPerSecond) {
+    frameRateLimit = framesPerSecond;
+}
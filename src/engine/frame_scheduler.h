@@ -0,0 +1,47 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <chrono>
+
+// Paces frames with one timeline semaphore per queue instead of per-frame fences. Frame n
+// signals value n on both the trace and the present timeline once its work is done, so any
+// subsystem can wait for the results of a frame, on the GPU or the CPU, by its number. Extra
+// waits and signals can be attached to the trace of the next frame, up to MAX_SEMAPHORE_INFO_COUNT
+// of each including the trace timeline. Frames can also be limited to a rate on the CPU,
+// independently of the present mode.
+class FrameScheduler {
+public:
+    VkSemaphore traceSemaphore;
+    VkSemaphore presentSemaphore;
+    uint64_t frame = 0;
+
+    FrameScheduler() = default;
+    FrameScheduler(VkDevice device);
+    void destroy(VkDevice device);
+
+    void beginFrame(VkDevice device, uint32_t framesInFlight);
+    void submitTrace(VkQueue queue, uint32_t commandBufferCount, const VkCommandBuffer* commandBuffers);
+    void submitPresent(VkQueue queue, uint32_t commandBufferCount, const VkCommandBuffer* commandBuffers, VkSemaphore imageAvailableSemaphore, VkSemaphore renderFinishedSemaphore);
+
+    void addTraceWait(VkSemaphore semaphore, uint64_t value, VkPipelineStageFlags2 stageMask);
+    void addTraceSignal(VkSemaphore semaphore, uint64_t value);
+
+    bool isComplete(VkDevice device, uint64_t frame);
+    void wait(VkDevice device, uint64_t frame);
+    double getWaitTime();
+
+    void setFrameRateLimit(uint32_t framesPerSecond);
+
+private:
+    static constexpr uint32_t MAX_SEMAPHORE_INFO_COUNT = 8;
+    static constexpr uint32_t MAX_COMMAND_BUFFER_COUNT = 8;
+
+    VkSemaphoreSubmitInfo traceWaitInfos[MAX_SEMAPHORE_INFO_COUNT];
+    uint32_t traceWaitInfoCount = 0;
+    VkSemaphoreSubmitInfo traceSignalInfos[MAX_SEMAPHORE_INFO_COUNT];
+    uint32_t traceSignalInfoCount = 0;
+    double waitTime = 0.0;
+    uint32_t frameRateLimit = 0;
+    std::chrono::steady_clock::time_point nextFrameTime;
+};
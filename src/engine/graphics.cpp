@@ -1,17 +1,27 @@
 #include "graphics.h"
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <fstream>
 
 #include <imgui_impl_vulkan.h>
+#include <job_system.h>
+#include <trace.h>
+
+#include "shader_cache.h"
+#include "staging.h"
 
 #define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
 
 static PFN_vkCreateRayTracingPipelinesKHR vkCreateRayTracingPipelines;
+static PFN_vkGetRayTracingShaderGroupHandlesKHR vkGetRayTracingShaderGroupHandles;
 static PFN_vkCmdTraceRaysKHR vkCmdTraceRays;
+static PFN_vkCmdTraceRaysIndirectKHR vkCmdTraceRaysIndirect;
+static PFN_vkWaitForPresentKHR vkWaitForPresent;
 
-VkInstance createInstance() {
+VkInstance createInstance(bool headless) {
     VkApplicationInfo applicationInfo = {
         .sType              = VK_STRUCTURE_TYPE_APPLICATION_INFO,
         .pNext              = nullptr,
@@ -22,8 +32,9 @@ VkInstance createInstance() {
         .apiVersion         = VK_API_VERSION_1_3
     };
 
-    uint32_t extensionCount;
-    const char** extensions = glfwGetRequiredInstanceExtensions(&extensionCount);
+    // Headless instances don't need any surface extensions, nor GLFW.
+    uint32_t extensionCount = 0;
+    const char** extensions = headless ? nullptr : glfwGetRequiredInstanceExtensions(&extensionCount);
 
     VkInstanceCreateInfo instanceCreateInfo = {
         .sType                   = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
@@ -57,25 +68,98 @@ static bool isDiscrete(VkPhysicalDevice physicalDevice) {
     return properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU;
 }
 
-static bool supportsRayTracing(VkPhysicalDevice physicalDevice) {
+static bool supportsExtension(VkPhysicalDevice physicalDevice, const char* extensionName) {
     uint32_t extensionPropertyCount;
     vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionPropertyCount, nullptr);
 
     VkExtensionProperties* extensionProperties = new VkExtensionProperties[extensionPropertyCount];
     vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionPropertyCount, extensionProperties);
 
-    bool supportsRayTracing = false;
+    bool supportsExtension = false;
 
     for (uint32_t i = 0; i < extensionPropertyCount; ++i) {
-        if (strcmp(extensionProperties[i].extensionName, VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME) == 0) {
-            supportsRayTracing = true;
+        if (strcmp(extensionProperties[i].extensionName, extensionName) == 0) {
+            supportsExtension = true;
             break;
         }
     }
 
     delete[] extensionProperties;
 
-    return supportsRayTracing;
+    return supportsExtension;
+}
+
+static VkPhysicalDeviceRayTracingPipelineFeaturesKHR getRayTracingPipelineFeatures(VkPhysicalDevice physicalDevice) {
+    VkPhysicalDeviceRayTracingPipelineFeaturesKHR rayTracingPipelineFeatures = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_FEATURES_KHR,
+        .pNext = nullptr
+    };
+
+    VkPhysicalDeviceFeatures2 features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+        .pNext = &rayTracingPipelineFeatures
+    };
+
+    vkGetPhysicalDeviceFeatures2(physicalDevice, &features);
+
+    return rayTracingPipelineFeatures;
+}
+
+static bool supportsRayTracing(VkPhysicalDevice physicalDevice) {
+    return supportsExtension(physicalDevice, VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME) && getRayTracingPipelineFeatures(physicalDevice).rayTracingPipeline;
+}
+
+// Lets one raygen shader write to the swapchain images as well as the off-screen images.
+static bool supportsStorageImageWriteWithoutFormat(VkPhysicalDevice physicalDevice) {
+    VkPhysicalDeviceFeatures features;
+    vkGetPhysicalDeviceFeatures(physicalDevice, &features);
+
+    return features.shaderStorageImageWriteWithoutFormat;
+}
+
+static bool supportsShaderModuleIdentifiers(VkPhysicalDevice physicalDevice) {
+    if (!supportsExtension(physicalDevice, VK_EXT_SHADER_MODULE_IDENTIFIER_EXTENSION_NAME)) {
+        return false;
+    }
+
+    VkPhysicalDeviceShaderModuleIdentifierFeaturesEXT shaderModuleIdentifierFeatures = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_MODULE_IDENTIFIER_FEATURES_EXT,
+        .pNext = nullptr
+    };
+
+    VkPhysicalDeviceFeatures2 features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+        .pNext = &shaderModuleIdentifierFeatures
+    };
+
+    vkGetPhysicalDeviceFeatures2(physicalDevice, &features);
+
+    return shaderModuleIdentifierFeatures.shaderModuleIdentifier;
+}
+
+static bool supportsPresentWait(VkPhysicalDevice physicalDevice) {
+    if (!supportsExtension(physicalDevice, VK_KHR_PRESENT_ID_EXTENSION_NAME) || !supportsExtension(physicalDevice, VK_KHR_PRESENT_WAIT_EXTENSION_NAME)) {
+        return false;
+    }
+
+    VkPhysicalDevicePresentWaitFeaturesKHR presentWaitFeatures = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR,
+        .pNext = nullptr
+    };
+
+    VkPhysicalDevicePresentIdFeaturesKHR presentIdFeatures = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR,
+        .pNext = &presentWaitFeatures
+    };
+
+    VkPhysicalDeviceFeatures2 features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+        .pNext = &presentIdFeatures
+    };
+
+    vkGetPhysicalDeviceFeatures2(physicalDevice, &features);
+
+    return presentIdFeatures.presentId && presentWaitFeatures.presentWait;
 }
 
 static VkDeviceSize getPhysicalDeviceMemorySize(VkPhysicalDevice physicalDevice) {
@@ -95,19 +179,153 @@ static VkDeviceSize getPhysicalDeviceMemorySize(VkPhysicalDevice physicalDevice)
     return memorySize;
 }
 
-Device::Device(VkInstance instance, VkSurfaceKHR surface) {
-    // Select a physical device.
+static const char* requiredDeviceExtensions[] = {
+    VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME,
+    VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME,
+    VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME,
+    VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME
+};
+
+static uint32_t findRenderQueueFamily(VkPhysicalDevice physicalDevice, VkSurfaceKHR surface) {
+    uint32_t queueFamilyPropertyCount;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyPropertyCount, nullptr);
+
+    VkQueueFamilyProperties* queueFamilyProperties = new VkQueueFamilyProperties[queueFamilyPropertyCount];
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyPropertyCount, queueFamilyProperties);
+
+    uint32_t renderQueueFamily = UINT32_MAX;
+
+    for (uint32_t i = 0; i < queueFamilyPropertyCount; ++i) {
+        if (queueFamilyProperties[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+            // Without a surface (headless) any graphics queue family will do.
+            VkBool32 surfaceSupported = VK_TRUE;
+
+            if (surface != VK_NULL_HANDLE) {
+                vkGetPhysicalDeviceSurfaceSupportKHR(physicalDevice, i, surface, &surfaceSupported);
+            }
+
+            if (surfaceSupported) {
+                renderQueueFamily = i;
+                break;
+            }
+        }
+    }
+
+    delete[] queueFamilyProperties;
+
+    return renderQueueFamily;
+}
+
+// Returns 0 for devices that can't run the renderer. Otherwise discrete GPUs rank first, then
+// devices with more video memory, then devices that can dispatch more rays at once.
+static uint64_t getPhysicalDeviceScore(VkPhysicalDevice physicalDevice, VkSurfaceKHR surface) {
+    if (!supportsRayTracing(physicalDevice)) {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < ARRAY_SIZE(requiredDeviceExtensions); ++i) {
+        if (!supportsExtension(physicalDevice, requiredDeviceExtensions[i])) {
+            return 0;
+        }
+    }
+
+    if (surface != VK_NULL_HANDLE && !supportsExtension(physicalDevice, VK_KHR_SWAPCHAIN_EXTENSION_NAME)) {
+        return 0;
+    }
+
+    if (findRenderQueueFamily(physicalDevice, surface) == UINT32_MAX) {
+        return 0;
+    }
+
+    VkPhysicalDeviceRayTracingPipelinePropertiesKHR rayTracingProperties = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_PROPERTIES_KHR,
+        .pNext = nullptr
+    };
+
+    VkPhysicalDeviceProperties2 physicalDeviceProperties = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+        .pNext = &rayTracingProperties
+    };
+
+    vkGetPhysicalDeviceProperties2(physicalDevice, &physicalDeviceProperties);
+
+    if (rayTracingProperties.maxRayRecursionDepth < MAX_RAY_RECURSION_DEPTH ||
+        rayTracingProperties.maxRayHitAttributeSize < MAX_RAY_HIT_ATTRIBUTE_SIZE) {
+        return 0;
+    }
+
+    uint64_t memorySizeMiB = getPhysicalDeviceMemorySize(physicalDevice) >> 20;
+    uint64_t dispatchScore = rayTracingProperties.maxRayDispatchInvocationCount >> 16;
+
+    uint64_t score = 1;
+    score += isDiscrete(physicalDevice) ? 1ull << 62 : 0;
+    score += (memorySizeMiB < (1ull << 40) ? memorySizeMiB : (1ull << 40) - 1) << 16;
+    score += dispatchScore < 0xffff ? dispatchScore : 0xffff;
+
+    return score;
+}
+
+// The override is either the index of the device or a part of its name.
+static bool matchesDeviceOverride(VkPhysicalDevice physicalDevice, uint32_t index, const char* deviceOverride) {
+    char* end;
+    unsigned long overrideIndex = strtoul(deviceOverride, &end, 10);
+
+    if (end != deviceOverride && *end == '\0') {
+        return overrideIndex == index;
+    }
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+    return strstr(properties.deviceName, deviceOverride) != nullptr;
+}
+
+Device::Device(VkInstance instance, VkSurfaceKHR surface, const char* deviceOverride) {
+    TRACE_ZONE("Create Device");
+
+    // Select the physical device with the highest score, unless one was asked for.
     uint32_t physicalDeviceCount;
     vkEnumeratePhysicalDevices(instance, &physicalDeviceCount, nullptr);
 
     VkPhysicalDevice* physicalDevices = new VkPhysicalDevice[physicalDeviceCount];
     vkEnumeratePhysicalDevices(instance, &physicalDeviceCount, physicalDevices);
 
-    physical = physicalDevices[0]; // TODO
+    physical = VK_NULL_HANDLE;
+    uint64_t bestScore = 0;
+    bool overridden = false;
+
+    for (uint32_t i = 0; i < physicalDeviceCount; ++i) {
+        uint64_t score = getPhysicalDeviceScore(physicalDevices[i], surface);
+
+        if (score == 0) {
+            continue;
+        }
+
+        if (deviceOverride != nullptr && matchesDeviceOverride(physicalDevices[i], i, deviceOverride)) {
+            physical = physicalDevices[i];
+            overridden = true;
+            break;
+        }
+
+        if (score > bestScore) {
+            physical = physicalDevices[i];
+            bestScore = score;
+        }
+    }
 
     delete[] physicalDevices;
 
-    // Get the ray tracing pipeline properties.
+    // An override that matches no suitable device falls back to the best one.
+    if (deviceOverride != nullptr && !overridden) {
+        fprintf(stderr, "No suitable device matches \"%s\"\n", deviceOverride);
+    }
+
+    if (physical == VK_NULL_HANDLE) {
+        fprintf(stderr, "No device supports ray tracing\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Get the device and ray tracing pipeline properties.
     rtProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_PROPERTIES_KHR;
     rtProperties.pNext = nullptr;
 
@@ -118,90 +336,185 @@ Device::Device(VkInstance instance, VkSurfaceKHR surface) {
 
     vkGetPhysicalDeviceProperties2(physical, &physicalDeviceProperties);
 
-    // Select a queue family.
+    properties = physicalDeviceProperties.properties;
+
+    // Create the memory allocator.
+    allocator = Allocator(physical);
+
+    // Select the queue families.
     uint32_t queueFamilyPropertyCount;
     vkGetPhysicalDeviceQueueFamilyProperties(physical, &queueFamilyPropertyCount, nullptr);
 
     VkQueueFamilyProperties* queueFamilyProperties = new VkQueueFamilyProperties[queueFamilyPropertyCount];
     vkGetPhysicalDeviceQueueFamilyProperties(physical, &queueFamilyPropertyCount, queueFamilyProperties);
 
+    renderQueue.familyIndex = findRenderQueueFamily(physical, surface);
+
+    // Prefer a compute queue family without graphics for work that overlaps with rendering.
+    computeQueue.familyIndex = renderQueue.familyIndex;
+
     for (uint32_t i = 0; i < queueFamilyPropertyCount; ++i) {
-        if (queueFamilyProperties[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
-            VkBool32 surfaceSupported;
-            vkGetPhysicalDeviceSurfaceSupportKHR(physical, i, surface, &surfaceSupported);
+        VkQueueFlags queueFlags = queueFamilyProperties[i].queueFlags;
 
-            if (surfaceSupported) {
-                renderQueue.familyIndex = i;
-                break;
-            }
+        if (queueFlags & VK_QUEUE_COMPUTE_BIT && !(queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
+            computeQueue.familyIndex = i;
+            break;
+        }
+    }
+
+    // Prefer a transfer-only queue family (the copy engine) for uploads.
+    transferQueue.familyIndex = renderQueue.familyIndex;
+
+    for (uint32_t i = 0; i < queueFamilyPropertyCount; ++i) {
+        VkQueueFlags queueFlags = queueFamilyProperties[i].queueFlags;
+
+        if (queueFlags & VK_QUEUE_TRANSFER_BIT && !(queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+            transferQueue.familyIndex = i;
+            break;
         }
     }
 
     delete[] queueFamilyProperties;
 
     // Create the device.
+    shaderModuleIdentifiers = supportsShaderModuleIdentifiers(physical);
+    presentWait = surface != VK_NULL_HANDLE && supportsPresentWait(physical);
+    storageImageWriteWithoutFormat = supportsStorageImageWriteWithoutFormat(physical);
+    traceRaysIndirect = getRayTracingPipelineFeatures(physical).rayTracingPipelineTraceRaysIndirect;
+
+    VkPhysicalDevicePresentWaitFeaturesKHR presentWaitFeatures = {
+        .sType       = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR,
+        .pNext       = nullptr,
+        .presentWait = VK_TRUE
+    };
+
+    VkPhysicalDevicePresentIdFeaturesKHR presentIdFeatures = {
+        .sType     = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR,
+        .pNext     = &presentWaitFeatures,
+        .presentId = VK_TRUE
+    };
+
+    VkPhysicalDeviceShaderModuleIdentifierFeaturesEXT shaderModuleIdentifierFeatures = {
+        .sType                  = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_MODULE_IDENTIFIER_FEATURES_EXT,
+        .pNext                  = presentWait ? &presentIdFeatures : nullptr,
+        .shaderModuleIdentifier = VK_TRUE
+    };
+
     VkPhysicalDeviceAccelerationStructureFeaturesKHR accelerationStructureFeatures = {
         .sType                 = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR,
-        .pNext                 = nullptr,
+        .pNext                 = shaderModuleIdentifiers ? (void*)&shaderModuleIdentifierFeatures : presentWait ? (void*)&presentIdFeatures : nullptr,
         .accelerationStructure = VK_TRUE
     };
 
     VkPhysicalDeviceRayTracingPipelineFeaturesKHR rayTracingPipelineFeatures = {
-        .sType              = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_FEATURES_KHR,
-        .pNext              = &accelerationStructureFeatures,
-        .rayTracingPipeline = VK_TRUE
+        .sType                               = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_FEATURES_KHR,
+        .pNext                               = &accelerationStructureFeatures,
+        .rayTracingPipeline                  = VK_TRUE,
+        .rayTracingPipelineTraceRaysIndirect = traceRaysIndirect
     };
 
     VkPhysicalDeviceVulkan12Features vulkan12Features = {
         .sType               = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
         .pNext               = &rayTracingPipelineFeatures,
+        .hostQueryReset      = VK_TRUE,
+        .timelineSemaphore   = VK_TRUE,
         .bufferDeviceAddress = VK_TRUE
     };
 
     VkPhysicalDeviceVulkan13Features vulkan13Features = {
-        .sType            = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES,
-        .pNext            = &vulkan12Features,
-        .synchronization2 = VK_TRUE
+        .sType                        = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES,
+        .pNext                        = &vulkan12Features,
+        .pipelineCreationCacheControl = VK_TRUE,
+        .synchronization2             = VK_TRUE
     };
 
+    VkPhysicalDeviceFeatures features = {};
+    features.shaderStorageImageWriteWithoutFormat = storageImageWriteWithoutFormat;
+
     float queuePriority = 1.0f;
 
-    VkDeviceQueueCreateInfo deviceQueueCreateInfo = {
-        .sType            = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-        .pNext            = nullptr,
-        .flags            = 0,
-        .queueFamilyIndex = renderQueue.familyIndex,
-        .queueCount       = 1,
-        .pQueuePriorities = &queuePriority
-    };
+    uint32_t queueFamilyIndices[3];
+    uint32_t queueFamilyCount = getQueueFamilyIndices(queueFamilyIndices);
 
-    const char* deviceExtensions[] = {
-        VK_KHR_SWAPCHAIN_EXTENSION_NAME,
-        VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME,
-        VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME,
-        VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME
-    };
+    VkDeviceQueueCreateInfo deviceQueueCreateInfos[ARRAY_SIZE(queueFamilyIndices)];
+    uint32_t deviceQueueCreateInfoCount = 0;
+
+    for (uint32_t i = 0; i < queueFamilyCount; ++i) {
+        deviceQueueCreateInfos[deviceQueueCreateInfoCount++] = {
+            .sType            = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+            .pNext            = nullptr,
+            .flags            = 0,
+            .queueFamilyIndex = queueFamilyIndices[i],
+            .queueCount       = 1,
+            .pQueuePriorities = &queuePriority
+        };
+    }
+
+    const char* deviceExtensions[ARRAY_SIZE(requiredDeviceExtensions) + 4];
+    uint32_t deviceExtensionCount = ARRAY_SIZE(requiredDeviceExtensions);
+
+    memcpy(deviceExtensions, requiredDeviceExtensions, sizeof(requiredDeviceExtensions));
+
+    if (surface != VK_NULL_HANDLE) {
+        deviceExtensions[deviceExtensionCount++] = VK_KHR_SWAPCHAIN_EXTENSION_NAME;
+    }
+
+    if (shaderModuleIdentifiers) {
+        deviceExtensions[deviceExtensionCount++] = VK_EXT_SHADER_MODULE_IDENTIFIER_EXTENSION_NAME;
+    }
+
+    if (presentWait) {
+        deviceExtensions[deviceExtensionCount++] = VK_KHR_PRESENT_ID_EXTENSION_NAME;
+        deviceExtensions[deviceExtensionCount++] = VK_KHR_PRESENT_WAIT_EXTENSION_NAME;
+    }
 
     VkDeviceCreateInfo deviceCreateInfo = {
         .sType                   = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
         .pNext                   = &vulkan13Features,
         .flags                   = 0,
-        .queueCreateInfoCount    = 1,
-        .pQueueCreateInfos       = &deviceQueueCreateInfo,
+        .queueCreateInfoCount    = deviceQueueCreateInfoCount,
+        .pQueueCreateInfos       = deviceQueueCreateInfos,
         .enabledLayerCount       = 0,
         .ppEnabledLayerNames     = nullptr,
-        .enabledExtensionCount   = ARRAY_SIZE(deviceExtensions),
+        .enabledExtensionCount   = deviceExtensionCount,
         .ppEnabledExtensionNames = deviceExtensions,
-        .pEnabledFeatures        = nullptr
+        .pEnabledFeatures        = &features
     };
 
     vkCreateDevice(physical, &deviceCreateInfo, nullptr, &logical);
 
-    // Get the device queue.
+    // Get the device queues.
     vkGetDeviceQueue(logical, renderQueue.familyIndex, 0, &renderQueue);
+    vkGetDeviceQueue(logical, computeQueue.familyIndex, 0, &computeQueue);
+    vkGetDeviceQueue(logical, transferQueue.familyIndex, 0, &transferQueue);
+}
+
+uint32_t Device::getQueueFamilyIndices(uint32_t* queueFamilyIndices) {
+    uint32_t familyIndices[] = {
+        renderQueue.familyIndex,
+        computeQueue.familyIndex,
+        transferQueue.familyIndex
+    };
+
+    uint32_t queueFamilyCount = 0;
+
+    for (uint32_t i = 0; i < ARRAY_SIZE(familyIndices); ++i) {
+        bool duplicate = false;
+
+        for (uint32_t j = 0; j < queueFamilyCount; ++j) {
+            duplicate |= queueFamilyIndices[j] == familyIndices[i];
+        }
+
+        if (!duplicate) {
+            queueFamilyIndices[queueFamilyCount++] = familyIndices[i];
+        }
+    }
+
+    return queueFamilyCount;
 }
 
 void Device::destroy() {
+    allocator.destroy(logical);
     vkDestroyDevice(logical, nullptr);
 }
 
@@ -210,12 +523,13 @@ static uint32_t clamp(int d, uint32_t min, uint32_t max) {
     return t > max ? max : t;
 }
 
-VkSurfaceCapabilitiesKHR Device::getSurfaceCapabilities(VkSurfaceKHR surface, GLFWwindow* window) {
+// The image count is clamped to what the surface supports and stored in minImageCount.
+VkSurfaceCapabilitiesKHR Device::getSurfaceCapabilities(VkSurfaceKHR surface, GLFWwindow* window, uint32_t imageCount) {
     VkSurfaceCapabilitiesKHR surfaceCapabilities;
     vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physical, surface, &surfaceCapabilities);
 
     uint32_t maxImageCount = surfaceCapabilities.maxImageCount != 0 ? surfaceCapabilities.maxImageCount : UINT32_MAX;
-    surfaceCapabilities.minImageCount = clamp(3, surfaceCapabilities.minImageCount, maxImageCount);
+    surfaceCapabilities.minImageCount = clamp(imageCount, surfaceCapabilities.minImageCount, maxImageCount);
 
     VkExtent2D& currentExtent = surfaceCapabilities.currentExtent;
 
@@ -235,6 +549,28 @@ VkSurfaceCapabilitiesKHR Device::getSurfaceCapabilities(VkSurfaceKHR surface, GL
     return surfaceCapabilities;
 }
 
+// Falls back to FIFO, the only mode that's always supported.
+VkPresentModeKHR Device::getPresentMode(VkSurfaceKHR surface, VkPresentModeKHR presentMode) {
+    uint32_t presentModeCount;
+    vkGetPhysicalDeviceSurfacePresentModesKHR(physical, surface, &presentModeCount, nullptr);
+
+    VkPresentModeKHR* presentModes = new VkPresentModeKHR[presentModeCount];
+    vkGetPhysicalDeviceSurfacePresentModesKHR(physical, surface, &presentModeCount, presentModes);
+
+    bool supported = false;
+
+    for (uint32_t i = 0; i < presentModeCount; ++i) {
+        if (presentModes[i] == presentMode) {
+            supported = true;
+            break;
+        }
+    }
+
+    delete[] presentModes;
+
+    return supported ? presentMode : VK_PRESENT_MODE_FIFO_KHR;
+}
+
 VkSurfaceFormatKHR Device::getSurfaceFormat(VkSurfaceKHR surface) {
     VkFormat formats[] = {
         VK_FORMAT_R8G8B8A8_UNORM,
@@ -265,23 +601,15 @@ exit:
 }
 
 uint32_t Device::getMemoryTypeIndex(uint32_t memoryTypeBits, VkMemoryPropertyFlags memoryProperties) {
-    VkPhysicalDeviceMemoryProperties physicalDeviceMemoryProperties;
-    vkGetPhysicalDeviceMemoryProperties(physical, &physicalDeviceMemoryProperties);
-
-    for (uint32_t i = 0; i < physicalDeviceMemoryProperties.memoryTypeCount; ++i) {
-        VkMemoryType memoryType = physicalDeviceMemoryProperties.memoryTypes[i];
-
-        if (memoryTypeBits & (1 << i) && (memoryType.propertyFlags & memoryProperties) == memoryProperties) {
-            return i;
-        }
-    }
-
-    return UINT32_MAX;
+    return allocator.getMemoryTypeIndex(memoryTypeBits, memoryProperties);
 }
 
 void loadFunctionPointers(VkDevice device) {
     vkCreateRayTracingPipelines = (PFN_vkCreateRayTracingPipelinesKHR)vkGetDeviceProcAddr(device, "vkCreateRayTracingPipelinesKHR");
+    vkGetRayTracingShaderGroupHandles = (PFN_vkGetRayTracingShaderGroupHandlesKHR)vkGetDeviceProcAddr(device, "vkGetRayTracingShaderGroupHandlesKHR");
     vkCmdTraceRays = (PFN_vkCmdTraceRaysKHR)vkGetDeviceProcAddr(device, "vkCmdTraceRaysKHR");
+    vkCmdTraceRaysIndirect = (PFN_vkCmdTraceRaysIndirectKHR)vkGetDeviceProcAddr(device, "vkCmdTraceRaysIndirectKHR");
+    vkWaitForPresent = (PFN_vkWaitForPresentKHR)vkGetDeviceProcAddr(device, "vkWaitForPresentKHR");
 }
 
 Buffer::Buffer(Device& device, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags memoryProperties) {
@@ -297,37 +625,31 @@ Buffer::Buffer(Device& device, VkDeviceSize size, VkBufferUsageFlags usage, VkMe
         .pQueueFamilyIndices   = nullptr
     };
 
-    vkCreateBuffer(device.logical, &bufferCreateInfo, nullptr, &buffer);
+    // Upload destinations are shared between the queues instead of transferring their ownership.
+    uint32_t queueFamilyIndices[3];
+    uint32_t queueFamilyCount = device.getQueueFamilyIndices(queueFamilyIndices);
 
-    // Allocate the device memory.
-    VkMemoryAllocateFlagsInfo memoryAllocateFlagsInfo = {
-        .sType      = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO,
-        .pNext      = nullptr,
-        .flags      = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT,
-        .deviceMask = 0
-    };
+    if (usage & VK_BUFFER_USAGE_TRANSFER_DST_BIT && queueFamilyCount > 1) {
+        bufferCreateInfo.sharingMode           = VK_SHARING_MODE_CONCURRENT;
+        bufferCreateInfo.queueFamilyIndexCount = queueFamilyCount;
+        bufferCreateInfo.pQueueFamilyIndices   = queueFamilyIndices;
+    }
 
+    vkCreateBuffer(device.logical, &bufferCreateInfo, nullptr, &buffer);
+
+    // Sub-allocate the device memory.
     VkMemoryRequirements memoryRequirements;
     vkGetBufferMemoryRequirements(device.logical, buffer, &memoryRequirements);
 
-    uint32_t memoryTypeIndex = device.getMemoryTypeIndex(memoryRequirements.memoryTypeBits, memoryProperties);
-
-    VkMemoryAllocateInfo memoryAllocateInfo = {
-        .sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-        .pNext           = usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT ? &memoryAllocateFlagsInfo : nullptr,
-        .allocationSize  = memoryRequirements.size,
-        .memoryTypeIndex = memoryTypeIndex
-    };
-
-    vkAllocateMemory(device.logical, &memoryAllocateInfo, nullptr, &memory);
+    allocation = device.allocator.allocate(device.logical, memoryRequirements, memoryProperties, AllocationKind::BUFFER);
 
     // Bind the buffer memory.
-    vkBindBufferMemory(device.logical, buffer, memory, 0);
+    vkBindBufferMemory(device.logical, buffer, allocation.memory, allocation.offset);
 }
 
-void Buffer::destroy(VkDevice device) {
-    vkFreeMemory(device, memory, nullptr);
-    vkDestroyBuffer(device, buffer, nullptr);
+void Buffer::destroy(Device& device) {
+    vkDestroyBuffer(device.logical, buffer, nullptr);
+    device.allocator.free(device.logical, allocation);
 }
 
 VkDeviceAddress Buffer::getDeviceAddress(VkDevice device) {
@@ -483,45 +805,45 @@ VkPipelineLayout createPipelineLayout(VkDevice device, uint32_t setLayoutCount,
     return pipelineLayout;
 }
 
-static VkShaderModule createShaderModule(VkDevice device, const char* fileName) {
-    std::ifstream file(fileName, std::ios::ate | std::ios::binary);
-
-    size_t codeSize = file.tellg();
-    char* code = new char[codeSize];
-
-    file.seekg(0);
-    file.read(code, codeSize);
-    file.close();
-
-    VkShaderModuleCreateInfo shaderModuleCreateInfo = {
-        .sType    = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
-        .pNext    = nullptr,
-        .flags    = 0,
-        .codeSize = codeSize,
-        .pCode    = (uint32_t*)code
-    };
-
-    VkShaderModule shaderModule;
-    vkCreateShaderModule(device, &shaderModuleCreateInfo, nullptr, &shaderModule);
-
-    delete[] code;
+// Without a module, the driver looks the stage up in the pipeline cache by its identifier.
+static void populateShaderStageCreateInfo(VkPipelineShaderStageCreateInfo& createInfo, VkPipelineShaderStageModuleIdentifierCreateInfoEXT& identifierCreateInfo, VkShaderStageFlagBits stage, const ShaderModule& module, const VkSpecializationInfo* specializationInfo) {
+    identifierCreateInfo.sType          = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_MODULE_IDENTIFIER_CREATE_INFO_EXT;
+    identifierCreateInfo.pNext          = nullptr;
+    identifierCreateInfo.identifierSize = module.identifierSize;
+    identifierCreateInfo.pIdentifier    = module.identifier;
 
-    return shaderModule;
-}
+    const bool useIdentifier = module.module == VK_NULL_HANDLE && module.identifierSize != 0;
 
-static void populateShaderStageCreateInfo(VkPipelineShaderStageCreateInfo& createInfo, VkShaderStageFlagBits stage, VkShaderModule module) {
     createInfo.sType               = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    createInfo.pNext               = nullptr;
+    createInfo.pNext               = useIdentifier ? &identifierCreateInfo : nullptr;
     createInfo.flags               = 0;
     createInfo.stage               = stage;
-    createInfo.module              = module;
+    createInfo.module              = module.module;
     createInfo.pName               = "main";
-    createInfo.pSpecializationInfo = nullptr;
+    createInfo.pSpecializationInfo = specializationInfo;
 }
 
-VkPipeline createRayTracingPipeline(VkDevice device, uint32_t entryCount, const ShaderBindingTableEntry* entries, VkPipelineLayout pipelineLayout) {
-    uint32_t shaderCount = 0;
+static void copySpecializationInfo(VkSpecializationInfo& copy, const VkSpecializationInfo* specializationInfo) {
+    if (specializationInfo == nullptr) {
+        copy = {};
+        return;
+    }
+
+    VkSpecializationMapEntry* mapEntries = new VkSpecializationMapEntry[specializationInfo->mapEntryCount];
+    memcpy(mapEntries, specializationInfo->pMapEntries, specializationInfo->mapEntryCount * sizeof(VkSpecializationMapEntry));
+
+    char* data = new char[specializationInfo->dataSize];
+    memcpy(data, specializationInfo->pData, specializationInfo->dataSize);
 
+    copy = {
+        .mapEntryCount = specializationInfo->mapEntryCount,
+        .pMapEntries   = mapEntries,
+        .dataSize      = specializationInfo->dataSize,
+        .pData         = data
+    };
+}
+
+RayTracingPipelineBuild::RayTracingPipelineBuild(VkDevice device, ShaderModuleCache& shaderModuleCache, uint32_t entryCount, const ShaderBindingTableEntry* entries, VkPipelineLayout pipelineLayout, VkPipelineCreateFlags flags) : pipeline(VK_NULL_HANDLE), shaderCount(0) {
     for (uint32_t i = 0; i < entryCount; ++i) {
         if (entries[i].stage != ShaderBindingTableStage::HIT) {
             ++shaderCount;
@@ -541,11 +863,19 @@ VkPipeline createRayTracingPipeline(VkDevice device, uint32_t entryCount, const
         }
     }
 
-    VkShaderModule* shaderModules = new VkShaderModule[shaderCount];
-    VkPipelineShaderStageCreateInfo* shaderStageCreateInfos = new VkPipelineShaderStageCreateInfo[shaderCount];
-    VkRayTracingShaderGroupCreateInfoKHR* shaderGroupCreateInfos = new VkRayTracingShaderGroupCreateInfoKHR[entryCount];
+    shaderModules = new ShaderModule[shaderCount];
+    shaderModuleIdentifierCreateInfos = new VkPipelineShaderStageModuleIdentifierCreateInfoEXT[shaderCount];
+    shaderStageCreateInfos = new VkPipelineShaderStageCreateInfo[shaderCount];
+    shaderGroupCreateInfos = new VkRayTracingShaderGroupCreateInfoKHR[entryCount];
+    specializationInfos = new VkSpecializationInfo[entryCount];
+    specializationInfoCount = entryCount;
 
     for (uint32_t i = 0, j = 0; i < entryCount; ++i) {
+        // Keep a copy of the constants, since the caller's may not outlive a deferred creation.
+        copySpecializationInfo(specializationInfos[i], entries[i].specializationInfo);
+
+        const VkSpecializationInfo* specializationInfo = entries[i].specializationInfo != nullptr ? &specializationInfos[i] : nullptr;
+
         shaderGroupCreateInfos[i].sType                           = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR;
         shaderGroupCreateInfos[i].pNext                           = nullptr;
         shaderGroupCreateInfos[i].generalShader                   = VK_SHADER_UNUSED_KHR;
@@ -555,13 +885,13 @@ VkPipeline createRayTracingPipeline(VkDevice device, uint32_t entryCount, const
         shaderGroupCreateInfos[i].pShaderGroupCaptureReplayHandle = nullptr;
 
         if (entries[i].stage != ShaderBindingTableStage::HIT) {
-            shaderModules[j] = createShaderModule(device, entries[i].generalShader);
+            shaderModules[j] = shaderModuleCache.getShaderModule(device, entries[i].generalShader);
 
             if (entries[i].stage == ShaderBindingTableStage::RAYGEN) {
-                populateShaderStageCreateInfo(shaderStageCreateInfos[j], VK_SHADER_STAGE_RAYGEN_BIT_KHR, shaderModules[j]);
+                populateShaderStageCreateInfo(shaderStageCreateInfos[j], shaderModuleIdentifierCreateInfos[j], VK_SHADER_STAGE_RAYGEN_BIT_KHR, shaderModules[j], specializationInfo);
             }
             else {
-                populateShaderStageCreateInfo(shaderStageCreateInfos[j], VK_SHADER_STAGE_MISS_BIT_KHR, shaderModules[j]);
+                populateShaderStageCreateInfo(shaderStageCreateInfos[j], shaderModuleIdentifierCreateInfos[j], VK_SHADER_STAGE_MISS_BIT_KHR, shaderModules[j], specializationInfo);
             }
 
             shaderGroupCreateInfos[i].type          = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR;
@@ -569,20 +899,20 @@ VkPipeline createRayTracingPipeline(VkDevice device, uint32_t entryCount, const
         }
         else {
             if (entries[i].closestHitShader != nullptr) {
-                shaderModules[j] = createShaderModule(device, entries[i].closestHitShader);
-                populateShaderStageCreateInfo(shaderStageCreateInfos[j], VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, shaderModules[j]);
+                shaderModules[j] = shaderModuleCache.getShaderModule(device, entries[i].closestHitShader);
+                populateShaderStageCreateInfo(shaderStageCreateInfos[j], shaderModuleIdentifierCreateInfos[j], VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, shaderModules[j], specializationInfo);
                 shaderGroupCreateInfos[i].closestHitShader = j++;
             }
 
             if (entries[i].anyHitShader != nullptr) {
-                shaderModules[j] = createShaderModule(device, entries[i].anyHitShader);
-                populateShaderStageCreateInfo(shaderStageCreateInfos[j], VK_SHADER_STAGE_ANY_HIT_BIT_KHR, shaderModules[j]);
+                shaderModules[j] = shaderModuleCache.getShaderModule(device, entries[i].anyHitShader);
+                populateShaderStageCreateInfo(shaderStageCreateInfos[j], shaderModuleIdentifierCreateInfos[j], VK_SHADER_STAGE_ANY_HIT_BIT_KHR, shaderModules[j], specializationInfo);
                 shaderGroupCreateInfos[i].anyHitShader = j++;
             }
 
             if (entries[i].intersectionShader != nullptr) {
-                shaderModules[j] = createShaderModule(device, entries[i].intersectionShader);
-                populateShaderStageCreateInfo(shaderStageCreateInfos[j], VK_SHADER_STAGE_INTERSECTION_BIT_KHR, shaderModules[j]);
+                shaderModules[j] = shaderModuleCache.getShaderModule(device, entries[i].intersectionShader);
+                populateShaderStageCreateInfo(shaderStageCreateInfos[j], shaderModuleIdentifierCreateInfos[j], VK_SHADER_STAGE_INTERSECTION_BIT_KHR, shaderModules[j], specializationInfo);
                 shaderGroupCreateInfos[i].type               = VK_RAY_TRACING_SHADER_GROUP_TYPE_PROCEDURAL_HIT_GROUP_KHR;
                 shaderGroupCreateInfos[i].intersectionShader = j++;
             }
@@ -592,15 +922,21 @@ VkPipeline createRayTracingPipeline(VkDevice device, uint32_t entryCount, const
         }
     }
 
-    VkRayTracingPipelineCreateInfoKHR rayTracingPipelineCreateInfo = {
+    for (uint32_t i = 0; i < shaderCount; ++i) {
+        if (shaderStageCreateInfos[i].module == VK_NULL_HANDLE) {
+            flags |= VK_PIPELINE_CREATE_FAIL_ON_PIPELINE_COMPILE_REQUIRED_BIT;
+        }
+    }
+
+    createInfo = {
         .sType                        = VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR,
         .pNext                        = nullptr,
-        .flags                        = 0,
+        .flags                        = flags,
         .stageCount                   = shaderCount,
         .pStages                      = shaderStageCreateInfos,
         .groupCount                   = entryCount,
         .pGroups                      = shaderGroupCreateInfos,
-        .maxPipelineRayRecursionDepth = 0,
+        .maxPipelineRayRecursionDepth = MAX_RAY_RECURSION_DEPTH,
         .pLibraryInfo                 = nullptr,
         .pLibraryInterface            = nullptr,
         .pDynamicState                = nullptr,
@@ -609,25 +945,98 @@ VkPipeline createRayTracingPipeline(VkDevice device, uint32_t entryCount, const
         .basePipelineIndex            = -1
     };
 
-    VkPipeline pipeline;
-    vkCreateRayTracingPipelines(device, VK_NULL_HANDLE, VK_NULL_HANDLE, 1, &rayTracingPipelineCreateInfo, nullptr, &pipeline);
+    libraryInfo.libraryCount = 0;
+}
 
-    for (uint32_t i = 0; i < shaderCount; ++i) {
-        vkDestroyShaderModule(device, shaderModules[i], nullptr);
+RayTracingPipelineBuild::RayTracingPipelineBuild(uint32_t libraryCount, const VkPipeline* libraries, VkPipelineLayout pipelineLayout) : pipeline(VK_NULL_HANDLE), shaderCount(0) {
+    shaderModules = nullptr;
+    shaderModuleIdentifierCreateInfos = nullptr;
+    shaderStageCreateInfos = nullptr;
+    shaderGroupCreateInfos = nullptr;
+    specializationInfos = nullptr;
+    specializationInfoCount = 0;
+
+    createInfo = {
+        .sType                        = VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR,
+        .pNext                        = nullptr,
+        .flags                        = 0,
+        .stageCount                   = 0,
+        .pStages                      = nullptr,
+        .groupCount                   = 0,
+        .pGroups                      = nullptr,
+        .maxPipelineRayRecursionDepth = MAX_RAY_RECURSION_DEPTH,
+        .pLibraryInfo                 = nullptr,
+        .pLibraryInterface            = nullptr,
+        .pDynamicState                = nullptr,
+        .layout                       = pipelineLayout,
+        .basePipelineHandle           = VK_NULL_HANDLE,
+        .basePipelineIndex            = -1
+    };
+
+    libraryInfo = {
+        .sType        = VK_STRUCTURE_TYPE_PIPELINE_LIBRARY_CREATE_INFO_KHR,
+        .pNext        = nullptr,
+        .libraryCount = libraryCount,
+        .pLibraries   = libraries
+    };
+}
+
+void RayTracingPipelineBuild::destroy(VkDevice device) {
+    for (uint32_t i = 0; i < specializationInfoCount; ++i) {
+        delete[] (const char*)specializationInfos[i].pData;
+        delete[] specializationInfos[i].pMapEntries;
     }
 
+    delete[] specializationInfos;
     delete[] shaderGroupCreateInfos;
     delete[] shaderStageCreateInfos;
+    delete[] shaderModuleIdentifierCreateInfos;
     delete[] shaderModules;
+}
+
+// A shader may be unreadable while an editor is still saving it, and a null module must never
+// reach the driver.
+VkResult RayTracingPipelineBuild::create(VkDevice device, VkDeferredOperationKHR deferredOperation, VkPipelineCache pipelineCache) {
+    for (uint32_t i = 0; i < shaderCount; ++i) {
+        if (shaderStageCreateInfos[i].module == VK_NULL_HANDLE && shaderStageCreateInfos[i].pNext == nullptr) {
+            return VK_ERROR_INITIALIZATION_FAILED;
+        }
+    }
+
+    // Libraries and the pipelines linked from them have to agree on the interface.
+    interfaceInfo = {
+        .sType                          = VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_INTERFACE_CREATE_INFO_KHR,
+        .pNext                          = nullptr,
+        .maxPipelineRayPayloadSize      = MAX_RAY_PAYLOAD_SIZE,
+        .maxPipelineRayHitAttributeSize = MAX_RAY_HIT_ATTRIBUTE_SIZE
+    };
+
+    createInfo.pLibraryInterface = &interfaceInfo;
+    createInfo.pLibraryInfo = libraryInfo.libraryCount != 0 ? &libraryInfo : nullptr;
+
+    return vkCreateRayTracingPipelines(device, deferredOperation, pipelineCache, 1, &createInfo, nullptr, &pipeline);
+}
+
+bool RayTracingPipelineBuild::usesShaderModuleIdentifiers() {
+    return createInfo.flags & VK_PIPELINE_CREATE_FAIL_ON_PIPELINE_COMPILE_REQUIRED_BIT;
+}
 
-    return pipeline;
+void RayTracingPipelineBuild::loadShaderModules(VkDevice device, ShaderModuleCache& shaderModuleCache) {
+    for (uint32_t i = 0; i < shaderCount; ++i) {
+        if (shaderStageCreateInfos[i].module == VK_NULL_HANDLE) {
+            shaderStageCreateInfos[i].pNext  = nullptr;
+            shaderStageCreateInfos[i].module = shaderModuleCache.loadShaderModule(device, shaderModules[i].contentHash);
+        }
+    }
+
+    createInfo.flags &= ~VK_PIPELINE_CREATE_FAIL_ON_PIPELINE_COMPILE_REQUIRED_BIT;
 }
 
 static uint32_t alignNumber(uint32_t number, uint32_t alignment) {
     return (number + alignment - 1) & ~(alignment - 1);
 }
 
-ShaderBindingTable::ShaderBindingTable(Device& device, uint32_t entryCount, const ShaderBindingTableEntry* entries) {
+ShaderBindingTable::ShaderBindingTable(Device& device, VkPipeline pipeline, uint32_t entryCount, const ShaderBindingTableEntry* entries, Uploader& uploader) {
     const VkPhysicalDeviceRayTracingPipelinePropertiesKHR& rtProperties = device.rtProperties;
 
     const uint32_t handleSize = rtProperties.shaderGroupHandleSize;
@@ -666,143 +1075,185 @@ ShaderBindingTable::ShaderBindingTable(Device& device, uint32_t entryCount, cons
     raygen.deviceAddress = buffer.getDeviceAddress(device.logical);
     hit.deviceAddress = raygen.deviceAddress + raygen.size;
     miss.deviceAddress = hit.deviceAddress + hit.size;
+
+    // Scatter the shader group handles into their regions and upload them.
+    char* handles = new char[entryCount * handleSize];
+    vkGetRayTracingShaderGroupHandles(device.logical, pipeline, 0, entryCount, entryCount * handleSize, handles);
+
+    char* data = new char[bufferSize];
+    memset(data, 0, bufferSize);
+
+    VkDeviceSize hitOffset = raygen.size;
+    VkDeviceSize missOffset = raygen.size + hit.size;
+
+    for (uint32_t i = 0; i < entryCount; ++i) {
+        char* handle = &handles[i * handleSize];
+
+        if (entries[i].stage == ShaderBindingTableStage::RAYGEN) {
+            memcpy(data, handle, handleSize);
+        }
+        else if (entries[i].stage == ShaderBindingTableStage::HIT) {
+            memcpy(&data[hitOffset], handle, handleSize);
+            hitOffset += hit.stride;
+        }
+        else {
+            memcpy(&data[missOffset], handle, handleSize);
+            missOffset += miss.stride;
+        }
+    }
+
+    uploader.uploadBuffer(device, buffer, 0, bufferSize, data);
+
+    delete[] data;
+    delete[] handles;
 }
 
-void ShaderBindingTable::destroy(VkDevice device) {
+void ShaderBindingTable::destroy(Device& device) {
     buffer.destroy(device);
 }
 
-Renderer::Renderer(Device& device, const RendererCreateInfo& createInfo) : framesInFlight(createInfo.framesInFlight) {
-    createSwapchain(device.logical, createInfo, VK_NULL_HANDLE);
+// Tracing into the swapchain images needs the surface to allow storage usage and the format to be
+// writable by the raygen shader, which then can't declare one.
+static bool supportsStorageSwapchain(Device& device, const RendererCreateInfo& createInfo) {
+    if (!device.storageImageWriteWithoutFormat || createInfo.surface == VK_NULL_HANDLE || !(createInfo.surfaceCapabilities->supportedUsageFlags & VK_IMAGE_USAGE_STORAGE_BIT)) {
+        return false;
+    }
 
-    // Create the command pools.
-    VkCommandPoolCreateInfo commandPoolCreateInfo = {
-        .sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-        .pNext            = nullptr,
-        .flags            = 0,
-        .queueFamilyIndex = device.renderQueue.familyIndex
+    VkFormatProperties3 formatProperties3 = {
+        .sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_3,
+        .pNext = nullptr
     };
 
-    vkCreateCommandPool(device.logical, &commandPoolCreateInfo, nullptr, &normalCommandPool);
+    VkFormatProperties2 formatProperties = {
+        .sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2,
+        .pNext = &formatProperties3
+    };
 
-    commandPoolCreateInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    vkGetPhysicalDeviceFormatProperties2(device.physical, createInfo.surfaceFormat.format, &formatProperties);
 
-    vkCreateCommandPool(device.logical, &commandPoolCreateInfo, nullptr, &transientCommandPool);
+    VkFormatFeatureFlags2 requiredFeatures = VK_FORMAT_FEATURE_2_STORAGE_IMAGE_BIT | VK_FORMAT_FEATURE_2_STORAGE_WRITE_WITHOUT_FORMAT_BIT;
 
-    // Create the descriptor set layout.
-    VkDescriptorSetLayoutBinding descriptorSetLayoutBinding = {
-        .binding            = 0,
-        .descriptorType     = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
-        .descriptorCount    = 1,
-        .stageFlags         = VK_SHADER_STAGE_RAYGEN_BIT_KHR,
-        .pImmutableSamplers = nullptr
-    };
+    return (formatProperties3.optimalTilingFeatures & requiredFeatures) == requiredFeatures;
+}
+
+Renderer::Renderer(Device& device, const RendererCreateInfo& createInfo) : headless(createInfo.surface == VK_NULL_HANDLE), presentWait(device.presentWait && !headless), waitForPresent(createInfo.waitForPresent && presentWait), traceRaysIndirect(device.traceRaysIndirect), traceToSwapchain(createInfo.traceToSwapchain && supportsStorageSwapchain(device, createInfo)), tlas(createInfo.tlas), geometryBuffer(createInfo.geometryBuffer), jobSystem(createInfo.jobSystem), framesInFlight(createInfo.framesInFlight) {
+    // Headless renderers only trace into the off-screen images.
+    if (!headless) {
+        createSwapchain(device.logical, createInfo, VK_NULL_HANDLE);
+    }
+
+    // Trace on the compute queue so that it overlaps with the blit and GUI of the previous frame.
+    traceQueueFamilyIndex = device.computeQueue.familyIndex;
+    presentQueueFamilyIndex = device.renderQueue.familyIndex;
+
+    scheduler = FrameScheduler(device.logical);
+
+    // Create the descriptor set layout.
+    VkDescriptorSetLayoutBinding descriptorSetLayoutBindings[] = {
+        {
+            .binding            = 0,
+            .descriptorType     = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+            .descriptorCount    = 1,
+            .stageFlags         = VK_SHADER_STAGE_RAYGEN_BIT_KHR,
+            .pImmutableSamplers = nullptr
+        },
+        {
+            .binding            = 1,
+            .descriptorType     = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR,
+            .descriptorCount    = 1,
+            .stageFlags         = VK_SHADER_STAGE_RAYGEN_BIT_KHR,
+            .pImmutableSamplers = nullptr
+        },
+        {
+            .binding            = 2,
+            .descriptorType     = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount    = 1,
+            .stageFlags         = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR | VK_SHADER_STAGE_INTERSECTION_BIT_KHR,
+            .pImmutableSamplers = nullptr
+        }
+    };
 
     VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {
         .sType        = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
         .pNext        = nullptr,
         .flags        = 0,
-        .bindingCount = 1,
-        .pBindings    = &descriptorSetLayoutBinding
+        .bindingCount = ARRAY_SIZE(descriptorSetLayoutBindings),
+        .pBindings    = descriptorSetLayoutBindings
     };
 
     vkCreateDescriptorSetLayout(device.logical, &descriptorSetLayoutCreateInfo, nullptr, &descriptorSetLayout);
 
     // Get the swapchain image count.
-    vkGetSwapchainImagesKHR(device.logical, swapchain, &swapchainImageCount, nullptr);
+    swapchainImageCount = 0;
+
+    if (!headless) {
+        vkGetSwapchainImagesKHR(device.logical, swapchain, &swapchainImageCount, nullptr);
+    }
 
     allocateSwapchainResourcesMemory();
-    createSwapchainResources(device.logical, createInfo);
+
+    if (!headless) {
+        createSwapchainResources(device.logical, createInfo);
+    }
     createFrameResources(device.logical);
-    allocateOffscreenResourcesMemory();
-    createOffscreenResources(device, createInfo);
-}
+    createTraceSizeBuffer(device);
 
-void Renderer::destroy(VkDevice device) {
-    destroyOffscreenResources(device);
-    freeOffscreenResourcesMemory();
-    destroyFrameResources(device);
-    destroySwapchainResources(device);
-    freeSwapchainResourcesMemory();
+    // Without off-screen images, the trace targets the acquired swapchain image.
+    if (!traceToSwapchain) {
+        allocateOffscreenResourcesMemory();
+        createOffscreenResources(device, createInfo);
+    }
 
-    vkDestroyDescriptorSetLayout(device, descriptorSetLayout, nullptr);
-    vkDestroyCommandPool(device, transientCommandPool, nullptr);
-    vkDestroyCommandPool(device, normalCommandPool, nullptr);
-    vkDestroySwapchainKHR(device, swapchain, nullptr);
+    profiler = GpuProfiler(device, framesInFlight);
 }
 
-void Renderer::recordCommandBuffers(VkDevice device, VkPipelineLayout pipelineLayout, VkPipeline rayTracingPipeline, const ShaderBindingTable& sbt, VkExtent2D extent) {
-    vkResetCommandPool(device, normalCommandPool, 0);
-
-    for (uint32_t i = 0; i < framesInFlight; ++i) {
-        VkCommandBufferBeginInfo commandBufferBeginInfo = {
-            .sType            = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-            .pNext            = nullptr,
-            .flags            = 0,
-            .pInheritanceInfo = nullptr
-        };
-
-        vkBeginCommandBuffer(normalCommandBuffers[i], &commandBufferBeginInfo);
-
-        VkImageMemoryBarrier2 imageMemoryBarrier = {
-            .sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
-            .pNext               = nullptr,
-            .srcStageMask        = VK_PIPELINE_STAGE_2_NONE,
-            .srcAccessMask       = VK_ACCESS_2_NONE,
-            .dstStageMask        = VK_PIPELINE_STAGE_2_RAY_TRACING_SHADER_BIT_KHR,
-            .dstAccessMask       = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
-            .oldLayout           = VK_IMAGE_LAYOUT_UNDEFINED,
-            .newLayout           = VK_IMAGE_LAYOUT_GENERAL,
-            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-            .image               = offscreenImages[i],
-            .subresourceRange    = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 }
-        };
-
-        VkDependencyInfo dependencyInfo = {
-            .sType                    = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
-            .pNext                    = nullptr,
-            .dependencyFlags          = 0,
-            .memoryBarrierCount       = 0,
-            .pMemoryBarriers          = nullptr,
-            .bufferMemoryBarrierCount = 0,
-            .pBufferMemoryBarriers    = nullptr,
-            .imageMemoryBarrierCount  = 1,
-            .pImageMemoryBarriers     = &imageMemoryBarrier
-        };
+void Renderer::destroy(Device& device) {
+    if (captureFrameNumber != 0) {
+        captureBuffer.destroy(device);
+    }
 
-        vkCmdPipelineBarrier2(normalCommandBuffers[i], &dependencyInfo);
+    profiler.destroy(device.logical);
 
-        vkCmdBindDescriptorSets(normalCommandBuffers[i], VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipelineLayout, 0, 1, &descriptorSets[i], 0, nullptr);
-        vkCmdBindPipeline(normalCommandBuffers[i], VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, rayTracingPipeline);
+    while (retiredSwapchainCount > 0) {
+        destroyRetiredSwapchain(device.logical);
+    }
 
-        VkStridedDeviceAddressRegionKHR callable = {};
+    if (!traceToSwapchain) {
+        destroyOffscreenResources(device);
+        freeOffscreenResourcesMemory();
+    }
 
-        vkCmdTraceRays(normalCommandBuffers[i], &sbt.raygen, &sbt.miss, &sbt.hit, &callable, extent.width, extent.height, 1);
+    traceSizeBuffer.destroy(device);
+    destroyFrameResources(device.logical);
+    destroySwapchainResources(device.logical);
+    freeSwapchainResourcesMemory();
 
-        imageMemoryBarrier.srcStageMask  = VK_PIPELINE_STAGE_2_RAY_TRACING_SHADER_BIT_KHR;
-        imageMemoryBarrier.srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
-        imageMemoryBarrier.dstStageMask  = VK_PIPELINE_STAGE_2_BLIT_BIT;
-        imageMemoryBarrier.dstAccessMask = VK_ACCESS_2_TRANSFER_READ_BIT;
-        imageMemoryBarrier.oldLayout     = VK_IMAGE_LAYOUT_GENERAL;
-        imageMemoryBarrier.newLayout     = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    scheduler.destroy(device.logical);
 
-        vkCmdPipelineBarrier2(normalCommandBuffers[i], &dependencyInfo);
+    vkDestroyDescriptorSetLayout(device.logical, descriptorSetLayout, nullptr);
 
-        vkEndCommandBuffer(normalCommandBuffers[i]);
+    if (!headless) {
+        vkDestroySwapchainKHR(device.logical, swapchain, nullptr);
     }
 }
 
-bool Renderer::render(Device& device, VkRenderPass renderPass, VkExtent2D extent) {
-    vkWaitForFences(device.logical, 1, &fences[frameIndex], VK_TRUE, UINT64_MAX);
+// Frames are recorded from scratch, so the pipeline only has to outlive the frames that use it.
+void Renderer::setTracePipeline(VkPipelineLayout pipelineLayout, VkPipeline rayTracingPipeline, const ShaderBindingTable& sbt) {
+    this->pipelineLayout = pipelineLayout;
+    this->rayTracingPipeline = rayTracingPipeline;
+    this->sbt = sbt;
+}
 
-    uint32_t imageIndex;
+// Runs on any worker, which records into its own pool of the frame. The GUI pass is only recorded
+// on the main thread, since ImGui's context belongs to it.
+void Renderer::recordPass(void* data, uint32_t pass, uint32_t workerIndex) {
+    TRACE_ZONE("Record Pass");
 
-    if (vkAcquireNextImageKHR(device.logical, swapchain, UINT64_MAX, imageAvailableSemaphores[frameIndex], VK_NULL_HANDLE, &imageIndex) == VK_ERROR_OUT_OF_DATE_KHR) {
-        return false;
-    }
+    FrameRecording& recording = *(FrameRecording*)data;
+    Renderer* renderer = recording.renderer;
+    FrameCommandPools& commandPools = pass == FRAME_PASS_TRACE ? renderer->traceCommandPools : renderer->presentCommandPools;
 
-    vkResetFences(device.logical, 1, &fences[frameIndex]);
+    VkCommandBuffer commandBuffer = commandPools.allocate(recording.device, renderer->frameIndex, workerIndex);
 
     VkCommandBufferBeginInfo commandBufferBeginInfo = {
         .sType            = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
@@ -811,20 +1262,41 @@ bool Renderer::render(Device& device, VkRenderPass renderPass, VkExtent2D extent
         .pInheritanceInfo = nullptr
     };
 
-    vkBeginCommandBuffer(transientCommandBuffers[frameIndex], &commandBufferBeginInfo);
+    vkBeginCommandBuffer(commandBuffer, &commandBufferBeginInfo);
+
+    if (pass == FRAME_PASS_TRACE) {
+        renderer->recordTrace(commandBuffer, recording);
+    }
+    else if (pass == FRAME_PASS_BLIT) {
+        renderer->recordBlit(commandBuffer, recording);
+    }
+    else {
+        renderer->recordGui(commandBuffer, recording);
+    }
+
+    vkEndCommandBuffer(commandBuffer);
+
+    recording.commandBuffers[pass] = commandBuffer;
+}
+
+// The trace size is written to the trace size buffer before recording, and is read from it by the
+// GPU with indirect traces, or by the host otherwise. The trace waits for the acquire in the ray
+// tracing stage when it writes the swapchain image, which the first barrier chains with.
+void Renderer::recordTrace(VkCommandBuffer commandBuffer, const FrameRecording& recording) {
+    VkImage image = traceToSwapchain ? swapchainImages[recording.imageIndex] : offscreenImages[frameIndex];
 
     VkImageMemoryBarrier2 imageMemoryBarrier = {
         .sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
         .pNext               = nullptr,
-        .srcStageMask        = VK_PIPELINE_STAGE_2_BLIT_BIT,
+        .srcStageMask        = traceToSwapchain ? VK_PIPELINE_STAGE_2_RAY_TRACING_SHADER_BIT_KHR : VK_PIPELINE_STAGE_2_NONE,
         .srcAccessMask       = VK_ACCESS_2_NONE,
-        .dstStageMask        = VK_PIPELINE_STAGE_2_BLIT_BIT,
-        .dstAccessMask       = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+        .dstStageMask        = VK_PIPELINE_STAGE_2_RAY_TRACING_SHADER_BIT_KHR,
+        .dstAccessMask       = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
         .oldLayout           = VK_IMAGE_LAYOUT_UNDEFINED,
-        .newLayout           = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        .newLayout           = VK_IMAGE_LAYOUT_GENERAL,
         .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
         .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .image               = swapchainImages[imageIndex],
+        .image               = image,
         .subresourceRange    = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 }
     };
 
@@ -840,31 +1312,151 @@ bool Renderer::render(Device& device, VkRenderPass renderPass, VkExtent2D extent
         .pImageMemoryBarriers     = &imageMemoryBarrier
     };
 
-    vkCmdPipelineBarrier2(transientCommandBuffers[frameIndex], &dependencyInfo);
+    vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
 
-    VkImageBlit2 imageBlit = {
-        .sType          = VK_STRUCTURE_TYPE_IMAGE_BLIT_2,
-        .pNext          = nullptr,
-        .srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 },
-        .srcOffsets     = { { 0, 0, 0 }, { (int32_t)extent.width, (int32_t)extent.height, 1 } },
-        .dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 },
-        .dstOffsets     = { { 0, (int32_t)extent.height, 0 }, { (int32_t)extent.width, 0, 1 } }
-    };
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipelineLayout, 0, 1, &descriptorSets[frameIndex], 0, nullptr);
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, rayTracingPipeline);
 
-    VkBlitImageInfo2 blitImageInfo = {
-        .sType          = VK_STRUCTURE_TYPE_BLIT_IMAGE_INFO_2,
-        .pNext          = nullptr,
-        .srcImage       = offscreenImages[frameIndex],
-        .srcImageLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-        .dstImage       = swapchainImages[imageIndex],
-        .dstImageLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        .regionCount    = 1,
-        .pRegions       = &imageBlit,
-        .filter         = VK_FILTER_NEAREST
-    };
+    VkStridedDeviceAddressRegionKHR callable = {};
+
+    profiler.beginScope(commandBuffer, frameIndex, recording.scopes[FRAME_PASS_TRACE]);
+
+    if (traceRaysIndirect) {
+        VkDeviceAddress traceSizeAddress = traceSizeBufferAddress + frameIndex * sizeof(VkTraceRaysIndirectCommandKHR);
+        vkCmdTraceRaysIndirect(commandBuffer, &sbt.raygen, &sbt.miss, &sbt.hit, &callable, traceSizeAddress);
+    }
+    else {
+        const VkTraceRaysIndirectCommandKHR& traceSize = ((const VkTraceRaysIndirectCommandKHR*)traceSizeBuffer.allocation.mappedData)[frameIndex];
+        vkCmdTraceRays(commandBuffer, &sbt.raygen, &sbt.miss, &sbt.hit, &callable, traceSize.width, traceSize.height, traceSize.depth);
+    }
+
+    profiler.endScope(commandBuffer, frameIndex, recording.scopes[FRAME_PASS_TRACE]);
 
-    vkCmdBlitImage2(transientCommandBuffers[frameIndex], &blitImageInfo);
+    // Release the image to the render queue, which acquires it with the same barrier before
+    // the blit. The contents are discarded by the next trace, so it's never released back.
+    // Swapchain images take the place of the blit destination instead, which the GUI render
+    // pass loads.
+    imageMemoryBarrier.srcStageMask  = VK_PIPELINE_STAGE_2_RAY_TRACING_SHADER_BIT_KHR;
+    imageMemoryBarrier.srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+    imageMemoryBarrier.oldLayout     = VK_IMAGE_LAYOUT_GENERAL;
 
+    if (traceToSwapchain) {
+        imageMemoryBarrier.dstStageMask  = VK_PIPELINE_STAGE_2_BLIT_BIT;
+        imageMemoryBarrier.dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+        imageMemoryBarrier.newLayout     = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    }
+    else {
+        imageMemoryBarrier.dstStageMask  = VK_PIPELINE_STAGE_2_BLIT_BIT | VK_PIPELINE_STAGE_2_COPY_BIT;
+        imageMemoryBarrier.dstAccessMask = VK_ACCESS_2_TRANSFER_READ_BIT;
+        imageMemoryBarrier.newLayout     = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    }
+
+    if (traceQueueFamilyIndex != presentQueueFamilyIndex) {
+        imageMemoryBarrier.dstStageMask        = VK_PIPELINE_STAGE_2_NONE;
+        imageMemoryBarrier.dstAccessMask       = VK_ACCESS_2_NONE;
+        imageMemoryBarrier.srcQueueFamilyIndex = traceQueueFamilyIndex;
+        imageMemoryBarrier.dstQueueFamilyIndex = presentQueueFamilyIndex;
+    }
+
+    vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
+}
+
+// Acquires the traced image on the render queue and scales it into the swapchain image, or only
+// acquires it for the capture when headless.
+void Renderer::recordBlit(VkCommandBuffer commandBuffer, const FrameRecording& recording) {
+    VkImageMemoryBarrier2 imageMemoryBarriers[2];
+    uint32_t imageMemoryBarrierCount = 0;
+
+    if (!headless && !traceToSwapchain) {
+        imageMemoryBarriers[imageMemoryBarrierCount++] = {
+            .sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+            .pNext               = nullptr,
+            .srcStageMask        = VK_PIPELINE_STAGE_2_BLIT_BIT,
+            .srcAccessMask       = VK_ACCESS_2_NONE,
+            .dstStageMask        = VK_PIPELINE_STAGE_2_BLIT_BIT,
+            .dstAccessMask       = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+            .oldLayout           = VK_IMAGE_LAYOUT_UNDEFINED,
+            .newLayout           = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image               = swapchainImages[recording.imageIndex],
+            .subresourceRange    = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 }
+        };
+    }
+
+    // Acquire the image released by the trace, which becomes the blit source or, when tracing
+    // into the swapchain, takes the place of the blit destination.
+    if (traceQueueFamilyIndex != presentQueueFamilyIndex) {
+        imageMemoryBarriers[imageMemoryBarrierCount++] = {
+            .sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+            .pNext               = nullptr,
+            .srcStageMask        = VK_PIPELINE_STAGE_2_NONE,
+            .srcAccessMask       = VK_ACCESS_2_NONE,
+            .dstStageMask        = traceToSwapchain ? VK_PIPELINE_STAGE_2_BLIT_BIT : VK_PIPELINE_STAGE_2_BLIT_BIT | VK_PIPELINE_STAGE_2_COPY_BIT,
+            .dstAccessMask       = traceToSwapchain ? VK_ACCESS_2_TRANSFER_WRITE_BIT : VK_ACCESS_2_TRANSFER_READ_BIT,
+            .oldLayout           = VK_IMAGE_LAYOUT_GENERAL,
+            .newLayout           = traceToSwapchain ? VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL : VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            .srcQueueFamilyIndex = traceQueueFamilyIndex,
+            .dstQueueFamilyIndex = presentQueueFamilyIndex,
+            .image               = traceToSwapchain ? swapchainImages[recording.imageIndex] : offscreenImages[frameIndex],
+            .subresourceRange    = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 }
+        };
+    }
+
+    if (imageMemoryBarrierCount != 0) {
+        VkDependencyInfo dependencyInfo = {
+            .sType                    = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+            .pNext                    = nullptr,
+            .dependencyFlags          = 0,
+            .memoryBarrierCount       = 0,
+            .pMemoryBarriers          = nullptr,
+            .bufferMemoryBarrierCount = 0,
+            .pBufferMemoryBarriers    = nullptr,
+            .imageMemoryBarrierCount  = imageMemoryBarrierCount,
+            .pImageMemoryBarriers     = imageMemoryBarriers
+        };
+
+        vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
+    }
+
+    if (recording.capture) {
+        recordCapture(commandBuffer);
+    }
+
+    if (!headless && !traceToSwapchain) {
+        VkImageBlit2 imageBlit = {
+            .sType          = VK_STRUCTURE_TYPE_IMAGE_BLIT_2,
+            .pNext          = nullptr,
+            .srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 },
+            .srcOffsets     = { { 0, 0, 0 }, { (int32_t)recording.traceExtent.width, (int32_t)recording.traceExtent.height, 1 } },
+            .dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 },
+            .dstOffsets     = { { 0, 0, 0 }, { (int32_t)recording.extent.width, (int32_t)recording.extent.height, 1 } }
+        };
+
+        // Scaled traces are upscaled with bilinear filtering, which the off-screen format
+        // always supports.
+        bool scaled = recording.traceExtent.width != recording.extent.width || recording.traceExtent.height != recording.extent.height;
+
+        VkBlitImageInfo2 blitImageInfo = {
+            .sType          = VK_STRUCTURE_TYPE_BLIT_IMAGE_INFO_2,
+            .pNext          = nullptr,
+            .srcImage       = offscreenImages[frameIndex],
+            .srcImageLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            .dstImage       = swapchainImages[recording.imageIndex],
+            .dstImageLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            .regionCount    = 1,
+            .pRegions       = &imageBlit,
+            .filter         = scaled ? VK_FILTER_LINEAR : VK_FILTER_NEAREST
+        };
+
+        profiler.beginScope(commandBuffer, frameIndex, recording.scopes[FRAME_PASS_BLIT]);
+        vkCmdBlitImage2(commandBuffer, &blitImageInfo);
+        profiler.endScope(commandBuffer, frameIndex, recording.scopes[FRAME_PASS_BLIT]);
+    }
+}
+
+// The GUI render pass loads whatever the blit or the trace left in the swapchain image.
+void Renderer::recordGui(VkCommandBuffer commandBuffer, const FrameRecording& recording) {
     VkClearValue clearValue = {
         0.0f, 0.0f, 0.0f, 1.0f
     };
@@ -872,140 +1464,421 @@ bool Renderer::render(Device& device, VkRenderPass renderPass, VkExtent2D extent
     VkRenderPassBeginInfo renderPassBeginInfo = {
         .sType           = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
         .pNext           = nullptr,
-        .renderPass      = renderPass,
-        .framebuffer     = framebuffers[imageIndex],
-        .renderArea      = { { 0, 0 }, extent },
+        .renderPass      = recording.renderPass,
+        .framebuffer     = framebuffers[recording.imageIndex],
+        .renderArea      = { { 0, 0 }, recording.extent },
         .clearValueCount = 1,
         .pClearValues    = &clearValue
     };
 
-    vkCmdBeginRenderPass(transientCommandBuffers[frameIndex], &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+    profiler.beginScope(commandBuffer, frameIndex, recording.scopes[FRAME_PASS_GUI]);
+    vkCmdBeginRenderPass(commandBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
 
     ImDrawData* drawData = ImGui::GetDrawData();
-    ImGui_ImplVulkan_RenderDrawData(drawData, transientCommandBuffers[frameIndex]);
+    ImGui_ImplVulkan_RenderDrawData(drawData, commandBuffer);
 
-    vkCmdEndRenderPass(transientCommandBuffers[frameIndex]);
+    vkCmdEndRenderPass(commandBuffer);
+    profiler.endScope(commandBuffer, frameIndex, recording.scopes[FRAME_PASS_GUI]);
+}
 
-    vkEndCommandBuffer(transientCommandBuffers[frameIndex]);
+bool Renderer::render(Device& device, VkRenderPass renderPass, VkExtent2D extent) {
+    TRACE_ZONE("Render");
 
-    VkSemaphoreSubmitInfo waitSemaphoreInfo = {
-        .sType       = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
-        .pNext       = nullptr,
-        .semaphore   = imageAvailableSemaphores[frameIndex],
-        .value       = 0,
-        .stageMask   = VK_PIPELINE_STAGE_2_BLIT_BIT,
-        .deviceIndex = 0
+    scheduler.beginFrame(device.logical, framesInFlight);
+    bool resolved = profiler.resolve(device.logical, frameIndex, scheduler.frame + 1);
+
+    writeCapture(device);
+
+    if (presentWait) {
+        updatePresentLatency(device.logical);
+    }
+
+    // Swapchains that were replaced are destroyed once the frames that used them have completed.
+    while (retiredSwapchainCount > 0 && scheduler.isComplete(device.logical, retiredSwapchains[0].frame)) {
+        destroyRetiredSwapchain(device.logical);
+    }
+
+    // The trace size of this frame slot is still the one of the frame whose timings were just
+    // resolved.
+    VkTraceRaysIndirectCommandKHR* traceSizes = (VkTraceRaysIndirectCommandKHR*)traceSizeBuffer.allocation.mappedData;
+
+    if (resolved) {
+        resolutionScaler.update(profiler.getLastDuration(profiler.getScope("Trace")), { traceSizes[frameIndex].width, traceSizes[frameIndex].height }, extent);
+    }
+
+    // Swapchain images can only be traced at full resolution.
+    VkExtent2D traceExtent = traceToSwapchain ? extent : resolutionScaler.getExtent(extent);
+
+    // This frame's resources aren't used by the GPU anymore, so its off-screen image can grow
+    // without waiting, and the trace size can be written.
+    if (!traceToSwapchain) {
+        VkExtent2D offscreenExtent = offscreenExtents[frameIndex];
+
+        if (traceExtent.width > offscreenExtent.width || traceExtent.height > offscreenExtent.height) {
+            growOffscreenImage(device, frameIndex, traceExtent);
+        }
+    }
+
+    traceSizes[frameIndex] = { traceExtent.width, traceExtent.height, 1 };
+
+    uint32_t imageIndex = 0;
+
+    if (!headless) {
+        TRACE_ZONE("Acquire Image");
+
+        if (vkAcquireNextImageKHR(device.logical, swapchain, UINT64_MAX, imageAvailableSemaphores[frameIndex], VK_NULL_HANDLE, &imageIndex) == VK_ERROR_OUT_OF_DATE_KHR) {
+            return false;
+        }
+    }
+
+    if (traceToSwapchain) {
+        updateTraceDescriptorSet(device.logical, frameIndex, swapchainImageViews[imageIndex]);
+    }
+
+    // Scopes are registered here, in a fixed order, since the jobs can't add any. Passes that
+    // aren't recorded don't get one.
+    FrameRecording recording = {
+        .renderer    = this,
+        .device      = device.logical,
+        .renderPass  = renderPass,
+        .imageIndex  = imageIndex,
+        .extent      = extent,
+        .traceExtent = traceExtent,
+        .capture     = captureFileName != nullptr && captureFrameNumber == 0,
+        .scopes      = {
+            profiler.getScope("Trace"),
+            !headless && !traceToSwapchain ? profiler.getScope("Blit") : UINT32_MAX,
+            !headless ? profiler.getScope("GUI") : UINT32_MAX
+        }
     };
 
-    VkSemaphoreSubmitInfo signalSemaphoreInfo = {
-        .sType       = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
-        .pNext       = nullptr,
-        .semaphore   = renderFinishedSemaphores[frameIndex],
-        .value       = 0,
-        .stageMask   = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
-        .deviceIndex = 0
+    if (recording.capture) {
+        createCapture(device, traceExtent);
+    }
+
+    // The frame slot has completed, so all of its command buffers can be recycled at once.
+    traceCommandPools.reset(device.logical, frameIndex);
+    presentCommandPools.reset(device.logical, frameIndex);
+
+    // Headless frames have no GUI, but still submit the blit pass for the capture and the
+    // queue family transfer.
+    uint32_t passCount = headless ? FRAME_PASS_GUI : FRAME_PASS_COUNT;
+
+    Job jobs[FRAME_PASS_COUNT];
+    JobCounter counter;
+
+    for (uint32_t i = 0; i < passCount; ++i) {
+        jobs[i] = { .function = recordPass, .data = &recording, .index = i, .mainThread = i == FRAME_PASS_GUI };
+    }
+
+    {
+        TRACE_ZONE("Record Passes");
+
+        jobSystem->submit(passCount, jobs, counter);
+        jobSystem->wait(counter);
+    }
+
+    if (uploadSemaphore != VK_NULL_HANDLE) {
+        scheduler.addTraceWait(uploadSemaphore, uploadValue, VK_PIPELINE_STAGE_2_RAY_TRACING_SHADER_BIT_KHR);
+    }
+
+    // The trace writes the swapchain image, so it waits for the acquire instead of the blit.
+    VkSemaphore imageAvailableSemaphore = VK_NULL_HANDLE;
+
+    if (traceToSwapchain) {
+        scheduler.addTraceWait(imageAvailableSemaphores[frameIndex], 0, VK_PIPELINE_STAGE_2_RAY_TRACING_SHADER_BIT_KHR);
+    }
+    else if (!headless) {
+        imageAvailableSemaphore = imageAvailableSemaphores[frameIndex];
+    }
+
+    scheduler.submitTrace(device.computeQueue, 1, &recording.commandBuffers[FRAME_PASS_TRACE]);
+
+    if (headless) {
+        // Still submitted to signal the present timeline, which paces the frames.
+        scheduler.submitPresent(device.renderQueue, passCount - 1, &recording.commandBuffers[FRAME_PASS_BLIT], VK_NULL_HANDLE, VK_NULL_HANDLE);
+    }
+    else {
+        scheduler.submitPresent(device.renderQueue, passCount - 1, &recording.commandBuffers[FRAME_PASS_BLIT], imageAvailableSemaphore, renderFinishedSemaphores[frameIndex]);
+
+        // Frame numbers double as present IDs, which only have to increase.
+        VkPresentIdKHR presentId = {
+            .sType          = VK_STRUCTURE_TYPE_PRESENT_ID_KHR,
+            .pNext          = nullptr,
+            .swapchainCount = 1,
+            .pPresentIds    = &scheduler.frame
+        };
+
+        VkPresentInfoKHR presentInfo = {
+            .sType              = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+            .pNext              = presentWait ? &presentId : nullptr,
+            .waitSemaphoreCount = 1,
+            .pWaitSemaphores    = &renderFinishedSemaphores[frameIndex],
+            .swapchainCount     = 1,
+            .pSwapchains        = &swapchain,
+            .pImageIndices      = &imageIndex,
+            .pResults           = nullptr
+        };
+
+        TRACE_ZONE("Present");
+        vkQueuePresentKHR(device.renderQueue, &presentInfo);
+
+        if (presentWait) {
+            // Drop the oldest present if it was never waited for.
+            if (pendingPresentCount == MAX_PENDING_PRESENT_COUNT) {
+                pendingPresentIndex = (pendingPresentIndex + 1) % MAX_PENDING_PRESENT_COUNT;
+                --pendingPresentCount;
+            }
+
+            pendingPresents[(pendingPresentIndex + pendingPresentCount++) % MAX_PENDING_PRESENT_COUNT] = { scheduler.frame, std::chrono::steady_clock::now() };
+        }
+    }
+
+    frameIndex = (frameIndex + 1) % framesInFlight;
+
+    return true;
+}
+
+bool Renderer::measuresPresentLatency() {
+    return presentWait;
+}
+
+bool Renderer::tracesToSwapchain() {
+    return traceToSwapchain;
+}
+
+// The time between queueing a present and the image being on screen, in milliseconds.
+double Renderer::getPresentLatency() {
+    return presentLatency;
+}
+
+// Only one frame is captured at a time, and only from the off-screen images.
+void Renderer::captureFrame(const char* fileName) {
+    if (captureFileName == nullptr && !traceToSwapchain) {
+        captureFileName = fileName;
+    }
+}
+
+bool Renderer::writeCapture(Device& device) {
+    if (captureFrameNumber == 0 || !scheduler.isComplete(device.logical, captureFrameNumber)) {
+        return false;
+    }
+
+    std::ofstream file(captureFileName, std::ios::binary | std::ios::trunc);
+
+    file << "P6\n" << captureExtent.width << ' ' << captureExtent.height << "\n255\n";
+
+    const uint32_t* pixels = (const uint32_t*)captureBuffer.allocation.mappedData;
+    uint8_t* row = new uint8_t[captureExtent.width * 3];
+
+    for (uint32_t y = 0; y < captureExtent.height; ++y) {
+        for (uint32_t x = 0; x < captureExtent.width; ++x) {
+            // Keep the 8 most significant bits of every 10-bit channel.
+            uint32_t pixel = pixels[y * captureExtent.width + x];
+
+            row[x * 3 + 0] = (pixel >> 2) & 0xff;
+            row[x * 3 + 1] = (pixel >> 12) & 0xff;
+            row[x * 3 + 2] = (pixel >> 22) & 0xff;
+        }
+
+        file.write((const char*)row, captureExtent.width * 3);
+    }
+
+    delete[] row;
+
+    file.close();
+
+    if (file.fail()) {
+        printf("Failed to write the capture to %s\n", captureFileName);
+    }
+
+    captureBuffer.destroy(device);
+    captureFileName = nullptr;
+    captureFrameNumber = 0;
+
+    return true;
+}
+
+// The capture buffer is created on the main thread, before the frame's passes are recorded.
+void Renderer::createCapture(Device& device, VkExtent2D extent) {
+    captureExtent = extent;
+    captureFrameNumber = scheduler.frame + 1;
+    captureBuffer = Buffer(device, (VkDeviceSize)extent.width * extent.height * 4, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+}
+
+// Copies the off-screen image of the current frame to the capture buffer, which is written to
+// disk once the frame has completed.
+void Renderer::recordCapture(VkCommandBuffer commandBuffer) {
+    VkBufferImageCopy2 bufferImageCopy = {
+        .sType             = VK_STRUCTURE_TYPE_BUFFER_IMAGE_COPY_2,
+        .pNext             = nullptr,
+        .bufferOffset      = 0,
+        .bufferRowLength   = 0,
+        .bufferImageHeight = 0,
+        .imageSubresource  = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 },
+        .imageOffset       = { 0, 0, 0 },
+        .imageExtent       = { captureExtent.width, captureExtent.height, 1 }
     };
 
-    VkCommandBufferSubmitInfo normalCommandBufferInfo = {
-        .sType         = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
-        .pNext         = nullptr,
-        .commandBuffer = normalCommandBuffers[frameIndex],
-        .deviceMask    = 0
+    VkCopyImageToBufferInfo2 copyImageToBufferInfo = {
+        .sType          = VK_STRUCTURE_TYPE_COPY_IMAGE_TO_BUFFER_INFO_2,
+        .pNext          = nullptr,
+        .srcImage       = offscreenImages[frameIndex],
+        .srcImageLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        .dstBuffer      = captureBuffer,
+        .regionCount    = 1,
+        .pRegions       = &bufferImageCopy
     };
 
-    VkCommandBufferSubmitInfo transientCommandBufferInfo = {
-        .sType         = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
-        .pNext         = nullptr,
-        .commandBuffer = transientCommandBuffers[frameIndex],
-        .deviceMask    = 0
+    vkCmdCopyImageToBuffer2(commandBuffer, &copyImageToBufferInfo);
+
+    // Make the copy visible to the host.
+    VkBufferMemoryBarrier2 bufferMemoryBarrier = {
+        .sType               = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+        .pNext               = nullptr,
+        .srcStageMask        = VK_PIPELINE_STAGE_2_COPY_BIT,
+        .srcAccessMask       = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+        .dstStageMask        = VK_PIPELINE_STAGE_2_HOST_BIT,
+        .dstAccessMask       = VK_ACCESS_2_HOST_READ_BIT,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .buffer              = captureBuffer,
+        .offset              = 0,
+        .size                = VK_WHOLE_SIZE
     };
 
-    VkSubmitInfo2 submitInfos[2];
-
-    submitInfos[0].sType                    = VK_STRUCTURE_TYPE_SUBMIT_INFO_2;
-    submitInfos[0].pNext                    = nullptr;
-    submitInfos[0].flags                    = 0;
-    submitInfos[0].waitSemaphoreInfoCount   = 0;
-    submitInfos[0].pWaitSemaphoreInfos      = nullptr;
-    submitInfos[0].commandBufferInfoCount   = 1;
-    submitInfos[0].pCommandBufferInfos      = &normalCommandBufferInfo;
-    submitInfos[0].signalSemaphoreInfoCount = 0;
-    submitInfos[0].pSignalSemaphoreInfos    = nullptr;
-
-    submitInfos[1].sType                    = VK_STRUCTURE_TYPE_SUBMIT_INFO_2;
-    submitInfos[1].pNext                    = nullptr;
-    submitInfos[1].flags                    = 0;
-    submitInfos[1].waitSemaphoreInfoCount   = 1;
-    submitInfos[1].pWaitSemaphoreInfos      = &waitSemaphoreInfo;
-    submitInfos[1].commandBufferInfoCount   = 1;
-    submitInfos[1].pCommandBufferInfos      = &transientCommandBufferInfo;
-    submitInfos[1].signalSemaphoreInfoCount = 1;
-    submitInfos[1].pSignalSemaphoreInfos    = &signalSemaphoreInfo;
-
-    vkQueueSubmit2(device.renderQueue, ARRAY_SIZE(submitInfos), submitInfos, fences[frameIndex]);
-
-    VkPresentInfoKHR presentInfo = {
-        .sType              = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
-        .pNext              = nullptr,
-        .waitSemaphoreCount = 1,
-        .pWaitSemaphores    = &renderFinishedSemaphores[frameIndex],
-        .swapchainCount     = 1,
-        .pSwapchains        = &swapchain,
-        .pImageIndices      = &imageIndex,
-        .pResults           = nullptr
+    VkDependencyInfo dependencyInfo = {
+        .sType                    = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        .pNext                    = nullptr,
+        .dependencyFlags          = 0,
+        .memoryBarrierCount       = 0,
+        .pMemoryBarriers          = nullptr,
+        .bufferMemoryBarrierCount = 1,
+        .pBufferMemoryBarriers    = &bufferMemoryBarrier,
+        .imageMemoryBarrierCount  = 0,
+        .pImageMemoryBarriers     = nullptr
     };
 
-    vkQueuePresentKHR(device.renderQueue, &presentInfo);
+    vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
+}
+
+// Checks which of the queued presents are on screen without blocking, unless presents are waited
+// for. Then the previous frame has to be on screen before the next one starts, so its latency is
+// measured exactly, while polling only notices completed presents once per frame.
+void Renderer::updatePresentLatency(VkDevice device) {
+    TRACE_ZONE("Wait For Present");
 
-    frameIndex = (frameIndex + 1) % framesInFlight;
+    while (pendingPresentCount > 0) {
+        const PendingPresent& present = pendingPresents[pendingPresentIndex];
 
-    return true;
+        // Don't block forever on windows that are hidden.
+        VkResult result = vkWaitForPresent(device, swapchain, present.id, waitForPresent ? 100'000'000 : 0);
+
+        if (result == VK_TIMEOUT) {
+            break;
+        }
+
+        if (result == VK_SUCCESS || result == VK_SUBOPTIMAL_KHR) {
+            presentLatency = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - present.time).count();
+        }
+
+        pendingPresentIndex = (pendingPresentIndex + 1) % MAX_PENDING_PRESENT_COUNT;
+        --pendingPresentCount;
+    }
+}
+
+void Renderer::setUploadDependency(VkSemaphore semaphore, uint64_t value) {
+    uploadSemaphore = semaphore;
+    uploadValue = value;
 }
 
 void Renderer::waitIdle(VkDevice device) {
-    vkWaitForFences(device, framesInFlight, fences, VK_TRUE, UINT64_MAX);
+    scheduler.wait(device, scheduler.frame);
 }
 
+// Never waits for the GPU: the off-screen images grow on demand in render(), and the old swapchain
+// is retired until the frames that used it have completed.
 void Renderer::resize(Device& device, const RendererCreateInfo& createInfo) {
-    destroyOffscreenResources(device.logical);
-    destroySwapchainResources(device.logical);
+    // The present IDs belong to the old swapchain.
+    waitForPresent = createInfo.waitForPresent && presentWait;
+    pendingPresentCount = 0;
+
+    if (headless) {
+        return;
+    }
 
-    // Store the old swapchain.
     VkSwapchainKHR oldSwapchain = swapchain;
 
-    // Create the new swapchain.
     createSwapchain(device.logical, createInfo, oldSwapchain);
+    retireSwapchain(device.logical, oldSwapchain);
 
-    // Destroy the old swapchain.
-    vkDestroySwapchainKHR(device.logical, oldSwapchain, nullptr);
-
-    // Reallocate the host memory only if the number of swapchain images has changed.
-    uint32_t swapchainImageCount;
     vkGetSwapchainImagesKHR(device.logical, swapchain, &swapchainImageCount, nullptr);
 
-    if (swapchainImageCount != this->swapchainImageCount) {
-        freeSwapchainResourcesMemory();
+    allocateSwapchainResourcesMemory();
+    createSwapchainResources(device.logical, createInfo);
+}
+
+void Renderer::retireSwapchain(VkDevice device, VkSwapchainKHR oldSwapchain) {
+    // Only block when the window is resized faster than frames complete.
+    if (retiredSwapchainCount == MAX_RETIRED_SWAPCHAIN_COUNT) {
+        scheduler.wait(device, retiredSwapchains[0].frame);
+        destroyRetiredSwapchain(device);
+    }
 
-        this->swapchainImageCount = swapchainImageCount;
+    retiredSwapchains[retiredSwapchainCount++] = {
+        .frame        = scheduler.frame,
+        .swapchain    = oldSwapchain,
+        .imageCount   = swapchainImageCount,
+        .images       = swapchainImages,
+        .imageViews   = swapchainImageViews,
+        .framebuffers = framebuffers
+    };
+}
+
+void Renderer::destroyRetiredSwapchain(VkDevice device) {
+    RetiredSwapchain& retiredSwapchain = retiredSwapchains[0];
 
-        allocateSwapchainResourcesMemory();
+    for (uint32_t i = 0; i < retiredSwapchain.imageCount; ++i) {
+        vkDestroyFramebuffer(device, retiredSwapchain.framebuffers[i], nullptr);
+        vkDestroyImageView(device, retiredSwapchain.imageViews[i], nullptr);
     }
 
-    createSwapchainResources(device.logical, createInfo);
-    createOffscreenResources(device, createInfo);
+    delete[] retiredSwapchain.framebuffers;
+    delete[] retiredSwapchain.imageViews;
+    delete[] retiredSwapchain.images;
+
+    vkDestroySwapchainKHR(device, retiredSwapchain.swapchain, nullptr);
+
+    --retiredSwapchainCount;
+    memmove(&retiredSwapchains[0], &retiredSwapchains[1], retiredSwapchainCount * sizeof(RetiredSwapchain));
+}
+
+void Renderer::createTraceSizeBuffer(Device& device) {
+    traceSizeBuffer = Buffer(device, framesInFlight * sizeof(VkTraceRaysIndirectCommandKHR), VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    traceSizeBufferAddress = traceSizeBuffer.getDeviceAddress(device.logical);
 }
 
 void Renderer::setFramesInFlight(Device& device, const RendererCreateInfo& createInfo) {
-    destroyOffscreenResources(device.logical);
-    freeOffscreenResourcesMemory();
+    if (!traceToSwapchain) {
+        destroyOffscreenResources(device);
+        freeOffscreenResourcesMemory();
+    }
+
+    traceSizeBuffer.destroy(device);
     destroyFrameResources(device.logical);
 
     framesInFlight = createInfo.framesInFlight;
     frameIndex = 0;
 
+    profiler.setFramesInFlight(device.logical, framesInFlight);
+
     createFrameResources(device.logical);
-    allocateOffscreenResourcesMemory();
-    createOffscreenResources(device, createInfo);
+    createTraceSizeBuffer(device);
+
+    if (!traceToSwapchain) {
+        allocateOffscreenResourcesMemory();
+        createOffscreenResources(device, createInfo);
+    }
 }
 
 void Renderer::createSwapchain(VkDevice device, const RendererCreateInfo& createInfo, VkSwapchainKHR oldSwapchain) {
@@ -1022,13 +1895,13 @@ void Renderer::createSwapchain(VkDevice device, const RendererCreateInfo& create
         .imageColorSpace       = surfaceFormat.colorSpace,
         .imageExtent           = surfaceCapabilities->currentExtent,
         .imageArrayLayers      = 1,
-        .imageUsage            = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+        .imageUsage            = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | (traceToSwapchain ? VK_IMAGE_USAGE_STORAGE_BIT : VK_IMAGE_USAGE_TRANSFER_DST_BIT),
         .imageSharingMode      = VK_SHARING_MODE_EXCLUSIVE,
         .queueFamilyIndexCount = 0,
         .pQueueFamilyIndices   = nullptr,
         .preTransform          = surfaceCapabilities->currentTransform,
         .compositeAlpha        = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
-        .presentMode           = VK_PRESENT_MODE_MAILBOX_KHR, // TODO
+        .presentMode           = createInfo.presentMode,
         .clipped               = VK_TRUE,
         .oldSwapchain          = oldSwapchain
     };
@@ -1083,7 +1956,9 @@ void Renderer::createSwapchainResources(VkDevice device, const RendererCreateInf
 void Renderer::createFrameResources(VkDevice device) {
     // Create the descriptor pool.
     VkDescriptorPoolSize descriptorPoolSizes[] = {
-        { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, framesInFlight }
+        { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, framesInFlight },
+        { VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, framesInFlight },
+        { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, framesInFlight }
     };
 
     VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {
@@ -1118,28 +1993,59 @@ void Renderer::createFrameResources(VkDevice device) {
 
     delete[] descriptorSetLayouts;
 
-    // Allocate the command buffers.
-    normalCommandBuffers = new VkCommandBuffer[framesInFlight];
-    transientCommandBuffers = new VkCommandBuffer[framesInFlight];
+    // The TLAS is rebuilt in place and the geometry buffer never changes, so their descriptors
+    // never change either.
+    for (uint32_t i = 0; i < framesInFlight; ++i) {
+        VkWriteDescriptorSetAccelerationStructureKHR writeDescriptorSetAccelerationStructure = {
+            .sType                      = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR,
+            .pNext                      = nullptr,
+            .accelerationStructureCount = 1,
+            .pAccelerationStructures    = &tlas
+        };
 
-    VkCommandBufferAllocateInfo commandBufferAllocateInfo = {
-        .sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-        .pNext              = nullptr,
-        .commandPool        = normalCommandPool,
-        .level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-        .commandBufferCount = framesInFlight
-    };
+        VkDescriptorBufferInfo descriptorBufferInfo = {
+            .buffer = geometryBuffer,
+            .offset = 0,
+            .range  = VK_WHOLE_SIZE
+        };
 
-    vkAllocateCommandBuffers(device, &commandBufferAllocateInfo, normalCommandBuffers);
+        VkWriteDescriptorSet writeDescriptorSets[] = {
+            {
+                .sType            = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .pNext            = &writeDescriptorSetAccelerationStructure,
+                .dstSet           = descriptorSets[i],
+                .dstBinding       = 1,
+                .dstArrayElement  = 0,
+                .descriptorCount  = 1,
+                .descriptorType   = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR,
+                .pImageInfo       = nullptr,
+                .pBufferInfo      = nullptr,
+                .pTexelBufferView = nullptr
+            },
+            {
+                .sType            = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .pNext            = nullptr,
+                .dstSet           = descriptorSets[i],
+                .dstBinding       = 2,
+                .dstArrayElement  = 0,
+                .descriptorCount  = 1,
+                .descriptorType   = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                .pImageInfo       = nullptr,
+                .pBufferInfo      = &descriptorBufferInfo,
+                .pTexelBufferView = nullptr
+            }
+        };
 
-    commandBufferAllocateInfo.commandPool = transientCommandPool;
+        vkUpdateDescriptorSets(device, ARRAY_SIZE(writeDescriptorSets), writeDescriptorSets, 0, nullptr);
+    }
 
-    vkAllocateCommandBuffers(device, &commandBufferAllocateInfo, transientCommandBuffers);
+    // Create the command pools of every frame and worker.
+    traceCommandPools = FrameCommandPools(device, traceQueueFamilyIndex, framesInFlight, jobSystem->getWorkerCount());
+    presentCommandPools = FrameCommandPools(device, presentQueueFamilyIndex, framesInFlight, jobSystem->getWorkerCount());
 
-    // Create the semaphores and fences.
+    // Create the swapchain semaphores.
     imageAvailableSemaphores = new VkSemaphore[framesInFlight];
     renderFinishedSemaphores = new VkSemaphore[framesInFlight];
-    fences = new VkFence[framesInFlight];
 
     for (uint32_t i = 0; i < framesInFlight; ++i) {
         VkSemaphoreCreateInfo semaphoreCreateInfo = {
@@ -1150,119 +2056,114 @@ void Renderer::createFrameResources(VkDevice device) {
 
         vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &imageAvailableSemaphores[i]);
         vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &renderFinishedSemaphores[i]);
-
-        VkFenceCreateInfo fenceCreateInfo = {
-            .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-            .pNext = nullptr,
-            .flags = VK_FENCE_CREATE_SIGNALED_BIT
-        };
-
-        vkCreateFence(device, &fenceCreateInfo, nullptr, &fences[i]);
     }
 }
 
 void Renderer::allocateOffscreenResourcesMemory() {
     offscreenImages = new VkImage[framesInFlight];
+    offscreenImageAllocations = new Allocation[framesInFlight];
     offscreenImageViews = new VkImageView[framesInFlight];
+    offscreenExtents = new VkExtent2D[framesInFlight];
 }
 
 void Renderer::createOffscreenResources(Device& device, const RendererCreateInfo& createInfo) {
-    // Create the off-screen images.
-    VkExtent2D extent = createInfo.surfaceCapabilities->currentExtent;
-
     for (uint32_t i = 0; i < framesInFlight; ++i) {
-        VkImageCreateInfo imageCreateInfo = {
-            .sType                 = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
-            .pNext                 = nullptr,
-            .flags                 = 0,
-            .imageType             = VK_IMAGE_TYPE_2D,
-            .format                = VK_FORMAT_A2B10G10R10_UNORM_PACK32,
-            .extent                = { extent.width, extent.height, 1 },
-            .mipLevels             = 1,
-            .arrayLayers           = 1,
-            .samples               = VK_SAMPLE_COUNT_1_BIT,
-            .tiling                = VK_IMAGE_TILING_OPTIMAL,
-            .usage                 = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
-            .sharingMode           = VK_SHARING_MODE_EXCLUSIVE,
-            .queueFamilyIndexCount = 0,
-            .pQueueFamilyIndices   = nullptr,
-            .initialLayout         = VK_IMAGE_LAYOUT_UNDEFINED
-        };
-
-        vkCreateImage(device.logical, &imageCreateInfo, nullptr, &offscreenImages[i]);
+        createOffscreenImage(device, i, createInfo.surfaceCapabilities->currentExtent);
     }
+}
 
-    // Allocate the off-screen images memory.
-    VkMemoryRequirements memoryRequirements;
-    vkGetImageMemoryRequirements(device.logical, offscreenImages[0], &memoryRequirements);
+// The image only has to be at least as large as the extent, so it's rounded up to make windows
+// that are being resized grow it only every few hundred pixels.
+void Renderer::createOffscreenImage(Device& device, uint32_t frameIndex, VkExtent2D extent) {
+    VkExtent2D& offscreenExtent = offscreenExtents[frameIndex];
 
-    uint32_t memoryTypeIndex = device.getMemoryTypeIndex(memoryRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    offscreenExtent = {
+        .width  = alignNumber(extent.width, OFFSCREEN_EXTENT_GRANULARITY),
+        .height = alignNumber(extent.height, OFFSCREEN_EXTENT_GRANULARITY)
+    };
 
-    VkMemoryAllocateInfo memoryAllocateInfo = {
-        .sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-        .pNext           = nullptr,
-        .allocationSize  = framesInFlight * memoryRequirements.size,
-        .memoryTypeIndex = memoryTypeIndex
+    // Create the off-screen image.
+    VkImageCreateInfo imageCreateInfo = {
+        .sType                 = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+        .pNext                 = nullptr,
+        .flags                 = 0,
+        .imageType             = VK_IMAGE_TYPE_2D,
+        .format                = VK_FORMAT_A2B10G10R10_UNORM_PACK32,
+        .extent                = { offscreenExtent.width, offscreenExtent.height, 1 },
+        .mipLevels             = 1,
+        .arrayLayers           = 1,
+        .samples               = VK_SAMPLE_COUNT_1_BIT,
+        .tiling                = VK_IMAGE_TILING_OPTIMAL,
+        .usage                 = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+        .sharingMode           = VK_SHARING_MODE_EXCLUSIVE,
+        .queueFamilyIndexCount = 0,
+        .pQueueFamilyIndices   = nullptr,
+        .initialLayout         = VK_IMAGE_LAYOUT_UNDEFINED
     };
 
-    vkAllocateMemory(device.logical, &memoryAllocateInfo, nullptr, &offscreenImagesMemory);
+    vkCreateImage(device.logical, &imageCreateInfo, nullptr, &offscreenImages[frameIndex]);
 
-    // Bind the off-screen images memory.
-    VkBindImageMemoryInfo* bindImageMemoryInfos = new VkBindImageMemoryInfo[framesInFlight];
+    // Sub-allocate the off-screen image memory.
+    VkMemoryRequirements memoryRequirements;
+    vkGetImageMemoryRequirements(device.logical, offscreenImages[frameIndex], &memoryRequirements);
 
-    for (uint32_t i = 0; i < framesInFlight; ++i) {
-        bindImageMemoryInfos[i].sType        = VK_STRUCTURE_TYPE_BIND_IMAGE_MEMORY_INFO;
-        bindImageMemoryInfos[i].pNext        = nullptr;
-        bindImageMemoryInfos[i].image        = offscreenImages[i];
-        bindImageMemoryInfos[i].memory       = offscreenImagesMemory;
-        bindImageMemoryInfos[i].memoryOffset = i * memoryRequirements.size;
-    }
+    Allocation& allocation = offscreenImageAllocations[frameIndex];
+    allocation = device.allocator.allocate(device.logical, memoryRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, AllocationKind::IMAGE);
 
-    vkBindImageMemory2(device.logical, framesInFlight, bindImageMemoryInfos);
+    vkBindImageMemory(device.logical, offscreenImages[frameIndex], allocation.memory, allocation.offset);
 
-    delete[] bindImageMemoryInfos;
+    // Create the off-screen image view.
+    VkImageViewCreateInfo imageViewCreateInfo = {
+        .sType            = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        .pNext            = nullptr,
+        .flags            = 0,
+        .image            = offscreenImages[frameIndex],
+        .viewType         = VK_IMAGE_VIEW_TYPE_2D,
+        .format           = VK_FORMAT_A2B10G10R10_UNORM_PACK32,
+        .components       = { VK_COMPONENT_SWIZZLE_IDENTITY },
+        .subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 }
+    };
 
-    // Create the off-screen image views.
-    for (uint32_t i = 0; i < framesInFlight; ++i) {
-        VkImageViewCreateInfo imageViewCreateInfo = {
-            .sType            = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
-            .pNext            = nullptr,
-            .flags            = 0,
-            .image            = offscreenImages[i],
-            .viewType         = VK_IMAGE_VIEW_TYPE_2D,
-            .format           = VK_FORMAT_A2B10G10R10_UNORM_PACK32,
-            .components       = { VK_COMPONENT_SWIZZLE_IDENTITY },
-            .subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 }
-        };
+    vkCreateImageView(device.logical, &imageViewCreateInfo, nullptr, &offscreenImageViews[frameIndex]);
 
-        vkCreateImageView(device.logical, &imageViewCreateInfo, nullptr, &offscreenImageViews[i]);
-    }
+    updateTraceDescriptorSet(device.logical, frameIndex, offscreenImageViews[frameIndex]);
+}
+
+// The frame's descriptor set isn't used by pending work once its frame slot has been waited for.
+void Renderer::updateTraceDescriptorSet(VkDevice device, uint32_t frameIndex, VkImageView imageView) {
+    VkDescriptorImageInfo descriptorImageInfo = {
+        .sampler     = VK_NULL_HANDLE,
+        .imageView   = imageView,
+        .imageLayout = VK_IMAGE_LAYOUT_GENERAL
+    };
 
-    // Update the descriptor sets.
-    VkDescriptorImageInfo* descriptorImageInfos = new VkDescriptorImageInfo[framesInFlight];
-    VkWriteDescriptorSet* writeDescriptorSets = new VkWriteDescriptorSet[framesInFlight];
+    VkWriteDescriptorSet writeDescriptorSet = {
+        .sType            = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .pNext            = nullptr,
+        .dstSet           = descriptorSets[frameIndex],
+        .dstBinding       = 0,
+        .dstArrayElement  = 0,
+        .descriptorCount  = 1,
+        .descriptorType   = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+        .pImageInfo       = &descriptorImageInfo,
+        .pBufferInfo      = nullptr,
+        .pTexelBufferView = nullptr
+    };
 
-    for (uint32_t i = 0; i < framesInFlight; ++i) {
-        descriptorImageInfos[i].sampler     = VK_NULL_HANDLE;
-        descriptorImageInfos[i].imageView   = offscreenImageViews[i];
-        descriptorImageInfos[i].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    vkUpdateDescriptorSets(device, 1, &writeDescriptorSet, 0, nullptr);
+}
 
-        writeDescriptorSets[i].sType            = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        writeDescriptorSets[i].pNext            = nullptr;
-        writeDescriptorSets[i].dstSet           = descriptorSets[i];
-        writeDescriptorSets[i].dstBinding       = 0;
-        writeDescriptorSets[i].dstArrayElement  = 0;
-        writeDescriptorSets[i].descriptorCount  = 1;
-        writeDescriptorSets[i].descriptorType   = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-        writeDescriptorSets[i].pImageInfo       = &descriptorImageInfos[i];
-        writeDescriptorSets[i].pBufferInfo      = nullptr;
-        writeDescriptorSets[i].pTexelBufferView = nullptr;
-    }
+// Called once the frame that last used the image has completed, so nothing waits for the GPU.
+void Renderer::growOffscreenImage(Device& device, uint32_t frameIndex, VkExtent2D extent) {
+    TRACE_ZONE("Grow Off-screen Image");
 
-    vkUpdateDescriptorSets(device.logical, framesInFlight, writeDescriptorSets, 0, nullptr);
+    VkExtent2D offscreenExtent = offscreenExtents[frameIndex];
 
-    delete[] writeDescriptorSets;
-    delete[] descriptorImageInfos;
+    destroyOffscreenImage(device, frameIndex);
+    createOffscreenImage(device, frameIndex, {
+        .width  = extent.width > offscreenExtent.width ? extent.width : offscreenExtent.width,
+        .height = extent.height > offscreenExtent.height ? extent.height : offscreenExtent.height
+    });
 }
 
 void Renderer::freeSwapchainResourcesMemory() {
@@ -1280,38 +2181,36 @@ void Renderer::destroySwapchainResources(VkDevice device) {
 
 void Renderer::destroyFrameResources(VkDevice device) {
     for (uint32_t i = 0; i < framesInFlight; ++i) {
-        vkDestroyFence(device, fences[i], nullptr);
         vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
         vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
     }
 
-    delete[] fences;
     delete[] renderFinishedSemaphores;
     delete[] imageAvailableSemaphores;
 
-    vkFreeCommandBuffers(device, transientCommandPool, framesInFlight, transientCommandBuffers);
-    vkFreeCommandBuffers(device, normalCommandPool, framesInFlight, normalCommandBuffers);
+    presentCommandPools.destroy(device);
+    traceCommandPools.destroy(device);
 
-    delete[] transientCommandBuffers;
-    delete[] normalCommandBuffers;
     delete[] descriptorSets;
 
     vkDestroyDescriptorPool(device, descriptorPool, nullptr);
 }
 
 void Renderer::freeOffscreenResourcesMemory() {
+    delete[] offscreenExtents;
     delete[] offscreenImageViews;
+    delete[] offscreenImageAllocations;
     delete[] offscreenImages;
 }
 
-void Renderer::destroyOffscreenResources(VkDevice device) {
+void Renderer::destroyOffscreenResources(Device& device) {
     for (uint32_t i = 0; i < framesInFlight; ++i) {
-        vkDestroyImageView(device, offscreenImageViews[i], nullptr);
+        destroyOffscreenImage(device, i);
     }
+}
 
-    vkFreeMemory(device, offscreenImagesMemory, nullptr);
-
-    for (uint32_t i = 0; i < framesInFlight; ++i) {
-        vkDestroyImage(device, offscreenImages[i], nullptr);
-    }
+void Renderer::destroyOffscreenImage(Device& device, uint32_t frameIndex) {
+    vkDestroyImageView(device.logical, offscreenImageViews[frameIndex], nullptr);
+    vkDestroyImage(device.logical, offscreenImages[frameIndex], nullptr);
+    device.allocator.free(device.logical, offscreenImageAllocations[frameIndex]);
 }
@@ -3,7 +3,20 @@
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 
-VkInstance createInstance();
+#include <chrono>
+
+#include "command_pools.h"
+#include "frame_scheduler.h"
+#include "memory.h"
+#include "profiler.h"
+#include "resolution_scaler.h"
+
+class JobSystem;
+class ShaderModuleCache;
+class Uploader;
+struct ShaderModule;
+
+VkInstance createInstance(bool headless);
 
 class Queue {
 public:
@@ -19,15 +32,27 @@ private:
 class Device {
 public:
     VkPhysicalDevice physical;
+    VkPhysicalDeviceProperties properties;
     VkPhysicalDeviceRayTracingPipelinePropertiesKHR rtProperties;
+    bool shaderModuleIdentifiers;
+    bool presentWait;
+    bool storageImageWriteWithoutFormat;
+    bool traceRaysIndirect;
     Queue renderQueue;
+    Queue computeQueue;
+    Queue transferQueue;
     VkDevice logical;
+    Allocator allocator;
 
     Device() = default;
-    Device(VkInstance instance, VkSurfaceKHR surface);
+    Device(VkInstance instance, VkSurfaceKHR surface, const char* deviceOverride);
     void destroy();
 
-    VkSurfaceCapabilitiesKHR getSurfaceCapabilities(VkSurfaceKHR surface, GLFWwindow* window);
+    // Writes the distinct families of the render, compute and transfer queues.
+    uint32_t getQueueFamilyIndices(uint32_t* queueFamilyIndices);
+
+    VkSurfaceCapabilitiesKHR getSurfaceCapabilities(VkSurfaceKHR surface, GLFWwindow* window, uint32_t imageCount);
+    VkPresentModeKHR getPresentMode(VkSurfaceKHR surface, VkPresentModeKHR presentMode);
     VkSurfaceFormatKHR getSurfaceFormat(VkSurfaceKHR surface);
 
     uint32_t getMemoryTypeIndex(uint32_t memoryTypeBits, VkMemoryPropertyFlags memoryProperties);
@@ -37,11 +62,11 @@ void loadFunctionPointers(VkDevice device);
 
 class Buffer {
 public:
-    VkDeviceMemory memory;
+    Allocation allocation;
 
     Buffer() = default;
     Buffer(Device& device, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags memoryProperties);
-    void destroy(VkDevice device);
+    void destroy(Device& device);
 
     VkDeviceAddress getDeviceAddress(VkDevice device);
 
@@ -67,9 +92,45 @@ struct ShaderBindingTableEntry {
     const char* closestHitShader;
     const char* anyHitShader;
     const char* intersectionShader;
+    const VkSpecializationInfo* specializationInfo;
 };
 
-VkPipeline createRayTracingPipeline(VkDevice device, uint32_t entryCount, const ShaderBindingTableEntry* entries, VkPipelineLayout pipelineLayout);
+constexpr uint32_t MAX_RAY_RECURSION_DEPTH = 1;
+constexpr uint32_t MAX_RAY_PAYLOAD_SIZE = 32;
+constexpr uint32_t MAX_RAY_HIT_ATTRIBUTE_SIZE = 32;
+
+// Owns the create infos of a ray tracing pipeline, which have to outlive the (possibly deferred)
+// pipeline creation. A build either compiles shader groups, possibly into a pipeline library, or
+// links previously compiled libraries. Stages whose module is only known by its identifier make
+// the creation fail with VK_PIPELINE_COMPILE_REQUIRED if the driver has to compile them, after
+// which loadShaderModules() lets it be retried with the SPIR-V. Builds with shaders that couldn't
+// be read fail with VK_ERROR_INITIALIZATION_FAILED.
+class RayTracingPipelineBuild {
+public:
+    VkPipeline pipeline;
+
+    RayTracingPipelineBuild() = default;
+    RayTracingPipelineBuild(VkDevice device, ShaderModuleCache& shaderModuleCache, uint32_t entryCount, const ShaderBindingTableEntry* entries, VkPipelineLayout pipelineLayout, VkPipelineCreateFlags flags);
+    RayTracingPipelineBuild(uint32_t libraryCount, const VkPipeline* libraries, VkPipelineLayout pipelineLayout);
+    void destroy(VkDevice device);
+
+    VkResult create(VkDevice device, VkDeferredOperationKHR deferredOperation, VkPipelineCache pipelineCache);
+
+    bool usesShaderModuleIdentifiers();
+    void loadShaderModules(VkDevice device, ShaderModuleCache& shaderModuleCache);
+
+private:
+    uint32_t shaderCount;
+    ShaderModule* shaderModules;
+    VkPipelineShaderStageModuleIdentifierCreateInfoEXT* shaderModuleIdentifierCreateInfos;
+    VkPipelineShaderStageCreateInfo* shaderStageCreateInfos;
+    VkRayTracingShaderGroupCreateInfoKHR* shaderGroupCreateInfos;
+    uint32_t specializationInfoCount;
+    VkSpecializationInfo* specializationInfos;
+    VkPipelineLibraryCreateInfoKHR libraryInfo;
+    VkRayTracingPipelineInterfaceCreateInfoKHR interfaceInfo;
+    VkRayTracingPipelineCreateInfoKHR createInfo;
+};
 
 class ShaderBindingTable {
 public:
@@ -78,41 +139,119 @@ public:
     VkStridedDeviceAddressRegionKHR miss;
 
     ShaderBindingTable() = default;
-    ShaderBindingTable(Device& device, uint32_t entryCount, const ShaderBindingTableEntry* entries);
-    void destroy(VkDevice device);
+    ShaderBindingTable(Device& device, VkPipeline pipeline, uint32_t entryCount, const ShaderBindingTableEntry* entries, Uploader& uploader);
+    void destroy(Device& device);
 
 private:
     Buffer buffer;
 };
 
+// Without a surface the renderer is headless: it only traces into its off-screen images, which
+// can be captured to disk, and never presents. The extent is then taken from the capabilities.
+// Waiting for presents trades throughput for latency by not starting a frame before the previous
+// one is on screen, which needs VK_KHR_present_wait. Tracing straight into the swapchain images
+// saves the blit when the surface format supports storage, but then the trace isn't scaled or
+// captured. It's only chosen when the renderer is created. The TLAS that's traced against, and the
+// geometry buffer that hit and intersection shaders read their primitives' data from, have to keep
+// their handles for the lifetime of the renderer. The passes of every frame are recorded by jobs
+// on the job system, in pools that belong to its workers.
 struct RendererCreateInfo {
     VkSurfaceKHR surface;
     const VkSurfaceCapabilitiesKHR* surfaceCapabilities;
     VkSurfaceFormatKHR surfaceFormat;
+    VkPresentModeKHR presentMode;
+    bool waitForPresent;
+    bool traceToSwapchain;
+    VkAccelerationStructureKHR tlas;
+    VkBuffer geometryBuffer;
     VkRenderPass renderPass;
     uint32_t framesInFlight;
+    JobSystem* jobSystem;
 };
 
 class Renderer {
 public:
     VkDescriptorSetLayout descriptorSetLayout;
+    FrameScheduler scheduler;
+    GpuProfiler profiler;
+    ResolutionScaler resolutionScaler;
 
     Renderer() = default;
     Renderer(Device& device, const RendererCreateInfo& createInfo);
-    void destroy(VkDevice device);
+    void destroy(Device& device);
 
-    void recordCommandBuffers(VkDevice device, VkPipelineLayout pipelineLayout, VkPipeline rayTracingPipeline, const ShaderBindingTable& sbt, VkExtent2D extent);
+    void setTracePipeline(VkPipelineLayout pipelineLayout, VkPipeline rayTracingPipeline, const ShaderBindingTable& sbt);
     bool render(Device& device, VkRenderPass renderPass, VkExtent2D extent);
 
+    void setUploadDependency(VkSemaphore semaphore, uint64_t value);
+
+    void captureFrame(const char* fileName);
+    bool writeCapture(Device& device);
+
+    bool measuresPresentLatency();
+    double getPresentLatency();
+
+    bool tracesToSwapchain();
+
     void waitIdle(VkDevice device);
 
     void resize(Device& device, const RendererCreateInfo& createInfo);
     void setFramesInFlight(Device& device, const RendererCreateInfo& createInfo);
 
 private:
+    static constexpr uint32_t MAX_PENDING_PRESENT_COUNT = 8;
+    static constexpr uint32_t MAX_RETIRED_SWAPCHAIN_COUNT = 4;
+    static constexpr uint32_t OFFSCREEN_EXTENT_GRANULARITY = 256;
+
+    struct PendingPresent {
+        uint64_t id;
+        std::chrono::steady_clock::time_point time;
+    };
+
+    // Every pass is recorded into its own primary command buffer. The trace is submitted to the
+    // compute queue, and the others are submitted together to the render queue, in this order.
+    enum FramePass : uint32_t {
+        FRAME_PASS_TRACE,
+        FRAME_PASS_BLIT,
+        FRAME_PASS_GUI,
+        FRAME_PASS_COUNT
+    };
+
+    // Everything the pass jobs of a frame read, which is set up on the main thread beforehand.
+    struct FrameRecording {
+        Renderer* renderer;
+        VkDevice device;
+        VkRenderPass renderPass;
+        uint32_t imageIndex;
+        VkExtent2D extent;
+        VkExtent2D traceExtent;
+        bool capture;
+        uint32_t scopes[FRAME_PASS_COUNT];
+        VkCommandBuffer commandBuffers[FRAME_PASS_COUNT];
+    };
+
+    struct RetiredSwapchain {
+        uint64_t frame;
+        VkSwapchainKHR swapchain;
+        uint32_t imageCount;
+        VkImage* images;
+        VkImageView* imageViews;
+        VkFramebuffer* framebuffers;
+    };
+
+    bool headless;
+    bool presentWait;
+    bool waitForPresent;
+    bool traceRaysIndirect;
+    bool traceToSwapchain;
+    VkAccelerationStructureKHR tlas;
+    VkBuffer geometryBuffer;
     VkSwapchainKHR swapchain;
-    VkCommandPool normalCommandPool;
-    VkCommandPool transientCommandPool;
+    uint32_t traceQueueFamilyIndex;
+    uint32_t presentQueueFamilyIndex;
+    JobSystem* jobSystem;
+    FrameCommandPools traceCommandPools;
+    FrameCommandPools presentCommandPools;
     uint32_t swapchainImageCount;
     VkImage* swapchainImages;
     VkImageView* swapchainImageViews;
@@ -120,15 +259,30 @@ private:
     uint32_t framesInFlight;
     VkDescriptorPool descriptorPool;
     VkDescriptorSet* descriptorSets;
-    VkCommandBuffer* normalCommandBuffers;
-    VkCommandBuffer* transientCommandBuffers;
     VkSemaphore* imageAvailableSemaphores;
     VkSemaphore* renderFinishedSemaphores;
-    VkFence* fences;
     VkImage* offscreenImages;
-    VkDeviceMemory offscreenImagesMemory;
+    Allocation* offscreenImageAllocations;
     VkImageView* offscreenImageViews;
+    VkExtent2D* offscreenExtents;
+    Buffer traceSizeBuffer;
+    VkDeviceAddress traceSizeBufferAddress;
+    VkPipelineLayout pipelineLayout;
+    VkPipeline rayTracingPipeline;
+    ShaderBindingTable sbt;
+    RetiredSwapchain retiredSwapchains[MAX_RETIRED_SWAPCHAIN_COUNT];
+    uint32_t retiredSwapchainCount = 0;
     uint32_t frameIndex = 0;
+    VkSemaphore uploadSemaphore = VK_NULL_HANDLE;
+    uint64_t uploadValue = 0;
+    const char* captureFileName = nullptr;
+    uint64_t captureFrameNumber = 0;
+    VkExtent2D captureExtent;
+    Buffer captureBuffer;
+    PendingPresent pendingPresents[MAX_PENDING_PRESENT_COUNT];
+    uint32_t pendingPresentIndex = 0;
+    uint32_t pendingPresentCount = 0;
+    double presentLatency = 0.0;
 
     void createSwapchain(VkDevice device, const RendererCreateInfo& createInfo, VkSwapchainKHR oldSwapchain);
     void allocateSwapchainResourcesMemory();
@@ -136,10 +290,24 @@ private:
     void createFrameResources(VkDevice device);
     void allocateOffscreenResourcesMemory();
     void createOffscreenResources(Device& device, const RendererCreateInfo& createInfo);
+    void createOffscreenImage(Device& device, uint32_t frameIndex, VkExtent2D extent);
+    void createTraceSizeBuffer(Device& device);
+    void growOffscreenImage(Device& device, uint32_t frameIndex, VkExtent2D extent);
+    static void recordPass(void* data, uint32_t pass, uint32_t workerIndex);
+    void recordTrace(VkCommandBuffer commandBuffer, const FrameRecording& recording);
+    void recordBlit(VkCommandBuffer commandBuffer, const FrameRecording& recording);
+    void recordGui(VkCommandBuffer commandBuffer, const FrameRecording& recording);
+    void updateTraceDescriptorSet(VkDevice device, uint32_t frameIndex, VkImageView imageView);
+    void retireSwapchain(VkDevice device, VkSwapchainKHR oldSwapchain);
+    void createCapture(Device& device, VkExtent2D extent);
+    void recordCapture(VkCommandBuffer commandBuffer);
+    void updatePresentLatency(VkDevice device);
 
     void freeSwapchainResourcesMemory();
     void destroySwapchainResources(VkDevice device);
     void destroyFrameResources(VkDevice device);
     void freeOffscreenResourcesMemory();
-    void destroyOffscreenResources(VkDevice device);
+    void destroyOffscreenResources(Device& device);
+    void destroyOffscreenImage(Device& device, uint32_t frameIndex);
+    void destroyRetiredSwapchain(VkDevice device);
 };
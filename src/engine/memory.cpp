@@ -0,0 +1,364 @@
+#include "memory.h"
+
+#include <string.h>
+
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
+
+static constexpr VkDeviceSize MAX_BLOCK_SIZE = 256ull * 1024 * 1024;
+
+static VkDeviceSize alignSize(VkDeviceSize size, VkDeviceSize alignment) {
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+static void insertRange(MemoryBlock& block, uint32_t index, MemoryRange range) {
+    if (block.freeRangeCount == block.freeRangeCapacity) {
+        block.freeRangeCapacity *= 2;
+
+        MemoryRange* freeRanges = new MemoryRange[block.freeRangeCapacity];
+        memcpy(freeRanges, block.freeRanges, block.freeRangeCount * sizeof(MemoryRange));
+
+        delete[] block.freeRanges;
+        block.freeRanges = freeRanges;
+    }
+
+    memmove(&block.freeRanges[index + 1], &block.freeRanges[index], (block.freeRangeCount - index) * sizeof(MemoryRange));
+
+    block.freeRanges[index] = range;
+    ++block.freeRangeCount;
+}
+
+static void removeRange(MemoryBlock& block, uint32_t index) {
+    memmove(&block.freeRanges[index], &block.freeRanges[index + 1], (block.freeRangeCount - index - 1) * sizeof(MemoryRange));
+    --block.freeRangeCount;
+}
+
+static VkDeviceMemory allocateDeviceMemory(VkDevice device, VkDeviceSize size, uint32_t memoryTypeIndex) {
+    // Every block can back buffers that need a device address.
+    VkMemoryAllocateFlagsInfo memoryAllocateFlagsInfo = {
+        .sType      = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO,
+        .pNext      = nullptr,
+        .flags      = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT,
+        .deviceMask = 0
+    };
+
+    VkMemoryAllocateInfo memoryAllocateInfo = {
+        .sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .pNext           = &memoryAllocateFlagsInfo,
+        .allocationSize  = size,
+        .memoryTypeIndex = memoryTypeIndex
+    };
+
+    VkDeviceMemory memory;
+    vkAllocateMemory(device, &memoryAllocateInfo, nullptr, &memory);
+
+    return memory;
+}
+
+Allocator::Allocator(VkPhysicalDevice physicalDevice) : memoryTypeCacheCount(0), mutex(new std::mutex) {
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+
+    // Create one buffer pool and one image pool per memory type.
+    poolCount = 2 * memoryProperties.memoryTypeCount;
+    pools = new MemoryPool[poolCount];
+
+    for (uint32_t i = 0; i < poolCount; ++i) {
+        uint32_t memoryTypeIndex = i / 2;
+        VkDeviceSize heapSize = memoryProperties.memoryHeaps[memoryProperties.memoryTypes[memoryTypeIndex].heapIndex].size;
+
+        pools[i].memoryTypeIndex          = memoryTypeIndex;
+        pools[i].kind                     = i % 2 == 0 ? AllocationKind::BUFFER : AllocationKind::IMAGE;
+        pools[i].blockSize                = heapSize / 8 < MAX_BLOCK_SIZE ? heapSize / 8 : MAX_BLOCK_SIZE;
+        pools[i].blocks                   = nullptr;
+        pools[i].blockCount               = 0;
+        pools[i].blockCapacity            = 0;
+        pools[i].dedicatedAllocationCount = 0;
+        pools[i].dedicatedSize            = 0;
+        pools[i].usedSize                 = 0;
+    }
+}
+
+void Allocator::destroy(VkDevice device) {
+    for (uint32_t i = 0; i < poolCount; ++i) {
+        for (uint32_t j = 0; j < pools[i].blockCount; ++j) {
+            MemoryBlock& block = pools[i].blocks[j];
+
+            if (block.memory != VK_NULL_HANDLE) {
+                vkFreeMemory(device, block.memory, nullptr);
+                delete[] block.freeRanges;
+            }
+        }
+
+        delete[] pools[i].blocks;
+    }
+
+    delete[] pools;
+    delete mutex;
+}
+
+uint32_t Allocator::getMemoryTypeIndex(uint32_t memoryTypeBits, VkMemoryPropertyFlags memoryProperties) {
+    std::lock_guard<std::mutex> lock(*mutex);
+
+    for (uint32_t i = 0; i < memoryTypeCacheCount && i < ARRAY_SIZE(memoryTypeCache); ++i) {
+        const MemoryTypeCacheEntry& entry = memoryTypeCache[i];
+
+        if (entry.memoryTypeBits == memoryTypeBits && entry.memoryProperties == memoryProperties) {
+            return entry.memoryTypeIndex;
+        }
+    }
+
+    uint32_t memoryTypeIndex = UINT32_MAX;
+
+    for (uint32_t i = 0; i < this->memoryProperties.memoryTypeCount; ++i) {
+        VkMemoryType memoryType = this->memoryProperties.memoryTypes[i];
+
+        if (memoryTypeBits & (1 << i) && (memoryType.propertyFlags & memoryProperties) == memoryProperties) {
+            memoryTypeIndex = i;
+            break;
+        }
+    }
+
+    memoryTypeCache[memoryTypeCacheCount++ % ARRAY_SIZE(memoryTypeCache)] = {
+        .memoryTypeBits   = memoryTypeBits,
+        .memoryProperties = memoryProperties,
+        .memoryTypeIndex  = memoryTypeIndex
+    };
+
+    return memoryTypeIndex;
+}
+
+Allocation Allocator::allocate(VkDevice device, const VkMemoryRequirements& memoryRequirements, VkMemoryPropertyFlags memoryProperties, AllocationKind kind) {
+    uint32_t memoryTypeIndex = getMemoryTypeIndex(memoryRequirements.memoryTypeBits, memoryProperties);
+
+    Allocation allocation = {
+        .memory     = VK_NULL_HANDLE,
+        .offset     = 0,
+        .size       = memoryRequirements.size,
+        .mappedData = nullptr,
+        .poolIndex  = 2 * memoryTypeIndex + (uint32_t)kind,
+        .blockIndex = UINT32_MAX
+    };
+
+    if (memoryTypeIndex == UINT32_MAX) {
+        return allocation;
+    }
+
+    bool hostVisible = this->memoryProperties.memoryTypes[memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+
+    std::lock_guard<std::mutex> lock(*mutex);
+
+    MemoryPool& pool = pools[allocation.poolIndex];
+    pool.usedSize += memoryRequirements.size;
+
+    // Resources larger than half a block get their own allocation.
+    if (memoryRequirements.size > pool.blockSize / 2) {
+        allocation.memory = allocateDeviceMemory(device, memoryRequirements.size, memoryTypeIndex);
+
+        if (hostVisible) {
+            vkMapMemory(device, allocation.memory, 0, VK_WHOLE_SIZE, 0, &allocation.mappedData);
+        }
+
+        ++pool.dedicatedAllocationCount;
+        pool.dedicatedSize += memoryRequirements.size;
+
+        return allocation;
+    }
+
+    // Sub-allocate from the first block with a large enough free range.
+    for (uint32_t i = 0; i < pool.blockCount; ++i) {
+        MemoryBlock& block = pool.blocks[i];
+
+        if (block.memory != VK_NULL_HANDLE && allocateFromBlock(block, memoryRequirements.size, memoryRequirements.alignment, allocation.offset)) {
+            allocation.blockIndex = i;
+            break;
+        }
+    }
+
+    if (allocation.blockIndex == UINT32_MAX) {
+        allocation.blockIndex = createBlock(device, pool);
+        allocateFromBlock(pool.blocks[allocation.blockIndex], memoryRequirements.size, memoryRequirements.alignment, allocation.offset);
+    }
+
+    MemoryBlock& block = pool.blocks[allocation.blockIndex];
+    ++block.allocationCount;
+
+    allocation.memory = block.memory;
+
+    if (block.mappedData != nullptr) {
+        allocation.mappedData = (char*)block.mappedData + allocation.offset;
+    }
+
+    return allocation;
+}
+
+void Allocator::free(VkDevice device, const Allocation& allocation) {
+    if (allocation.memory == VK_NULL_HANDLE) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(*mutex);
+
+    MemoryPool& pool = pools[allocation.poolIndex];
+    pool.usedSize -= allocation.size;
+
+    if (allocation.blockIndex == UINT32_MAX) {
+        vkFreeMemory(device, allocation.memory, nullptr);
+
+        --pool.dedicatedAllocationCount;
+        pool.dedicatedSize -= allocation.size;
+
+        return;
+    }
+
+    MemoryBlock& block = pool.blocks[allocation.blockIndex];
+
+    // Return the range to the sorted free list and merge it with its neighbours.
+    uint32_t index = 0;
+
+    while (index < block.freeRangeCount && block.freeRanges[index].offset < allocation.offset) {
+        ++index;
+    }
+
+    insertRange(block, index, { allocation.offset, allocation.size });
+
+    if (index + 1 < block.freeRangeCount && block.freeRanges[index].offset + block.freeRanges[index].size == block.freeRanges[index + 1].offset) {
+        block.freeRanges[index].size += block.freeRanges[index + 1].size;
+        removeRange(block, index + 1);
+    }
+
+    if (index > 0 && block.freeRanges[index - 1].offset + block.freeRanges[index - 1].size == block.freeRanges[index].offset) {
+        block.freeRanges[index - 1].size += block.freeRanges[index].size;
+        removeRange(block, index);
+    }
+
+    --block.allocationCount;
+
+    // Release empty blocks, but keep one around so that streaming doesn't thrash the driver.
+    if (block.allocationCount == 0) {
+        uint32_t liveBlockCount = 0;
+
+        for (uint32_t i = 0; i < pool.blockCount; ++i) {
+            if (pool.blocks[i].memory != VK_NULL_HANDLE) {
+                ++liveBlockCount;
+            }
+        }
+
+        if (liveBlockCount > 1) {
+            vkFreeMemory(device, block.memory, nullptr);
+            delete[] block.freeRanges;
+
+            block.memory = VK_NULL_HANDLE;
+        }
+    }
+}
+
+uint32_t Allocator::getPoolCount() {
+    return poolCount;
+}
+
+MemoryPoolStatistics Allocator::getPoolStatistics(uint32_t poolIndex) {
+    std::lock_guard<std::mutex> lock(*mutex);
+
+    const MemoryPool& pool = pools[poolIndex];
+
+    MemoryPoolStatistics statistics = {
+        .memoryTypeIndex          = pool.memoryTypeIndex,
+        .kind                     = pool.kind,
+        .blockCount               = 0,
+        .allocationCount          = pool.dedicatedAllocationCount,
+        .dedicatedAllocationCount = pool.dedicatedAllocationCount,
+        .reservedSize             = pool.dedicatedSize,
+        .usedSize                 = pool.usedSize
+    };
+
+    for (uint32_t i = 0; i < pool.blockCount; ++i) {
+        if (pool.blocks[i].memory != VK_NULL_HANDLE) {
+            ++statistics.blockCount;
+            statistics.allocationCount += pool.blocks[i].allocationCount;
+            statistics.reservedSize += pool.blocks[i].size;
+        }
+    }
+
+    return statistics;
+}
+
+bool Allocator::allocateFromBlock(MemoryBlock& block, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset) {
+    for (uint32_t i = 0; i < block.freeRangeCount; ++i) {
+        MemoryRange range = block.freeRanges[i];
+
+        VkDeviceSize alignedOffset = alignSize(range.offset, alignment);
+        VkDeviceSize padding = alignedOffset - range.offset;
+
+        if (padding + size > range.size) {
+            continue;
+        }
+
+        VkDeviceSize tailOffset = alignedOffset + size;
+        VkDeviceSize tailSize = range.offset + range.size - tailOffset;
+
+        // Keep the alignment padding and the tail as free ranges.
+        if (padding == 0 && tailSize == 0) {
+            removeRange(block, i);
+        }
+        else if (padding == 0) {
+            block.freeRanges[i] = { tailOffset, tailSize };
+        }
+        else {
+            block.freeRanges[i].size = padding;
+
+            if (tailSize != 0) {
+                insertRange(block, i + 1, { tailOffset, tailSize });
+            }
+        }
+
+        offset = alignedOffset;
+
+        return true;
+    }
+
+    return false;
+}
+
+uint32_t Allocator::createBlock(VkDevice device, MemoryPool& pool) {
+    // Reuse the slot of a released block so that block indices stay stable.
+    uint32_t blockIndex = 0;
+
+    while (blockIndex < pool.blockCount && pool.blocks[blockIndex].memory != VK_NULL_HANDLE) {
+        ++blockIndex;
+    }
+
+    if (blockIndex == pool.blockCapacity) {
+        pool.blockCapacity = pool.blockCapacity != 0 ? 2 * pool.blockCapacity : 4;
+
+        MemoryBlock* blocks = new MemoryBlock[pool.blockCapacity];
+
+        if (pool.blocks != nullptr) {
+            memcpy(blocks, pool.blocks, pool.blockCount * sizeof(MemoryBlock));
+        }
+
+        delete[] pool.blocks;
+        pool.blocks = blocks;
+    }
+
+    if (blockIndex == pool.blockCount) {
+        ++pool.blockCount;
+    }
+
+    MemoryBlock& block = pool.blocks[blockIndex];
+
+    block.memory            = allocateDeviceMemory(device, pool.blockSize, pool.memoryTypeIndex);
+    block.size              = pool.blockSize;
+    block.mappedData        = nullptr;
+    block.freeRanges        = new MemoryRange[8];
+    block.freeRangeCount    = 1;
+    block.freeRangeCapacity = 8;
+    block.allocationCount   = 0;
+
+    block.freeRanges[0] = { 0, pool.blockSize };
+
+    // Host visible blocks stay persistently mapped.
+    if (memoryProperties.memoryTypes[pool.memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        vkMapMemory(device, block.memory, 0, VK_WHOLE_SIZE, 0, &block.mappedData);
+    }
+
+    return blockIndex;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <mutex>
+
+// Buffers and optimally tiled images are kept in separate pools so that no block ever has
+// to respect bufferImageGranularity between neighbouring sub-allocations.
+enum class AllocationKind {
+    BUFFER,
+    IMAGE
+};
+
+struct Allocation {
+    VkDeviceMemory memory;
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    void* mappedData;
+    uint32_t poolIndex;
+    uint32_t blockIndex;
+};
+
+struct MemoryPoolStatistics {
+    uint32_t memoryTypeIndex;
+    AllocationKind kind;
+    uint32_t blockCount;
+    uint32_t allocationCount;
+    uint32_t dedicatedAllocationCount;
+    VkDeviceSize reservedSize;
+    VkDeviceSize usedSize;
+};
+
+struct MemoryRange {
+    VkDeviceSize offset;
+    VkDeviceSize size;
+};
+
+struct MemoryBlock {
+    VkDeviceMemory memory;
+    VkDeviceSize size;
+    void* mappedData;
+    MemoryRange* freeRanges;
+    uint32_t freeRangeCount;
+    uint32_t freeRangeCapacity;
+    uint32_t allocationCount;
+};
+
+struct MemoryPool {
+    uint32_t memoryTypeIndex;
+    AllocationKind kind;
+    VkDeviceSize blockSize;
+    MemoryBlock* blocks;
+    uint32_t blockCount;
+    uint32_t blockCapacity;
+    uint32_t dedicatedAllocationCount;
+    VkDeviceSize dedicatedSize;
+    VkDeviceSize usedSize;
+};
+
+class Allocator {
+public:
+    Allocator() = default;
+    Allocator(VkPhysicalDevice physicalDevice);
+    void destroy(VkDevice device);
+
+    uint32_t getMemoryTypeIndex(uint32_t memoryTypeBits, VkMemoryPropertyFlags memoryProperties);
+
+    Allocation allocate(VkDevice device, const VkMemoryRequirements& memoryRequirements, VkMemoryPropertyFlags memoryProperties, AllocationKind kind);
+    void free(VkDevice device, const Allocation& allocation);
+
+    uint32_t getPoolCount();
+    MemoryPoolStatistics getPoolStatistics(uint32_t poolIndex);
+
+private:
+    struct MemoryTypeCacheEntry {
+        uint32_t memoryTypeBits;
+        VkMemoryPropertyFlags memoryProperties;
+        uint32_t memoryTypeIndex;
+    };
+
+    VkPhysicalDeviceMemoryProperties memoryProperties;
+    MemoryTypeCacheEntry memoryTypeCache[16];
+    uint32_t memoryTypeCacheCount;
+    uint32_t poolCount;
+    MemoryPool* pools;
+    std::mutex* mutex;
+
+    bool allocateFromBlock(MemoryBlock& block, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset);
+    uint32_t createBlock(VkDevice device, MemoryPool& pool);
+};
@@ -0,0 +1,126 @@
+#include "pipeline_cache.h"
+
+#include <string.h>
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+static constexpr uint32_t PIPELINE_CACHE_MAGIC = 0x43505856; // "VXPC"
+
+static uint64_t hashBytes(const char* data, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ (uint8_t)data[i]) * 1099511628211ull;
+    }
+
+    return hash;
+}
+
+PipelineCache::PipelineCache(Device& device, const char* fileName) : warm(false), fileName(fileName) {
+    // Get the properties that identify the device and driver.
+    VkPhysicalDeviceIDProperties idProperties = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES,
+        .pNext = nullptr
+    };
+
+    VkPhysicalDeviceProperties2 physicalDeviceProperties = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+        .pNext = &idProperties
+    };
+
+    vkGetPhysicalDeviceProperties2(device.physical, &physicalDeviceProperties);
+
+    const VkPhysicalDeviceProperties& properties = physicalDeviceProperties.properties;
+
+    memset(&header, 0, sizeof(header));
+    header.magic         = PIPELINE_CACHE_MAGIC;
+    header.vendorID      = properties.vendorID;
+    header.deviceID      = properties.deviceID;
+    header.driverVersion = properties.driverVersion;
+
+    memcpy(header.deviceUUID, idProperties.deviceUUID, VK_UUID_SIZE);
+    memcpy(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
+
+    // Load the cache file if it matches this device and driver. The data has to fill the rest of
+    // the file exactly, so that a corrupted size can't make it allocate any amount of memory.
+    char* data = nullptr;
+    size_t dataSize = 0;
+
+    std::error_code error;
+    uintmax_t fileSize = std::filesystem::file_size(fileName, error);
+
+    std::ifstream file(fileName, std::ios::binary);
+    PipelineCacheFileHeader fileHeader;
+
+    if (!error &&
+        file.read((char*)&fileHeader, sizeof(fileHeader)) &&
+        fileHeader.dataSize == fileSize - sizeof(fileHeader) &&
+        fileHeader.magic == header.magic &&
+        fileHeader.vendorID == header.vendorID &&
+        fileHeader.deviceID == header.deviceID &&
+        fileHeader.driverVersion == header.driverVersion &&
+        memcmp(fileHeader.deviceUUID, header.deviceUUID, VK_UUID_SIZE) == 0 &&
+        memcmp(fileHeader.pipelineCacheUUID, header.pipelineCacheUUID, VK_UUID_SIZE) == 0) {
+        data = new char[fileHeader.dataSize];
+
+        if (file.read(data, fileHeader.dataSize) && hashBytes(data, fileHeader.dataSize) == fileHeader.checksum) {
+            dataSize = fileHeader.dataSize;
+            warm = true;
+        }
+    }
+
+    file.close();
+
+    // Create the pipeline cache.
+    VkPipelineCacheCreateInfo pipelineCacheCreateInfo = {
+        .sType           = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+        .pNext           = nullptr,
+        .flags           = 0,
+        .initialDataSize = dataSize,
+        .pInitialData    = data
+    };
+
+    vkCreatePipelineCache(device.logical, &pipelineCacheCreateInfo, nullptr, &cache);
+
+    delete[] data;
+}
+
+void PipelineCache::save(Device& device) {
+    size_t dataSize;
+    vkGetPipelineCacheData(device.logical, cache, &dataSize, nullptr);
+
+    char* data = new char[dataSize];
+    vkGetPipelineCacheData(device.logical, cache, &dataSize, data);
+
+    header.dataSize = dataSize;
+    header.checksum = hashBytes(data, dataSize);
+
+    // Write to a temporary file and move it over the old one.
+    std::string temporaryFileName = std::string(fileName) + ".tmp";
+
+    std::ofstream file(temporaryFileName, std::ios::binary | std::ios::trunc);
+    file.write((const char*)&header, sizeof(header));
+    file.write(data, dataSize);
+    file.close();
+
+    delete[] data;
+
+    std::error_code error;
+
+    if (file) {
+        std::filesystem::rename(temporaryFileName, fileName, error);
+    }
+    else {
+        std::filesystem::remove(temporaryFileName, error);
+    }
+}
+
+void PipelineCache::destroy(VkDevice device) {
+    vkDestroyPipelineCache(device, cache, nullptr);
+}
+
+PipelineCache::operator VkPipelineCache() {
+    return cache;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "graphics.h"
+
+struct PipelineCacheFileHeader {
+    uint32_t magic;
+    uint32_t vendorID;
+    uint32_t deviceID;
+    uint32_t driverVersion;
+    uint8_t deviceUUID[VK_UUID_SIZE];
+    uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+    uint64_t dataSize;
+    uint64_t checksum;
+};
+
+// A VkPipelineCache backed by a file. The file is only used if it was written by the same
+// device and driver, and it is replaced atomically so that a crash never leaves it truncated.
+class PipelineCache {
+public:
+    bool warm;
+
+    PipelineCache() = default;
+    PipelineCache(Device& device, const char* fileName);
+    void save(Device& device);
+    void destroy(VkDevice device);
+
+    operator VkPipelineCache();
+
+private:
+    VkPipelineCache cache;
+    const char* fileName;
+    PipelineCacheFileHeader header;
+};
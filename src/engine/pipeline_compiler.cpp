@@ -0,0 +1,394 @@
+#include "pipeline_compiler.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <thread>
+
+#include <trace.h>
+
+static PFN_vkCreateDeferredOperationKHR vkCreateDeferredOperation;
+static PFN_vkDestroyDeferredOperationKHR vkDestroyDeferredOperation;
+static PFN_vkGetDeferredOperationMaxConcurrencyKHR vkGetDeferredOperationMaxConcurrency;
+static PFN_vkGetDeferredOperationResultKHR vkGetDeferredOperationResult;
+static PFN_vkDeferredOperationJoinKHR vkDeferredOperationJoin;
+
+static uint64_t hashBytes(uint64_t hash, const void* data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ ((const uint8_t*)data)[i]) * 1099511628211ull;
+    }
+
+    return hash;
+}
+
+static uint64_t hashSpecializationInfo(uint64_t hash, const VkSpecializationInfo* specializationInfo) {
+    if (specializationInfo == nullptr) {
+        return hash;
+    }
+
+    hash = hashBytes(hash, specializationInfo->pMapEntries, specializationInfo->mapEntryCount * sizeof(VkSpecializationMapEntry));
+    hash = hashBytes(hash, specializationInfo->pData, specializationInfo->dataSize);
+
+    return hash;
+}
+
+// Shaders are identified by their code rather than their file names, so that an edited shader
+// gets a new library and an unchanged one keeps its library across reloads.
+static uint64_t hashShader(uint64_t hash, PipelineCompilerState* state, const char* fileName) {
+    uint64_t contentHash = fileName != nullptr ? state->shaderModuleCache->getShaderModule(state->device, fileName).contentHash : 0;
+    return hashBytes(hash, &contentHash, sizeof(contentHash));
+}
+
+// Libraries can only be linked with the layout they were compiled with.
+static uint64_t getLibraryKey(PipelineCompilerState* state, const ShaderBindingTableEntry& entry, VkPipelineLayout pipelineLayout) {
+    uint64_t hash = 14695981039346656037ull;
+
+    hash = hashBytes(hash, &pipelineLayout, sizeof(pipelineLayout));
+    hash = (hash ^ (uint64_t)entry.stage) * 1099511628211ull;
+    hash = hashShader(hash, state, entry.generalShader);
+    hash = hashShader(hash, state, entry.closestHitShader);
+    hash = hashShader(hash, state, entry.anyHitShader);
+    hash = hashShader(hash, state, entry.intersectionShader);
+    hash = hashSpecializationInfo(hash, entry.specializationInfo);
+
+    return hash;
+}
+
+uint64_t getSpecializationKey(uint32_t entryCount, const ShaderBindingTableEntry* entries) {
+    uint64_t hash = 14695981039346656037ull;
+
+    for (uint32_t i = 0; i < entryCount; ++i) {
+        hash = hashSpecializationInfo((hash ^ i) * 1099511628211ull, entries[i].specializationInfo);
+    }
+
+    return hash;
+}
+
+static VkPipeline findLibrary(PipelineCompilerState* state, uint64_t key) {
+    for (uint32_t i = 0; i < state->libraryCount; ++i) {
+        if (state->libraries[i].key == key) {
+            return state->libraries[i].pipeline;
+        }
+    }
+
+    return VK_NULL_HANDLE;
+}
+
+static void insertLibrary(PipelineCompilerState* state, uint64_t key, VkPipeline pipeline) {
+    if (state->libraryCount == state->libraryCapacity) {
+        state->libraryCapacity *= 2;
+
+        PipelineLibrary* libraries = new PipelineLibrary[state->libraryCapacity];
+        memcpy(libraries, state->libraries, state->libraryCount * sizeof(PipelineLibrary));
+
+        delete[] state->libraries;
+        state->libraries = libraries;
+    }
+
+    state->libraries[state->libraryCount++] = { key, pipeline };
+}
+
+static PipelineCompilation* createCompilation(PipelineCompilerState* state, VkPipelineCache pipelineCache) {
+    PipelineCompilation* compilation = new PipelineCompilation;
+
+    compilation->state                  = state;
+    compilation->pipelineCache          = pipelineCache;
+    compilation->result                 = VK_NOT_READY;
+    compilation->complete               = false;
+    compilation->joinJobCount           = 0;
+    compilation->joinJobs               = new Job[state->jobSystem->getWorkerCount()];
+    compilation->parent                 = nullptr;
+    compilation->libraryIndex           = 0;
+    compilation->libraryKey             = 0;
+    compilation->pipelineLayout         = VK_NULL_HANDLE;
+    compilation->libraryCount           = 0;
+    compilation->libraries              = nullptr;
+    compilation->dependencyCount        = 0;
+    compilation->dependencies           = nullptr;
+    compilation->pendingDependencyCount = 0;
+
+    vkCreateDeferredOperation(state->device, nullptr, &compilation->deferredOperation);
+
+    // Released once the compilation completes.
+    state->jobSystem->hold(compilation->counter);
+
+    return compilation;
+}
+
+static void destroyCompilation(VkDevice device, PipelineCompilation* compilation) {
+    vkDestroyDeferredOperation(device, compilation->deferredOperation, nullptr);
+    compilation->build.destroy(device);
+
+    delete[] compilation->dependencies;
+    delete[] compilation->libraries;
+    delete[] compilation->joinJobs;
+    delete compilation;
+}
+
+static void startCompilation(PipelineCompilerState* state, PipelineCompilation* compilation);
+
+// Called with the state mutex locked.
+static void completeCompilation(PipelineCompilerState* state, std::unique_lock<std::mutex>& lock, PipelineCompilation* compilation, VkResult result) {
+    if (result == VK_PIPELINE_COMPILE_REQUIRED && compilation->build.usesShaderModuleIdentifiers()) {
+        // The driver didn't find the pipeline in its cache, so compile it from the SPIR-V.
+        lock.unlock();
+        compilation->build.loadShaderModules(state->device, *state->shaderModuleCache);
+        startCompilation(state, compilation);
+        lock.lock();
+        return;
+    }
+
+    compilation->result = result;
+    compilation->complete = true;
+
+    PipelineCompilation* parent = compilation->parent;
+
+    if (parent != nullptr) {
+        parent->libraries[compilation->libraryIndex] = compilation->build.pipeline;
+
+        if (result != VK_SUCCESS) {
+            parent->result = result;
+        }
+
+        // The last library to finish starts the link.
+        if (--parent->pendingDependencyCount == 0) {
+            lock.unlock();
+            startCompilation(state, parent);
+            lock.lock();
+        }
+    }
+
+    state->jobSystem->release(compilation->counter);
+}
+
+// Joins the deferred operation until it has no more work for this thread. The last join job to
+// return completes the compilation, so that no job is still joining when it's started again.
+static void joinCompilation(void* data, uint32_t, uint32_t) {
+    PipelineCompilation* compilation = (PipelineCompilation*)data;
+    PipelineCompilerState* state = compilation->state;
+
+    {
+        TRACE_ZONE("Join Pipeline Compilation");
+
+        // An idle thread may get more work once the other threads make progress.
+        while (vkDeferredOperationJoin(state->device, compilation->deferredOperation) == VK_THREAD_IDLE_KHR) {
+            std::this_thread::yield();
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+
+    if (--compilation->joinJobCount > 0) {
+        return;
+    }
+
+    lock.unlock();
+
+    // With every other job gone, any work that's left is this thread's to do.
+    VkResult result;
+
+    while ((result = vkGetDeferredOperationResult(state->device, compilation->deferredOperation)) == VK_NOT_READY) {
+        vkDeferredOperationJoin(state->device, compilation->deferredOperation);
+    }
+
+    lock.lock();
+    completeCompilation(state, lock, compilation, result);
+}
+
+// Called without the state mutex locked.
+static void startCompilation(PipelineCompilerState* state, PipelineCompilation* compilation) {
+    TRACE_ZONE("Start Pipeline Compilation");
+
+    VkResult result = compilation->result;
+
+    if (result == VK_NOT_READY) {
+        if (compilation->libraries != nullptr) {
+            compilation->build = RayTracingPipelineBuild(compilation->libraryCount, compilation->libraries, compilation->pipelineLayout);
+        }
+
+        result = compilation->build.create(state->device, compilation->deferredOperation, compilation->pipelineCache);
+    }
+
+    if (result == VK_OPERATION_DEFERRED_KHR) {
+        // Join the operation on as many worker threads as it can use. The joins are background
+        // jobs, so that the main thread never ends up joining a whole compilation while it waits
+        // for the passes of a frame.
+        uint32_t workerThreadCount = std::max(state->jobSystem->getWorkerCount() - 1, 1u);
+        uint32_t joinJobCount = std::clamp(vkGetDeferredOperationMaxConcurrency(state->device, compilation->deferredOperation), 1u, workerThreadCount);
+
+        compilation->joinJobCount = joinJobCount;
+
+        for (uint32_t i = 0; i < joinJobCount; ++i) {
+            compilation->joinJobs[i] = { .function = joinCompilation, .data = compilation, .index = i, .mainThread = false, .background = true };
+        }
+
+        state->jobSystem->submit(joinJobCount, compilation->joinJobs, compilation->counter);
+        return;
+    }
+
+    if (result == VK_OPERATION_NOT_DEFERRED_KHR) {
+        result = vkGetDeferredOperationResult(state->device, compilation->deferredOperation);
+    }
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    completeCompilation(state, lock, compilation, result);
+}
+
+PipelineCompiler::PipelineCompiler(VkDevice device, ShaderModuleCache& shaderModuleCache, JobSystem& jobSystem) : state(new PipelineCompilerState) {
+    vkCreateDeferredOperation = (PFN_vkCreateDeferredOperationKHR)vkGetDeviceProcAddr(device, "vkCreateDeferredOperationKHR");
+    vkDestroyDeferredOperation = (PFN_vkDestroyDeferredOperationKHR)vkGetDeviceProcAddr(device, "vkDestroyDeferredOperationKHR");
+    vkGetDeferredOperationMaxConcurrency = (PFN_vkGetDeferredOperationMaxConcurrencyKHR)vkGetDeviceProcAddr(device, "vkGetDeferredOperationMaxConcurrencyKHR");
+    vkGetDeferredOperationResult = (PFN_vkGetDeferredOperationResultKHR)vkGetDeviceProcAddr(device, "vkGetDeferredOperationResultKHR");
+    vkDeferredOperationJoin = (PFN_vkDeferredOperationJoinKHR)vkGetDeviceProcAddr(device, "vkDeferredOperationJoinKHR");
+
+    state->device            = device;
+    state->shaderModuleCache = &shaderModuleCache;
+    state->jobSystem         = &jobSystem;
+    state->libraries         = new PipelineLibrary[16];
+    state->libraryCount      = 0;
+    state->libraryCapacity   = 16;
+}
+
+void PipelineCompiler::destroy() {
+    for (uint32_t i = 0; i < state->libraryCount; ++i) {
+        vkDestroyPipeline(state->device, state->libraries[i].pipeline, nullptr);
+    }
+
+    delete[] state->libraries;
+    delete state;
+}
+
+PipelineCompilation* PipelineCompiler::compile(VkDevice device, VkPipelineCache pipelineCache, uint32_t entryCount, const ShaderBindingTableEntry* entries, VkPipelineLayout pipelineLayout) {
+    PipelineCompilation* link = createCompilation(state, pipelineCache);
+
+    link->build          = RayTracingPipelineBuild(0, nullptr, pipelineLayout);
+    link->pipelineLayout = pipelineLayout;
+    link->libraryCount   = entryCount;
+    link->libraries      = new VkPipeline[entryCount];
+    link->dependencies   = new PipelineCompilation*[entryCount];
+
+    // Hold the link back until every missing library has been started.
+    link->pendingDependencyCount = 1;
+
+    for (uint32_t i = 0; i < entryCount; ++i) {
+        uint64_t key = getLibraryKey(state, entries[i], pipelineLayout);
+
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+
+            link->libraries[i] = findLibrary(state, key);
+
+            if (link->libraries[i] != VK_NULL_HANDLE) {
+                continue;
+            }
+
+            ++link->pendingDependencyCount;
+        }
+
+        // Compile the missing shader group into a library.
+        PipelineCompilation* library = createCompilation(state, pipelineCache);
+
+        library->build        = RayTracingPipelineBuild(device, *state->shaderModuleCache, 1, &entries[i], pipelineLayout, VK_PIPELINE_CREATE_LIBRARY_BIT_KHR);
+        library->parent       = link;
+        library->libraryIndex = i;
+        library->libraryKey   = key;
+
+        link->dependencies[link->dependencyCount++] = library;
+
+        startCompilation(state, library);
+    }
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+
+    if (--link->pendingDependencyCount == 0) {
+        lock.unlock();
+        startCompilation(state, link);
+    }
+
+    return link;
+}
+
+bool PipelineCompiler::isComplete(PipelineCompilation* compilation) {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    return compilation->complete;
+}
+
+VkPipeline PipelineCompiler::finish(VkDevice device, PipelineCompilation* compilation) {
+    TRACE_ZONE("Finish Pipeline Compilation");
+
+    // Run jobs instead of just blocking, until the compilation and its libraries are complete and
+    // none of their jobs is left.
+    state->jobSystem->wait(compilation->counter);
+
+    for (uint32_t i = 0; i < compilation->dependencyCount; ++i) {
+        state->jobSystem->wait(compilation->dependencies[i]->counter);
+    }
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+
+    // Keep the new libraries for later links.
+    for (uint32_t i = 0; i < compilation->dependencyCount; ++i) {
+        PipelineCompilation* library = compilation->dependencies[i];
+
+        if (library->result == VK_SUCCESS) {
+            if (findLibrary(state, library->libraryKey) == VK_NULL_HANDLE) {
+                insertLibrary(state, library->libraryKey, library->build.pipeline);
+            }
+            else {
+                vkDestroyPipeline(device, library->build.pipeline, nullptr);
+            }
+        }
+
+        destroyCompilation(device, library);
+    }
+
+    lock.unlock();
+
+    VkPipeline pipeline = compilation->result == VK_SUCCESS ? compilation->build.pipeline : VK_NULL_HANDLE;
+
+    destroyCompilation(device, compilation);
+
+    return pipeline;
+}
+
+PipelineVariantCache::PipelineVariantCache(uint32_t capacity) : variantCount(0), variantCapacity(capacity), variants(new PipelineVariant[capacity]) {}
+
+void PipelineVariantCache::destroy(Device& device) {
+    clear(device);
+    delete[] variants;
+}
+
+PipelineVariant* PipelineVariantCache::find(uint64_t key) {
+    for (uint32_t i = 0; i < variantCount; ++i) {
+        if (variants[i].key == key) {
+            return &variants[i];
+        }
+    }
+
+    return nullptr;
+}
+
+PipelineVariant* PipelineVariantCache::insert(uint64_t key, VkPipeline pipeline, const ShaderBindingTable& sbt) {
+    if (variantCount == variantCapacity) {
+        variantCapacity *= 2;
+
+        PipelineVariant* newVariants = new PipelineVariant[variantCapacity];
+        memcpy(newVariants, variants, variantCount * sizeof(PipelineVariant));
+
+        delete[] variants;
+        variants = newVariants;
+    }
+
+    variants[variantCount] = { key, pipeline, sbt };
+
+    return &variants[variantCount++];
+}
+
+void PipelineVariantCache::clear(Device& device) {
+    for (uint32_t i = 0; i < variantCount; ++i) {
+        vkDestroyPipeline(device.logical, variants[i].pipeline, nullptr);
+        variants[i].sbt.destroy(device);
+    }
+
+    variantCount = 0;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "graphics.h"
+#include "shader_cache.h"
+
+#include <mutex>
+
+#include <job_system.h>
+
+struct PipelineCompilerState;
+
+// The counter is held until the compilation completes, and also counts the jobs that join its
+// deferred operation.
+struct PipelineCompilation {
+    PipelineCompilerState* state;
+    RayTracingPipelineBuild build;
+    VkDeferredOperationKHR deferredOperation;
+    VkPipelineCache pipelineCache;
+    VkResult result;
+    bool complete;
+    uint32_t joinJobCount;
+    Job* joinJobs;
+    JobCounter counter;
+
+    // A library compilation feeds one library of its parent link.
+    PipelineCompilation* parent;
+    uint32_t libraryIndex;
+    uint64_t libraryKey;
+
+    // A link compilation starts once all of its libraries have been compiled.
+    VkPipelineLayout pipelineLayout;
+    uint32_t libraryCount;
+    VkPipeline* libraries;
+    uint32_t dependencyCount;
+    PipelineCompilation** dependencies;
+    uint32_t pendingDependencyCount;
+};
+
+struct PipelineLibrary {
+    uint64_t key;
+    VkPipeline pipeline;
+};
+
+struct PipelineVariant {
+    uint64_t key;
+    VkPipeline pipeline;
+    ShaderBindingTable sbt;
+};
+
+struct PipelineCompilerState {
+    VkDevice device;
+    ShaderModuleCache* shaderModuleCache;
+    JobSystem* jobSystem;
+    std::mutex mutex;
+    PipelineLibrary* libraries;
+    uint32_t libraryCount;
+    uint32_t libraryCapacity;
+};
+
+uint64_t getSpecializationKey(uint32_t entryCount, const ShaderBindingTableEntry* entries);
+
+// Creates ray tracing pipelines through deferred host operations that are joined by jobs on the
+// job system, so that several pipelines can compile while frames keep being presented.
+// Every shader group is compiled once into a pipeline library and the final pipelines are
+// linked from the cached libraries, so adding a group only costs one small compile. Libraries
+// are kept until the compiler is destroyed, so that reloads only compile edited shaders.
+class PipelineCompiler {
+public:
+    PipelineCompiler() = default;
+    PipelineCompiler(VkDevice device, ShaderModuleCache& shaderModuleCache, JobSystem& jobSystem);
+    void destroy();
+
+    PipelineCompilation* compile(VkDevice device, VkPipelineCache pipelineCache, uint32_t entryCount, const ShaderBindingTableEntry* entries, VkPipelineLayout pipelineLayout);
+    bool isComplete(PipelineCompilation* compilation);
+    VkPipeline finish(VkDevice device, PipelineCompilation* compilation);
+
+private:
+    PipelineCompilerState* state;
+};
+
+// Compiled pipelines and their shader binding tables keyed by their specialization constants,
+// so that switching back to a variant that was already built is a lookup. Returned pointers
+// are invalidated by the next insert.
+class PipelineVariantCache {
+public:
+    PipelineVariantCache() = default;
+    PipelineVariantCache(uint32_t capacity);
+    void destroy(Device& device);
+
+    PipelineVariant* find(uint64_t key);
+    PipelineVariant* insert(uint64_t key, VkPipeline pipeline, const ShaderBindingTable& sbt);
+    void clear(Device& device);
+
+private:
+    uint32_t variantCount;
+    uint32_t variantCapacity;
+    PipelineVariant* variants;
+};
@@ -0,0 +1,232 @@
+#include "profiler.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+
+#include "graphics.h"
+
+GpuProfiler::GpuProfiler(Device& device, uint32_t framesInFlight) : framesInFlight(framesInFlight), scopeCount(0), historyCount(0), historyIndex(0) {
+    // The trace and the blit run on different queues, which both have to support timestamps.
+    uint32_t queueFamilyPropertyCount;
+    vkGetPhysicalDeviceQueueFamilyProperties(device.physical, &queueFamilyPropertyCount, nullptr);
+
+    VkQueueFamilyProperties* queueFamilyProperties = new VkQueueFamilyProperties[queueFamilyPropertyCount];
+    vkGetPhysicalDeviceQueueFamilyProperties(device.physical, &queueFamilyPropertyCount, queueFamilyProperties);
+
+    uint32_t renderValidBits = queueFamilyProperties[device.renderQueue.familyIndex].timestampValidBits;
+    uint32_t computeValidBits = queueFamilyProperties[device.computeQueue.familyIndex].timestampValidBits;
+
+    delete[] queueFamilyProperties;
+
+    uint32_t validBits = std::min(renderValidBits, computeValidBits);
+
+    supported = validBits != 0 && device.properties.limits.timestampPeriod != 0.0f;
+    timestampPeriod = device.properties.limits.timestampPeriod;
+    timestampMask = validBits < 64 ? (1ull << validBits) - 1 : UINT64_MAX;
+
+    history = new GpuFrameTimings[GPU_PROFILER_HISTORY_SIZE];
+
+    createQueryPool(device.logical);
+}
+
+void GpuProfiler::destroy(VkDevice device) {
+    vkDestroyQueryPool(device, queryPool, nullptr);
+
+    delete[] history;
+    delete[] frames;
+}
+
+void GpuProfiler::setFramesInFlight(VkDevice device, uint32_t framesInFlight) {
+    vkDestroyQueryPool(device, queryPool, nullptr);
+    delete[] frames;
+
+    this->framesInFlight = framesInFlight;
+
+    createQueryPool(device);
+}
+
+uint32_t GpuProfiler::getScope(const char* label) {
+    for (uint32_t i = 0; i < scopeCount; ++i) {
+        if (strcmp(scopeLabels[i], label) == 0) {
+            return i;
+        }
+    }
+
+    if (scopeCount == MAX_GPU_SCOPE_COUNT) {
+        return UINT32_MAX;
+    }
+
+    scopeLabels[scopeCount] = label;
+
+    return scopeCount++;
+}
+
+void GpuProfiler::beginScope(VkCommandBuffer commandBuffer, uint32_t frameIndex, uint32_t scope) {
+    if (supported && scope != UINT32_MAX) {
+        vkCmdWriteTimestamp2(commandBuffer, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, queryPool, getQuery(frameIndex, scope));
+    }
+}
+
+void GpuProfiler::endScope(VkCommandBuffer commandBuffer, uint32_t frameIndex, uint32_t scope) {
+    if (supported && scope != UINT32_MAX) {
+        vkCmdWriteTimestamp2(commandBuffer, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, queryPool, getQuery(frameIndex, scope) + 1);
+    }
+}
+
+// Returns whether timings were read, which are then the last ones in the history.
+bool GpuProfiler::resolve(VkDevice device, uint32_t frameIndex, uint64_t frame) {
+    if (!supported) {
+        return false;
+    }
+
+    bool resolved = frames[frameIndex] != 0;
+
+    // Read the timings of the last frame that used these queries. Queries that weren't
+    // written are left out instead of waited for.
+    if (resolved) {
+        uint64_t results[MAX_GPU_SCOPE_COUNT * 2][2];
+
+        vkGetQueryPoolResults(device, queryPool, getQuery(frameIndex, 0), MAX_GPU_SCOPE_COUNT * 2, sizeof(results), results, sizeof(results[0]), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+
+        GpuFrameTimings& timings = history[historyIndex];
+        timings.frame = frames[frameIndex];
+
+        for (uint32_t i = 0; i < MAX_GPU_SCOPE_COUNT; ++i) {
+            const uint64_t* begin = results[i * 2];
+            const uint64_t* end = results[i * 2 + 1];
+
+            if (i < scopeCount && begin[1] != 0 && end[1] != 0) {
+                uint64_t ticks = (end[0] - begin[0]) & timestampMask;
+                timings.durations[i] = ticks * timestampPeriod * 1e-6f;
+            }
+            else {
+                timings.durations[i] = -1.0f;
+            }
+        }
+
+        historyIndex = (historyIndex + 1) % GPU_PROFILER_HISTORY_SIZE;
+        historyCount = std::min(historyCount + 1, GPU_PROFILER_HISTORY_SIZE);
+    }
+
+    // The frame that used the queries has finished, so they can be reset on the host.
+    vkResetQueryPool(device, queryPool, getQuery(frameIndex, 0), MAX_GPU_SCOPE_COUNT * 2);
+
+    frames[frameIndex] = frame;
+
+    return resolved;
+}
+
+uint32_t GpuProfiler::getScopeCount() {
+    return scopeCount;
+}
+
+const char* GpuProfiler::getScopeLabel(uint32_t scope) {
+    return scopeLabels[scope];
+}
+
+GpuScopeStatistics GpuProfiler::getStatistics(uint32_t scope) {
+    GpuScopeStatistics statistics = {};
+
+    float durations[GPU_PROFILER_HISTORY_SIZE];
+    uint32_t durationCount = 0;
+
+    // Walk from the oldest to the newest frame.
+    for (uint32_t i = 0; i < historyCount; ++i) {
+        uint32_t index = (historyIndex + GPU_PROFILER_HISTORY_SIZE - historyCount + i) % GPU_PROFILER_HISTORY_SIZE;
+        float duration = history[index].durations[scope];
+
+        if (duration >= 0.0f) {
+            durations[durationCount++] = duration;
+        }
+    }
+
+    if (durationCount == 0) {
+        return statistics;
+    }
+
+    statistics.last = durations[durationCount - 1];
+    statistics.min = durations[0];
+
+    float sum = 0.0f;
+
+    for (uint32_t i = 0; i < durationCount; ++i) {
+        statistics.min = std::min(statistics.min, durations[i]);
+        sum += durations[i];
+    }
+
+    statistics.average = sum / durationCount;
+
+    uint32_t p99Index = (durationCount * 99) / 100;
+    std::nth_element(durations, durations + p99Index, durations + durationCount);
+
+    statistics.p99 = durations[p99Index];
+
+    return statistics;
+}
+
+// Negative if the scope wasn't timed in the last resolved frame.
+float GpuProfiler::getLastDuration(uint32_t scope) {
+    if (historyCount == 0 || scope >= scopeCount) {
+        return -1.0f;
+    }
+
+    return history[(historyIndex + GPU_PROFILER_HISTORY_SIZE - 1) % GPU_PROFILER_HISTORY_SIZE].durations[scope];
+}
+
+bool GpuProfiler::exportCsv(const char* fileName) {
+    std::ofstream file(fileName, std::ios::trunc);
+
+    file << "frame";
+
+    for (uint32_t i = 0; i < scopeCount; ++i) {
+        file << ',' << scopeLabels[i];
+    }
+
+    file << '\n';
+
+    for (uint32_t i = 0; i < historyCount; ++i) {
+        const GpuFrameTimings& timings = history[(historyIndex + GPU_PROFILER_HISTORY_SIZE - historyCount + i) % GPU_PROFILER_HISTORY_SIZE];
+
+        file << timings.frame;
+
+        for (uint32_t j = 0; j < scopeCount; ++j) {
+            file << ',';
+
+            if (timings.durations[j] >= 0.0f) {
+                file << timings.durations[j];
+            }
+        }
+
+        file << '\n';
+    }
+
+    file.close();
+
+    return !file.fail();
+}
+
+void GpuProfiler::createQueryPool(VkDevice device) {
+    VkQueryPoolCreateInfo queryPoolCreateInfo = {
+        .sType              = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        .pNext              = nullptr,
+        .flags              = 0,
+        .queryType          = VK_QUERY_TYPE_TIMESTAMP,
+        .queryCount         = framesInFlight * MAX_GPU_SCOPE_COUNT * 2,
+        .pipelineStatistics = 0
+    };
+
+    vkCreateQueryPool(device, &queryPoolCreateInfo, nullptr, &queryPool);
+    vkResetQueryPool(device, queryPool, 0, queryPoolCreateInfo.queryCount);
+
+    frames = new uint64_t[framesInFlight];
+
+    for (uint32_t i = 0; i < framesInFlight; ++i) {
+        frames[i] = 0;
+    }
+}
+
+uint32_t GpuProfiler::getQuery(uint32_t frameIndex, uint32_t scope) {
+    return (frameIndex * MAX_GPU_SCOPE_COUNT + scope) * 2;
+}
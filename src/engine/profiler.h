@@ -0,0 +1,62 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+class Device;
+
+constexpr uint32_t MAX_GPU_SCOPE_COUNT = 32;
+constexpr uint32_t GPU_PROFILER_HISTORY_SIZE = 512;
+
+// Scopes that weren't timed in a frame have a negative duration.
+struct GpuFrameTimings {
+    uint64_t frame;
+    float durations[MAX_GPU_SCOPE_COUNT];
+};
+
+struct GpuScopeStatistics {
+    float last;
+    float min;
+    float average;
+    float p99;
+};
+
+// Times labelled scopes of command buffers with timestamp queries. Every frame in flight has
+// its own range of queries, which is only read back once the scheduler has waited for the
+// frame that last used it, so reading never stalls. Durations are in milliseconds.
+class GpuProfiler {
+public:
+    GpuProfiler() = default;
+    GpuProfiler(Device& device, uint32_t framesInFlight);
+    void destroy(VkDevice device);
+
+    void setFramesInFlight(VkDevice device, uint32_t framesInFlight);
+
+    uint32_t getScope(const char* label);
+    void beginScope(VkCommandBuffer commandBuffer, uint32_t frameIndex, uint32_t scope);
+    void endScope(VkCommandBuffer commandBuffer, uint32_t frameIndex, uint32_t scope);
+
+    bool resolve(VkDevice device, uint32_t frameIndex, uint64_t frame);
+
+    uint32_t getScopeCount();
+    const char* getScopeLabel(uint32_t scope);
+    GpuScopeStatistics getStatistics(uint32_t scope);
+    float getLastDuration(uint32_t scope);
+
+    bool exportCsv(const char* fileName);
+
+private:
+    bool supported;
+    float timestampPeriod;
+    uint64_t timestampMask;
+    VkQueryPool queryPool;
+    uint32_t framesInFlight;
+    uint64_t* frames;
+    const char* scopeLabels[MAX_GPU_SCOPE_COUNT];
+    uint32_t scopeCount;
+    GpuFrameTimings* history;
+    uint32_t historyCount;
+    uint32_t historyIndex;
+
+    void createQueryPool(VkDevice device);
+    uint32_t getQuery(uint32_t frameIndex, uint32_t scope);
+};
@@ -0,0 +1,40 @@
+// Shared by the raygen shaders, which declare the image they write to.
+
+// Selected by a specialization constant, so that unused views are compiled out.
+layout(constant_id = 0) const uint DEBUG_VIEW = 0;
+
+const uint DEBUG_VIEW_NONE = 0;
+const uint DEBUG_VIEW_LAUNCH_ID = 1;
+
+layout(binding = 1) uniform accelerationStructureEXT tlas;
+
+layout(location = 0) rayPayloadEXT vec3 payload;
+
+// Fixed camera looking down at the scene.
+const vec3 CAMERA_POSITION = vec3(0.0, 24.0, 40.0);
+const vec3 CAMERA_TARGET = vec3(0.0, 0.0, 0.0);
+const float CAMERA_FOV = 1.0;
+
+void main() {
+    vec4 color;
+
+    if (DEBUG_VIEW == DEBUG_VIEW_LAUNCH_ID) {
+        color = vec4(vec2(gl_LaunchIDEXT.xy) / vec2(gl_LaunchSizeEXT.xy), 0.0, 1.0);
+    }
+    else {
+        vec2 uv = (vec2(gl_LaunchIDEXT.xy) + 0.5) / vec2(gl_LaunchSizeEXT.xy) * 2.0 - 1.0;
+        uv.x *= float(gl_LaunchSizeEXT.x) / float(gl_LaunchSizeEXT.y);
+
+        vec3 forward = normalize(CAMERA_TARGET - CAMERA_POSITION);
+        vec3 right = normalize(cross(forward, vec3(0.0, 1.0, 0.0)));
+        vec3 up = cross(right, forward);
+        vec3 direction = normalize(forward + tan(CAMERA_FOV * 0.5) * (uv.x * right + uv.y * up));
+
+        traceRayEXT(tlas, gl_RayFlagsOpaqueEXT, 0xff, 0, 0, 0, CAMERA_POSITION, 0.01, direction, 1000.0, 0);
+
+        color = vec4(payload, 1.0);
+    }
+
+    // Launch IDs grow upwards, images downwards.
+    imageStore(image, ivec2(gl_LaunchIDEXT.x, gl_LaunchSizeEXT.y - 1 - gl_LaunchIDEXT.y), color);
+}
@@ -0,0 +1,57 @@
+#include "resolution_scaler.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+void ResolutionScaler::setBudget(float budget) {
+    this->budget = budget;
+
+    if (budget == 0.0f) {
+        scale = 1.0f;
+    }
+}
+
+// The traced extent is the one of the frame the trace time was measured on.
+void ResolutionScaler::update(float traceTime, VkExtent2D tracedExtent, VkExtent2D extent) {
+    if (budget == 0.0f || traceTime <= 0.0f || tracedExtent.width == 0 || tracedExtent.height == 0) {
+        return;
+    }
+
+    float pixelTime = traceTime / ((float)tracedExtent.width * tracedExtent.height);
+    float pixelCount = budget * HEADROOM / pixelTime;
+    float targetScale = std::clamp(sqrtf(pixelCount / ((float)extent.width * extent.height)), MIN_SCALE, 1.0f);
+
+    // Ignore small changes, which would make the resolution flicker around the budget.
+    if (fabsf(targetScale - scale) < HYSTERESIS && targetScale != 1.0f) {
+        return;
+    }
+
+    scale += (targetScale - scale) * SMOOTHING;
+
+    if (scale > 1.0f - HYSTERESIS / 2.0f) {
+        scale = 1.0f;
+    }
+}
+
+float ResolutionScaler::getScale() {
+    return scale;
+}
+
+// Scaled extents are rounded down to a multiple of a few pixels, so that small changes of the
+// scale don't change the resolution every frame.
+VkExtent2D ResolutionScaler::getExtent(VkExtent2D extent) {
+    if (scale == 1.0f) {
+        return extent;
+    }
+
+    VkExtent2D scaledExtent = {
+        .width  = (uint32_t)(extent.width * scale) / EXTENT_GRANULARITY * EXTENT_GRANULARITY,
+        .height = (uint32_t)(extent.height * scale) / EXTENT_GRANULARITY * EXTENT_GRANULARITY
+    };
+
+    scaledExtent.width = std::clamp(scaledExtent.width, 1u, extent.width);
+    scaledExtent.height = std::clamp(scaledExtent.height, 1u, extent.height);
+
+    return scaledExtent;
+}
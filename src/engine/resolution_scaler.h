@@ -0,0 +1,27 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+// Scales the trace resolution down so that tracing fits a GPU time budget in milliseconds. The
+// cost of the trace is assumed to be proportional to its pixel count, but it's only measured a
+// few frames late, so the scale moves part of the way to its estimate every frame. A budget of 0
+// traces at full resolution.
+class ResolutionScaler {
+public:
+    void setBudget(float budget);
+
+    void update(float traceTime, VkExtent2D tracedExtent, VkExtent2D extent);
+
+    float getScale();
+    VkExtent2D getExtent(VkExtent2D extent);
+
+private:
+    static constexpr float MIN_SCALE = 0.5f;
+    static constexpr float HEADROOM = 0.9f;
+    static constexpr float SMOOTHING = 0.2f;
+    static constexpr float HYSTERESIS = 0.02f;
+    static constexpr uint32_t EXTENT_GRANULARITY = 8;
+
+    float budget = 0.0f;
+    float scale = 1.0f;
+};
@@ -0,0 +1,413 @@
+#include "shader_cache.h"
+
+#include <string.h>
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static constexpr uint32_t SHADER_MODULE_CACHE_MAGIC = 0x43535856; // "VXSC"
+
+static PFN_vkGetShaderModuleIdentifierEXT vkGetShaderModuleIdentifier;
+
+struct MappedFile {
+    const char* data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+};
+
+#ifdef _WIN32
+static bool mapFile(MappedFile& mappedFile, const char* fileName) {
+    mappedFile.file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+    if (mappedFile.file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    LARGE_INTEGER fileSize;
+    GetFileSizeEx(mappedFile.file, &fileSize);
+
+    mappedFile.size = fileSize.QuadPart;
+    mappedFile.mapping = CreateFileMappingA(mappedFile.file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    mappedFile.data = mappedFile.mapping != nullptr ? (const char*)MapViewOfFile(mappedFile.mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+
+    if (mappedFile.data == nullptr) {
+        if (mappedFile.mapping != nullptr) {
+            CloseHandle(mappedFile.mapping);
+        }
+
+        CloseHandle(mappedFile.file);
+        return false;
+    }
+
+    return true;
+}
+
+static void unmapFile(MappedFile& mappedFile) {
+    UnmapViewOfFile(mappedFile.data);
+    CloseHandle(mappedFile.mapping);
+    CloseHandle(mappedFile.file);
+}
+#else
+static bool mapFile(MappedFile& mappedFile, const char* fileName) {
+    int file = open(fileName, O_RDONLY);
+
+    if (file < 0) {
+        return false;
+    }
+
+    struct stat fileStatus;
+
+    if (fstat(file, &fileStatus) != 0 || fileStatus.st_size == 0) {
+        close(file);
+        return false;
+    }
+
+    void* data = mmap(nullptr, fileStatus.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+
+    // The mapping stays valid after the descriptor is closed.
+    close(file);
+
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    mappedFile.data = (const char*)data;
+    mappedFile.size = fileStatus.st_size;
+
+    return true;
+}
+
+static void unmapFile(MappedFile& mappedFile) {
+    munmap((void*)mappedFile.data, mappedFile.size);
+}
+#endif
+
+static uint64_t hashBytes(const char* data, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ (uint8_t)data[i]) * 1099511628211ull;
+    }
+
+    return hash;
+}
+
+template<typename T>
+static void reserve(T*& array, uint32_t count, uint32_t& capacity) {
+    if (count < capacity) {
+        return;
+    }
+
+    capacity *= 2;
+
+    T* newArray = new T[capacity];
+    memcpy(newArray, array, count * sizeof(T));
+
+    delete[] array;
+    array = newArray;
+}
+
+static char* copyString(const char* string, size_t length) {
+    char* copy = new char[length + 1];
+    memcpy(copy, string, length);
+    copy[length] = '\0';
+
+    return copy;
+}
+
+static void getFileStatus(const char* fileName, uint64_t& fileSize, int64_t& modifiedTime) {
+    std::error_code error;
+
+    fileSize = std::filesystem::file_size(fileName, error);
+    modifiedTime = error ? 0 : std::filesystem::last_write_time(fileName, error).time_since_epoch().count();
+}
+
+static VkShaderModule createShaderModule(VkDevice device, const MappedFile& mappedFile) {
+    // The SPIR-V is read straight from the mapping instead of being copied first.
+    VkShaderModuleCreateInfo shaderModuleCreateInfo = {
+        .sType    = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+        .pNext    = nullptr,
+        .flags    = 0,
+        .codeSize = mappedFile.size,
+        .pCode    = (const uint32_t*)mappedFile.data
+    };
+
+    VkShaderModule shaderModule;
+    vkCreateShaderModule(device, &shaderModuleCreateInfo, nullptr, &shaderModule);
+
+    return shaderModule;
+}
+
+ShaderModuleCache::ShaderModuleCache(Device& device, const char* fileName) : fileName(fileName), identifiers(device.shaderModuleIdentifiers), mutex(new std::mutex), fileCount(0), fileCapacity(16), moduleCount(0), moduleCapacity(16) {
+    files = new ShaderFile[fileCapacity];
+    modules = new ShaderModule[moduleCapacity];
+
+    memset(&header, 0, sizeof(header));
+    header.magic = SHADER_MODULE_CACHE_MAGIC;
+
+    if (!identifiers) {
+        return;
+    }
+
+    vkGetShaderModuleIdentifier = (PFN_vkGetShaderModuleIdentifierEXT)vkGetDeviceProcAddr(device.logical, "vkGetShaderModuleIdentifierEXT");
+
+    // Identifiers are only meaningful to drivers that use the same algorithm.
+    VkPhysicalDeviceShaderModuleIdentifierPropertiesEXT identifierProperties = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_MODULE_IDENTIFIER_PROPERTIES_EXT,
+        .pNext = nullptr
+    };
+
+    VkPhysicalDeviceProperties2 physicalDeviceProperties = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+        .pNext = &identifierProperties
+    };
+
+    vkGetPhysicalDeviceProperties2(device.physical, &physicalDeviceProperties);
+
+    memcpy(header.identifierAlgorithmUUID, identifierProperties.shaderModuleIdentifierAlgorithmUUID, VK_UUID_SIZE);
+
+    // Load the identifiers of the files that were used last time.
+    std::ifstream file(fileName, std::ios::binary);
+    ShaderModuleCacheFileHeader fileHeader;
+
+    if (!file.read((char*)&fileHeader, sizeof(fileHeader)) ||
+        fileHeader.magic != header.magic ||
+        memcmp(fileHeader.identifierAlgorithmUUID, header.identifierAlgorithmUUID, VK_UUID_SIZE) != 0) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < fileHeader.fileCount; ++i) {
+        uint32_t fileNameLength;
+        char shaderFileName[256];
+        ShaderFile shaderFile;
+        ShaderModule shaderModule;
+
+        if (!file.read((char*)&fileNameLength, sizeof(fileNameLength)) || fileNameLength >= sizeof(shaderFileName) ||
+            !file.read(shaderFileName, fileNameLength) ||
+            !file.read((char*)&shaderFile.fileSize, sizeof(shaderFile.fileSize)) ||
+            !file.read((char*)&shaderFile.modifiedTime, sizeof(shaderFile.modifiedTime)) ||
+            !file.read((char*)&shaderModule.contentHash, sizeof(shaderModule.contentHash)) ||
+            !file.read((char*)&shaderModule.identifierSize, sizeof(shaderModule.identifierSize)) ||
+            shaderModule.identifierSize > VK_MAX_SHADER_MODULE_IDENTIFIER_SIZE_EXT ||
+            !file.read((char*)shaderModule.identifier, shaderModule.identifierSize)) {
+            break;
+        }
+
+        shaderModule.module = VK_NULL_HANDLE;
+        shaderFile.moduleIndex = findModule(shaderModule.contentHash);
+
+        if (shaderFile.moduleIndex == UINT32_MAX) {
+            reserve(modules, moduleCount, moduleCapacity);
+
+            shaderFile.moduleIndex = moduleCount;
+            modules[moduleCount++] = shaderModule;
+        }
+
+        shaderFile.fileName = copyString(shaderFileName, fileNameLength);
+
+        reserve(files, fileCount, fileCapacity);
+        files[fileCount++] = shaderFile;
+    }
+}
+
+void ShaderModuleCache::save() {
+    if (!identifiers) {
+        return;
+    }
+
+    header.fileCount = 0;
+
+    for (uint32_t i = 0; i < fileCount; ++i) {
+        if (modules[files[i].moduleIndex].identifierSize != 0) {
+            ++header.fileCount;
+        }
+    }
+
+    // Write to a temporary file and move it over the old one.
+    std::string temporaryFileName = std::string(fileName) + ".tmp";
+
+    std::ofstream file(temporaryFileName, std::ios::binary | std::ios::trunc);
+    file.write((const char*)&header, sizeof(header));
+
+    for (uint32_t i = 0; i < fileCount; ++i) {
+        const ShaderFile& shaderFile = files[i];
+        const ShaderModule& shaderModule = modules[shaderFile.moduleIndex];
+
+        if (shaderModule.identifierSize == 0) {
+            continue;
+        }
+
+        uint32_t fileNameLength = strlen(shaderFile.fileName);
+
+        file.write((const char*)&fileNameLength, sizeof(fileNameLength));
+        file.write(shaderFile.fileName, fileNameLength);
+        file.write((const char*)&shaderFile.fileSize, sizeof(shaderFile.fileSize));
+        file.write((const char*)&shaderFile.modifiedTime, sizeof(shaderFile.modifiedTime));
+        file.write((const char*)&shaderModule.contentHash, sizeof(shaderModule.contentHash));
+        file.write((const char*)&shaderModule.identifierSize, sizeof(shaderModule.identifierSize));
+        file.write((const char*)shaderModule.identifier, shaderModule.identifierSize);
+    }
+
+    file.close();
+
+    std::error_code error;
+
+    if (file) {
+        std::filesystem::rename(temporaryFileName, fileName, error);
+    }
+    else {
+        std::filesystem::remove(temporaryFileName, error);
+    }
+}
+
+void ShaderModuleCache::destroy(VkDevice device) {
+    for (uint32_t i = 0; i < moduleCount; ++i) {
+        vkDestroyShaderModule(device, modules[i].module, nullptr);
+    }
+
+    for (uint32_t i = 0; i < fileCount; ++i) {
+        delete[] files[i].fileName;
+    }
+
+    delete[] modules;
+    delete[] files;
+    delete mutex;
+}
+
+ShaderModule ShaderModuleCache::getShaderModule(VkDevice device, const char* fileName) {
+    std::lock_guard<std::mutex> lock(*mutex);
+
+    uint64_t fileSize;
+    int64_t modifiedTime;
+    getFileStatus(fileName, fileSize, modifiedTime);
+
+    ShaderFile* file = findFile(fileName);
+
+    if (file != nullptr && file->fileSize == fileSize && file->modifiedTime == modifiedTime) {
+        return modules[file->moduleIndex];
+    }
+
+    // The file is new or has changed, so read it again.
+    uint32_t moduleIndex = createModule(device, fileName);
+
+    if (moduleIndex == UINT32_MAX) {
+        return {};
+    }
+
+    if (file == nullptr) {
+        reserve(files, fileCount, fileCapacity);
+
+        file = &files[fileCount++];
+        file->fileName = copyString(fileName, strlen(fileName));
+    }
+
+    file->fileSize     = fileSize;
+    file->modifiedTime = modifiedTime;
+    file->moduleIndex  = moduleIndex;
+
+    return modules[moduleIndex];
+}
+
+VkShaderModule ShaderModuleCache::loadShaderModule(VkDevice device, uint64_t contentHash) {
+    std::lock_guard<std::mutex> lock(*mutex);
+
+    uint32_t moduleIndex = findModule(contentHash);
+
+    if (moduleIndex == UINT32_MAX) {
+        return VK_NULL_HANDLE;
+    }
+
+    ShaderModule& shaderModule = modules[moduleIndex];
+
+    // Read the SPIR-V of a module that was only known by its identifier.
+    for (uint32_t i = 0; i < fileCount && shaderModule.module == VK_NULL_HANDLE; ++i) {
+        MappedFile mappedFile;
+
+        if (files[i].moduleIndex != moduleIndex || !mapFile(mappedFile, files[i].fileName)) {
+            continue;
+        }
+
+        if (hashBytes(mappedFile.data, mappedFile.size) == contentHash) {
+            shaderModule.module = createShaderModule(device, mappedFile);
+        }
+
+        unmapFile(mappedFile);
+    }
+
+    return shaderModule.module;
+}
+
+ShaderFile* ShaderModuleCache::findFile(const char* fileName) {
+    for (uint32_t i = 0; i < fileCount; ++i) {
+        if (strcmp(files[i].fileName, fileName) == 0) {
+            return &files[i];
+        }
+    }
+
+    return nullptr;
+}
+
+uint32_t ShaderModuleCache::findModule(uint64_t contentHash) {
+    for (uint32_t i = 0; i < moduleCount; ++i) {
+        if (modules[i].contentHash == contentHash) {
+            return i;
+        }
+    }
+
+    return UINT32_MAX;
+}
+
+uint32_t ShaderModuleCache::createModule(VkDevice device, const char* fileName) {
+    MappedFile mappedFile;
+
+    if (!mapFile(mappedFile, fileName)) {
+        return UINT32_MAX;
+    }
+
+    uint64_t contentHash = hashBytes(mappedFile.data, mappedFile.size);
+    uint32_t moduleIndex = findModule(contentHash);
+
+    // Another file, or an earlier version of this one, has the same code.
+    if (moduleIndex != UINT32_MAX) {
+        unmapFile(mappedFile);
+        return moduleIndex;
+    }
+
+    ShaderModule shaderModule = {
+        .contentHash    = contentHash,
+        .module         = createShaderModule(device, mappedFile),
+        .identifierSize = 0
+    };
+
+    unmapFile(mappedFile);
+
+    if (identifiers) {
+        VkShaderModuleIdentifierEXT identifier = {
+            .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_IDENTIFIER_EXT,
+            .pNext = nullptr
+        };
+
+        vkGetShaderModuleIdentifier(device, shaderModule.module, &identifier);
+
+        shaderModule.identifierSize = identifier.identifierSize;
+        memcpy(shaderModule.identifier, identifier.identifier, identifier.identifierSize);
+    }
+
+    reserve(modules, moduleCount, moduleCapacity);
+    modules[moduleCount] = shaderModule;
+
+    return moduleCount++;
+}
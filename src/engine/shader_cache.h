@@ -0,0 +1,59 @@
+#pragma once
+
+#include "graphics.h"
+
+#include <mutex>
+
+struct ShaderModule {
+    uint64_t contentHash;
+    VkShaderModule module;
+    uint32_t identifierSize;
+    uint8_t identifier[VK_MAX_SHADER_MODULE_IDENTIFIER_SIZE_EXT];
+};
+
+struct ShaderFile {
+    char* fileName;
+    uint64_t fileSize;
+    int64_t modifiedTime;
+    uint32_t moduleIndex;
+};
+
+struct ShaderModuleCacheFileHeader {
+    uint32_t magic;
+    uint8_t identifierAlgorithmUUID[VK_UUID_SIZE];
+    uint32_t fileCount;
+};
+
+// Creates shader modules from memory-mapped SPIR-V files and keeps them by content hash, so
+// that the same code is only read and compiled once however many pipelines use it. A file is
+// only read again once its size or modification time changes.
+//
+// With VK_EXT_shader_module_identifier the identifiers are saved to a file. Modules listed
+// there are returned without a VkShaderModule, and pipelines that the driver finds in the
+// pipeline cache are then created without reading or compiling any SPIR-V.
+class ShaderModuleCache {
+public:
+    ShaderModuleCache() = default;
+    ShaderModuleCache(Device& device, const char* fileName);
+    void save();
+    void destroy(VkDevice device);
+
+    ShaderModule getShaderModule(VkDevice device, const char* fileName);
+    VkShaderModule loadShaderModule(VkDevice device, uint64_t contentHash);
+
+private:
+    const char* fileName;
+    bool identifiers;
+    ShaderModuleCacheFileHeader header;
+    std::mutex* mutex;
+    ShaderFile* files;
+    uint32_t fileCount;
+    uint32_t fileCapacity;
+    ShaderModule* modules;
+    uint32_t moduleCount;
+    uint32_t moduleCapacity;
+
+    ShaderFile* findFile(const char* fileName);
+    uint32_t findModule(uint64_t contentHash);
+    uint32_t createModule(VkDevice device, const char* fileName);
+};
@@ -0,0 +1,425 @@
+#include "staging.h"
+
+#include <assert.h>
+#include <string.h>
+
+static constexpr VkDeviceSize RING_ALIGNMENT = 16;
+
+static VkDeviceSize alignSize(VkDeviceSize size, VkDeviceSize alignment) {
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+template<typename T>
+static void reserve(T*& array, uint32_t count, uint32_t& capacity) {
+    if (count < capacity) {
+        return;
+    }
+
+    capacity *= 2;
+
+    T* newArray = new T[capacity];
+    memcpy(newArray, array, count * sizeof(T));
+
+    delete[] array;
+    array = newArray;
+}
+
+Uploader::Uploader(Device& device, VkDeviceSize capacity) : capacity(capacity) {
+    // Create the ring buffer.
+    ringBuffer = Buffer(device, capacity, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+    // Create the timeline semaphore.
+    VkSemaphoreTypeCreateInfo semaphoreTypeCreateInfo = {
+        .sType         = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+        .pNext         = nullptr,
+        .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+        .initialValue  = 0
+    };
+
+    VkSemaphoreCreateInfo semaphoreCreateInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        .pNext = &semaphoreTypeCreateInfo,
+        .flags = 0
+    };
+
+    vkCreateSemaphore(device.logical, &semaphoreCreateInfo, nullptr, &semaphore);
+
+    // Create the command pool.
+    VkCommandPoolCreateInfo commandPoolCreateInfo = {
+        .sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .pNext            = nullptr,
+        .flags            = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+        .queueFamilyIndex = device.transferQueue.familyIndex
+    };
+
+    vkCreateCommandPool(device.logical, &commandPoolCreateInfo, nullptr, &commandPool);
+
+    // Allocate the command buffers.
+    VkCommandBuffer commandBuffers[SUBMISSION_COUNT];
+
+    VkCommandBufferAllocateInfo commandBufferAllocateInfo = {
+        .sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .pNext              = nullptr,
+        .commandPool        = commandPool,
+        .level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = SUBMISSION_COUNT
+    };
+
+    vkAllocateCommandBuffers(device.logical, &commandBufferAllocateInfo, commandBuffers);
+
+    for (uint32_t i = 0; i < SUBMISSION_COUNT; ++i) {
+        submissions[i].commandBuffer = commandBuffers[i];
+        submissions[i].value         = 0;
+        submissions[i].ringHead      = 0;
+    }
+
+    // Allocate the pending copy arrays.
+    bufferUploadCapacity = 64;
+    bufferUploads = new BufferUpload[bufferUploadCapacity];
+
+    imageUploadCapacity = 16;
+    imageUploads = new ImageUpload[imageUploadCapacity];
+}
+
+void Uploader::destroy(Device& device) {
+    VkSemaphoreWaitInfo semaphoreWaitInfo = {
+        .sType          = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+        .pNext          = nullptr,
+        .flags          = 0,
+        .semaphoreCount = 1,
+        .pSemaphores    = &semaphore,
+        .pValues        = &submittedValue
+    };
+
+    vkWaitSemaphores(device.logical, &semaphoreWaitInfo, UINT64_MAX);
+
+    delete[] imageUploads;
+    delete[] bufferUploads;
+
+    vkDestroyCommandPool(device.logical, commandPool, nullptr);
+    vkDestroySemaphore(device.logical, semaphore, nullptr);
+
+    ringBuffer.destroy(device);
+}
+
+void Uploader::uploadBuffer(Device& device, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size, const void* data) {
+    const char* bytes = (const char*)data;
+
+    // Split large uploads so that every piece fits in the ring.
+    while (size > 0) {
+        VkDeviceSize chunkSize = size < capacity / 2 ? size : capacity / 2;
+        VkDeviceSize ringOffset = allocateRange(device, chunkSize);
+
+        memcpy((char*)ringBuffer.allocation.mappedData + ringOffset, bytes, chunkSize);
+
+        reserve(bufferUploads, bufferUploadCount, bufferUploadCapacity);
+
+        bufferUploads[bufferUploadCount++] = {
+            .buffer = buffer,
+            .region = {
+                .sType     = VK_STRUCTURE_TYPE_BUFFER_COPY_2,
+                .pNext     = nullptr,
+                .srcOffset = ringOffset,
+                .dstOffset = offset,
+                .size      = chunkSize
+            }
+        };
+
+        bytes += chunkSize;
+        offset += chunkSize;
+        size -= chunkSize;
+    }
+}
+
+void Uploader::uploadImage(Device& device, VkImage image, VkExtent3D extent, VkImageLayout finalLayout, VkDeviceSize size, const void* data) {
+    const char* bytes = (const char*)data;
+
+    VkDeviceSize rowSize = size / (extent.height * extent.depth);
+    uint32_t maxBandHeight = (uint32_t)(capacity / 2 / rowSize);
+
+    assert(maxBandHeight != 0);
+
+    for (uint32_t z = 0; z < extent.depth; ++z) {
+        for (uint32_t y = 0; y < extent.height;) {
+            uint32_t bandHeight = extent.height - y < maxBandHeight ? extent.height - y : maxBandHeight;
+            VkDeviceSize bandSize = bandHeight * rowSize;
+            VkDeviceSize ringOffset = allocateRange(device, bandSize);
+
+            memcpy((char*)ringBuffer.allocation.mappedData + ringOffset, bytes, bandSize);
+
+            reserve(imageUploads, imageUploadCount, imageUploadCapacity);
+
+            imageUploads[imageUploadCount++] = {
+                .image       = image,
+                .oldLayout   = z == 0 && y == 0 ? VK_IMAGE_LAYOUT_UNDEFINED : finalLayout,
+                .finalLayout = finalLayout,
+                .region      = {
+                    .sType             = VK_STRUCTURE_TYPE_BUFFER_IMAGE_COPY_2,
+                    .pNext             = nullptr,
+                    .bufferOffset      = ringOffset,
+                    .bufferRowLength   = 0,
+                    .bufferImageHeight = 0,
+                    .imageSubresource  = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 },
+                    .imageOffset       = { 0, (int32_t)y, (int32_t)z },
+                    .imageExtent       = { extent.width, bandHeight, 1 }
+                }
+            };
+
+            bytes += bandSize;
+            y += bandHeight;
+        }
+    }
+}
+
+uint64_t Uploader::flush(Device& device) {
+    if (bufferUploadCount == 0 && imageUploadCount == 0) {
+        return submittedValue;
+    }
+
+    UploadSubmission& submission = submissions[submissionIndex];
+
+    // The command buffer of this slot may still be executing.
+    VkSemaphoreWaitInfo semaphoreWaitInfo = {
+        .sType          = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+        .pNext          = nullptr,
+        .flags          = 0,
+        .semaphoreCount = 1,
+        .pSemaphores    = &semaphore,
+        .pValues        = &submission.value
+    };
+
+    vkWaitSemaphores(device.logical, &semaphoreWaitInfo, UINT64_MAX);
+
+    VkCommandBufferBeginInfo commandBufferBeginInfo = {
+        .sType            = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .pNext            = nullptr,
+        .flags            = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+        .pInheritanceInfo = nullptr
+    };
+
+    vkBeginCommandBuffer(submission.commandBuffer, &commandBufferBeginInfo);
+
+    // Find the runs of bands of the same image, which share their barriers and copy command.
+    uint32_t* imageRunStarts = new uint32_t[imageUploadCount + 1];
+    uint32_t imageRunCount = 0;
+
+    for (uint32_t i = 0; i < imageUploadCount; ++i) {
+        if (i == 0 || imageUploads[i].image != imageUploads[i - 1].image) {
+            imageRunStarts[imageRunCount++] = i;
+        }
+    }
+
+    imageRunStarts[imageRunCount] = imageUploadCount;
+
+    // Transition the images to the transfer destination layout. Images that earlier flushes
+    // already copied bands into have to wait for those copies.
+    VkImageMemoryBarrier2* imageMemoryBarriers = new VkImageMemoryBarrier2[imageRunCount];
+
+    for (uint32_t i = 0; i < imageRunCount; ++i) {
+        const ImageUpload& upload = imageUploads[imageRunStarts[i]];
+        bool copied = upload.oldLayout != VK_IMAGE_LAYOUT_UNDEFINED;
+
+        imageMemoryBarriers[i] = {
+            .sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+            .pNext               = nullptr,
+            .srcStageMask        = copied ? VK_PIPELINE_STAGE_2_COPY_BIT : VK_PIPELINE_STAGE_2_NONE,
+            .srcAccessMask       = copied ? VK_ACCESS_2_TRANSFER_WRITE_BIT : VK_ACCESS_2_NONE,
+            .dstStageMask        = VK_PIPELINE_STAGE_2_COPY_BIT,
+            .dstAccessMask       = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+            .oldLayout           = upload.oldLayout,
+            .newLayout           = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image               = upload.image,
+            .subresourceRange    = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 }
+        };
+    }
+
+    VkDependencyInfo dependencyInfo = {
+        .sType                    = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        .pNext                    = nullptr,
+        .dependencyFlags          = 0,
+        .memoryBarrierCount       = 0,
+        .pMemoryBarriers          = nullptr,
+        .bufferMemoryBarrierCount = 0,
+        .pBufferMemoryBarriers    = nullptr,
+        .imageMemoryBarrierCount  = imageRunCount,
+        .pImageMemoryBarriers     = imageMemoryBarriers
+    };
+
+    if (imageRunCount != 0) {
+        vkCmdPipelineBarrier2(submission.commandBuffer, &dependencyInfo);
+    }
+
+    // Record one copy command per run of uploads into the same buffer.
+    VkBufferCopy2* regions = new VkBufferCopy2[bufferUploadCount];
+
+    for (uint32_t i = 0; i < bufferUploadCount;) {
+        uint32_t regionCount = 0;
+        VkBuffer buffer = bufferUploads[i].buffer;
+
+        while (i < bufferUploadCount && bufferUploads[i].buffer == buffer) {
+            regions[regionCount++] = bufferUploads[i++].region;
+        }
+
+        VkCopyBufferInfo2 copyBufferInfo = {
+            .sType       = VK_STRUCTURE_TYPE_COPY_BUFFER_INFO_2,
+            .pNext       = nullptr,
+            .srcBuffer   = ringBuffer,
+            .dstBuffer   = buffer,
+            .regionCount = regionCount,
+            .pRegions    = regions
+        };
+
+        vkCmdCopyBuffer2(submission.commandBuffer, &copyBufferInfo);
+    }
+
+    delete[] regions;
+
+    VkBufferImageCopy2* imageRegions = new VkBufferImageCopy2[imageUploadCount];
+
+    for (uint32_t i = 0; i < imageRunCount; ++i) {
+        uint32_t regionCount = 0;
+
+        for (uint32_t j = imageRunStarts[i]; j < imageRunStarts[i + 1]; ++j) {
+            imageRegions[regionCount++] = imageUploads[j].region;
+        }
+
+        VkCopyBufferToImageInfo2 copyBufferToImageInfo = {
+            .sType          = VK_STRUCTURE_TYPE_COPY_BUFFER_TO_IMAGE_INFO_2,
+            .pNext          = nullptr,
+            .srcBuffer      = ringBuffer,
+            .dstImage       = imageUploads[imageRunStarts[i]].image,
+            .dstImageLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            .regionCount    = regionCount,
+            .pRegions       = imageRegions
+        };
+
+        vkCmdCopyBufferToImage2(submission.commandBuffer, &copyBufferToImageInfo);
+    }
+
+    delete[] imageRegions;
+
+    // Transition the images to their final layouts. Consumers synchronize through the timeline semaphore.
+    for (uint32_t i = 0; i < imageRunCount; ++i) {
+        imageMemoryBarriers[i].srcStageMask  = VK_PIPELINE_STAGE_2_COPY_BIT;
+        imageMemoryBarriers[i].srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+        imageMemoryBarriers[i].dstStageMask  = VK_PIPELINE_STAGE_2_NONE;
+        imageMemoryBarriers[i].dstAccessMask = VK_ACCESS_2_NONE;
+        imageMemoryBarriers[i].oldLayout     = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        imageMemoryBarriers[i].newLayout     = imageUploads[imageRunStarts[i]].finalLayout;
+    }
+
+    if (imageRunCount != 0) {
+        vkCmdPipelineBarrier2(submission.commandBuffer, &dependencyInfo);
+    }
+
+    delete[] imageMemoryBarriers;
+    delete[] imageRunStarts;
+
+    vkEndCommandBuffer(submission.commandBuffer);
+
+    // Submit the copies.
+    submission.value = ++submittedValue;
+    submission.ringHead = head;
+
+    VkCommandBufferSubmitInfo commandBufferInfo = {
+        .sType         = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+        .pNext         = nullptr,
+        .commandBuffer = submission.commandBuffer,
+        .deviceMask    = 0
+    };
+
+    VkSemaphoreSubmitInfo signalSemaphoreInfo = {
+        .sType       = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+        .pNext       = nullptr,
+        .semaphore   = semaphore,
+        .value       = submission.value,
+        .stageMask   = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+        .deviceIndex = 0
+    };
+
+    VkSubmitInfo2 submitInfo = {
+        .sType                    = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+        .pNext                    = nullptr,
+        .flags                    = 0,
+        .waitSemaphoreInfoCount   = 0,
+        .pWaitSemaphoreInfos      = nullptr,
+        .commandBufferInfoCount   = 1,
+        .pCommandBufferInfos      = &commandBufferInfo,
+        .signalSemaphoreInfoCount = 1,
+        .pSignalSemaphoreInfos    = &signalSemaphoreInfo
+    };
+
+    vkQueueSubmit2(device.transferQueue, 1, &submitInfo, VK_NULL_HANDLE);
+
+    submissionIndex = (submissionIndex + 1) % SUBMISSION_COUNT;
+    bufferUploadCount = 0;
+    imageUploadCount = 0;
+
+    return submittedValue;
+}
+
+bool Uploader::isComplete(VkDevice device, uint64_t value) {
+    uint64_t completedValue;
+    vkGetSemaphoreCounterValue(device, semaphore, &completedValue);
+
+    return completedValue >= value;
+}
+
+// A range that wraps around skips the rest of the ring, which is only reclaimed up to the current
+// head, so ranges larger than half of the ring could wait forever.
+VkDeviceSize Uploader::allocateRange(Device& device, VkDeviceSize size) {
+    assert(size <= capacity / 2);
+
+    VkDeviceSize offset = alignSize(head, RING_ALIGNMENT);
+
+    // Don't let a range wrap around the end of the ring.
+    if (offset % capacity + size > capacity) {
+        offset = (offset / capacity + 1) * capacity;
+    }
+
+    reclaim(device.logical);
+
+    while (offset + size - tail > capacity) {
+        // The space may be held by copies that haven't been submitted yet.
+        flush(device);
+
+        // Wait for the oldest submission that still holds part of the ring.
+        uint64_t value = UINT64_MAX;
+
+        for (uint32_t i = 0; i < SUBMISSION_COUNT; ++i) {
+            if (submissions[i].ringHead > tail && submissions[i].value < value) {
+                value = submissions[i].value;
+            }
+        }
+
+        VkSemaphoreWaitInfo semaphoreWaitInfo = {
+            .sType          = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+            .pNext          = nullptr,
+            .flags          = 0,
+            .semaphoreCount = 1,
+            .pSemaphores    = &semaphore,
+            .pValues        = &value
+        };
+
+        vkWaitSemaphores(device.logical, &semaphoreWaitInfo, UINT64_MAX);
+
+        reclaim(device.logical);
+    }
+
+    head = offset + size;
+
+    return offset % capacity;
+}
+
+void Uploader::reclaim(VkDevice device) {
+    uint64_t completedValue;
+    vkGetSemaphoreCounterValue(device, semaphore, &completedValue);
+
+    for (uint32_t i = 0; i < SUBMISSION_COUNT; ++i) {
+        if (submissions[i].value <= completedValue && submissions[i].ringHead > tail) {
+            tail = submissions[i].ringHead;
+        }
+    }
+}
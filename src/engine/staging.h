@@ -0,0 +1,64 @@
+#pragma once
+
+#include "graphics.h"
+
+struct BufferUpload {
+    VkBuffer buffer;
+    VkBufferCopy2 region;
+};
+
+// Bands of an image after the first find it in its final layout, since an earlier flush may have
+// already copied the first ones.
+struct ImageUpload {
+    VkImage image;
+    VkImageLayout oldLayout;
+    VkImageLayout finalLayout;
+    VkBufferImageCopy2 region;
+};
+
+struct UploadSubmission {
+    VkCommandBuffer commandBuffer;
+    uint64_t value;
+    VkDeviceSize ringHead;
+};
+
+// Streams data into device local resources through a persistently mapped ring buffer. Copies
+// are batched until flush(), which submits them to the transfer queue and returns the value
+// that the timeline semaphore reaches once they have landed. Images are tightly packed and split
+// into bands of rows that fit in half of the ring, and must be created with concurrent sharing
+// between the render and transfer queue families.
+class Uploader {
+public:
+    VkSemaphore semaphore;
+
+    Uploader() = default;
+    Uploader(Device& device, VkDeviceSize capacity);
+    void destroy(Device& device);
+
+    void uploadBuffer(Device& device, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size, const void* data);
+    void uploadImage(Device& device, VkImage image, VkExtent3D extent, VkImageLayout finalLayout, VkDeviceSize size, const void* data);
+
+    uint64_t flush(Device& device);
+    bool isComplete(VkDevice device, uint64_t value);
+
+private:
+    static constexpr uint32_t SUBMISSION_COUNT = 8;
+
+    Buffer ringBuffer;
+    VkDeviceSize capacity;
+    VkDeviceSize head = 0;
+    VkDeviceSize tail = 0;
+    VkCommandPool commandPool;
+    UploadSubmission submissions[SUBMISSION_COUNT];
+    uint32_t submissionIndex = 0;
+    uint64_t submittedValue = 0;
+    BufferUpload* bufferUploads;
+    uint32_t bufferUploadCount = 0;
+    uint32_t bufferUploadCapacity;
+    ImageUpload* imageUploads;
+    uint32_t imageUploadCount = 0;
+    uint32_t imageUploadCapacity;
+
+    VkDeviceSize allocateRange(Device& device, VkDeviceSize size);
+    void reclaim(VkDevice device);
+};
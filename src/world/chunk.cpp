@@ -0,0 +1,408 @@
+#include "chunk.h"
+
+#include <string.h>
+
+#include <bit>
+
+static uint32_t getPaletteBitsPerBlock(uint32_t paletteSize) {
+    if (paletteSize <= 1) {
+        return 0;
+    }
+
+    if (paletteSize <= 2) {
+        return 1;
+    }
+
+    if (paletteSize <= 4) {
+        return 2;
+    }
+
+    if (paletteSize <= 16) {
+        return 4;
+    }
+
+    return paletteSize <= 256 ? 8 : 16;
+}
+
+static uint32_t hashBlock(Block block) {
+    uint32_t hash = block * 2654435761u;
+    return hash ^ (hash >> 16);
+}
+
+template<uint32_t BITS>
+static void decodeBlocks(const uint64_t* data, const Block* palette, Block* blocks) {
+    constexpr uint32_t BLOCKS_PER_WORD = 64 / BITS;
+    constexpr uint64_t MASK = (1ull << BITS) - 1;
+
+    for (uint32_t i = 0; i < CHUNK_BLOCK_COUNT / BLOCKS_PER_WORD; ++i) {
+        uint64_t word = data[i];
+
+        for (uint32_t j = 0; j < BLOCKS_PER_WORD; ++j) {
+            blocks[i * BLOCKS_PER_WORD + j] = palette[word & MASK];
+            word >>= BITS;
+        }
+    }
+}
+
+Chunk::Chunk(Block block) : data(nullptr), bitsPerBlock(0), paletteSize(1), paletteCapacity(1), freePaletteEntryCount(0), paletteLookup(nullptr), paletteLookupMask(0) {
+    palette = new Block[1];
+    paletteCounts = new uint16_t[1];
+
+    palette[0] = block;
+    paletteCounts[0] = CHUNK_BLOCK_COUNT;
+}
+
+void Chunk::destroy() {
+    delete[] paletteLookup;
+    delete[] paletteCounts;
+    delete[] palette;
+    delete[] data;
+}
+
+Block Chunk::get(uint32_t index) {
+    return palette[getPaletteIndex(index)];
+}
+
+void Chunk::set(uint32_t index, Block block) {
+    uint32_t oldPaletteIndex = getPaletteIndex(index);
+
+    if (palette[oldPaletteIndex] == block) {
+        return;
+    }
+
+    uint32_t paletteIndex = findPaletteIndex(block);
+
+    // Adding an entry may repack the blocks, but it never moves the entries that are in use.
+    if (paletteIndex == UINT32_MAX) {
+        paletteIndex = addPaletteEntry(block);
+    }
+
+    if (--paletteCounts[oldPaletteIndex] == 0) {
+        ++freePaletteEntryCount;
+    }
+
+    if (paletteCounts[paletteIndex]++ == 0) {
+        --freePaletteEntryCount;
+    }
+
+    setPaletteIndex(index, paletteIndex);
+}
+
+void Chunk::fill(Block block) {
+    destroy();
+    *this = Chunk(block);
+}
+
+void Chunk::decode(Block* blocks) {
+    switch (bitsPerBlock) {
+        case 0:
+            for (uint32_t i = 0; i < CHUNK_BLOCK_COUNT; ++i) {
+                blocks[i] = palette[0];
+            }
+            break;
+        case 1:
+            decodeBlocks<1>(data, palette, blocks);
+            break;
+        case 2:
+            decodeBlocks<2>(data, palette, blocks);
+            break;
+        case 4:
+            decodeBlocks<4>(data, palette, blocks);
+            break;
+        case 8:
+            decodeBlocks<8>(data, palette, blocks);
+            break;
+        default:
+            decodeBlocks<16>(data, palette, blocks);
+            break;
+    }
+}
+
+// The palette is built from scratch, sorted by block, without any unused entries.
+void Chunk::encode(const Block* blocks) {
+    uint64_t present[65536 / 64] = {};
+    uint32_t newPaletteSize = 0;
+
+    for (uint32_t i = 0; i < CHUNK_BLOCK_COUNT; ++i) {
+        uint64_t bit = 1ull << (blocks[i] & 63);
+
+        if ((present[blocks[i] >> 6] & bit) == 0) {
+            present[blocks[i] >> 6] |= bit;
+            ++newPaletteSize;
+        }
+    }
+
+    destroy();
+
+    bitsPerBlock = getPaletteBitsPerBlock(newPaletteSize);
+    data = bitsPerBlock != 0 ? new uint64_t[CHUNK_BLOCK_COUNT * bitsPerBlock / 64]() : nullptr;
+
+    paletteCapacity = std::bit_ceil(newPaletteSize);
+    palette = new Block[paletteCapacity];
+    paletteCounts = new uint16_t[paletteCapacity];
+    paletteSize = 0;
+    freePaletteEntryCount = 0;
+    paletteLookup = nullptr;
+
+    for (uint32_t i = 0; i < 65536 / 64; ++i) {
+        for (uint64_t word = present[i]; word != 0; word &= word - 1) {
+            palette[paletteSize] = (Block)(i * 64 + std::countr_zero(word));
+            paletteCounts[paletteSize] = 0;
+            ++paletteSize;
+        }
+    }
+
+    createPaletteLookup();
+
+    // Neighbouring blocks are usually the same, so the last lookup is reused.
+    Block lastBlock = palette[0];
+    uint32_t lastPaletteIndex = 0;
+
+    for (uint32_t i = 0; i < CHUNK_BLOCK_COUNT; ++i) {
+        if (blocks[i] != lastBlock) {
+            lastBlock = blocks[i];
+            lastPaletteIndex = findPaletteIndex(lastBlock);
+        }
+
+        ++paletteCounts[lastPaletteIndex];
+
+        if (bitsPerBlock != 0) {
+            uint32_t bitOffset = i * bitsPerBlock;
+            data[bitOffset >> 6] |= (uint64_t)lastPaletteIndex << (bitOffset & 63);
+        }
+    }
+}
+
+// Drops the unused palette entries and shrinks the blocks to the fewest bits that still fit.
+void Chunk::compact() {
+    if (freePaletteEntryCount == 0) {
+        return;
+    }
+
+    uint32_t* remap = new uint32_t[paletteSize];
+    uint32_t newPaletteSize = 0;
+
+    for (uint32_t i = 0; i < paletteSize; ++i) {
+        remap[i] = paletteCounts[i] != 0 ? newPaletteSize++ : UINT32_MAX;
+    }
+
+    repack(getPaletteBitsPerBlock(newPaletteSize), remap);
+
+    Block* oldPalette = palette;
+    uint16_t* oldPaletteCounts = paletteCounts;
+    uint32_t oldPaletteSize = paletteSize;
+
+    paletteCapacity = std::bit_ceil(newPaletteSize);
+    palette = new Block[paletteCapacity];
+    paletteCounts = new uint16_t[paletteCapacity];
+    paletteSize = newPaletteSize;
+    freePaletteEntryCount = 0;
+
+    for (uint32_t i = 0; i < oldPaletteSize; ++i) {
+        if (remap[i] != UINT32_MAX) {
+            palette[remap[i]] = oldPalette[i];
+            paletteCounts[remap[i]] = oldPaletteCounts[i];
+        }
+    }
+
+    delete[] oldPaletteCounts;
+    delete[] oldPalette;
+    delete[] remap;
+
+    createPaletteLookup();
+}
+
+bool Chunk::isUniform() {
+    return paletteSize - freePaletteEntryCount == 1;
+}
+
+uint32_t Chunk::getBitsPerBlock() {
+    return bitsPerBlock;
+}
+
+// Includes the unused entries.
+uint32_t Chunk::getPaletteSize() {
+    return paletteSize;
+}
+
+size_t Chunk::getMemoryUsage() {
+    size_t size = sizeof(Chunk);
+
+    size += CHUNK_BLOCK_COUNT * bitsPerBlock / 8;
+    size += paletteCapacity * (sizeof(Block) + sizeof(uint16_t));
+
+    if (paletteLookup != nullptr) {
+        size += (paletteLookupMask + 1) * sizeof(uint32_t);
+    }
+
+    return size;
+}
+
+uint32_t Chunk::getPaletteIndex(uint32_t index) {
+    if (bitsPerBlock == 0) {
+        return 0;
+    }
+
+    uint32_t bitOffset = index * bitsPerBlock;
+
+    return (data[bitOffset >> 6] >> (bitOffset & 63)) & ((1u << bitsPerBlock) - 1);
+}
+
+void Chunk::setPaletteIndex(uint32_t index, uint32_t paletteIndex) {
+    uint32_t bitOffset = index * bitsPerBlock;
+    uint64_t mask = (1ull << bitsPerBlock) - 1;
+
+    uint64_t& word = data[bitOffset >> 6];
+    word = (word & ~(mask << (bitOffset & 63))) | ((uint64_t)paletteIndex << (bitOffset & 63));
+}
+
+// Returns UINT32_MAX if the block isn't in the palette. Unused entries are found as well.
+uint32_t Chunk::findPaletteIndex(Block block) {
+    if (paletteLookup == nullptr) {
+        for (uint32_t i = 0; i < paletteSize; ++i) {
+            if (palette[i] == block) {
+                return i;
+            }
+        }
+
+        return UINT32_MAX;
+    }
+
+    for (uint32_t slot = hashBlock(block) & paletteLookupMask; paletteLookup[slot] != 0; slot = (slot + 1) & paletteLookupMask) {
+        if (palette[paletteLookup[slot] - 1] == block) {
+            return paletteLookup[slot] - 1;
+        }
+    }
+
+    return UINT32_MAX;
+}
+
+// Reuses an unused entry if there is one, and otherwise appends one. Full palettes double their
+// capacity, which widens the blocks if it no longer fits their bits. The new entry is unused until
+// the caller counts it.
+uint32_t Chunk::addPaletteEntry(Block block) {
+    if (freePaletteEntryCount != 0) {
+        for (uint32_t i = 0; i < paletteSize; ++i) {
+            if (paletteCounts[i] == 0) {
+                removePaletteLookup(i);
+                palette[i] = block;
+                insertPaletteLookup(i);
+
+                return i;
+            }
+        }
+    }
+
+    if (paletteSize == paletteCapacity) {
+        uint32_t newBitsPerBlock = getPaletteBitsPerBlock(paletteCapacity * 2);
+
+        if (newBitsPerBlock != bitsPerBlock) {
+            repack(newBitsPerBlock, nullptr);
+        }
+
+        reallocatePalette(paletteCapacity * 2);
+        createPaletteLookup();
+    }
+
+    uint32_t paletteIndex = paletteSize++;
+
+    palette[paletteIndex] = block;
+    paletteCounts[paletteIndex] = 0;
+    ++freePaletteEntryCount;
+
+    insertPaletteLookup(paletteIndex);
+
+    return paletteIndex;
+}
+
+// The lookup stores palette indices plus one, so that zero marks an empty slot.
+void Chunk::insertPaletteLookup(uint32_t paletteIndex) {
+    if (paletteLookup == nullptr) {
+        return;
+    }
+
+    uint32_t slot = hashBlock(palette[paletteIndex]) & paletteLookupMask;
+
+    while (paletteLookup[slot] != 0) {
+        slot = (slot + 1) & paletteLookupMask;
+    }
+
+    paletteLookup[slot] = paletteIndex + 1;
+}
+
+// Shifts the following entries of the probe sequence back instead of leaving a tombstone.
+void Chunk::removePaletteLookup(uint32_t paletteIndex) {
+    if (paletteLookup == nullptr) {
+        return;
+    }
+
+    uint32_t slot = hashBlock(palette[paletteIndex]) & paletteLookupMask;
+
+    while (paletteLookup[slot] != paletteIndex + 1) {
+        slot = (slot + 1) & paletteLookupMask;
+    }
+
+    for (uint32_t next = (slot + 1) & paletteLookupMask; paletteLookup[next] != 0; next = (next + 1) & paletteLookupMask) {
+        uint32_t home = hashBlock(palette[paletteLookup[next] - 1]) & paletteLookupMask;
+
+        // Entries whose home lies cyclically after the hole have to stay.
+        if (((next - home) & paletteLookupMask) >= ((next - slot) & paletteLookupMask)) {
+            paletteLookup[slot] = paletteLookup[next];
+            slot = next;
+        }
+    }
+
+    paletteLookup[slot] = 0;
+}
+
+// Small palettes are faster to search linearly. Large ones get a table of twice their capacity.
+void Chunk::createPaletteLookup() {
+    delete[] paletteLookup;
+
+    if (paletteCapacity <= MAX_LINEAR_PALETTE_SIZE) {
+        paletteLookup = nullptr;
+        paletteLookupMask = 0;
+        return;
+    }
+
+    paletteLookup = new uint32_t[paletteCapacity * 2]();
+    paletteLookupMask = paletteCapacity * 2 - 1;
+
+    for (uint32_t i = 0; i < paletteSize; ++i) {
+        insertPaletteLookup(i);
+    }
+}
+
+void Chunk::reallocatePalette(uint32_t capacity) {
+    Block* newPalette = new Block[capacity];
+    uint16_t* newPaletteCounts = new uint16_t[capacity];
+
+    memcpy(newPalette, palette, paletteSize * sizeof(Block));
+    memcpy(newPaletteCounts, paletteCounts, paletteSize * sizeof(uint16_t));
+
+    delete[] paletteCounts;
+    delete[] palette;
+
+    palette = newPalette;
+    paletteCounts = newPaletteCounts;
+    paletteCapacity = capacity;
+}
+
+// Rewrites the blocks with a different number of bits, optionally remapping their palette indices.
+void Chunk::repack(uint32_t newBitsPerBlock, const uint32_t* remap) {
+    uint64_t* newData = newBitsPerBlock != 0 ? new uint64_t[CHUNK_BLOCK_COUNT * newBitsPerBlock / 64]() : nullptr;
+
+    if (newBitsPerBlock != 0) {
+        for (uint32_t i = 0; i < CHUNK_BLOCK_COUNT; ++i) {
+            uint32_t paletteIndex = getPaletteIndex(i);
+            uint32_t bitOffset = i * newBitsPerBlock;
+
+            newData[bitOffset >> 6] |= (uint64_t)(remap != nullptr ? remap[paletteIndex] : paletteIndex) << (bitOffset & 63);
+        }
+    }
+
+    delete[] data;
+
+    data = newData;
+    bitsPerBlock = newBitsPerBlock;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint16_t Block;
+
+constexpr Block AIR = 0;
+
+constexpr uint32_t CHUNK_SIZE = 32;
+constexpr uint32_t CHUNK_BLOCK_COUNT = CHUNK_SIZE * CHUNK_SIZE * CHUNK_SIZE;
+
+// Blocks are indexed with x varying fastest, then y, then z.
+inline uint32_t getBlockIndex(uint32_t x, uint32_t y, uint32_t z) {
+    return (z * CHUNK_SIZE + y) * CHUNK_SIZE + x;
+}
+
+// Stores the blocks of a chunk as indices into a palette of the distinct blocks, bit-packed with
+// 0, 1, 2, 4, 8 or 16 bits per block depending on the palette size. A chunk of a single block
+// has no block data at all. Since the widths are powers of two, a block never straddles two
+// words, so getting and setting a block are a shift and a mask. Palette entries count their
+// blocks, and entries that are no longer used are only dropped when the palette would otherwise
+// have to grow, or by compact().
+class Chunk {
+public:
+    Chunk() = default;
+    explicit Chunk(Block block);
+    void destroy();
+
+    Block get(uint32_t index);
+    void set(uint32_t index, Block block);
+    void fill(Block block);
+
+    // Unpacks or packs all blocks at once, which is much faster than getting or setting them
+    // one by one.
+    void decode(Block* blocks);
+    void encode(const Block* blocks);
+
+    void compact();
+
+    bool isUniform();
+    uint32_t getBitsPerBlock();
+    uint32_t getPaletteSize();
+    size_t getMemoryUsage();
+
+private:
+    // Palettes up to this size are searched linearly, larger ones through a hash table.
+    static constexpr uint32_t MAX_LINEAR_PALETTE_SIZE = 16;
+
+    uint64_t* data;
+    uint32_t bitsPerBlock;
+    Block* palette;
+    uint16_t* paletteCounts;
+    uint32_t paletteSize;
+    uint32_t paletteCapacity;
+    uint32_t freePaletteEntryCount;
+    uint32_t* paletteLookup;
+    uint32_t paletteLookupMask;
+
+    uint32_t getPaletteIndex(uint32_t index);
+    void setPaletteIndex(uint32_t index, uint32_t paletteIndex);
+
+    uint32_t findPaletteIndex(Block block);
+    uint32_t addPaletteEntry(Block block);
+    void insertPaletteLookup(uint32_t paletteIndex);
+    void removePaletteLookup(uint32_t paletteIndex);
+    void createPaletteLookup();
+    void reallocatePalette(uint32_t capacity);
+
+    void repack(uint32_t newBitsPerBlock, const uint32_t* remap);
+};
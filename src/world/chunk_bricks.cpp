@@ -0,0 +1,111 @@
+#include "chunk_bricks.h"
+
+#include <bit>
+
+static_assert(BRICK_SIZE == 8, "Brick rows are packed into bytes");
+
+// Finds the most common solid block with a linear palette, since bricks rarely have many.
+static Block findMostCommonBlock(const Block* blocks, uint32_t originIndex) {
+    static thread_local Block palette[BRICK_SIZE * BRICK_SIZE * BRICK_SIZE];
+    static thread_local uint32_t counts[BRICK_SIZE * BRICK_SIZE * BRICK_SIZE];
+
+    uint32_t paletteSize = 0;
+    Block mostCommonBlock = AIR;
+    uint32_t mostCommonCount = 0;
+
+    for (uint32_t z = 0; z < BRICK_SIZE; ++z) {
+        for (uint32_t y = 0; y < BRICK_SIZE; ++y) {
+            const Block* row = &blocks[originIndex + getBlockIndex(0, y, z)];
+
+            for (uint32_t x = 0; x < BRICK_SIZE; ++x) {
+                if (row[x] == AIR) {
+                    continue;
+                }
+
+                uint32_t i = 0;
+
+                while (i < paletteSize && palette[i] != row[x]) {
+                    ++i;
+                }
+
+                if (i == paletteSize) {
+                    palette[paletteSize] = row[x];
+                    counts[paletteSize++] = 0;
+                }
+
+                if (++counts[i] > mostCommonCount) {
+                    mostCommonBlock = row[x];
+                    mostCommonCount = counts[i];
+                }
+            }
+        }
+    }
+
+    return mostCommonBlock;
+}
+
+uint32_t buildChunkBricks(const Block* blocks, Brick* bricks, BrickBounds* bounds) {
+    uint32_t brickCount = 0;
+
+    for (uint32_t brickZ = 0; brickZ < CHUNK_BRICK_SIZE; ++brickZ) {
+        for (uint32_t brickY = 0; brickY < CHUNK_BRICK_SIZE; ++brickY) {
+            for (uint32_t brickX = 0; brickX < CHUNK_BRICK_SIZE; ++brickX) {
+                uint32_t originX = brickX * BRICK_SIZE;
+                uint32_t originY = brickY * BRICK_SIZE;
+                uint32_t originZ = brickZ * BRICK_SIZE;
+                uint32_t originIndex = getBlockIndex(originX, originY, originZ);
+
+                Brick& brick = bricks[brickCount];
+
+                // Pack every row of the brick into a byte, and bound the solid blocks by the
+                // rows that have any and the lowest and highest bits set in them.
+                uint32_t rowUnion = 0;
+                uint32_t minY = BRICK_SIZE, maxY = 0;
+                uint32_t minZ = BRICK_SIZE, maxZ = 0;
+
+                for (uint32_t z = 0; z < BRICK_SIZE; ++z) {
+                    for (uint32_t y = 0; y < BRICK_SIZE; ++y) {
+                        const Block* row = &blocks[originIndex + getBlockIndex(0, y, z)];
+                        uint32_t rowBits = 0;
+
+                        for (uint32_t x = 0; x < BRICK_SIZE; ++x) {
+                            rowBits |= (uint32_t)(row[x] != AIR) << x;
+                        }
+
+                        uint32_t rowIndex = z * BRICK_SIZE + y;
+
+                        if (rowIndex % 4 == 0) {
+                            brick.occupancy[rowIndex / 4] = 0;
+                        }
+
+                        brick.occupancy[rowIndex / 4] |= rowBits << (rowIndex % 4 * 8);
+
+                        if (rowBits != 0) {
+                            rowUnion |= rowBits;
+                            minY = y < minY ? y : minY;
+                            maxY = y > maxY ? y : maxY;
+                            minZ = z < minZ ? z : minZ;
+                            maxZ = z > maxZ ? z : maxZ;
+                        }
+                    }
+                }
+
+                if (rowUnion == 0) {
+                    continue;
+                }
+
+                brick.origin = originX | originY << 8 | originZ << 16;
+                brick.block = findMostCommonBlock(blocks, originIndex);
+
+                bounds[brickCount] = {
+                    .min = { (float)(originX + std::countr_zero(rowUnion)), (float)(originY + minY), (float)(originZ + minZ) },
+                    .max = { (float)(originX + 32 - std::countl_zero(rowUnion)), (float)(originY + maxY + 1), (float)(originZ + maxZ + 1) }
+                };
+
+                ++brickCount;
+            }
+        }
+    }
+
+    return brickCount;
+}
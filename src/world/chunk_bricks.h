@@ -0,0 +1,27 @@
+#pragma once
+
+#include "chunk.h"
+
+constexpr uint32_t BRICK_SIZE = 8;
+constexpr uint32_t CHUNK_BRICK_SIZE = CHUNK_SIZE / BRICK_SIZE;
+constexpr uint32_t CHUNK_BRICK_COUNT = CHUNK_BRICK_SIZE * CHUNK_BRICK_SIZE * CHUNK_BRICK_SIZE;
+
+// Bit (z * 8 + y) * 8 + x of the occupancy is set for the solid blocks of the brick, which has its
+// origin in chunk space packed into 8 bits per axis. Since a brick only has one block, it shades
+// as the most common of its blocks. The layout matches the bricks that the intersection shader
+// traverses.
+struct Brick {
+    uint32_t occupancy[BRICK_SIZE * BRICK_SIZE * BRICK_SIZE / 32];
+    uint32_t origin;
+    uint32_t block;
+};
+
+// The bounds of the solid blocks of a brick in chunk space, in the layout of VkAabbPositionsKHR.
+struct BrickBounds {
+    float min[3];
+    float max[3];
+};
+
+// Splits a decoded chunk into bricks and writes the bricks that have solid blocks, with their
+// bounds. Returns their count, which is at most CHUNK_BRICK_COUNT.
+uint32_t buildChunkBricks(const Block* blocks, Brick* bricks, BrickBounds* bounds);
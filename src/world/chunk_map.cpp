@@ -0,0 +1,175 @@
+#include "chunk_map.h"
+
+#include <bit>
+
+static_assert((CHUNK_SIZE & (CHUNK_SIZE - 1)) == 0, "Chunk coordinates are found by shifting");
+
+static constexpr int32_t CHUNK_SHIFT = std::countr_zero(CHUNK_SIZE);
+
+static uint64_t hashCoordinate(ChunkCoordinate coordinate) {
+    // Pack the coordinates and mix their bits with the finalizer of MurmurHash3.
+    uint64_t hash = (uint64_t)(uint32_t)coordinate.x * 0x9e3779b97f4a7c15ull;
+    hash ^= (uint64_t)(uint32_t)coordinate.y * 0xc2b2ae3d27d4eb4full;
+    hash ^= (uint64_t)(uint32_t)coordinate.z * 0x165667b19e3779f9ull;
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+static bool operator==(ChunkCoordinate a, ChunkCoordinate b) {
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+// The capacity is rounded up to a power of two.
+ChunkMap::ChunkMap(uint32_t capacity) : capacity(std::bit_ceil(capacity < 16 ? 16 : capacity)), count(0) {
+    slots = new ChunkSlot[this->capacity];
+
+    for (uint32_t i = 0; i < this->capacity; ++i) {
+        slots[i].used = false;
+    }
+}
+
+void ChunkMap::destroy() {
+    for (uint32_t i = 0; i < capacity; ++i) {
+        if (slots[i].used) {
+            slots[i].chunk.destroy();
+        }
+    }
+
+    delete[] slots;
+}
+
+Chunk* ChunkMap::find(ChunkCoordinate coordinate) {
+    uint32_t slot = findSlot(coordinate);
+
+    return slots[slot].used ? &slots[slot].chunk : nullptr;
+}
+
+// Returns the existing chunk, or a new chunk of air.
+Chunk& ChunkMap::insert(ChunkCoordinate coordinate) {
+    uint32_t slot = findSlot(coordinate);
+
+    if (slots[slot].used) {
+        return slots[slot].chunk;
+    }
+
+    if ((count + 1) * 4 > capacity * 3) {
+        grow();
+        slot = findSlot(coordinate);
+    }
+
+    slots[slot] = {
+        .used       = true,
+        .coordinate = coordinate,
+        .chunk      = Chunk(AIR)
+    };
+
+    ++count;
+
+    return slots[slot].chunk;
+}
+
+bool ChunkMap::remove(ChunkCoordinate coordinate) {
+    uint32_t slot = findSlot(coordinate);
+
+    if (!slots[slot].used) {
+        return false;
+    }
+
+    slots[slot].chunk.destroy();
+
+    uint32_t mask = capacity - 1;
+
+    for (uint32_t next = (slot + 1) & mask; slots[next].used; next = (next + 1) & mask) {
+        uint32_t home = hashCoordinate(slots[next].coordinate) & mask;
+
+        // Chunks whose home lies cyclically after the hole have to stay.
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            slots[slot] = slots[next];
+            slot = next;
+        }
+    }
+
+    slots[slot].used = false;
+    --count;
+
+    return true;
+}
+
+Block ChunkMap::getBlock(int32_t x, int32_t y, int32_t z) {
+    Chunk* chunk = find({ x >> CHUNK_SHIFT, y >> CHUNK_SHIFT, z >> CHUNK_SHIFT });
+
+    if (chunk == nullptr) {
+        return AIR;
+    }
+
+    return chunk->get(getBlockIndex(x & (CHUNK_SIZE - 1), y & (CHUNK_SIZE - 1), z & (CHUNK_SIZE - 1)));
+}
+
+void ChunkMap::setBlock(int32_t x, int32_t y, int32_t z, Block block) {
+    ChunkCoordinate coordinate = { x >> CHUNK_SHIFT, y >> CHUNK_SHIFT, z >> CHUNK_SHIFT };
+    Chunk* chunk = find(coordinate);
+
+    if (chunk == nullptr) {
+        if (block == AIR) {
+            return;
+        }
+
+        chunk = &insert(coordinate);
+    }
+
+    chunk->set(getBlockIndex(x & (CHUNK_SIZE - 1), y & (CHUNK_SIZE - 1), z & (CHUNK_SIZE - 1)), block);
+}
+
+uint32_t ChunkMap::getChunkCount() {
+    return count;
+}
+
+size_t ChunkMap::getMemoryUsage() {
+    size_t size = sizeof(ChunkMap) + capacity * sizeof(ChunkSlot);
+
+    for (uint32_t i = 0; i < capacity; ++i) {
+        if (slots[i].used) {
+            size += slots[i].chunk.getMemoryUsage() - sizeof(Chunk);
+        }
+    }
+
+    return size;
+}
+
+// Returns the slot of the chunk, or the empty slot that ends its probe sequence.
+uint32_t ChunkMap::findSlot(ChunkCoordinate coordinate) {
+    uint32_t mask = capacity - 1;
+    uint32_t slot = hashCoordinate(coordinate) & mask;
+
+    while (slots[slot].used && !(slots[slot].coordinate == coordinate)) {
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+void ChunkMap::grow() {
+    ChunkSlot* oldSlots = slots;
+    uint32_t oldCapacity = capacity;
+
+    capacity *= 2;
+    slots = new ChunkSlot[capacity];
+
+    for (uint32_t i = 0; i < capacity; ++i) {
+        slots[i].used = false;
+    }
+
+    for (uint32_t i = 0; i < oldCapacity; ++i) {
+        if (oldSlots[i].used) {
+            slots[findSlot(oldSlots[i].coordinate)] = oldSlots[i];
+        }
+    }
+
+    delete[] oldSlots;
+}
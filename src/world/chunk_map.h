@@ -0,0 +1,55 @@
+#pragma once
+
+#include "chunk.h"
+
+struct ChunkCoordinate {
+    int32_t x;
+    int32_t y;
+    int32_t z;
+};
+
+struct ChunkSlot {
+    bool used;
+    ChunkCoordinate coordinate;
+    Chunk chunk;
+};
+
+// Maps chunk coordinates to chunks with open addressing and linear probing, so that a sparse world
+// only stores the chunks that exist. Chunks live in the slots themselves, which are never more
+// than three quarters full, and removing one shifts the rest of its probe sequence back instead
+// of leaving a tombstone. Pointers to chunks are invalidated by insert() and remove().
+class ChunkMap {
+public:
+    ChunkMap() = default;
+    explicit ChunkMap(uint32_t capacity);
+    void destroy();
+
+    Chunk* find(ChunkCoordinate coordinate);
+    Chunk& insert(ChunkCoordinate coordinate);
+    bool remove(ChunkCoordinate coordinate);
+
+    // Blocks are addressed by world coordinate. Missing chunks are air, and setting air in them
+    // doesn't create them.
+    Block getBlock(int32_t x, int32_t y, int32_t z);
+    void setBlock(int32_t x, int32_t y, int32_t z, Block block);
+
+    uint32_t getChunkCount();
+    size_t getMemoryUsage();
+
+    template<typename Function>
+    void forEachChunk(Function function) {
+        for (uint32_t i = 0; i < capacity; ++i) {
+            if (slots[i].used) {
+                function(slots[i].coordinate, slots[i].chunk);
+            }
+        }
+    }
+
+private:
+    ChunkSlot* slots;
+    uint32_t capacity;
+    uint32_t count;
+
+    uint32_t findSlot(ChunkCoordinate coordinate);
+    void grow();
+};
@@ -0,0 +1,329 @@
+#include "chunk_mesher.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <bit>
+
+static constexpr uint32_t COLUMN_COUNT = CHUNK_SIZE * CHUNK_SIZE;
+static constexpr uint32_t AXIS_STRIDES[] = { 1, CHUNK_SIZE, CHUNK_SIZE * CHUNK_SIZE };
+
+void writeQuadIndices(uint32_t quadCount, uint32_t* indices) {
+    for (uint32_t i = 0; i < quadCount; ++i) {
+        uint32_t vertex = i * 4;
+
+        indices[i * 6 + 0] = vertex;
+        indices[i * 6 + 1] = vertex + 1;
+        indices[i * 6 + 2] = vertex + 2;
+        indices[i * 6 + 3] = vertex;
+        indices[i * 6 + 4] = vertex + 2;
+        indices[i * 6 + 5] = vertex + 3;
+    }
+}
+
+static void reserveQuads(ChunkMeshArena& arena, uint32_t quadCount) {
+    if (quadCount <= arena.quadCapacity) {
+        return;
+    }
+
+    arena.quadCapacity = std::max(arena.quadCapacity * 2, quadCount);
+
+    float* vertices = new float[arena.quadCapacity * 12];
+    uint32_t* quadAttributes = new uint32_t[arena.quadCapacity];
+
+    if (arena.quadCount > 0) {
+        memcpy(vertices, arena.vertices, arena.quadCount * 12 * sizeof(float));
+        memcpy(quadAttributes, arena.quadAttributes, arena.quadCount * sizeof(uint32_t));
+    }
+
+    delete[] arena.quadAttributes;
+    delete[] arena.vertices;
+
+    arena.vertices = vertices;
+    arena.quadAttributes = quadAttributes;
+}
+
+// Corners are given as (axis, u, v) coordinates, which are rotated back into chunk space.
+static void emitQuad(ChunkMeshArena& arena, uint32_t axis, bool positive, uint32_t depth, uint32_t u, uint32_t v, uint32_t width, uint32_t height, Block block) {
+    reserveQuads(arena, arena.quadCount + 1);
+
+    uint32_t face = depth + (positive ? 1 : 0);
+
+    // Counter-clockwise around the normal of the face.
+    uint32_t corners[4][2] = {
+        { u, v },
+        { u + width, v },
+        { u + width, v + height },
+        { u, v + height }
+    };
+
+    if (!positive) {
+        std::swap(corners[1], corners[3]);
+    }
+
+    float* vertices = &arena.vertices[arena.quadCount * 12];
+
+    for (uint32_t i = 0; i < 4; ++i) {
+        vertices[i * 3 + axis] = (float)face;
+        vertices[i * 3 + (axis + 1) % 3] = (float)corners[i][0];
+        vertices[i * 3 + (axis + 2) % 3] = (float)corners[i][1];
+    }
+
+    arena.quadAttributes[arena.quadCount] = block | (axis * 2 + (positive ? 0 : 1)) << CHUNK_QUAD_FACE_SHIFT;
+    ++arena.quadCount;
+}
+
+// Packs the boundary blocks of a neighbouring chunk into the end bits of the columns.
+static void packNeighbour(ChunkMap& chunkMap, ChunkCoordinate coordinate, uint32_t axis, bool positive, uint64_t* columns) {
+    int32_t* component = axis == 0 ? &coordinate.x : axis == 1 ? &coordinate.y : &coordinate.z;
+    *component += positive ? 1 : -1;
+
+    Chunk* neighbour = chunkMap.find(coordinate);
+
+    if (neighbour == nullptr) {
+        return;
+    }
+
+    uint64_t bit = positive ? 1ull << (CHUNK_SIZE + 1) : 1;
+
+    if (neighbour->isUniform()) {
+        if (neighbour->get(0) != AIR) {
+            for (uint32_t i = 0; i < COLUMN_COUNT; ++i) {
+                columns[i] |= bit;
+            }
+        }
+
+        return;
+    }
+
+    uint32_t depthIndex = (positive ? 0 : CHUNK_SIZE - 1) * AXIS_STRIDES[axis];
+
+    for (uint32_t v = 0; v < CHUNK_SIZE; ++v) {
+        for (uint32_t u = 0; u < CHUNK_SIZE; ++u) {
+            uint32_t index = depthIndex + u * AXIS_STRIDES[(axis + 1) % 3] + v * AXIS_STRIDES[(axis + 2) % 3];
+
+            if (neighbour->get(index) != AIR) {
+                columns[v * CHUNK_SIZE + u] |= bit;
+            }
+        }
+    }
+}
+
+// Merges the visible faces of one slice, whose rows are indexed by v and have a bit per u.
+static void mergeSlice(const Block* blocks, uint32_t* plane, uint32_t axis, bool positive, uint32_t depth, ChunkMeshArena& arena) {
+    uint32_t depthIndex = depth * AXIS_STRIDES[axis];
+    uint32_t uStride = AXIS_STRIDES[(axis + 1) % 3];
+    uint32_t vStride = AXIS_STRIDES[(axis + 2) % 3];
+
+    for (uint32_t v = 0; v < CHUNK_SIZE; ++v) {
+        while (plane[v] != 0) {
+            uint32_t u = std::countr_zero(plane[v]);
+            uint32_t rowIndex = depthIndex + v * vStride;
+            Block block = blocks[rowIndex + u * uStride];
+
+            // Grow the quad along the row, then over the following rows while they match.
+            uint32_t width = 1;
+
+            while (u + width < CHUNK_SIZE && (plane[v] >> (u + width) & 1) != 0 && blocks[rowIndex + (u + width) * uStride] == block) {
+                ++width;
+            }
+
+            uint32_t span = (width == 32 ? UINT32_MAX : (1u << width) - 1) << u;
+            uint32_t height = 1;
+
+            while (v + height < CHUNK_SIZE && (plane[v + height] & span) == span) {
+                uint32_t nextRowIndex = depthIndex + (v + height) * vStride;
+                bool matches = true;
+
+                for (uint32_t i = u; i < u + width && matches; ++i) {
+                    matches = blocks[nextRowIndex + i * uStride] == block;
+                }
+
+                if (!matches) {
+                    break;
+                }
+
+                ++height;
+            }
+
+            for (uint32_t i = 0; i < height; ++i) {
+                plane[v + i] &= ~span;
+            }
+
+            emitQuad(arena, axis, positive, depth, u, v, width, height, block);
+        }
+    }
+}
+
+static void meshChunk(ChunkMap& chunkMap, ChunkCoordinate coordinate, ChunkMesherScratch& scratch, ChunkMeshArena& arena) {
+    Chunk* chunk = chunkMap.find(coordinate);
+
+    if (chunk == nullptr || (chunk->isUniform() && chunk->get(0) == AIR)) {
+        return;
+    }
+
+    chunk->decode(scratch.blocks);
+
+    // Pack the solid blocks into columns along every axis. The column of axis a at (u, v) runs
+    // along a, with u along the next axis and v along the one after, and bit 0 and 33 hold the
+    // neighbouring chunks.
+    uint64_t* columns[3] = { scratch.columns, scratch.columns + COLUMN_COUNT, scratch.columns + 2 * COLUMN_COUNT };
+
+    memset(scratch.columns, 0, 3 * COLUMN_COUNT * sizeof(uint64_t));
+
+    for (uint32_t z = 0; z < CHUNK_SIZE; ++z) {
+        for (uint32_t y = 0; y < CHUNK_SIZE; ++y) {
+            const Block* row = &scratch.blocks[getBlockIndex(0, y, z)];
+            uint64_t xColumn = 0;
+
+            for (uint32_t x = 0; x < CHUNK_SIZE; ++x) {
+                if (row[x] != AIR) {
+                    xColumn |= 1ull << (x + 1);
+                    columns[1][x * CHUNK_SIZE + z] |= 1ull << (y + 1);
+                    columns[2][y * CHUNK_SIZE + x] |= 1ull << (z + 1);
+                }
+            }
+
+            columns[0][z * CHUNK_SIZE + y] = xColumn;
+        }
+    }
+
+    for (uint32_t axis = 0; axis < 3; ++axis) {
+        packNeighbour(chunkMap, coordinate, axis, false, columns[axis]);
+        packNeighbour(chunkMap, coordinate, axis, true, columns[axis]);
+    }
+
+    for (uint32_t axis = 0; axis < 3; ++axis) {
+        for (uint32_t direction = 0; direction < 2; ++direction) {
+            bool positive = direction == 0;
+            const uint64_t* axisColumns = columns[axis];
+
+            // A face is visible where a solid block is followed by air in its direction.
+            if (positive) {
+                for (uint32_t i = 0; i < COLUMN_COUNT; ++i) {
+                    scratch.faces[i] = (uint32_t)((axisColumns[i] & ~(axisColumns[i] >> 1)) >> 1);
+                }
+            }
+            else {
+                for (uint32_t i = 0; i < COLUMN_COUNT; ++i) {
+                    scratch.faces[i] = (uint32_t)((axisColumns[i] & ~(axisColumns[i] << 1)) >> 1);
+                }
+            }
+
+            // Transpose the faces into one plane per slice along the axis.
+            memset(scratch.planes, 0, CHUNK_SIZE * CHUNK_SIZE * sizeof(uint32_t));
+
+            for (uint32_t i = 0; i < COLUMN_COUNT; ++i) {
+                for (uint32_t faces = scratch.faces[i]; faces != 0; faces &= faces - 1) {
+                    scratch.planes[std::countr_zero(faces) * CHUNK_SIZE + i / CHUNK_SIZE] |= 1u << (i % CHUNK_SIZE);
+                }
+            }
+
+            for (uint32_t depth = 0; depth < CHUNK_SIZE; ++depth) {
+                mergeSlice(scratch.blocks, &scratch.planes[depth * CHUNK_SIZE], axis, positive, depth, arena);
+            }
+        }
+    }
+}
+
+static void runMeshJob(void* data, uint32_t chunkIndex, uint32_t workerIndex) {
+    ChunkMesherState* state = (ChunkMesherState*)data;
+    ChunkMeshArena& arena = state->arenas[workerIndex];
+
+    uint32_t offset = arena.quadCount;
+
+    meshChunk(*state->chunkMap, state->coordinates[chunkIndex], state->scratches[workerIndex], arena);
+
+    state->meshArenas[chunkIndex] = workerIndex;
+    state->meshOffsets[chunkIndex] = offset;
+    state->meshes[chunkIndex].quadCount = arena.quadCount - offset;
+}
+
+// Runs once all chunks are meshed, when the arenas don't move anymore, so the meshes can point
+// into them.
+static void resolveMeshes(void* data, uint32_t, uint32_t) {
+    ChunkMesherState* state = (ChunkMesherState*)data;
+
+    for (uint32_t i = 0; i < state->chunkCount; ++i) {
+        const ChunkMeshArena& arena = state->arenas[state->meshArenas[i]];
+
+        state->meshes[i].vertices = arena.vertices + state->meshOffsets[i] * 12;
+        state->meshes[i].quadAttributes = arena.quadAttributes + state->meshOffsets[i];
+    }
+}
+
+ChunkMesher::ChunkMesher(JobSystem& jobSystem) : state(new ChunkMesherState), meshCapacity(0) {
+    uint32_t workerCount = jobSystem.getWorkerCount();
+
+    state->jobSystem = &jobSystem;
+    state->meshArenas = nullptr;
+    state->meshOffsets = nullptr;
+    state->arenas = new ChunkMeshArena[workerCount];
+    state->scratches = new ChunkMesherScratch[workerCount];
+    state->meshJobs = nullptr;
+    state->resolveJob = { .function = resolveMeshes, .data = state, .index = 0, .mainThread = false };
+
+    for (uint32_t i = 0; i < workerCount; ++i) {
+        state->arenas[i] = {
+            .vertices       = nullptr,
+            .quadAttributes = nullptr,
+            .quadCount      = 0,
+            .quadCapacity   = 0
+        };
+
+        state->scratches[i] = {
+            .blocks  = new Block[CHUNK_BLOCK_COUNT],
+            .columns = new uint64_t[3 * COLUMN_COUNT],
+            .faces   = new uint32_t[COLUMN_COUNT],
+            .planes  = new uint32_t[CHUNK_SIZE * CHUNK_SIZE]
+        };
+    }
+}
+
+void ChunkMesher::destroy() {
+    for (uint32_t i = 0; i < state->jobSystem->getWorkerCount(); ++i) {
+        delete[] state->arenas[i].quadAttributes;
+        delete[] state->arenas[i].vertices;
+
+        delete[] state->scratches[i].planes;
+        delete[] state->scratches[i].faces;
+        delete[] state->scratches[i].columns;
+        delete[] state->scratches[i].blocks;
+    }
+
+    delete[] state->scratches;
+    delete[] state->arenas;
+    delete[] state->meshJobs;
+    delete[] state->meshOffsets;
+    delete[] state->meshArenas;
+    delete state;
+}
+
+void ChunkMesher::mesh(ChunkMap& chunkMap, uint32_t chunkCount, const ChunkCoordinate* coordinates, ChunkMesh* meshes, JobCounter& counter) {
+    if (chunkCount > meshCapacity) {
+        delete[] state->meshJobs;
+        delete[] state->meshOffsets;
+        delete[] state->meshArenas;
+
+        meshCapacity = std::max(meshCapacity * 2, chunkCount);
+        state->meshArenas = new uint32_t[meshCapacity];
+        state->meshOffsets = new uint32_t[meshCapacity];
+        state->meshJobs = new Job[meshCapacity];
+    }
+
+    for (uint32_t i = 0; i < state->jobSystem->getWorkerCount(); ++i) {
+        state->arenas[i].quadCount = 0;
+    }
+
+    state->chunkMap = &chunkMap;
+    state->chunkCount = chunkCount;
+    state->coordinates = coordinates;
+    state->meshes = meshes;
+
+    for (uint32_t i = 0; i < chunkCount; ++i) {
+        state->meshJobs[i] = { .function = runMeshJob, .data = state, .index = i, .mainThread = false };
+    }
+
+    state->jobSystem->submit(chunkCount, state->meshJobs, state->meshCounter);
+    state->jobSystem->submit(1, &state->resolveJob, counter, state->meshCounter);
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <job_system.h>
+
+#include "chunk_map.h"
+
+// The attributes of a quad hold its block in the low 16 bits and its face in the next 3.
+enum ChunkFace : uint32_t {
+    CHUNK_FACE_POSITIVE_X,
+    CHUNK_FACE_NEGATIVE_X,
+    CHUNK_FACE_POSITIVE_Y,
+    CHUNK_FACE_NEGATIVE_Y,
+    CHUNK_FACE_POSITIVE_Z,
+    CHUNK_FACE_NEGATIVE_Z
+};
+
+constexpr uint32_t CHUNK_QUAD_FACE_SHIFT = 16;
+
+// Every quad has four vertices of three floats in chunk space, in the layout that BLASes are built
+// from, and its triangles are indexed by writeQuadIndices().
+struct ChunkMesh {
+    uint32_t quadCount;
+    const float* vertices;
+    const uint32_t* quadAttributes;
+};
+
+// Per-thread buffers that only ever grow, so meshing allocates nothing once they're large enough.
+struct ChunkMeshArena {
+    float* vertices;
+    uint32_t* quadAttributes;
+    uint32_t quadCount;
+    uint32_t quadCapacity;
+};
+
+struct ChunkMesherScratch {
+    Block* blocks;
+    uint64_t* columns;
+    uint32_t* faces;
+    uint32_t* planes;
+};
+
+struct ChunkMesherState {
+    JobSystem* jobSystem;
+    ChunkMap* chunkMap;
+    uint32_t chunkCount;
+    const ChunkCoordinate* coordinates;
+    ChunkMesh* meshes;
+    uint32_t* meshArenas;
+    uint32_t* meshOffsets;
+    ChunkMeshArena* arenas;
+    ChunkMesherScratch* scratches;
+    Job* meshJobs;
+    Job resolveJob;
+    JobCounter meshCounter;
+};
+
+// The same indices serve every mesh, so they can be shared by all chunk BLASes.
+void writeQuadIndices(uint32_t quadCount, uint32_t* indices);
+
+// Meshes chunks with greedy meshing, which merges neighbouring visible faces of the same block
+// into quads. Solid blocks are packed into 64-bit columns along every axis, with a block of the
+// neighbouring chunks at each end, so that the visible faces of 32 blocks at a time are found
+// with a shift and a mask, in loops that compilers vectorize. The faces are then transposed into
+// 32x32 bit planes per slice, which are merged row by row.
+//
+// Chunks are meshed in parallel as a job per chunk, into an arena per worker of the job system.
+// The chunk map must not change until the meshes are done.
+class ChunkMesher {
+public:
+    ChunkMesher() = default;
+    explicit ChunkMesher(JobSystem& jobSystem);
+    void destroy();
+
+    // Submits the jobs and returns. The meshes are done once the counter reaches zero, and valid
+    // until the next call, which mustn't come before.
+    void mesh(ChunkMap& chunkMap, uint32_t chunkCount, const ChunkCoordinate* coordinates, ChunkMesh* meshes, JobCounter& counter);
+
+private:
+    ChunkMesherState* state;
+    uint32_t meshCapacity;
+};
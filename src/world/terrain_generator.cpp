@@ -0,0 +1,333 @@
+#include "terrain_generator.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+#include "terrain_noise.h"
+
+static constexpr uint32_t X_HASH = 0x27d4eb2du;
+static constexpr uint32_t Y_HASH = 0x9e3779b1u;
+static constexpr uint32_t Z_HASH = 0x165667b1u;
+static constexpr uint32_t MIX_HASH = 0x2c1b3c6du;
+
+static uint32_t finishHash(uint32_t hash) {
+    hash ^= hash >> 15;
+    hash *= MIX_HASH;
+    hash ^= hash >> 12;
+
+    return hash;
+}
+
+TerrainScratch createTerrainScratch() {
+    TerrainScratch scratch = {
+        .heights = new int32_t[CHUNK_SIZE * CHUNK_SIZE],
+        .blocks  = new Block[CHUNK_BLOCK_COUNT]
+    };
+
+    return scratch;
+}
+
+void destroyTerrainScratch(TerrainScratch& scratch) {
+    delete[] scratch.blocks;
+    delete[] scratch.heights;
+}
+
+void generateTerrainColumn(const TerrainSettings& settings, int32_t x, int32_t z, TerrainScratch& scratch, Chunk* chunks, bool* empty) {
+    int32_t* heights = scratch.heights;
+    Block* blocks = scratch.blocks;
+
+    int32_t minX = x * (int32_t)CHUNK_SIZE;
+    int32_t minZ = z * (int32_t)CHUNK_SIZE;
+    int32_t maxHeight = INT32_MIN;
+
+    for (uint32_t blockZ = 0; blockZ < CHUNK_SIZE; ++blockZ) {
+        float noise[CHUNK_SIZE];
+        sampleNoiseRow(settings.seed, settings.octaveCount, minX * settings.frequency, (minZ + (int32_t)blockZ) * settings.frequency, settings.frequency, CHUNK_SIZE, noise);
+
+        for (uint32_t blockX = 0; blockX < CHUNK_SIZE; ++blockX) {
+            int32_t height = (int32_t)floorf(settings.baseHeight + settings.amplitude * noise[blockX]);
+
+            heights[blockZ * CHUNK_SIZE + blockX] = height;
+            maxHeight = std::max(maxHeight, height);
+        }
+    }
+
+    uint32_t oreMask = settings.oreRarity - 1;
+
+    for (int32_t chunkY = 0; chunkY < settings.chunkHeight; ++chunkY) {
+        int32_t minY = chunkY * (int32_t)CHUNK_SIZE;
+
+        // Any chunk that reaches the highest surface has at least one solid block.
+        empty[chunkY] = minY > maxHeight;
+
+        if (empty[chunkY]) {
+            continue;
+        }
+
+        for (uint32_t blockZ = 0; blockZ < CHUNK_SIZE; ++blockZ) {
+            const int32_t* rowHeights = &heights[blockZ * CHUNK_SIZE];
+
+            for (uint32_t blockY = 0; blockY < CHUNK_SIZE; ++blockY) {
+                int32_t worldY = minY + (int32_t)blockY;
+                uint32_t rowHash = (uint32_t)worldY * Y_HASH ^ (uint32_t)(minZ + (int32_t)blockZ) * Z_HASH ^ settings.seed;
+                Block* rowBlocks = &blocks[getBlockIndex(0, blockY, blockZ)];
+
+                for (uint32_t blockX = 0; blockX < CHUNK_SIZE; ++blockX) {
+                    int32_t height = rowHeights[blockX];
+                    uint32_t hash = finishHash((uint32_t)(minX + (int32_t)blockX) * X_HASH ^ rowHash);
+
+                    Block stone = (hash & oreMask) == 0 ? settings.ore : settings.stone;
+                    Block ground = worldY < height - settings.dirtDepth ? stone : settings.dirt;
+                    Block surface = worldY == height ? settings.grass : AIR;
+
+                    rowBlocks[blockX] = worldY < height ? ground : surface;
+                }
+            }
+        }
+
+        chunks[chunkY] = Chunk(AIR);
+        chunks[chunkY].encode(blocks);
+    }
+}
+
+static uint32_t wrapCoordinate(int32_t coordinate, int32_t gridSize) {
+    return (uint32_t)(((coordinate % gridSize) + gridSize) % gridSize);
+}
+
+static TerrainCell& getCell(TerrainGeneratorState* state, int32_t x, int32_t z) {
+    return state->cells[wrapCoordinate(z, state->gridSize) * state->gridSize + wrapCoordinate(x, state->gridSize)];
+}
+
+// Distances are measured to the centers of the columns.
+static float getDistance(const TerrainView& view, int32_t x, int32_t z) {
+    float offsetX = (float)x + 0.5f - view.x;
+    float offsetZ = (float)z + 0.5f - view.z;
+
+    return sqrtf(offsetX * offsetX + offsetZ * offsetZ);
+}
+
+// Columns count as farther away the further they are from the view direction, with the ones right
+// behind the view counting as twice as far.
+static float getPriority(const TerrainView& view, int32_t x, int32_t z) {
+    float offsetX = (float)x + 0.5f - view.x;
+    float offsetZ = (float)z + 0.5f - view.z;
+
+    float distance = sqrtf(offsetX * offsetX + offsetZ * offsetZ);
+    float directionLength = sqrtf(view.directionX * view.directionX + view.directionZ * view.directionZ);
+
+    if (distance == 0.0f || directionLength == 0.0f) {
+        return distance;
+    }
+
+    float alignment = (offsetX * view.directionX + offsetZ * view.directionZ) / (distance * directionLength);
+
+    return distance * (1.5f - 0.5f * alignment);
+}
+
+static void generateRequestedColumn(void* data, uint32_t requestIndex, uint32_t workerIndex) {
+    TerrainGeneratorState* state = (TerrainGeneratorState*)data;
+    TerrainRequest& request = state->requests[requestIndex];
+
+    generateTerrainColumn(state->settings, request.x, request.z, state->scratches[workerIndex], request.chunks, request.empty);
+}
+
+// The map inserts chunks of air, which the generated chunks replace.
+static void insertColumn(TerrainGeneratorState* state, ChunkMap& chunkMap, TerrainRequest& request) {
+    for (int32_t y = 0; y < state->settings.chunkHeight; ++y) {
+        if (request.empty[y]) {
+            continue;
+        }
+
+        Chunk& chunk = chunkMap.insert({ request.x, y, request.z });
+        chunk.destroy();
+        chunk = request.chunks[y];
+    }
+}
+
+static void discardColumn(TerrainGeneratorState* state, TerrainRequest& request) {
+    for (int32_t y = 0; y < state->settings.chunkHeight; ++y) {
+        if (!request.empty[y]) {
+            request.chunks[y].destroy();
+        }
+    }
+}
+
+static void removeColumn(TerrainGeneratorState* state, ChunkMap& chunkMap, int32_t x, int32_t z) {
+    for (int32_t y = 0; y < state->settings.chunkHeight; ++y) {
+        chunkMap.remove({ x, y, z });
+    }
+}
+
+// Columns within reach of the view are at most 2 * (viewDistance + 1) + 1 columns apart along
+// either axis, so they never share a cell.
+TerrainGenerator::TerrainGenerator(JobSystem& jobSystem, const TerrainSettings& settings, uint32_t viewDistance, uint32_t maxPendingCount) {
+    state = new TerrainGeneratorState;
+
+    state->jobSystem    = &jobSystem;
+    state->settings     = settings;
+    state->viewDistance = (int32_t)viewDistance;
+    state->gridSize     = 2 * (int32_t)viewDistance + 3;
+
+    uint32_t cellCount = (uint32_t)(state->gridSize * state->gridSize);
+
+    state->cells = new TerrainCell[cellCount];
+    state->candidates = new TerrainCandidate[cellCount];
+
+    for (uint32_t i = 0; i < cellCount; ++i) {
+        state->cells[i] = { 0, 0, TERRAIN_CELL_EMPTY };
+    }
+
+    state->scratches = new TerrainScratch[jobSystem.getWorkerCount()];
+
+    for (uint32_t i = 0; i < jobSystem.getWorkerCount(); ++i) {
+        state->scratches[i] = createTerrainScratch();
+    }
+
+    state->requests = new TerrainRequest[maxPendingCount];
+    state->requestCount = maxPendingCount;
+    state->freeRequests = new uint32_t[maxPendingCount];
+    state->freeRequestCount = maxPendingCount;
+    state->pendingRequests = new uint32_t[maxPendingCount];
+    state->pendingRequestCount = 0;
+
+    for (uint32_t i = 0; i < maxPendingCount; ++i) {
+        state->requests[i].chunks = new Chunk[settings.chunkHeight];
+        state->requests[i].empty = new bool[settings.chunkHeight];
+        state->freeRequests[i] = maxPendingCount - 1 - i;
+    }
+}
+
+// Columns that are still being generated are waited for and discarded.
+void TerrainGenerator::destroy() {
+    for (uint32_t i = 0; i < state->pendingRequestCount; ++i) {
+        TerrainRequest& request = state->requests[state->pendingRequests[i]];
+
+        state->jobSystem->wait(request.counter);
+        discardColumn(state, request);
+    }
+
+    for (uint32_t i = 0; i < state->requestCount; ++i) {
+        delete[] state->requests[i].empty;
+        delete[] state->requests[i].chunks;
+    }
+
+    for (uint32_t i = 0; i < state->jobSystem->getWorkerCount(); ++i) {
+        destroyTerrainScratch(state->scratches[i]);
+    }
+
+    delete[] state->pendingRequests;
+    delete[] state->freeRequests;
+    delete[] state->requests;
+    delete[] state->scratches;
+    delete[] state->candidates;
+    delete[] state->cells;
+    delete state;
+}
+
+uint32_t TerrainGenerator::update(ChunkMap& chunkMap, const TerrainView& view, uint32_t budget) {
+    float unloadDistance = (float)state->viewDistance + 1.0f;
+    uint32_t changeCount = 0;
+
+    // Insert the columns that are done, unless they've fallen out of reach in the meantime. Their
+    // cells can't have been taken by other columns while they were pending.
+    for (uint32_t i = 0; i < state->pendingRequestCount;) {
+        uint32_t requestIndex = state->pendingRequests[i];
+        TerrainRequest& request = state->requests[requestIndex];
+
+        if (!state->jobSystem->isComplete(request.counter)) {
+            ++i;
+            continue;
+        }
+
+        TerrainCell& cell = getCell(state, request.x, request.z);
+
+        if (getDistance(view, request.x, request.z) <= unloadDistance) {
+            insertColumn(state, chunkMap, request);
+            cell.status = TERRAIN_CELL_LOADED;
+            ++changeCount;
+        }
+        else {
+            discardColumn(state, request);
+            cell.status = TERRAIN_CELL_EMPTY;
+        }
+
+        state->freeRequests[state->freeRequestCount++] = requestIndex;
+        state->pendingRequests[i] = state->pendingRequests[--state->pendingRequestCount];
+    }
+
+    // Remove the columns that are out of reach, which frees their cells for the columns that
+    // came into view.
+    int32_t gridSize = state->gridSize;
+
+    for (int32_t i = 0; i < gridSize * gridSize; ++i) {
+        TerrainCell& cell = state->cells[i];
+
+        if (cell.status == TERRAIN_CELL_LOADED && getDistance(view, cell.x, cell.z) > unloadDistance) {
+            removeColumn(state, chunkMap, cell.x, cell.z);
+            cell.status = TERRAIN_CELL_EMPTY;
+            ++changeCount;
+        }
+    }
+
+    // Find the missing columns in view. A cell that's still pending for a column out of reach
+    // holds up the column that replaces it until the next update.
+    int32_t viewX = (int32_t)floorf(view.x);
+    int32_t viewZ = (int32_t)floorf(view.z);
+    int32_t viewDistance = state->viewDistance;
+    uint32_t candidateCount = 0;
+
+    for (int32_t z = viewZ - viewDistance - 1; z <= viewZ + viewDistance + 1; ++z) {
+        for (int32_t x = viewX - viewDistance - 1; x <= viewX + viewDistance + 1; ++x) {
+            if (getDistance(view, x, z) > (float)viewDistance || getCell(state, x, z).status != TERRAIN_CELL_EMPTY) {
+                continue;
+            }
+
+            state->candidates[candidateCount++] = { getPriority(view, x, z), x, z };
+        }
+    }
+
+    // Start the most urgent ones within the budget, in order.
+    uint32_t startCount = std::min({ budget, state->freeRequestCount, candidateCount });
+
+    std::partial_sort(state->candidates, state->candidates + startCount, state->candidates + candidateCount, [](const TerrainCandidate& a, const TerrainCandidate& b) {
+        return a.priority < b.priority;
+    });
+
+    for (uint32_t i = 0; i < startCount; ++i) {
+        const TerrainCandidate& candidate = state->candidates[i];
+
+        uint32_t requestIndex = state->freeRequests[--state->freeRequestCount];
+        TerrainRequest& request = state->requests[requestIndex];
+
+        request.x = candidate.x;
+        request.z = candidate.z;
+        request.job = { .function = generateRequestedColumn, .data = state, .index = requestIndex, .mainThread = false };
+
+        state->jobSystem->submit(1, &request.job, request.counter);
+
+        getCell(state, candidate.x, candidate.z) = { candidate.x, candidate.z, TERRAIN_CELL_PENDING };
+        state->pendingRequests[state->pendingRequestCount++] = requestIndex;
+    }
+
+    return changeCount;
+}
+
+// Every update inserts the columns that the previous one started, until none are missing.
+void TerrainGenerator::load(ChunkMap& chunkMap, const TerrainView& view) {
+    while (true) {
+        update(chunkMap, view, UINT32_MAX);
+
+        if (state->pendingRequestCount == 0) {
+            return;
+        }
+
+        for (uint32_t i = 0; i < state->pendingRequestCount; ++i) {
+            state->jobSystem->wait(state->requests[state->pendingRequests[i]].counter);
+        }
+    }
+}
+
+uint32_t TerrainGenerator::getPendingCount() {
+    return state->pendingRequestCount;
+}
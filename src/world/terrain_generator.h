@@ -0,0 +1,121 @@
+#pragma once
+
+#include <job_system.h>
+
+#include "chunk_map.h"
+
+// Columns span chunks 0 to chunkHeight - 1. The surface height is in blocks and its first octave
+// has the given frequency in cycles per block. Below the grass and the dirt there's stone, of
+// which about one block in oreRarity is ore, which has to be a power of two.
+struct TerrainSettings {
+    uint32_t seed;
+    int32_t chunkHeight;
+    float baseHeight;
+    float amplitude;
+    float frequency;
+    uint32_t octaveCount;
+    int32_t dirtDepth;
+    uint32_t oreRarity;
+    Block stone;
+    Block dirt;
+    Block grass;
+    Block ore;
+};
+
+struct TerrainScratch {
+    int32_t* heights;
+    Block* blocks;
+};
+
+// The view position is in chunks on the xz plane. The direction doesn't have to be normalized,
+// and without one columns are only prioritized by distance.
+struct TerrainView {
+    float x;
+    float z;
+    float directionX;
+    float directionZ;
+};
+
+enum TerrainCellStatus : uint32_t {
+    TERRAIN_CELL_EMPTY,
+    TERRAIN_CELL_PENDING,
+    TERRAIN_CELL_LOADED
+};
+
+// The status of the column that last used a cell of the grid around the view.
+struct TerrainCell {
+    int32_t x;
+    int32_t z;
+    TerrainCellStatus status;
+};
+
+// Chunks that are all air are never created.
+struct TerrainRequest {
+    int32_t x;
+    int32_t z;
+    Chunk* chunks;
+    bool* empty;
+    Job job;
+    JobCounter counter;
+};
+
+struct TerrainCandidate {
+    float priority;
+    int32_t x;
+    int32_t z;
+};
+
+struct TerrainGeneratorState {
+    JobSystem* jobSystem;
+    TerrainSettings settings;
+    int32_t viewDistance;
+    int32_t gridSize;
+    TerrainCell* cells;
+    TerrainScratch* scratches;
+    TerrainRequest* requests;
+    uint32_t requestCount;
+    uint32_t* freeRequests;
+    uint32_t freeRequestCount;
+    uint32_t* pendingRequests;
+    uint32_t pendingRequestCount;
+    TerrainCandidate* candidates;
+};
+
+TerrainScratch createTerrainScratch();
+void destroyTerrainScratch(TerrainScratch& scratch);
+
+// Fills a column of chunks. The surface heights of the column are sampled a row of noise at a
+// time, and the blocks are then filled a row at a time in a loop without branches, with ores
+// placed by hashing their position, so that compilers vectorize it. Chunks above the surface are
+// left empty without being filled.
+void generateTerrainColumn(const TerrainSettings& settings, int32_t x, int32_t z, TerrainScratch& scratch, Chunk* chunks, bool* empty);
+
+// Streams columns of terrain into a chunk map around a moving view. Every update inserts the
+// columns that were generated since the previous one, removes the columns that have fallen out of
+// view, and starts generating up to a budget of the missing columns in view, closest and most in
+// front of the view first. Columns are generated by jobs on the job system, with at most a fixed
+// number of them in flight, so that columns that become more urgent as the view moves don't
+// queue up behind stale ones.
+//
+// Columns are only removed a chunk beyond the view distance, so that a view moving back and forth
+// along the edge doesn't keep generating the same columns. The state of the columns is kept in a
+// grid that wraps around, which is just large enough that no two columns within reach of the view
+// share a cell.
+class TerrainGenerator {
+public:
+    TerrainGenerator() = default;
+    TerrainGenerator(JobSystem& jobSystem, const TerrainSettings& settings, uint32_t viewDistance, uint32_t maxPendingCount);
+    void destroy();
+
+    // Returns the number of columns that were inserted or removed. Only the thread that created
+    // the job system may update.
+    uint32_t update(ChunkMap& chunkMap, const TerrainView& view, uint32_t budget);
+
+    // Generates every missing column in view and waits for them.
+    void load(ChunkMap& chunkMap, const TerrainView& view);
+
+    uint32_t getPendingCount();
+
+private:
+    TerrainGeneratorState* state;
+};
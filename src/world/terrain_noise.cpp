@@ -0,0 +1,317 @@
+#include "terrain_noise.h"
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define NOISE_AVX2
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define NOISE_SSE2
+#endif
+
+static constexpr uint32_t X_HASH = 0x27d4eb2du;
+static constexpr uint32_t Z_HASH = 0x165667b1u;
+static constexpr uint32_t MIX_HASH = 0x2c1b3c6du;
+static constexpr uint32_t OCTAVE_SEED = 0x9e3779b9u;
+
+// An octave spans about [-1.5, 1.5] with these gradients.
+static constexpr float NOISE_SCALE = 2.0f / 3.0f;
+
+// Everything about an octave that only depends on z, which all samples of a row share. The
+// amplitudes include the normalization.
+struct NoiseOctave {
+    float frequency;
+    float amplitude;
+    float fractionZ;
+    float fadeZ;
+    uint32_t hashZ0;
+    uint32_t hashZ1;
+};
+
+static float fade(float t) {
+    return t * t * t * (t * (t * 6.0f - 15.0f) + 10.0f);
+}
+
+static uint32_t finishHash(uint32_t hash) {
+    hash ^= hash >> 15;
+    hash *= MIX_HASH;
+    hash ^= hash >> 12;
+
+    return hash;
+}
+
+// One of eight gradients, picked by the low bits of the hash, dotted with the offset from its
+// lattice point.
+static float getGradient(uint32_t hash, float x, float z) {
+    float u = (hash & 4) != 0 ? z : x;
+    float v = (hash & 4) != 0 ? x : z;
+
+    return ((hash & 1) != 0 ? -u : u) + ((hash & 2) != 0 ? -(v + v) : v + v);
+}
+
+// Both samplers keep their octaves on the stack.
+static void getOctaves(uint32_t seed, uint32_t octaveCount, float z, NoiseOctave* octaves) {
+    assert(octaveCount <= MAX_NOISE_OCTAVE_COUNT);
+
+    float frequency = 1.0f;
+    float amplitude = 1.0f;
+    float amplitudeSum = 0.0f;
+
+    for (uint32_t i = 0; i < octaveCount; ++i) {
+        float octaveZ = z * frequency;
+        float floorZ = floorf(octaveZ);
+        uint32_t latticeZ = (uint32_t)(int32_t)floorZ;
+        uint32_t octaveSeed = seed + i * OCTAVE_SEED;
+
+        octaves[i] = {
+            .frequency = frequency,
+            .amplitude = amplitude,
+            .fractionZ = octaveZ - floorZ,
+            .fadeZ     = fade(octaveZ - floorZ),
+            .hashZ0    = latticeZ * Z_HASH ^ octaveSeed,
+            .hashZ1    = (latticeZ + 1) * Z_HASH ^ octaveSeed
+        };
+
+        amplitudeSum += amplitude;
+        frequency *= 2.0f;
+        amplitude *= 0.5f;
+    }
+
+    for (uint32_t i = 0; i < octaveCount; ++i) {
+        octaves[i].amplitude *= NOISE_SCALE / amplitudeSum;
+    }
+}
+
+static float sampleOctave(const NoiseOctave& octave, float x) {
+    float floorX = floorf(x);
+    uint32_t latticeX = (uint32_t)(int32_t)floorX;
+    float fractionX = x - floorX;
+
+    uint32_t hashX0 = latticeX * X_HASH;
+    uint32_t hashX1 = hashX0 + X_HASH;
+
+    float gradient00 = getGradient(finishHash(hashX0 ^ octave.hashZ0), fractionX, octave.fractionZ);
+    float gradient10 = getGradient(finishHash(hashX1 ^ octave.hashZ0), fractionX - 1.0f, octave.fractionZ);
+    float gradient01 = getGradient(finishHash(hashX0 ^ octave.hashZ1), fractionX, octave.fractionZ - 1.0f);
+    float gradient11 = getGradient(finishHash(hashX1 ^ octave.hashZ1), fractionX - 1.0f, octave.fractionZ - 1.0f);
+
+    float fadeX = fade(fractionX);
+    float front = gradient00 + fadeX * (gradient10 - gradient00);
+    float back = gradient01 + fadeX * (gradient11 - gradient01);
+
+    return front + octave.fadeZ * (back - front);
+}
+
+static void sampleRowScalar(const NoiseOctave* octaves, uint32_t octaveCount, float x, float step, uint32_t count, float* values) {
+    for (uint32_t i = 0; i < count; ++i) {
+        float position = x + (float)i * step;
+        float sum = 0.0f;
+
+        for (uint32_t j = 0; j < octaveCount; ++j) {
+            sum += octaves[j].amplitude * sampleOctave(octaves[j], position * octaves[j].frequency);
+        }
+
+        values[i] = sum;
+    }
+}
+
+// The vectorized rows do the same operations in the same order as the scalar ones. The last
+// vector of a row that isn't a multiple of the width is evaluated in full and stored in part.
+#if defined(NOISE_AVX2)
+static __m256i finishHash(__m256i hash) {
+    hash = _mm256_xor_si256(hash, _mm256_srli_epi32(hash, 15));
+    hash = _mm256_mullo_epi32(hash, _mm256_set1_epi32((int)MIX_HASH));
+
+    return _mm256_xor_si256(hash, _mm256_srli_epi32(hash, 12));
+}
+
+static __m256 getGradient(__m256i hash, __m256 x, __m256 z) {
+    __m256 swap = _mm256_castsi256_ps(_mm256_slli_epi32(hash, 29));
+    __m256 u = _mm256_blendv_ps(x, z, swap);
+    __m256 v = _mm256_blendv_ps(z, x, swap);
+
+    // The two low bits of the hash become the signs.
+    __m256 signU = _mm256_castsi256_ps(_mm256_slli_epi32(hash, 31));
+    __m256 signV = _mm256_castsi256_ps(_mm256_slli_epi32(hash, 30));
+    signV = _mm256_and_ps(signV, _mm256_castsi256_ps(_mm256_set1_epi32((int)0x80000000u)));
+
+    return _mm256_add_ps(_mm256_xor_ps(u, signU), _mm256_xor_ps(_mm256_add_ps(v, v), signV));
+}
+
+static __m256 fade(__m256 t) {
+    __m256 polynomial = _mm256_add_ps(_mm256_mul_ps(t, _mm256_sub_ps(_mm256_mul_ps(t, _mm256_set1_ps(6.0f)), _mm256_set1_ps(15.0f))), _mm256_set1_ps(10.0f));
+
+    return _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(t, t), t), polynomial);
+}
+
+static void sampleRow(const NoiseOctave* octaves, uint32_t octaveCount, float x, float step, uint32_t count, float* values) {
+    const __m256 lanes = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+    const __m256 one = _mm256_set1_ps(1.0f);
+
+    for (uint32_t i = 0; i < count; i += 8) {
+        __m256 positions = _mm256_add_ps(_mm256_set1_ps(x), _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps((float)i), lanes), _mm256_set1_ps(step)));
+        __m256 sum = _mm256_setzero_ps();
+
+        for (uint32_t j = 0; j < octaveCount; ++j) {
+            const NoiseOctave& octave = octaves[j];
+
+            __m256 octaveX = _mm256_mul_ps(positions, _mm256_set1_ps(octave.frequency));
+            __m256 floorX = _mm256_floor_ps(octaveX);
+            __m256 fractionX = _mm256_sub_ps(octaveX, floorX);
+
+            __m256i hashX0 = _mm256_mullo_epi32(_mm256_cvttps_epi32(floorX), _mm256_set1_epi32((int)X_HASH));
+            __m256i hashX1 = _mm256_add_epi32(hashX0, _mm256_set1_epi32((int)X_HASH));
+            __m256i hashZ0 = _mm256_set1_epi32((int)octave.hashZ0);
+            __m256i hashZ1 = _mm256_set1_epi32((int)octave.hashZ1);
+
+            __m256 fractionZ = _mm256_set1_ps(octave.fractionZ);
+            __m256 fractionZ1 = _mm256_set1_ps(octave.fractionZ - 1.0f);
+            __m256 fractionX1 = _mm256_sub_ps(fractionX, one);
+
+            __m256 gradient00 = getGradient(finishHash(_mm256_xor_si256(hashX0, hashZ0)), fractionX, fractionZ);
+            __m256 gradient10 = getGradient(finishHash(_mm256_xor_si256(hashX1, hashZ0)), fractionX1, fractionZ);
+            __m256 gradient01 = getGradient(finishHash(_mm256_xor_si256(hashX0, hashZ1)), fractionX, fractionZ1);
+            __m256 gradient11 = getGradient(finishHash(_mm256_xor_si256(hashX1, hashZ1)), fractionX1, fractionZ1);
+
+            __m256 fadeX = fade(fractionX);
+            __m256 front = _mm256_add_ps(gradient00, _mm256_mul_ps(fadeX, _mm256_sub_ps(gradient10, gradient00)));
+            __m256 back = _mm256_add_ps(gradient01, _mm256_mul_ps(fadeX, _mm256_sub_ps(gradient11, gradient01)));
+            __m256 noise = _mm256_add_ps(front, _mm256_mul_ps(_mm256_set1_ps(octave.fadeZ), _mm256_sub_ps(back, front)));
+
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(octave.amplitude), noise));
+        }
+
+        if (count - i >= 8) {
+            _mm256_storeu_ps(&values[i], sum);
+        }
+        else {
+            float sums[8];
+            _mm256_storeu_ps(sums, sum);
+            memcpy(&values[i], sums, (count - i) * sizeof(float));
+        }
+    }
+}
+#elif defined(NOISE_SSE2)
+// SSE2 only multiplies the even lanes, so the odd ones are shifted down and interleaved back.
+static __m128i multiply(__m128i a, __m128i b) {
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static __m128i finishHash(__m128i hash) {
+    hash = _mm_xor_si128(hash, _mm_srli_epi32(hash, 15));
+    hash = multiply(hash, _mm_set1_epi32((int)MIX_HASH));
+
+    return _mm_xor_si128(hash, _mm_srli_epi32(hash, 12));
+}
+
+static __m128 getGradient(__m128i hash, __m128 x, __m128 z) {
+    __m128 swap = _mm_castsi128_ps(_mm_srai_epi32(_mm_slli_epi32(hash, 29), 31));
+    __m128 u = _mm_or_ps(_mm_and_ps(swap, z), _mm_andnot_ps(swap, x));
+    __m128 v = _mm_or_ps(_mm_and_ps(swap, x), _mm_andnot_ps(swap, z));
+
+    // The two low bits of the hash become the signs.
+    __m128 signU = _mm_castsi128_ps(_mm_slli_epi32(hash, 31));
+    __m128 signV = _mm_castsi128_ps(_mm_slli_epi32(_mm_srli_epi32(hash, 1), 31));
+
+    return _mm_add_ps(_mm_xor_ps(u, signU), _mm_xor_ps(_mm_add_ps(v, v), signV));
+}
+
+static __m128 fade(__m128 t) {
+    __m128 polynomial = _mm_add_ps(_mm_mul_ps(t, _mm_sub_ps(_mm_mul_ps(t, _mm_set1_ps(6.0f)), _mm_set1_ps(15.0f))), _mm_set1_ps(10.0f));
+
+    return _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(t, t), t), polynomial);
+}
+
+// SSE2 has no floor, so truncated values above their input are stepped down.
+static __m128 floorVector(__m128 x, __m128i& lattice) {
+    __m128i truncated = _mm_cvttps_epi32(x);
+    __m128 floored = _mm_cvtepi32_ps(truncated);
+    __m128 above = _mm_cmpgt_ps(floored, x);
+
+    lattice = _mm_add_epi32(truncated, _mm_castps_si128(above));
+
+    return _mm_sub_ps(floored, _mm_and_ps(above, _mm_set1_ps(1.0f)));
+}
+
+static void sampleRow(const NoiseOctave* octaves, uint32_t octaveCount, float x, float step, uint32_t count, float* values) {
+    const __m128 lanes = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+    const __m128 one = _mm_set1_ps(1.0f);
+
+    for (uint32_t i = 0; i < count; i += 4) {
+        __m128 positions = _mm_add_ps(_mm_set1_ps(x), _mm_mul_ps(_mm_add_ps(_mm_set1_ps((float)i), lanes), _mm_set1_ps(step)));
+        __m128 sum = _mm_setzero_ps();
+
+        for (uint32_t j = 0; j < octaveCount; ++j) {
+            const NoiseOctave& octave = octaves[j];
+
+            __m128 octaveX = _mm_mul_ps(positions, _mm_set1_ps(octave.frequency));
+            __m128i latticeX;
+            __m128 fractionX = _mm_sub_ps(octaveX, floorVector(octaveX, latticeX));
+
+            __m128i hashX0 = multiply(latticeX, _mm_set1_epi32((int)X_HASH));
+            __m128i hashX1 = _mm_add_epi32(hashX0, _mm_set1_epi32((int)X_HASH));
+            __m128i hashZ0 = _mm_set1_epi32((int)octave.hashZ0);
+            __m128i hashZ1 = _mm_set1_epi32((int)octave.hashZ1);
+
+            __m128 fractionZ = _mm_set1_ps(octave.fractionZ);
+            __m128 fractionZ1 = _mm_set1_ps(octave.fractionZ - 1.0f);
+            __m128 fractionX1 = _mm_sub_ps(fractionX, one);
+
+            __m128 gradient00 = getGradient(finishHash(_mm_xor_si128(hashX0, hashZ0)), fractionX, fractionZ);
+            __m128 gradient10 = getGradient(finishHash(_mm_xor_si128(hashX1, hashZ0)), fractionX1, fractionZ);
+            __m128 gradient01 = getGradient(finishHash(_mm_xor_si128(hashX0, hashZ1)), fractionX, fractionZ1);
+            __m128 gradient11 = getGradient(finishHash(_mm_xor_si128(hashX1, hashZ1)), fractionX1, fractionZ1);
+
+            __m128 fadeX = fade(fractionX);
+            __m128 front = _mm_add_ps(gradient00, _mm_mul_ps(fadeX, _mm_sub_ps(gradient10, gradient00)));
+            __m128 back = _mm_add_ps(gradient01, _mm_mul_ps(fadeX, _mm_sub_ps(gradient11, gradient01)));
+            __m128 noise = _mm_add_ps(front, _mm_mul_ps(_mm_set1_ps(octave.fadeZ), _mm_sub_ps(back, front)));
+
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(octave.amplitude), noise));
+        }
+
+        if (count - i >= 4) {
+            _mm_storeu_ps(&values[i], sum);
+        }
+        else {
+            float sums[4];
+            _mm_storeu_ps(sums, sum);
+            memcpy(&values[i], sums, (count - i) * sizeof(float));
+        }
+    }
+}
+#endif
+
+void sampleNoiseRow(uint32_t seed, uint32_t octaveCount, float x, float z, float step, uint32_t count, float* values) {
+    NoiseOctave octaves[MAX_NOISE_OCTAVE_COUNT];
+    getOctaves(seed, octaveCount, z, octaves);
+
+#if defined(NOISE_AVX2) || defined(NOISE_SSE2)
+    sampleRow(octaves, octaveCount, x, step, count, values);
+#else
+    sampleRowScalar(octaves, octaveCount, x, step, count, values);
+#endif
+}
+
+void sampleNoiseRowScalar(uint32_t seed, uint32_t octaveCount, float x, float z, float step, uint32_t count, float* values) {
+    NoiseOctave octaves[MAX_NOISE_OCTAVE_COUNT];
+    getOctaves(seed, octaveCount, z, octaves);
+
+    sampleRowScalar(octaves, octaveCount, x, step, count, values);
+}
+
+const char* getNoiseInstructionSet() {
+#if defined(NOISE_AVX2)
+    return "AVX2";
+#elif defined(NOISE_SSE2)
+    return "SSE2";
+#else
+    return "scalar";
+#endif
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+
+constexpr uint32_t MAX_NOISE_OCTAVE_COUNT = 16;
+
+// Fractal gradient noise on a plane: octaves of 2D Perlin noise with doubling frequencies and
+// halving amplitudes, normalized to about [-1, 1]. The gradients at the lattice points come from
+// hashing the points with the seed instead of looking them up in a permutation table, so that
+// whole vectors of points are evaluated without gathers. There are at most MAX_NOISE_OCTAVE_COUNT
+// octaves.
+//
+// Rows of samples at (x + i * step, z) are evaluated 8 at a time with AVX2 when the compiler
+// targets it, 4 at a time with SSE2 on other x86 targets, and one at a time elsewhere. The lattice
+// row is shared by the whole row, so it's only hashed once per octave.
+void sampleNoiseRow(uint32_t seed, uint32_t octaveCount, float x, float z, float step, uint32_t count, float* values);
+
+// The same noise one sample at a time, which is what the vectorized rows are measured against.
+void sampleNoiseRowScalar(uint32_t seed, uint32_t octaveCount, float x, float z, float step, uint32_t count, float* values);
+
+const char* getNoiseInstructionSet();